@@ -0,0 +1,187 @@
+
+/**
+ * @file
+ * Measures the throughput of a \ref mqtt_client_pool with 1 to N connections.
+ *
+ * Each connection is served by its own in-process "broker" thread on the other end of a
+ * socketpair. The broker spends a fixed amount of time on every PUBLISH before it
+ * acknowledges it, like a real broker that handles each connection on a single core.
+ * QoS 1 messages are published in batches to many topics, and each batch is synced until
+ * every message in it has been acknowledged.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <mqtt.h>
+
+#define MAX_CONNECTIONS 8
+#define NUMBER_OF_TOPICS 64
+#define BATCH_SIZE 256
+
+/** @brief The state of the connections of one run. */
+struct run_state {
+    int sv[MAX_CONNECTIONS][2];
+    pthread_t brokers[MAX_CONNECTIONS];
+    uint8_t sendbuf[MAX_CONNECTIONS][1 << 16];
+    uint8_t recvbuf[MAX_CONNECTIONS][1 << 10];
+};
+
+/** @brief How long the broker spends on each PUBLISH, in microseconds. */
+static long broker_cost_us = 20;
+
+/**
+ * @brief Acknowledges the CONNECT and every PUBLISH sent on a connection until it closes.
+ */
+void* broker(void* fd);
+
+/**
+ * @brief Connects the client at \p index to a new broker thread.
+ */
+void reconnect(struct mqtt_client_pool *pool, size_t index, const char *client_id, void **state);
+
+/**
+ * @brief Publishes \p count messages with a pool of \p number_of_connections clients.
+ *
+ * @returns The number of messages acknowledged per second.
+ */
+double run(size_t number_of_connections, int count);
+
+/**
+ * Usage: bench_client_pool [count] [broker cost in us]
+ */
+int main(int argc, const char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 50000;
+    size_t n;
+
+    if (argc > 2) {
+        broker_cost_us = atol(argv[2]);
+    }
+    printf("%-12s %14s\n", "connections", "publishes/s");
+    for(n = 1; n <= MAX_CONNECTIONS; n *= 2) {
+        printf("%-12lu %14.0f\n", (unsigned long) n, run(n, count));
+    }
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void* broker(void* fd)
+{
+    int broker_fd = (int) (intptr_t) fd;
+    uint8_t buf[1 << 16], puback[4];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    struct mqtt_response response;
+    size_t buf_size = 0;
+    ssize_t rv;
+
+    while ((rv = recv(broker_fd, buf + buf_size, sizeof(buf) - buf_size, 0)) > 0) {
+        size_t consumed = 0;
+        buf_size += (size_t) rv;
+        while (consumed < buf_size) {
+            rv = mqtt_unpack_fixed_header(&response, buf + consumed, buf_size - consumed);
+            if (rv <= 0 || (size_t) rv + response.fixed_header.remaining_length > buf_size - consumed) {
+                break;
+            }
+            if (response.fixed_header.control_type == MQTT_CONTROL_CONNECT) {
+                send(broker_fd, connack, sizeof(connack), 0);
+            } else if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                double until = now() + 1e-6 * broker_cost_us;
+                mqtt_unpack_response(&response, buf + consumed, buf_size - consumed);
+                while (now() < until);
+                mqtt_pack_pubxxx_request(puback, sizeof(puback), MQTT_CONTROL_PUBACK, response.decoded.publish.packet_id);
+                send(broker_fd, puback, sizeof(puback), 0);
+            }
+            consumed += (size_t) rv + response.fixed_header.remaining_length;
+        }
+        memmove(buf, buf + consumed, buf_size - consumed);
+        buf_size -= consumed;
+    }
+    return NULL;
+}
+
+void reconnect(struct mqtt_client_pool *pool, size_t index, const char *client_id, void **state)
+{
+    struct run_state *run = *(struct run_state**) state;
+    struct mqtt_client *client = &pool->clients[index].client;
+
+    if (client->error != MQTT_ERROR_INITIAL_RECONNECT) {
+        fprintf(stderr, "error: %s\n", mqtt_error_str(client->error));
+        exit(EXIT_FAILURE);
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, run->sv[index]) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    fcntl(run->sv[index][0], F_SETFL, fcntl(run->sv[index][0], F_GETFL) | O_NONBLOCK);
+    pthread_create(&run->brokers[index], NULL, broker, (void*) (intptr_t) run->sv[index][1]);
+    mqtt_reinit(client, run->sv[index][0], run->sendbuf[index], sizeof(run->sendbuf[index]),
+                run->recvbuf[index], sizeof(run->recvbuf[index]));
+    mqtt_connect(client, client_id, NULL, NULL, 0, NULL, NULL, 0, 400);
+}
+
+/**
+ * @brief Returns non-zero once every PUBLISH of every client has been acknowledged.
+ */
+static int all_acknowledged(struct mqtt_client_pool *pool)
+{
+    size_t i;
+    for(i = 0; i < pool->number_of_clients; ++i) {
+        if (mqtt_mq_find(&pool->clients[i].client.mq, MQTT_CONTROL_PUBLISH, NULL) >= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+double run(size_t number_of_connections, int count)
+{
+    static struct run_state state;
+    static struct mqtt_client_pool_member members[MAX_CONNECTIONS];
+    struct mqtt_client_pool pool;
+    char topic[32], message[16] = "ingested";
+    double start, end;
+    size_t i;
+    int published;
+
+    mqtt_client_pool_init(&pool, members, number_of_connections, "bench", reconnect, &state, NULL);
+    /* connect */
+    while (mqtt_client_pool_sync(&pool) != MQTT_OK || mqtt_mq_find(&members[0].client.mq, MQTT_CONTROL_CONNECT, NULL) >= 0);
+
+    start = now();
+    for(published = 0; published < count; ) {
+        int batch_end = published + BATCH_SIZE < count ? published + BATCH_SIZE : count;
+        for(; published < batch_end; ++published) {
+            snprintf(topic, sizeof(topic), "ingest/%d", published % NUMBER_OF_TOPICS);
+            if (mqtt_client_pool_publish(&pool, topic, message, sizeof(message), MQTT_PUBLISH_QOS_1) != MQTT_OK) {
+                fprintf(stderr, "error: can't publish\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        do {
+            if (mqtt_client_pool_sync(&pool) != MQTT_OK) {
+                fprintf(stderr, "error: can't sync\n");
+                exit(EXIT_FAILURE);
+            }
+        } while (!all_acknowledged(&pool));
+    }
+    end = now();
+
+    mqtt_client_pool_deinit(&pool);
+    for(i = 0; i < number_of_connections; ++i) {
+        shutdown(state.sv[i][0], SHUT_RDWR);
+        pthread_join(state.brokers[i], NULL);
+        close(state.sv[i][0]);
+        close(state.sv[i][1]);
+    }
+    return count / (end - start);
+}
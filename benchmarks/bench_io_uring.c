@@ -0,0 +1,168 @@
+
+/**
+ * @file
+ * Compares the io_uring transport with plain \c send and \c recv.
+ *
+ * Must be built with \c MQTT_USE_IO_URING. The client connects over loopback TCP to an
+ * in-process "broker" thread that acknowledges every PUBLISH. QoS 1 messages are
+ * published in batches and each batch is synced until every message in it has been
+ * acknowledged, once with the ring disabled and once with it enabled.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <mqtt.h>
+
+#define BATCH_SIZE 64
+
+/**
+ * @brief Acknowledges the CONNECT and every PUBLISH sent on a connection until it closes.
+ */
+void* broker(void* fd);
+
+/**
+ * @brief Publishes \p count messages, using the ring if \p use_ring is non-zero.
+ */
+void run(int use_ring, int count);
+
+/**
+ * Usage: bench_io_uring [count]
+ */
+int main(int argc, const char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+
+    printf("%-12s %14s %18s\n", "transport", "publishes/s", "enters/publish");
+    run(0, count);
+    run(1, count);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void* broker(void* fd)
+{
+    int broker_fd = (int) (intptr_t) fd;
+    uint8_t buf[1 << 16], acks[1 << 14];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    struct mqtt_response response;
+    size_t buf_size = 0;
+    ssize_t rv;
+
+    while ((rv = recv(broker_fd, buf + buf_size, sizeof(buf) - buf_size, 0)) > 0) {
+        size_t consumed = 0, acks_size = 0;
+        buf_size += (size_t) rv;
+        while (consumed < buf_size) {
+            rv = mqtt_unpack_fixed_header(&response, buf + consumed, buf_size - consumed);
+            if (rv <= 0 || (size_t) rv + response.fixed_header.remaining_length > buf_size - consumed) {
+                break;
+            }
+            if (response.fixed_header.control_type == MQTT_CONTROL_CONNECT) {
+                memcpy(acks + acks_size, connack, sizeof(connack));
+                acks_size += sizeof(connack);
+            } else if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                mqtt_unpack_response(&response, buf + consumed, buf_size - consumed);
+                acks_size += (size_t) mqtt_pack_pubxxx_request(acks + acks_size, sizeof(acks) - acks_size,
+                                                               MQTT_CONTROL_PUBACK, response.decoded.publish.packet_id);
+            }
+            consumed += (size_t) rv + response.fixed_header.remaining_length;
+        }
+        /* acknowledge everything that was read at once */
+        if (acks_size > 0) {
+            send(broker_fd, acks, acks_size, 0);
+        }
+        memmove(buf, buf + consumed, buf_size - consumed);
+        buf_size -= consumed;
+    }
+    return NULL;
+}
+
+void run(int use_ring, int count)
+{
+    static uint8_t sendbuf[1 << 16], recvbuf[1 << 14];
+    struct mqtt_client client;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    mqtt_pal_socket_handle handle;
+    pthread_t broker_thread;
+    char message[16] = "ingested";
+    int listener, client_fd, broker_fd, one = 1, published;
+    double start, end;
+
+    /* connect over loopback */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, 1) != 0
+        || getsockname(listener, (struct sockaddr*) &addr, &addr_len) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    broker_fd = accept(listener, NULL, NULL);
+    close(listener);
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(broker_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    pthread_create(&broker_thread, NULL, broker, (void*) (intptr_t) broker_fd);
+
+    handle = mqtt_pal_uring_open(client_fd, use_ring, sizeof(sendbuf), 1 << 12, 16);
+    if (handle == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    if (use_ring && handle->ring_fd < 0) {
+        fprintf(stderr, "error: io_uring isn't available\n");
+        exit(EXIT_FAILURE);
+    }
+    mqtt_init(&client, handle, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_connect(&client, "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+    while (mqtt_sync(&client) == MQTT_OK && mqtt_mq_find(&client.mq, MQTT_CONTROL_CONNECT, NULL) >= 0);
+
+    start = now();
+    handle->number_of_enters = 0;
+    for(published = 0; published < count; ) {
+        int batch_end = published + BATCH_SIZE < count ? published + BATCH_SIZE : count;
+        for(; published < batch_end; ++published) {
+            if (mqtt_publish(&client, "bench/ingest", message, sizeof(message), MQTT_PUBLISH_QOS_1) != MQTT_OK) {
+                fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+                exit(EXIT_FAILURE);
+            }
+        }
+        do {
+            if (mqtt_sync(&client) != MQTT_OK) {
+                fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+                exit(EXIT_FAILURE);
+            }
+        } while (mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBLISH, NULL) >= 0);
+    }
+    end = now();
+
+    if (use_ring) {
+        printf("%-12s %14.0f %18.3f\n", "io_uring", count / (end - start), (double) handle->number_of_enters / count);
+    } else {
+        printf("%-12s %14.0f %18s\n", "send/recv", count / (end - start), "-");
+    }
+
+    shutdown(client_fd, SHUT_RDWR);
+    pthread_join(broker_thread, NULL);
+    mqtt_pal_uring_close(handle);
+    close(client_fd);
+    close(broker_fd);
+}
@@ -0,0 +1,210 @@
+
+/**
+ * @file
+ * Measures how long publishers wait while the client is busy with inbound traffic.
+ *
+ * Several producer threads publish QoS 0 messages while another thread calls
+ * \ref mqtt_sync. An in-process "broker" on the other end of a socketpair sends bursts
+ * of PUBLISHes to the client, and the publish callback takes a configurable amount of
+ * time to handle each of them. Since the callback runs without the client's mutex, the
+ * time producers spend in \ref mqtt_publish should not depend on the callback's delay.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <mqtt.h>
+
+#define NUMBER_OF_PRODUCERS 4
+#define BURST_SIZE 8
+#define PUBLISH_INTERVAL_US 20
+
+/** @brief The state shared by the threads of one run. */
+struct run_state {
+    struct mqtt_client client;
+    int broker_fd;
+    volatile int stop_broker;
+    volatile int stop_sync;
+    int publishes_per_producer;
+    int next_producer;
+    double *latencies;
+};
+
+/** @brief How long the publish callback takes, in microseconds. */
+static long callback_delay_us;
+
+/**
+ * @brief Handles an inbound PUBLISH by spinning for \ref callback_delay_us.
+ */
+void publish_callback(void** unused, struct mqtt_response_publish *published);
+
+/**
+ * @brief Sends bursts of PUBLISHes to the client and discards what it sends.
+ */
+void* broker(void* state);
+
+/**
+ * @brief Calls \ref mqtt_sync until told to stop.
+ */
+void* sync_client(void* state);
+
+/**
+ * @brief Publishes messages and records how long each call to \ref mqtt_publish took.
+ */
+void* producer(void* state);
+
+/**
+ * @brief Runs the benchmark with the publish callback taking \p delay_us per message.
+ */
+void run(long delay_us, int publishes_per_producer);
+
+/**
+ * Usage: bench_lock_contention [publishes per producer]
+ */
+int main(int argc, const char *argv[])
+{
+    const long delays[] = {0, 100, 1000};
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    size_t i;
+
+    printf("%-16s %10s %10s %10s\n", "callback (us)", "p50 (us)", "p99 (us)", "max (us)");
+    for(i = 0; i < sizeof(delays) / sizeof(delays[0]); ++i) {
+        run(delays[i], count);
+    }
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void publish_callback(void** unused, struct mqtt_response_publish *published)
+{
+    double until = now() + 1e-6 * callback_delay_us;
+    (void) unused;
+    (void) published;
+    while (now() < until);
+}
+
+void* broker(void* state)
+{
+    struct run_state *run = (struct run_state*) state;
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t burst[BURST_SIZE * 64];
+    uint8_t discard[1 << 14];
+    size_t burst_size = 0;
+    double next_burst = 0;
+    int i;
+
+    for(i = 0; i < BURST_SIZE; ++i) {
+        ssize_t rv = mqtt_pack_publish_request(burst + burst_size, sizeof(burst) - burst_size,
+                                               "bench/inbound", 0, "inbound message", 16, 0);
+        burst_size += (size_t) rv;
+    }
+
+    send(run->broker_fd, connack, sizeof(connack), 0);
+    while (!run->stop_broker) {
+        /* keep draining so the client's (non-blocking) sends don't fail */
+        while (recv(run->broker_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+        if (now() >= next_burst) {
+            send(run->broker_fd, burst, burst_size, 0);
+            next_burst = now() + 0.02;
+        }
+        usleep(100);
+    }
+    return NULL;
+}
+
+void* sync_client(void* state)
+{
+    struct run_state *run = (struct run_state*) state;
+    while (!run->stop_sync) {
+        mqtt_sync(&run->client);
+        usleep(100);
+    }
+    return NULL;
+}
+
+void* producer(void* state)
+{
+    struct run_state *run = (struct run_state*) state;
+    char message[32] = "outbound message";
+    double *latencies;
+    int i;
+
+    latencies = run->latencies + run->publishes_per_producer * __sync_fetch_and_add(&run->next_producer, 1);
+    for(i = 0; i < run->publishes_per_producer; ++i) {
+        double start = now();
+        enum MQTTErrors rv = mqtt_publish(&run->client, "bench/outbound", message, sizeof(message), MQTT_PUBLISH_QOS_0);
+        latencies[i] = now() - start;
+        if (rv != MQTT_OK) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(rv));
+            exit(EXIT_FAILURE);
+        }
+        /* publish at a steady rate rather than as fast as possible */
+        usleep(PUBLISH_INTERVAL_US);
+    }
+    return NULL;
+}
+
+void run(long delay_us, int publishes_per_producer)
+{
+    static uint8_t sendbuf[1 << 20], recvbuf[1 << 12];
+    struct run_state state;
+    pthread_t producers[NUMBER_OF_PRODUCERS], broker_thread, sync_thread;
+    int sv[2], i, total = NUMBER_OF_PRODUCERS * publishes_per_producer;
+    int socket_buffer_size = 1 << 20;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &socket_buffer_size, sizeof(socket_buffer_size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &socket_buffer_size, sizeof(socket_buffer_size));
+    callback_delay_us = delay_us;
+    state.broker_fd = sv[1];
+    state.stop_broker = 0;
+    state.stop_sync = 0;
+    state.publishes_per_producer = publishes_per_producer;
+    state.next_producer = 0;
+    state.latencies = (double*) malloc(sizeof(double) * (size_t) total);
+    mqtt_init(&state.client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), publish_callback);
+    mqtt_connect(&state.client, "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+
+    pthread_create(&broker_thread, NULL, broker, &state);
+    pthread_create(&sync_thread, NULL, sync_client, &state);
+    for(i = 0; i < NUMBER_OF_PRODUCERS; ++i) {
+        pthread_create(&producers[i], NULL, producer, &state);
+    }
+    for(i = 0; i < NUMBER_OF_PRODUCERS; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+
+    state.stop_broker = 1;
+    pthread_join(broker_thread, NULL);
+    state.stop_sync = 1;
+    pthread_join(sync_thread, NULL);
+
+    qsort(state.latencies, (size_t) total, sizeof(double), compare_doubles);
+    printf("%-16ld %10.1f %10.1f %10.1f\n", delay_us,
+           1e6 * state.latencies[total / 2],
+           1e6 * state.latencies[total - 1 - total / 100],
+           1e6 * state.latencies[total - 1]);
+
+    free(state.latencies);
+    close(sv[0]);
+    close(sv[1]);
+}
@@ -0,0 +1,140 @@
+
+/**
+ * @file
+ * Compares waiting for every QoS 1 publish with pipelining them and waiting for the last.
+ *
+ * The client is synced by its I/O thread and is connected to the other end of a
+ * socketpair, where an in-process "broker" thread acknowledges every PUBLISH. Once
+ * \ref mqtt_publish_handle_wait is called after every publish, so each message costs a
+ * round trip, and once after every batch of messages.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <mqtt.h>
+
+#define MAX_BATCH_SIZE 256
+
+/**
+ * @brief Acknowledges the CONNECT and every PUBLISH sent on a connection until it closes.
+ */
+void* broker(void* fd);
+
+/**
+ * @brief Publishes \p count messages, waiting after every \p batch_size of them.
+ */
+void run(int batch_size, int count);
+
+/**
+ * Usage: bench_publish_handles [count]
+ */
+int main(int argc, const char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+
+    printf("%-12s %14s\n", "wait every", "publishes/s");
+    run(1, count);
+    run(16, count);
+    run(MAX_BATCH_SIZE, count);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void* broker(void* fd)
+{
+    int broker_fd = (int) (intptr_t) fd;
+    uint8_t buf[1 << 16], acks[1 << 14];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    struct mqtt_response response;
+    size_t buf_size = 0;
+    ssize_t rv;
+
+    while ((rv = recv(broker_fd, buf + buf_size, sizeof(buf) - buf_size, 0)) > 0) {
+        size_t consumed = 0, acks_size = 0;
+        buf_size += (size_t) rv;
+        while (consumed < buf_size) {
+            rv = mqtt_unpack_fixed_header(&response, buf + consumed, buf_size - consumed);
+            if (rv <= 0 || (size_t) rv + response.fixed_header.remaining_length > buf_size - consumed) {
+                break;
+            }
+            if (response.fixed_header.control_type == MQTT_CONTROL_CONNECT) {
+                memcpy(acks + acks_size, connack, sizeof(connack));
+                acks_size += sizeof(connack);
+            } else if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                mqtt_unpack_response(&response, buf + consumed, buf_size - consumed);
+                acks_size += (size_t) mqtt_pack_pubxxx_request(acks + acks_size, sizeof(acks) - acks_size,
+                                                               MQTT_CONTROL_PUBACK, response.decoded.publish.packet_id);
+            }
+            consumed += (size_t) rv + response.fixed_header.remaining_length;
+        }
+        if (acks_size > 0) {
+            send(broker_fd, acks, acks_size, 0);
+        }
+        memmove(buf, buf + consumed, buf_size - consumed);
+        buf_size -= consumed;
+    }
+    return NULL;
+}
+
+void run(int batch_size, int count)
+{
+    static uint8_t sendbuf[1 << 16], recvbuf[1 << 14];
+    static struct mqtt_publish_handle handles[MAX_BATCH_SIZE];
+    struct mqtt_client client;
+    pthread_t broker_thread;
+    char message[16] = "request";
+    int fds[2], published;
+    double start, end;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    pthread_create(&broker_thread, NULL, broker, (void*) (intptr_t) fds[1]);
+
+    mqtt_init(&client, fds[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_connect(&client, "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+    if (mqtt_start_io_thread(&client) != MQTT_OK) {
+        fprintf(stderr, "error: can't start the I/O thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now();
+    for(published = 0; published < count; ) {
+        int i, n = count - published < batch_size ? count - published : batch_size;
+        for(i = 0; i < n; ++i) {
+            if (mqtt_publish_with_handle(&client, "bench/request", message, sizeof(message),
+                                         MQTT_PUBLISH_QOS_1, &handles[i]) != MQTT_OK)
+            {
+                fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+                exit(EXIT_FAILURE);
+            }
+        }
+        /* the broker acks in order, so the last message is acknowledged last */
+        if (mqtt_publish_handle_wait(&handles[n - 1], 5000) != MQTT_PUBLISH_HANDLE_ACKNOWLEDGED) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+            exit(EXIT_FAILURE);
+        }
+        published += n;
+    }
+    end = now();
+
+    printf("%-12d %14.0f\n", batch_size, count / (end - start));
+
+    mqtt_deinit(&client);
+    shutdown(fds[0], SHUT_RDWR);
+    pthread_join(broker_thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+}
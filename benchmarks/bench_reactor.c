@@ -0,0 +1,180 @@
+
+/**
+ * @file
+ * Compares a \ref mqtt_reactor with calling \ref mqtt_sync on every client in a loop.
+ *
+ * Thousands of clients are connected to the other ends of socketpairs, which stand in
+ * for a broker. Most clients stay idle: every round a handful of random clients are sent
+ * a PUBLISH, and the clients are driven until all of them have been delivered. The cost
+ * of a round is the time this takes and the number of clients that were synced.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <mqtt.h>
+
+#define MAX_CLIENTS 10000
+#define PUBLISHES_PER_ROUND 16
+#define ROUNDS 200
+
+/** @brief The clients and the broker's ends of their sockets. */
+struct run_state {
+    struct mqtt_client clients[MAX_CLIENTS];
+    int fds[MAX_CLIENTS][2];
+    uint8_t sendbuf[MAX_CLIENTS][256];
+    uint8_t recvbuf[MAX_CLIENTS][256];
+    size_t number_of_clients;
+};
+
+/** @brief The number of PUBLISHes delivered so far. */
+static size_t delivered;
+
+/**
+ * @brief Counts a delivered PUBLISH.
+ */
+void publish_callback(void** unused, struct mqtt_response_publish *published);
+
+/**
+ * @brief Drives the clients through \ref ROUNDS rounds, with a reactor if \p use_reactor
+ *        is non-zero.
+ */
+void run(struct run_state *state, int use_reactor);
+
+/**
+ * Usage: bench_reactor [number of clients]
+ */
+int main(int argc, const char *argv[])
+{
+    static struct run_state state;
+    struct rlimit limit;
+    size_t max_clients;
+
+    /* each client needs two descriptors */
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    max_clients = ((size_t) limit.rlim_cur - 64) / 2;
+
+    state.number_of_clients = argc > 1 ? (size_t) atol(argv[1]) : MAX_CLIENTS;
+    if (state.number_of_clients > MAX_CLIENTS) {
+        state.number_of_clients = MAX_CLIENTS;
+    }
+    if (state.number_of_clients > max_clients) {
+        state.number_of_clients = max_clients;
+    }
+
+    printf("%lu clients, %d publishes to random clients per round\n",
+           (unsigned long) state.number_of_clients, PUBLISHES_PER_ROUND);
+    printf("%-10s %16s %16s\n", "driver", "us/round", "syncs/round");
+    run(&state, 0);
+    run(&state, 1);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void publish_callback(void** unused, struct mqtt_response_publish *published)
+{
+    (void) unused;
+    (void) published;
+    ++delivered;
+}
+
+/**
+ * @brief Connects every client, with the CONNACK already waiting on its socket.
+ */
+static void connect_clients(struct run_state *state)
+{
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    size_t i;
+
+    for(i = 0; i < state->number_of_clients; ++i) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, state->fds[i]) != 0) {
+            fprintf(stderr, "error: can't create socket %lu\n", (unsigned long) i);
+            exit(EXIT_FAILURE);
+        }
+        fcntl(state->fds[i][0], F_SETFL, fcntl(state->fds[i][0], F_GETFL) | O_NONBLOCK);
+        send(state->fds[i][1], connack, sizeof(connack), 0);
+        mqtt_init(&state->clients[i], state->fds[i][0], state->sendbuf[i], sizeof(state->sendbuf[i]),
+                  state->recvbuf[i], sizeof(state->recvbuf[i]), publish_callback);
+        mqtt_connect(&state->clients[i], "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+    }
+}
+
+void run(struct run_state *state, int use_reactor)
+{
+    static struct mqtt_reactor reactor;
+    uint8_t inbound[64];
+    ssize_t inbound_size;
+    size_t i, syncs = 0, expected;
+    double elapsed = 0;
+    int round;
+
+    inbound_size = mqtt_pack_publish_request(inbound, sizeof(inbound), "gateway/device", 0, "reading", 8, 0);
+    connect_clients(state);
+    if (use_reactor) {
+        if (mqtt_reactor_init(&reactor) != MQTT_OK) {
+            fprintf(stderr, "error: can't create the reactor\n");
+            exit(EXIT_FAILURE);
+        }
+        for(i = 0; i < state->number_of_clients; ++i) {
+            mqtt_reactor_add(&reactor, &state->clients[i]);
+        }
+        mqtt_reactor_run_once(&reactor, 0);
+    } else {
+        for(i = 0; i < state->number_of_clients; ++i) {
+            mqtt_sync(&state->clients[i]);
+        }
+    }
+
+    delivered = 0;
+    srand(1);
+    if (use_reactor) {
+        syncs = reactor.number_of_syncs;
+    }
+    for(round = 0; round < ROUNDS; ++round) {
+        double start;
+        for(i = 0; i < PUBLISHES_PER_ROUND; ++i) {
+            send(state->fds[(size_t) rand() % state->number_of_clients][1], inbound, (size_t) inbound_size, 0);
+        }
+        expected = delivered + PUBLISHES_PER_ROUND;
+
+        start = now();
+        while (delivered < expected) {
+            if (use_reactor) {
+                mqtt_reactor_run_once(&reactor, 10);
+            } else {
+                for(i = 0; i < state->number_of_clients; ++i) {
+                    mqtt_sync(&state->clients[i]);
+                }
+                syncs += state->number_of_clients;
+            }
+        }
+        elapsed += now() - start;
+    }
+    if (use_reactor) {
+        syncs = reactor.number_of_syncs - syncs;
+    }
+
+    printf("%-10s %16.1f %16.1f\n", use_reactor ? "reactor" : "sync loop",
+           1e6 * elapsed / ROUNDS, (double) syncs / ROUNDS);
+
+    if (use_reactor) {
+        mqtt_reactor_deinit(&reactor);
+    }
+    for(i = 0; i < state->number_of_clients; ++i) {
+        mqtt_deinit(&state->clients[i]);
+        close(state->fds[i][0]);
+        close(state->fds[i][1]);
+    }
+}
@@ -0,0 +1,163 @@
+
+/**
+ * @file
+ * Measures how a \ref mqtt_reactor_group rebalances clients whose load is skewed.
+ *
+ * The clients are assigned to the reactors round robin, but only the clients of the
+ * first reactor are busy: an in-process "broker" thread sends each of them a few
+ * PUBLISHes every millisecond, and the publish callback spends a fixed amount of time on
+ * each of them. Together they need more than one core. The group is run once with
+ * stealing disabled and once with it enabled, and the throughput, the utilization of
+ * each reactor and the number of migrated clients are reported.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <mqtt.h>
+
+#define NUMBER_OF_REACTORS 4
+#define NUMBER_OF_CLIENTS 64
+#define CALLBACK_COST_US 20
+#define PUBLISHES_PER_MS 4
+
+/** @brief The clients and the state shared with the broker thread. */
+struct run_state {
+    struct mqtt_client clients[NUMBER_OF_CLIENTS];
+    int fds[NUMBER_OF_CLIENTS][2];
+    uint8_t sendbuf[NUMBER_OF_CLIENTS][1024];
+    uint8_t recvbuf[NUMBER_OF_CLIENTS][1 << 14];
+    volatile int stop_broker;
+};
+
+/** @brief The number of PUBLISHes delivered so far. */
+static size_t delivered;
+
+/**
+ * @brief Handles an inbound PUBLISH by spinning for \ref CALLBACK_COST_US.
+ */
+void publish_callback(void** unused, struct mqtt_response_publish *published);
+
+/**
+ * @brief Sends \ref PUBLISHES_PER_MS PUBLISHes to each busy client every millisecond.
+ */
+void* broker(void* state);
+
+/**
+ * @brief Runs the group for \p seconds with the given steal threshold.
+ */
+void run(double steal_threshold, double seconds);
+
+/**
+ * Usage: bench_reactor_group [seconds]
+ */
+int main(int argc, const char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 3.0;
+
+    printf("%-10s %14s %12s  %s\n", "stealing", "publishes/s", "migrations", "utilization per reactor");
+    run(2.0, seconds);
+    run(0.25, seconds);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void publish_callback(void** unused, struct mqtt_response_publish *published)
+{
+    double until = now() + 1e-6 * CALLBACK_COST_US;
+    (void) unused;
+    (void) published;
+    while (now() < until);
+    __sync_fetch_and_add(&delivered, 1);
+}
+
+void* broker(void* state)
+{
+    struct run_state *run = (struct run_state*) state;
+    uint8_t burst[PUBLISHES_PER_MS * 64];
+    size_t burst_size = 0;
+    int i;
+
+    for(i = 0; i < PUBLISHES_PER_MS; ++i) {
+        burst_size += (size_t) mqtt_pack_publish_request(burst + burst_size, sizeof(burst) - burst_size,
+                                                         "gateway/chatty", 0, "reading", 8, 0);
+    }
+    while (!run->stop_broker) {
+        /* the busy clients are the ones the first reactor got */
+        for(i = 0; i < NUMBER_OF_CLIENTS; i += NUMBER_OF_REACTORS) {
+            send(run->fds[i][1], burst, burst_size, 0);
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+void run(double steal_threshold, double seconds)
+{
+    static struct run_state state;
+    struct mqtt_reactor reactors[NUMBER_OF_REACTORS];
+    struct mqtt_reactor_group group;
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    pthread_t broker_thread;
+    size_t migrations = 0, start_delivered;
+    double start, end;
+    int i;
+
+    if (mqtt_reactor_group_init(&group, reactors, NUMBER_OF_REACTORS) != MQTT_OK) {
+        fprintf(stderr, "error: can't create the reactors\n");
+        exit(EXIT_FAILURE);
+    }
+    group.steal_threshold = steal_threshold;
+    for(i = 0; i < NUMBER_OF_CLIENTS; ++i) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, state.fds[i]) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        fcntl(state.fds[i][0], F_SETFL, fcntl(state.fds[i][0], F_GETFL) | O_NONBLOCK);
+        send(state.fds[i][1], connack, sizeof(connack), 0);
+        mqtt_init(&state.clients[i], state.fds[i][0], state.sendbuf[i], sizeof(state.sendbuf[i]),
+                  state.recvbuf[i], sizeof(state.recvbuf[i]), publish_callback);
+        mqtt_connect(&state.clients[i], "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+        /* a static assignment, like mqtt_reactor_group_add would make */
+        mqtt_reactor_add(&reactors[i % NUMBER_OF_REACTORS], &state.clients[i]);
+    }
+
+    state.stop_broker = 0;
+    start_delivered = delivered;
+    start = now();
+    mqtt_reactor_group_start(&group);
+    pthread_create(&broker_thread, NULL, broker, &state);
+    usleep((useconds_t) (seconds * 1e6));
+    end = now();
+
+    printf("%-10s %14.0f", steal_threshold > 1.0 ? "disabled" : "enabled",
+           (double) (delivered - start_delivered) / (end - start));
+    for(i = 0; i < NUMBER_OF_REACTORS; ++i) {
+        migrations += reactors[i].number_of_migrations;
+    }
+    printf(" %12lu ", (unsigned long) migrations);
+    for(i = 0; i < NUMBER_OF_REACTORS; ++i) {
+        MQTT_PAL_MUTEX_LOCK(&reactors[i].mutex);
+        printf(" %4.2f", reactors[i].utilization);
+        MQTT_PAL_MUTEX_UNLOCK(&reactors[i].mutex);
+    }
+    printf("\n");
+
+    state.stop_broker = 1;
+    pthread_join(broker_thread, NULL);
+    mqtt_reactor_group_deinit(&group);
+    for(i = 0; i < NUMBER_OF_CLIENTS; ++i) {
+        mqtt_deinit(&state.clients[i]);
+        close(state.fds[i][0]);
+        close(state.fds[i][1]);
+    }
+}
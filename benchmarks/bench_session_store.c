@@ -0,0 +1,125 @@
+
+/**
+ * @file
+ * Measures the throughput of durable QoS 1 publishes with a session store.
+ *
+ * The client talks to an in-process "broker" over a socketpair that acknowledges every
+ * PUBLISH, so the numbers are dominated by the client and the session store's syncs.
+ * Each run publishes a batch of messages between calls to \ref mqtt_sync; all the
+ * messages in a batch are made durable by one sync.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <mqtt.h>
+
+/**
+ * @brief Reads what the client sent and acknowledges every QoS 1 PUBLISH in it.
+ */
+void acknowledge_publishes(int broker_fd);
+
+/**
+ * @brief Publishes \p count messages, syncing every \p batch messages.
+ *
+ * @returns The number of messages published per second, or -1 on error.
+ */
+double run(const char *store_path, int count, int batch);
+
+/**
+ * Usage: bench_session_store [count] [store path]
+ */
+int main(int argc, const char *argv[])
+{
+    const int batches[] = {1, 16, 256};
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    const char *store_path = argc > 2 ? argv[2] : "/tmp/mqtt-c-bench-session";
+    size_t i;
+
+    printf("%-14s %8s %14s\n", "send buffer", "batch", "publishes/s");
+    for(i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i) {
+        printf("%-14s %8d %14.0f\n", "memory", batches[i], run(NULL, count, batches[i]));
+        printf("%-14s %8d %14.0f\n", "session store", batches[i], run(store_path, count, batches[i]));
+    }
+    unlink(store_path);
+    return 0;
+}
+
+void acknowledge_publishes(int broker_fd)
+{
+    static uint8_t buf[1 << 16];
+    static size_t buf_size = 0;
+    struct mqtt_response response;
+    uint8_t puback[4];
+    ssize_t rv;
+    size_t consumed = 0;
+
+    while ((rv = recv(broker_fd, buf + buf_size, sizeof(buf) - buf_size, MSG_DONTWAIT)) > 0) {
+        buf_size += (size_t) rv;
+    }
+    while (consumed < buf_size) {
+        rv = mqtt_unpack_fixed_header(&response, buf + consumed, buf_size - consumed);
+        if (rv <= 0) {
+            break;
+        }
+        if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+            rv = mqtt_unpack_response(&response, buf + consumed, buf_size - consumed);
+            mqtt_pack_pubxxx_request(puback, sizeof(puback), MQTT_CONTROL_PUBACK, response.decoded.publish.packet_id);
+            send(broker_fd, puback, sizeof(puback), 0);
+        } else {
+            rv += (ssize_t) response.fixed_header.remaining_length;
+        }
+        consumed += (size_t) rv;
+    }
+    memmove(buf, buf + consumed, buf_size - consumed);
+    buf_size -= consumed;
+}
+
+double run(const char *store_path, int count, int batch)
+{
+    static uint8_t sendbuf[1 << 16], recvbuf[1 << 12];
+    struct mqtt_session_store store;
+    struct mqtt_client client;
+    struct timespec start, end;
+    char message[64] = "durable message";
+    int sv[2], i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    if (store_path != NULL) {
+        unlink(store_path);
+        if (mqtt_session_store_open(&store, store_path, sizeof(sendbuf)) != MQTT_OK) {
+            fprintf(stderr, "error: can't open %s\n", store_path);
+            exit(EXIT_FAILURE);
+        }
+        mqtt_set_session_store(&client, &store);
+    }
+    mqtt_connect(&client, "bench", NULL, NULL, 0, NULL, NULL, 0, 400);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; ++i) {
+        if (mqtt_publish(&client, "bench/durable", message, sizeof(message), MQTT_PUBLISH_QOS_1) != MQTT_OK) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+            exit(EXIT_FAILURE);
+        }
+        if ((i + 1) % batch == 0 || i + 1 == count) {
+            mqtt_sync(&client);
+            acknowledge_publishes(sv[1]);
+            mqtt_sync(&client);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (store_path != NULL) {
+        mqtt_session_store_close(&store);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return count / ((end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec));
+}
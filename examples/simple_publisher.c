@@ -19,19 +19,9 @@
 void publish_callback(void** unused, struct mqtt_response_publish *published);
 
 /**
- * @brief The client's refresher. This function triggers back-end routines to 
- *        handle ingress/egress traffic to the broker.
- * 
- * @note All this function needs to do is call \ref __mqtt_recv and 
- *       \ref __mqtt_send every so often. I've picked 100 ms meaning that 
- *       client ingress/egress traffic will be handled every 100 ms.
- */
-void* client_refresher(void* client);
-
-/**
- * @brief Safelty closes the \p sockfd and cancels the \p client_daemon before \c exit. 
+ * @brief Safelty stops the \p client's I/O thread and closes the \p sockfd before \c exit. 
  */
-void exit_example(int status, int sockfd, pthread_t *client_daemon);
+void exit_example(int status, int sockfd, struct mqtt_client *client);
 
 /**
  * A simple program to that publishes the current time whenever ENTER is pressed. 
@@ -84,12 +74,10 @@ int main(int argc, const char *argv[])
         exit_example(EXIT_FAILURE, sockfd, NULL);
     }
 
-    /* start a thread to refresh the client (handle egress and ingree client traffic) */
-    pthread_t client_daemon;
-    if(pthread_create(&client_daemon, NULL, client_refresher, &client)) {
-        fprintf(stderr, "Failed to start client daemon.\n");
+    /* start a thread to handle egress and ingress client traffic */
+    if (mqtt_start_io_thread(&client) != MQTT_OK) {
+        fprintf(stderr, "Failed to start the client's I/O thread.\n");
         exit_example(EXIT_FAILURE, sockfd, NULL);
-
     }
 
     /* start publishing the time */
@@ -115,7 +103,7 @@ int main(int argc, const char *argv[])
         /* check for errors */
         if (client.error != MQTT_OK) {
             fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
-            exit_example(EXIT_FAILURE, sockfd, &client_daemon);
+            exit_example(EXIT_FAILURE, sockfd, &client);
         }
     }   
 
@@ -124,13 +112,13 @@ int main(int argc, const char *argv[])
     sleep(1);
 
     /* exit */ 
-    exit_example(EXIT_SUCCESS, sockfd, &client_daemon);
+    exit_example(EXIT_SUCCESS, sockfd, &client);
 }
 
-void exit_example(int status, int sockfd, pthread_t *client_daemon)
+void exit_example(int status, int sockfd, struct mqtt_client *client)
 {
+    if (client != NULL) mqtt_stop_io_thread(client);
     if (sockfd != -1) close(sockfd);
-    if (client_daemon != NULL) pthread_cancel(*client_daemon);
     exit(status);
 }
 
@@ -140,13 +128,3 @@ void publish_callback(void** unused, struct mqtt_response_publish *published)
 {
     /* not used in this example */
 }
-
-void* client_refresher(void* client)
-{
-    while(1) 
-    {
-        mqtt_sync((struct mqtt_client*) client);
-        usleep(100000U);
-    }
-    return NULL;
-}
\ No newline at end of file
@@ -158,6 +158,16 @@ struct mqtt_fixed_header {
  */
 #define MQTT_PROTOCOL_LEVEL 0x04
 
+/**
+ * @brief The protocol level of MQTT v5.0.
+ * @ingroup packers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901037">
+ * MQTT v5.0: Protocol Version.
+ * </a>  
+ */
+#define MQTT_PROTOCOL_LEVEL_5 0x05
+
 /** 
  * @brief A macro used to declare the enum MQTTErrors and associated 
  *        error messages (the members of the num) at the same time.
@@ -188,7 +198,18 @@ struct mqtt_fixed_header {
     MQTT_ERROR(MQTT_ERROR_SUBSCRIBE_FAILED)              \
     MQTT_ERROR(MQTT_ERROR_CONNECTION_CLOSED)             \
     MQTT_ERROR(MQTT_ERROR_INITIAL_RECONNECT)             \
-    MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)
+    MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)      \
+    MQTT_ERROR(MQTT_ERROR_SESSION_STORE_IO)              \
+    MQTT_ERROR(MQTT_ERROR_SESSION_STORE_CORRUPT)         \
+    MQTT_ERROR(MQTT_ERROR_SPOOL_IO)                      \
+    MQTT_ERROR(MQTT_ERROR_CLIENT_ID_TOO_LONG)            \
+    MQTT_ERROR(MQTT_ERROR_IO_THREAD)                     \
+    MQTT_ERROR(MQTT_ERROR_REACTOR)                       \
+    MQTT_ERROR(MQTT_ERROR_MALFORMED_PROPERTIES)          \
+    MQTT_ERROR(MQTT_ERROR_PACKET_TOO_LARGE)              \
+    MQTT_ERROR(MQTT_ERROR_TOPIC_ALIAS_INVALID)           \
+    MQTT_ERROR(MQTT_ERROR_KEEP_ALIVE_TIMEOUT)            \
+    MQTT_ERROR(MQTT_ERROR_SPOOL_ACTIVE)
 
 /* todo: add more connection refused errors */
 
@@ -267,6 +288,205 @@ ssize_t __mqtt_pack_str(uint8_t *buf, const char* str);
 /** @brief A macro to get the MQTT string length from a c-string. */
 #define __mqtt_packed_cstrlen(x) (2 + strlen(x))
 
+/**
+ * @brief Pack a variable byte integer (MQTT v5.0), as used for the remaining length and
+ *        the length of properties.
+ * 
+ * @param[out] buf the buffer that the integer will be written to.
+ * @param[in] integer the integer, less than 2^28.
+ * 
+ * @warning This function provides no error checking.
+ * 
+ * @returns The number of bytes written (1 to 4).
+ */
+ssize_t __mqtt_pack_varint(uint8_t *buf, uint32_t integer);
+
+/**
+ * @brief Unpack a variable byte integer (MQTT v5.0).
+ * 
+ * @param[in] buf the buffer that the integer will be read from.
+ * @param[in] bufsz the number of bytes in \p buf.
+ * @param[out] integer the integer.
+ * 
+ * @returns The number of bytes consumed, or \c MQTT_ERROR_MALFORMED_PROPERTIES if \p buf
+ *          doesn't hold a valid variable byte integer.
+ */
+ssize_t __mqtt_unpack_varint(const uint8_t *buf, size_t bufsz, uint32_t *integer);
+
+/** @brief A macro to get the number of bytes a variable byte integer is packed in. */
+#define __mqtt_packed_varint_size(x) ((x) < 128 ? 1 : (x) < 16384 ? 2 : (x) < 2097152 ? 3 : 4)
+
+/* PROPERTIES */
+
+/**
+ * @brief An enumeration of the MQTT v5.0 property identifiers.
+ * @ingroup packers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901029">
+ * MQTT v5.0: Properties.
+ * </a>
+ */
+enum MQTTPropertyIdentifiers {
+    MQTT_PROPERTY_PAYLOAD_FORMAT_INDICATOR = 0x01u,
+    MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL = 0x02u,
+    MQTT_PROPERTY_CONTENT_TYPE = 0x03u,
+    MQTT_PROPERTY_RESPONSE_TOPIC = 0x08u,
+    MQTT_PROPERTY_CORRELATION_DATA = 0x09u,
+    MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER = 0x0Bu,
+    MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL = 0x11u,
+    MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER = 0x12u,
+    MQTT_PROPERTY_SERVER_KEEP_ALIVE = 0x13u,
+    MQTT_PROPERTY_AUTHENTICATION_METHOD = 0x15u,
+    MQTT_PROPERTY_AUTHENTICATION_DATA = 0x16u,
+    MQTT_PROPERTY_REQUEST_PROBLEM_INFORMATION = 0x17u,
+    MQTT_PROPERTY_WILL_DELAY_INTERVAL = 0x18u,
+    MQTT_PROPERTY_REQUEST_RESPONSE_INFORMATION = 0x19u,
+    MQTT_PROPERTY_RESPONSE_INFORMATION = 0x1Au,
+    MQTT_PROPERTY_SERVER_REFERENCE = 0x1Cu,
+    MQTT_PROPERTY_REASON_STRING = 0x1Fu,
+    MQTT_PROPERTY_RECEIVE_MAXIMUM = 0x21u,
+    MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22u,
+    MQTT_PROPERTY_TOPIC_ALIAS = 0x23u,
+    MQTT_PROPERTY_MAXIMUM_QOS = 0x24u,
+    MQTT_PROPERTY_RETAIN_AVAILABLE = 0x25u,
+    MQTT_PROPERTY_USER_PROPERTY = 0x26u,
+    MQTT_PROPERTY_MAXIMUM_PACKET_SIZE = 0x27u,
+    MQTT_PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE = 0x28u,
+    MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE = 0x29u,
+    MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE = 0x2Au
+};
+
+/**
+ * @brief A single MQTT v5.0 property.
+ * @ingroup packers
+ * 
+ * Which member of \c value is used depends on the type of the property: integers (of any
+ * width) use \c integer, strings and binary data use \c binary and the user property 
+ * uses \c pair. Strings are not null terminated.
+ */
+struct mqtt_property {
+    /** @brief The \ref MQTTPropertyIdentifiers of the property. */
+    uint8_t identifier;
+
+    /** @brief The value of the property. */
+    union {
+        /** @brief The value of an integer property. */
+        uint32_t integer;
+
+        /** @brief The value of a string or binary data property. */
+        struct {
+            /** @brief The bytes of the value. */
+            const void *data;
+
+            /** @brief The number of bytes in \c data. */
+            uint16_t size;
+        } binary;
+
+        /** @brief The value of a user property. */
+        struct {
+            /** @brief The name. */
+            const void *name;
+
+            /** @brief The number of bytes in \c name. */
+            uint16_t name_size;
+
+            /** @brief The value. */
+            const void *value;
+
+            /** @brief The number of bytes in \c value. */
+            uint16_t value_size;
+        } pair;
+    } value;
+};
+
+/**
+ * @brief The packed properties of a received packet.
+ * @ingroup unpackers
+ * 
+ * Unpacking a packet only checks that its properties are well-formed. The properties 
+ * themselves are read out of the receive buffer with \ref mqtt_properties_next or 
+ * \ref mqtt_properties_find, so nothing is copied or allocated.
+ */
+struct mqtt_properties {
+    /** @brief The first byte of the first property. */
+    const uint8_t *start;
+
+    /** @brief The number of bytes of properties. */
+    uint32_t size;
+};
+
+/**
+ * @brief Returns the number of bytes \p properties are packed in, including the property 
+ *        length.
+ * @ingroup packers
+ * 
+ * @param[in] properties the properties.
+ * @param[in] num_properties the number of \p properties.
+ * 
+ * @returns The packed size, or \c MQTT_ERROR_MALFORMED_PROPERTIES if a property identifier
+ *          is unknown.
+ */
+ssize_t mqtt_properties_size(const struct mqtt_property *properties, size_t num_properties);
+
+/**
+ * @brief Serialize the property length and \p properties into \p buf.
+ * @ingroup packers
+ * 
+ * @param[out] buf the buffer to write to.
+ * @param[in] bufsz the maximum number of bytes that can be put in to \p buf.
+ * @param[in] properties the properties, \c NULL if \p num_properties is 0.
+ * @param[in] num_properties the number of \p properties.
+ * 
+ * @returns The number of bytes written to \p buf, or 0 if \p buf is too small, or a 
+ *          negative value if a property identifier is unknown.
+ */
+ssize_t mqtt_pack_properties(uint8_t *buf, size_t bufsz, const struct mqtt_property *properties, size_t num_properties);
+
+/**
+ * @brief Check the property length and properties at the start of \p buf and point 
+ *        \p properties at them.
+ * @ingroup unpackers
+ * 
+ * @param[out] properties the properties.
+ * @param[in] buf the buffer.
+ * @param[in] bufsz the number of bytes in \p buf that may belong to the properties.
+ * 
+ * @returns The number of bytes consumed, or \c MQTT_ERROR_MALFORMED_PROPERTIES.
+ */
+ssize_t mqtt_unpack_properties(struct mqtt_properties *properties, const uint8_t *buf, size_t bufsz);
+
+/**
+ * @brief Decode the property at \p offset in \p properties and move \p offset past it.
+ * @ingroup unpackers
+ * 
+ * @code
+ * size_t offset = 0;
+ * struct mqtt_property property;
+ * while (mqtt_properties_next(&response.decoded.connack.properties, &offset, &property)) {
+ *     ...
+ * }
+ * @endcode
+ * 
+ * @pre \p properties must have been filled in by \ref mqtt_unpack_properties.
+ * 
+ * @param[in] properties the properties.
+ * @param[in,out] offset the offset of the next property, start with 0.
+ * @param[out] property the decoded property.
+ * 
+ * @returns 1 if a property was decoded, 0 if there are no more properties.
+ */
+int mqtt_properties_next(const struct mqtt_properties *properties, size_t *offset, struct mqtt_property *property);
+
+/**
+ * @brief Decode the first property with \p identifier in \p properties.
+ * @ingroup unpackers
+ * 
+ * @pre \p properties must have been filled in by \ref mqtt_unpack_properties.
+ * 
+ * @returns 1 if the property was found, 0 otherwise.
+ */
+int mqtt_properties_find(const struct mqtt_properties *properties, uint8_t identifier, struct mqtt_property *property);
+
 /* RESPONSES */
 
 /**
@@ -304,9 +524,14 @@ struct mqtt_response_connack {
     /** 
      * @brief The return code of the connection request. 
      * 
+     * @note For MQTT v5.0 this is the CONNACK reason code, which is 0 on success too.
+     * 
      * @see MQTTConnackReturnCode
      */
     enum MQTTConnackReturnCode return_code;
+
+    /** @brief The CONNACK properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
  /**
@@ -357,6 +582,9 @@ struct mqtt_response_publish {
 
     /** @brief The size of the application message in bytes. */
     size_t application_message_size;
+
+    /** @brief The PUBLISH properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -371,6 +599,12 @@ struct mqtt_response_publish {
 struct mqtt_response_puback {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT v5.0 only, 0 otherwise). */
+    uint8_t reason_code;
+
+    /** @brief The properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -385,6 +619,12 @@ struct mqtt_response_puback {
 struct mqtt_response_pubrec {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT v5.0 only, 0 otherwise). */
+    uint8_t reason_code;
+
+    /** @brief The properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -399,6 +639,12 @@ struct mqtt_response_pubrec {
 struct mqtt_response_pubrel {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT v5.0 only, 0 otherwise). */
+    uint8_t reason_code;
+
+    /** @brief The properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -413,6 +659,12 @@ struct mqtt_response_pubrel {
 struct mqtt_response_pubcomp {
     /** T@brief he published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason code (MQTT v5.0 only, 0 otherwise). */
+    uint8_t reason_code;
+
+    /** @brief The properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -451,6 +703,9 @@ struct mqtt_response_suback {
 
     /** The number of return codes. */
     size_t num_return_codes;
+
+    /** @brief The SUBACK properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -464,6 +719,15 @@ struct mqtt_response_suback {
 struct mqtt_response_unsuback {
     /** @brief The published messages packet ID. */
     uint16_t packet_id;
+
+    /** @brief The reason codes for the topics (MQTT v5.0 only, none otherwise). */
+    const uint8_t *reason_codes;
+
+    /** @brief The number of reason codes. */
+    size_t num_reason_codes;
+
+    /** @brief The UNSUBACK properties (MQTT v5.0 only, empty otherwise). */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -480,6 +744,22 @@ struct mqtt_response_pingresp {
   int dummy;
 };
 
+/**
+ * @brief A DISCONNECT sent by the broker (MQTT v5.0 only).
+ * @ingroup unpackers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901205">
+ * MQTT v5.0: DISCONNECT - Disconnect notification.
+ * </a> 
+ */
+struct mqtt_response_disconnect {
+    /** @brief The reason code. */
+    uint8_t reason_code;
+
+    /** @brief The DISCONNECT properties. */
+    struct mqtt_properties properties;
+};
+
 /**
  * @brief A struct used to deserialize/interpret an incoming packet from the broker.
  * @ingroup unpackers
@@ -506,6 +786,7 @@ struct mqtt_response {
         struct mqtt_response_suback   suback;
         struct mqtt_response_unsuback unsuback;
         struct mqtt_response_pingresp pingresp;
+        struct mqtt_response_disconnect disconnect;
     } decoded;
 };
 
@@ -627,6 +908,24 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
  */
 ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf, size_t bufsz);
 
+/**
+ * @brief Deserialize an MQTT v5.0 packet from the broker.
+ * @ingroup unpackers
+ * 
+ * Like \ref mqtt_unpack_response, but the packets are expected in their MQTT v5.0 layout:
+ * reason codes and properties are unpacked too, and the broker may send a DISCONNECT.
+ * 
+ * @param[out] response the mqtt_response that will be initialize from \p buf.
+ * @param[in] buf the incoming data buffer.
+ * @param[in] bufsz the number of bytes available in the buffer.
+ * 
+ * @relates mqtt_response
+ * 
+ * @returns The number of bytes consumed on success, zero \p buf does not contain enough bytes
+ *          to deserialize the packet, a negative value if a protocol violation was encountered.  
+ */
+ssize_t mqtt_unpack_response_v5(struct mqtt_response* response, const uint8_t *buf, size_t bufsz);
+
 /* REQUESTS */
 
  /**
@@ -713,6 +1012,32 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
                                      uint8_t connect_flags,
                                      uint16_t keep_alive);
 
+/**
+ * @brief Serialize an MQTT v5.0 connection request into a buffer. 
+ * @ingroup packers
+ * 
+ * Like \ref mqtt_pack_connection_request, with the CONNECT \p properties. The will (if 
+ * any) is packed without will properties.
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901033">
+ * MQTT v5.0: CONNECT - Connection Request.
+ * </a>
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the CONNECT 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_connection_request_v5(uint8_t* buf, size_t bufsz, 
+                                        const char* client_id,
+                                        const char* will_topic,
+                                        const void* will_message,
+                                        size_t will_message_size,
+                                        const char* user_name,
+                                        const char* password,
+                                        uint8_t connect_flags,
+                                        uint16_t keep_alive,
+                                        const struct mqtt_property *properties,
+                                        size_t num_properties);
+
 /**
  * @brief An enumeration of the PUBLISH flags.
  * @ingroup packers
@@ -738,14 +1063,18 @@ enum MQTTPublishFlags {
  * @param[in] bufsz the maximum number of bytes that can be put into \p buf.
  * @param[in] topic_name the topic to publish \p application_message under.
  * @param[in] packet_id this packets packet ID.
- * @param[in] application_message the application message to be published.
+ * @param[in] application_message the application message to be published. Set to \c NULL to
+ *                                only reserve \p application_message_size bytes for the
+ *                                application message (the bytes are left uninitialized).
  * @param[in] application_message_size the size of \p application_message in bytes.
  * @param[in] publish_flags The flags to publish \p application_message with. These include
  *                          the \c MQTT_PUBLISH_DUP flag, \c MQTT_PUBLISH_QOS_X (\c X &isin; 
  *                          {0, 1, 2}), and \c MQTT_PUBLISH_RETAIN flag.
  * 
  * @note The default QoS is level 0.
- * 
+ * @note The application message is always the last \p application_message_size bytes of the
+ *       packed packet.
+ *
  * @see <a href="http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Toc398718037">
  * MQTT v3.1.1: PUBLISH - Publish Message.
  * </a>
@@ -760,6 +1089,28 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   size_t application_message_size,
                                   uint8_t publish_flags);
 
+/**
+ * @brief Serialize an MQTT v5.0 PUBLISH request and put it in \p buf.
+ * @ingroup packers
+ * 
+ * Like \ref mqtt_pack_publish_request, with the PUBLISH \p properties.
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901100">
+ * MQTT v5.0: PUBLISH - Publish message.
+ * </a>
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the PUBLISH 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_publish_request_v5(uint8_t *buf, size_t bufsz,
+                                     const char* topic_name,
+                                     uint16_t packet_id,
+                                     void* application_message,
+                                     size_t application_message_size,
+                                     uint8_t publish_flags,
+                                     const struct mqtt_property *properties,
+                                     size_t num_properties);
+
 /**
  * @brief Serialize a PUBACK, PUBREC, PUBREL, or PUBCOMP packet and put it in \p buf.
  * @ingroup packers
@@ -792,6 +1143,24 @@ ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz,
                                  enum MQTTControlPacketType control_type,
                                  uint16_t packet_id);
 
+/**
+ * @brief Serialize an MQTT v5.0 PUBACK, PUBREC, PUBREL, or PUBCOMP packet and put it in \p buf.
+ * @ingroup packers
+ * 
+ * Like \ref mqtt_pack_pubxxx_request, with a reason code and properties. If 
+ * \p reason_code is 0 and there are no properties the packet is packed exactly like 
+ * \ref mqtt_pack_pubxxx_request does.
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the PUBXXX 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_pubxxx_request_v5(uint8_t *buf, size_t bufsz, 
+                                    enum MQTTControlPacketType control_type,
+                                    uint16_t packet_id,
+                                    uint8_t reason_code,
+                                    const struct mqtt_property *properties,
+                                    size_t num_properties);
+
 /** 
  * @brief The maximum number topics that can be subscribed to in a single call to 
  *         mqtt_pack_subscribe_request.
@@ -827,6 +1196,26 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz,
                                     unsigned int packet_id, 
                                     ...); /* null terminated */
 
+/** 
+ * @brief Serialize an MQTT v5.0 SUBSCRIBE packet and put it in \p buf.
+ * @ingroup packers
+ * 
+ * Like \ref mqtt_pack_subscribe_request, with the SUBSCRIBE \p properties. The 
+ * \c {int max_qos_level} of each topic is packed as its subscription options byte.
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901161">
+ * MQTT v5.0: SUBSCRIBE - Subscribe request.
+ * </a>
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the SUBSCRIBE 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_subscribe_request_v5(uint8_t *buf, size_t bufsz, 
+                                       unsigned int packet_id, 
+                                       const struct mqtt_property *properties,
+                                       size_t num_properties,
+                                       ...); /* null terminated */
+
 /** 
  * @brief The maximum number topics that can be subscribed to in a single call to 
  *         mqtt_pack_unsubscribe_request.
@@ -861,6 +1250,21 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz,
                                       unsigned int packet_id, 
                                       ...); /* null terminated */
 
+/** 
+ * @brief Serialize an MQTT v5.0 UNSUBSCRIBE packet and put it in \p buf.
+ * @ingroup packers
+ * 
+ * Like \ref mqtt_pack_unsubscribe_request, with the UNSUBSCRIBE \p properties.
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the 
+ *          UNSUBSCRIBE packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_unsubscribe_request_v5(uint8_t *buf, size_t bufsz, 
+                                         unsigned int packet_id, 
+                                         const struct mqtt_property *properties,
+                                         size_t num_properties,
+                                         ...); /* null terminated */
+
 /**
  * @brief Serialize a PINGREQ and put it into \p buf.
  * @ingroup packers
@@ -893,124 +1297,398 @@ ssize_t mqtt_pack_ping_request(uint8_t *buf, size_t bufsz);
  */
 ssize_t mqtt_pack_disconnect(uint8_t *buf, size_t bufsz);
 
-
 /**
- * @brief An enumeration of queued message states. 
- * @ingroup details
+ * @brief Serialize an MQTT v5.0 DISCONNECT and put it into \p buf.
+ * @ingroup packers
+ * 
+ * If \p reason_code is 0 and there are no properties the packet is packed exactly like
+ * \ref mqtt_pack_disconnect does.
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the DISCONNECT 
+ *          packet, a negative value if there was a protocol violation.
  */
-enum MQTTQueuedMessageState {
-    MQTT_QUEUED_UNSENT,
-    MQTT_QUEUED_AWAITING_ACK,
-    MQTT_QUEUED_COMPLETE
-};
+ssize_t mqtt_pack_disconnect_v5(uint8_t *buf, size_t bufsz, uint8_t reason_code,
+                                const struct mqtt_property *properties, size_t num_properties);
+
+/* ALLOCATORS */
 
 /**
- * @brief A message in a mqtt_message_queue.
- * @ingroup details
+ * @brief An allocator that MQTT-C routes all of its dynamic memory through.
+ * @ingroup api
+ * 
+ * An allocator is a small vtable (\c alloc and \c free) plus the \c state they operate on.
+ * Callers should go through mqtt_allocator_alloc and mqtt_allocator_free, which keep the 
+ * usage counters up to date.
+ * 
+ * Three implementations are built in:
+ *  - mqtt_heap_allocator_init: \c MQTT_PAL_MALLOC and \c MQTT_PAL_FREE.
+ *  - mqtt_arena_allocator_init: a bump allocator over a caller buffer for short-lived scratch
+ *    data, released all at once by mqtt_arena_reset.
+ *  - mqtt_pool_allocator_init: a slab pool with power-of-two size classes for message-sized
+ *    objects.
+ * 
+ * Each client also has a scratch arena for data that doesn't outlive a call (see 
+ * mqtt_set_scratch_buffer). The PAL's own objects (pollers, io_uring rings) use 
+ * \c MQTT_PAL_MALLOC directly: they belong to sockets and reactors rather than to a client, 
+ * and the PAL can be given its own \c MQTT_PAL_MALLOC.
+ * 
+ * @note The built-in allocators are not thread-safe. An allocator shared by several clients
+ *       must do its own locking.
  */
-struct mqtt_queued_message {
-    /** @brief A pointer to the start of the message. */
-    uint8_t *start;
-
-    /** @brief The number of bytes in the message. */
-    size_t size;
-
-    /** @brief The state of the message. */
-    enum MQTTQueuedMessageState state;
-
+struct mqtt_allocator {
     /** 
-     * @brief The time at which the message was sent..
-     * 
-     * @note A timeout will only occur if the message is in
-     *       the MQTT_QUEUED_AWAITING_ACK \c state.
+     * @brief Allocates \p size bytes. 
+     * @returns The memory or \c NULL if the allocation failed.
      */
-    mqtt_pal_time_t time_sent;
-
-    /**
-     * @brief The control type of the message.
-     */
-    enum MQTTControlPacketType control_type;
+    void* (*alloc)(void *state, size_t size);
 
     /** 
-     * @brief The packet id of the message.
-     * 
-     * @note This field is only used if the associate \c control_type has a 
-     *       \c packet_id field.
+     * @brief Frees memory returned by \c alloc.
+     * @note \p size is always the size that was passed to \c alloc.
      */
-    uint16_t packet_id;
-};
+    void (*free)(void *state, void *ptr, size_t size);
 
-/**
- * @brief A message queue.
- * @ingroup details
- * 
- * @note This struct is used internally to manage sending messages.
- * @note The only members the user should use are \c curr and \c curr_sz. 
- */
-struct mqtt_message_queue {
-    /** 
-     * @brief The start of the message queue's memory block. 
-     * 
-     * @warning This member should \em not be manually changed.
-     */
-    void *mem_start;
+    /** @brief The state passed to \c alloc and \c free. */
+    void *state;
 
-    /** @brief The end of the message queue's memory block. */
-    void *mem_end;
+    /** @brief The number of bytes currently allocated. */
+    size_t bytes_in_use;
 
-    /**
-     * @brief A pointer to the position in the buffer you can pack bytes at.
-     * 
-     * @note Immediately after packing bytes at \c curr you \em must call
-     *       mqtt_mq_register.
-     */
-    uint8_t *curr;
+    /** @brief The largest value \c bytes_in_use has reached. */
+    size_t peak_bytes_in_use;
 
-    /**
-     * @brief The number of bytes that can be written to \c curr.
-     * 
-     * @note curr_sz will decrease by more than the number of bytes you write to 
-     *       \c curr. This is because the mqtt_queued_message structs share the 
-     *       same memory (and thus, a mqtt_queued_message must be allocated in 
-     *       the message queue's memory whenever a new message is registered).  
-     */
-    size_t curr_sz;
-    
-    /**
-     * @brief The tail of the array of mqtt_queued_messages's.
-     * 
-     * @note This member should not be used manually.
-     */
-    struct mqtt_queued_message *queue_tail;
+    /** @brief The number of successful allocations. */
+    size_t number_of_allocations;
+
+    /** @brief The number of frees. */
+    size_t number_of_frees;
+
+    /** @brief The number of allocations that failed. */
+    size_t number_of_failures;
 };
 
 /**
- * @brief Initialize a message queue.
- * @ingroup details
- * 
- * @param[out] mq The message queue to initialize.
- * @param[in] buf The buffer for this message queue.
- * @param[in] bufsz The number of bytes in the buffer. 
+ * @brief Allocate \p size bytes from \p allocator and update its counters.
+ * @ingroup api
  * 
- * @relates mqtt_message_queue
+ * @returns The memory or \c NULL if the allocation failed.
  */
-void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
+void* mqtt_allocator_alloc(struct mqtt_allocator *allocator, size_t size);
 
 /**
- * @brief Clear as many messages from the front of the queue as possible.
- * @ingroup details
- * 
- * @note Calls to this function are the \em only way to remove messages from the queue.
- * 
- * @param mq The message queue.
+ * @brief Return \p size bytes at \p ptr to \p allocator and update its counters.
+ * @ingroup api
  * 
- * @relates mqtt_message_queue
+ * @note \p size must be the size \p ptr was allocated with. \p ptr may be \c NULL.
  */
-void mqtt_mq_clean(struct mqtt_message_queue *mq);
+void mqtt_allocator_free(struct mqtt_allocator *allocator, void *ptr, size_t size);
 
 /**
- * @brief Register a message that was just added to the buffer.
- * @ingroup details
+ * @brief Initialize an allocator that uses \c MQTT_PAL_MALLOC and \c MQTT_PAL_FREE.
+ * @ingroup api
+ * 
+ * @param[out] allocator The allocator to initialize.
+ */
+void mqtt_heap_allocator_init(struct mqtt_allocator *allocator);
+
+/**
+ * @brief The state of an arena allocator.
+ * @ingroup details
+ */
+struct mqtt_arena {
+    /** @brief The arena's memory. */
+    uint8_t *mem;
+
+    /** @brief The size of the arena's memory. */
+    size_t size;
+
+    /** @brief The number of bytes at the front of \c mem that are in use. */
+    size_t used;
+};
+
+/**
+ * @brief Initialize a bump allocator over \p buf.
+ * @ingroup api
+ * 
+ * Allocations are carved off the front of \p buf. Frees are ignored unless they release
+ * the most recent allocation; everything is released at once by mqtt_arena_reset.
+ * 
+ * @param[out] allocator The allocator to initialize.
+ * @param[out] arena The arena state. Must outlive \p allocator.
+ * @param[in] buf The arena's memory.
+ * @param[in] bufsz The size of \p buf in bytes.
+ */
+void mqtt_arena_allocator_init(struct mqtt_allocator *allocator, struct mqtt_arena *arena, void *buf, size_t bufsz);
+
+/**
+ * @brief Release everything allocated from an arena allocator.
+ * @ingroup api
+ * 
+ * @param allocator An allocator initialized with mqtt_arena_allocator_init.
+ */
+void mqtt_arena_reset(struct mqtt_allocator *allocator);
+
+/**
+ * @brief The number of size classes in a pool allocator.
+ * @ingroup details
+ * 
+ * The classes are \ref MQTT_POOL_MIN_BLOCK_SIZE bytes and up, doubling each time.
+ */
+#define MQTT_POOL_NUM_SIZE_CLASSES 8
+
+/**
+ * @brief The size of the smallest block in a pool allocator.
+ * @ingroup details
+ */
+#define MQTT_POOL_MIN_BLOCK_SIZE 32
+
+/**
+ * @brief The state of a pool allocator.
+ * @ingroup details
+ */
+struct mqtt_pool {
+    /** @brief Where slabs, and allocations larger than the largest size class, come from. */
+    struct mqtt_allocator *backing;
+
+    /** @brief The number of bytes requested from \c backing for each slab. */
+    size_t slab_size;
+
+    /** @brief The free blocks of each size class. */
+    void *free_lists[MQTT_POOL_NUM_SIZE_CLASSES];
+
+    /** @brief The slabs allocated from \c backing. */
+    void *slabs;
+};
+
+/**
+ * @brief Initialize a size-class slab pool.
+ * @ingroup api
+ * 
+ * Allocations are rounded up to the next size class and served from free lists. Empty
+ * free lists are refilled by carving a slab of \p slab_size bytes from \p backing. Slabs
+ * are only returned to \p backing by mqtt_pool_deinit.
+ * 
+ * @param[out] allocator The allocator to initialize.
+ * @param[out] pool The pool state. Must outlive \p allocator.
+ * @param[in] backing The allocator slabs are allocated from.
+ * @param[in] slab_size The number of bytes in each slab.
+ */
+void mqtt_pool_allocator_init(struct mqtt_allocator *allocator, struct mqtt_pool *pool, struct mqtt_allocator *backing, size_t slab_size);
+
+/**
+ * @brief Return all of a pool allocator's slabs to its backing allocator.
+ * @ingroup api
+ * 
+ * @param allocator An allocator initialized with mqtt_pool_allocator_init.
+ */
+void mqtt_pool_deinit(struct mqtt_allocator *allocator);
+
+
+/**
+ * @brief An enumeration of queued message states. 
+ * @ingroup details
+ */
+enum MQTTQueuedMessageState {
+    MQTT_QUEUED_UNSENT,
+    MQTT_QUEUED_AWAITING_ACK,
+    MQTT_QUEUED_COMPLETE
+};
+
+/**
+ * @brief The number of bytes each queued message uses in a mqtt_message_queue.
+ * @ingroup details
+ * 
+ * One entry in each of the queue's descriptor arrays: \c time_sent, \c offset, \c size, 
+ * \c packet_id, \c state, \c control_type, \c qos and \c resends.
+ */
+#define MQTT_MQ_DESCRIPTOR_SIZE (sizeof(uint64_t) + 2*sizeof(uint32_t) + sizeof(uint16_t) + 4*sizeof(uint8_t))
+
+/**
+ * @brief The alignment of the descriptor arrays in a mqtt_message_queue.
+ * @ingroup details
+ */
+#define MQTT_MQ_DESCRIPTOR_ALIGNMENT (sizeof(uint64_t))
+
+/**
+ * @brief A message queue.
+ * @ingroup details
+ * 
+ * Packets are packed at the front of the queue's memory. The messages' descriptors are 
+ * kept at the back of the memory as parallel arrays of \c capacity entries (see 
+ * mqtt_mq_descriptors_start), so scans over the queue only touch the arrays they need 
+ * rather than the packets themselves. Message \c i is \c size[i] bytes at 
+ * \c mem_start \c + \c offset[i]; message 0 is the oldest.
+ * 
+ * @note This struct is used internally to manage sending messages.
+ * @note The only members the user should use are \c curr and \c curr_sz. 
+ */
+struct mqtt_message_queue {
+    /** 
+     * @brief The start of the message queue's memory block. 
+     * 
+     * @warning This member should \em not be manually changed.
+     */
+    void *mem_start;
+
+    /** @brief The end of the message queue's memory block. */
+    void *mem_end;
+
+    /**
+     * @brief A pointer to the position in the buffer you can pack bytes at.
+     * 
+     * @note Immediately after packing bytes at \c curr you \em must call
+     *       mqtt_mq_register.
+     */
+    uint8_t *curr;
+
+    /**
+     * @brief The number of bytes that can be written to \c curr.
+     * 
+     * @note curr_sz will decrease by more than the number of bytes you write to 
+     *       \c curr. This is because the message descriptors share the same memory 
+     *       (and thus, room for one more descriptor is always kept free for the next 
+     *       message that is registered).  
+     */
+    size_t curr_sz;
+
+    /** @brief The number of messages in the queue. */
+    size_t length;
+
+    /** @brief The number of messages the descriptor arrays have room for. */
+    size_t capacity;
+
+    /** 
+     * @brief The time at which each message was sent, in \ref mqtt_pal_clock_us time.
+     * 
+     * @note A timeout will only occur if the message is in
+     *       the MQTT_QUEUED_AWAITING_ACK \c state.
+     */
+    uint64_t *time_sent;
+
+    /** @brief The offset of each message from \c mem_start. */
+    uint32_t *offset;
+
+    /** @brief The number of bytes in each message. */
+    uint32_t *size;
+
+    /** 
+     * @brief The packet id of each message.
+     * 
+     * @note Only used if the message's \c control_type has a \c packet_id field.
+     */
+    uint16_t *packet_id;
+
+    /** @brief The \ref MQTTQueuedMessageState of each message. */
+    uint8_t *state;
+
+    /** @brief The \ref MQTTControlPacketType of each message. */
+    uint8_t *control_type;
+
+    /** @brief The QoS of each PUBLISH message (0 for other messages). */
+    uint8_t *qos;
+
+    /** 
+     * @brief The number of times each message timed out (at most 255). 
+     * 
+     * Unless mqtt_client::resend_only_on_reconnect is set the message was resent each 
+     * time. The round trips of such messages are ambiguous and aren't sampled (Karn's rule).
+     */
+    uint8_t *resends;
+
+    /** @brief The buffer that was passed to mqtt_mq_init. */
+    void *base_start;
+
+    /** @brief The size of the buffer that was passed to mqtt_mq_init. */
+    size_t base_size;
+
+    /** @brief The allocator the queue grows into. */
+    struct mqtt_allocator *allocator;
+
+    /**
+     * @brief The number of bytes the queue grows by when it is full.
+     * 
+     * When the queue runs out of room it moves into memory from \c allocator, 
+     * growing one segment at a time until it reaches 
+     * \c growth_max_size. Once enough of the queue has drained it moves back 
+     * into the buffer passed to mqtt_mq_init.
+     * 
+     * @note This member is initialized to 0 (growth disabled) but it can be manually set
+     *       at any time. It has no effect while the queue is \c pinned.
+     */
+    size_t growth_segment_size;
+
+    /** @brief The largest size, in bytes, the queue is allowed to grow to. */
+    size_t growth_max_size;
+
+    /**
+     * @brief Non-zero if the queue must stay in the buffer passed to mqtt_mq_init.
+     * 
+     * Set by \ref mqtt_set_session_store, whose file is that buffer: a queue that moved
+     * onto the heap would leave the file describing stale messages.
+     */
+    int pinned;
+
+    /**
+     * @brief The number of bytes of completed messages that were queued behind an 
+     *        incomplete message the last time the queue was cleaned.
+     * 
+     * These are the bytes that an incomplete message at the head of the queue (e.g. a 
+     * QoS 1 PUBLISH whose PUBACK is late) would pin if the queue could only be 
+     * drained from the front. \ref mqtt_mq_clean reclaims them anyway.
+     */
+    size_t head_of_line_blocked_bytes;
+
+    /** @brief The largest value \c head_of_line_blocked_bytes has had. */
+    size_t max_head_of_line_blocked_bytes;
+};
+
+/**
+ * @brief Initialize a message queue.
+ * @ingroup details
+ * 
+ * @param[out] mq The message queue to initialize.
+ * @param[in] buf The buffer for this message queue.
+ * @param[in] bufsz The number of bytes in the buffer. 
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
+
+/**
+ * @brief Release any memory the message queue allocated while growing.
+ * @ingroup details
+ * 
+ * @note The queue is left empty and back in the buffer passed to mqtt_mq_init.
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_deinit(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Remove all completed messages from the queue.
+ * @ingroup details
+ * 
+ * Completed messages are removed wherever they are in the queue; the messages that
+ * remain are compacted to the front of the buffer in their original order.
+ * 
+ * @note Calls to this function are the \em only way to remove messages from the queue.
+ * @note Removing messages changes the indices of the messages after them.
+ * @note If the queue has grown it is shrunk back once enough of it has drained.
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_clean(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Register a message that was just added to the buffer.
+ * @ingroup details
+ * 
+ * The message's \c control_type and \c qos are read from the packet's fixed header. Its 
+ * \c packet_id is left for the caller to fill in.
  * 
  * @note This function should be called immediately following a call to a packer function
  *       that returned a positive value. The positive value (number of bytes packed) should
@@ -1022,9 +1700,66 @@ void mqtt_mq_clean(struct mqtt_message_queue *mq);
  * @note This function will step mqtt_message_queue::curr and update mqtt_message_queue::curr_sz.
  * @relates mqtt_message_queue
  * 
- * @returns The newly added struct mqtt_queued_message.
+ * @returns The index of the newly added message.
+ */
+size_t mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes);
+
+/**
+ * @brief Grow the message queue by one mqtt_message_queue::growth_segment_size.
+ * @ingroup details
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ * 
+ * @returns 1 if the queue grew, 0 if growth is disabled, the queue is 
+ *          mqtt_message_queue::pinned or already mqtt_message_queue::growth_max_size 
+ *          bytes, or the allocation failed.
+ */
+int mqtt_mq_grow(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Move the message at \p index to the front of the queue.
+ * @ingroup details
+ * 
+ * The messages before it keep their order. Used to put a CONNECT ahead of messages that 
+ * were queued for a previous connection.
+ * 
+ * @param mq The message queue.
+ * @param index The index of the message.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_move_to_front(struct mqtt_message_queue *mq, size_t index);
+
+/**
+ * @brief Prepare the queue for a new connection.
+ * @ingroup details
+ * 
+ * QoS 1 and QoS 2 PUBLISHes and PUBRELs that haven't been acknowledged are resent (the 
+ * PUBLISHes that were sent before with DUP set), everything else is removed.
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_resume(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Reattach a queue to memory that already holds a queue's packets and descriptors.
+ * @ingroup details
+ * 
+ * @param mq The message queue, initialized on the memory with mqtt_mq_init.
+ * @param length The number of messages in the queue.
+ * @param capacity The capacity of the descriptor arrays.
+ * @param data_size The number of bytes of packets at the front of the memory.
+ * 
+ * @relates mqtt_message_queue
+ * 
+ * @returns 1 if the queue was reattached, 0 if the arguments don't describe a valid queue
+ *          (the queue is left empty).
  */
-struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes);
+int mqtt_mq_restore(struct mqtt_message_queue *mq, size_t length, size_t capacity, size_t data_size);
 
 /**
  * @brief Find a message in the message queue.
@@ -1036,177 +1771,1072 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
  *            don't want to specify a packet ID.
  * 
  * @relates mqtt_message_queue
- * @returns The found message. \c NULL if the message was not found.
+ * @returns The index of the found message. -1 if the message was not found.
  */
-struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id);
+ssize_t mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id);
 
 /**
- * @brief Returns the mqtt_queued_message at \p index.
+ * @brief Returns a pointer to the first byte of the message at \p index.
  * @ingroup details
  * 
  * @param mq_ptr A pointer to the message queue.
  * @param index The index of the message. 
- *
- * @returns The mqtt_queued_message at \p index.
  */
-#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - index)
+#define mqtt_mq_start(mq_ptr, index) ((uint8_t*) (mq_ptr)->mem_start + (mq_ptr)->offset[index])
 
 /**
  * @brief Returns the number of messages in the message queue, \p mq_ptr.
  * @ingroup details
  */
-#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (mq_ptr)->queue_tail)
+#define mqtt_mq_length(mq_ptr) ((ssize_t) (mq_ptr)->length)
+
+/**
+ * @brief Returns where the descriptor arrays start if they have room for \p capacity messages.
+ * @ingroup details
+ * 
+ * @returns The start of the arrays, or \c NULL if they would not fit in the queue's memory.
+ */
+uint8_t* mqtt_mq_descriptors_start(const struct mqtt_message_queue *mq, size_t capacity);
 
 /**
  * @brief Used internally to recalculate the \c curr_sz.
  * @ingroup details
+ * 
+ * Room is left for the descriptor of one more message.
+ */
+size_t mqtt_mq_currsz(const struct mqtt_message_queue *mq);
+
+/**
+ * @brief Returns the number of bytes of the message queue's memory that are in use.
+ * @ingroup details
  */
-#define mqtt_mq_currsz(mq_ptr) (mq_ptr->curr >= (uint8_t*) ((mq_ptr)->queue_tail - 1)) ? 0 : ((uint8_t*) ((mq_ptr)->queue_tail - 1)) - (mq_ptr)->curr
+#define mqtt_mq_bytes_used(mq_ptr) ((size_t) (((mq_ptr)->curr - (uint8_t*) (mq_ptr)->mem_start) + ((uint8_t*) (mq_ptr)->mem_end - (uint8_t*) (mq_ptr)->time_sent)))
 
-/* CLIENT */
+/* RECEIVE BUFFER POOL */
+
+/**
+ * @brief A pool of receive buffers shared by many clients.
+ * @ingroup api
+ * 
+ * A client that uses a pool (see \ref mqtt_set_recv_buffer_pool) only holds a receive 
+ * buffer while it is reading or has part of a packet buffered. Processes hosting many 
+ * mostly-idle connections then need about one block per \em active connection rather 
+ * than one per connection.
+ * 
+ * @note The pool is protected by its own mutex so clients running on different threads
+ *       can share it.
+ */
+struct mqtt_recv_buffer_pool {
+    /** @brief Protects the pool. */
+    mqtt_pal_mutex_t mutex;
+
+    /** @brief The size of each block. This is the largest packet a client can receive. */
+    size_t block_size;
+
+    /** @brief The free blocks. */
+    uint8_t *free_list;
+
+    /** @brief The number of blocks in the pool. */
+    size_t number_of_blocks;
+
+    /** @brief The number of blocks that are not lent to a client. */
+    size_t number_of_free_blocks;
+
+    /** @brief The number of times a client couldn't read because the pool was empty. */
+    size_t number_of_exhaustions;
+};
+
+/**
+ * @brief Initialize a receive buffer pool by splitting \p buf into blocks.
+ * @ingroup api
+ * 
+ * @param[out] pool The pool to initialize.
+ * @param[in] buf The memory for the blocks.
+ * @param[in] bufsz The size of \p buf in bytes.
+ * @param[in] block_size The size of each block. Must be at least \c sizeof(void*).
+ * 
+ * @returns The number of blocks in the pool.
+ */
+size_t mqtt_recv_buffer_pool_init(struct mqtt_recv_buffer_pool *pool, void *buf, size_t bufsz, size_t block_size);
 
 /**
- * @brief An MQTT client. 
+ * @brief Take a block from \p pool.
  * @ingroup details
  * 
- * @note All members can be manipulated via the related functions.
+ * @returns A block of \c pool->block_size bytes or \c NULL if the pool is empty.
  */
-struct mqtt_client {
-    /** @brief The socket connecting to the MQTT broker. */
-    mqtt_pal_socket_handle socketfd;
+uint8_t* mqtt_recv_buffer_pool_acquire(struct mqtt_recv_buffer_pool *pool);
+
+/**
+ * @brief Give a block taken with mqtt_recv_buffer_pool_acquire back to \p pool.
+ * @ingroup details
+ */
+void mqtt_recv_buffer_pool_release(struct mqtt_recv_buffer_pool *pool, uint8_t *block);
+
+/* SESSION STORE */
+
+/**
+ * @brief The number of bytes at the start of a session store file that hold its header. 
+ * @ingroup details
+ */
+#define MQTT_SESSION_STORE_HEADER_SIZE 64
+
+/**
+ * @brief A file-backed send buffer that lets unacknowledged messages survive a restart.
+ * @ingroup api
+ * 
+ * The file is mapped into memory and a client attached with 
+ * \ref mqtt_set_session_store uses it (after a small header) as its message queue, so 
+ * queued messages and their state live in the file. Changes reach the page cache as they 
+ * are made, which is enough to survive the process crashing. To survive the machine 
+ * crashing the file is synced (see \ref mqtt_session_store_commit) before messages are 
+ * sent: every message that was published since the last \ref mqtt_sync is made durable 
+ * with a single sync (group commit).
+ * 
+ * When a session store is attached to a new client, the QoS 1 and 2 PUBLISH and PUBREL 
+ * messages that were still in flight in the file are queued again and resent (with the 
+ * DUP flag) right after the next CONNECT. For the broker to accept them the client must
+ * connect with the same client id and without \c MQTT_CONNECT_CLEAN_SESSION.
+ * 
+ * @note The queue can't grow while a session store is attached (it is 
+ *       \ref mqtt_message_queue.pinned), whatever its growth settings are. 
+ */
+struct mqtt_session_store {
+    /** @brief The mapped file. */
+    uint8_t *mem;
+
+    /** @brief The size of the mapped file. */
+    size_t size;
+
+    /** @brief The file's handle. */
+    mqtt_pal_file_handle handle;
+
+    /** @brief Non-zero if the file held a session when it was opened. */
+    int restored;
+
+    /** @brief Non-zero if messages were queued or removed since the last commit. */
+    int dirty;
+
+    /** @brief The number of messages that were queued again from the file. */
+    size_t number_of_restored_messages;
+
+    /** @brief The number of times the file was synced. */
+    size_t number_of_commits;
+};
+
+/**
+ * @brief Open (or create) a session store file.
+ * @ingroup api
+ * 
+ * @param[out] store The session store.
+ * @param[in] path The path of the file.
+ * @param[in] size The size of the file, which bounds the size of the send buffer.
+ * 
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_SESSION_STORE_IO otherwise.
+ */
+enum MQTTErrors mqtt_session_store_open(struct mqtt_session_store *store, const char *path, size_t size);
+
+/**
+ * @brief Close a session store file. 
+ * @ingroup api
+ * 
+ * @pre No client may be using \p store.
+ */
+void mqtt_session_store_close(struct mqtt_session_store *store);
+
+/* SPOOL */
+
+/**
+ * @brief The longest path prefix a spool accepts.
+ * @ingroup details
+ */
+#define MQTT_SPOOL_MAX_PATH 256
+
+/**
+ * @brief What a full spool does with a new message.
+ * @ingroup api
+ */
+enum MQTTSpoolDropPolicy {
+    /** @brief Delete the oldest segment file to make room. */
+    MQTT_SPOOL_DROP_OLDEST,
+    /** @brief Discard the new message. */
+    MQTT_SPOOL_DROP_NEWEST
+};
+
+/**
+ * @brief An append-only, disk-backed queue for publishes made while disconnected.
+ * @ingroup api
+ * 
+ * While a client with a spool (see \ref mqtt_set_spool) is not connected (it has an 
+ * error or is still waiting for its CONNACK), \ref mqtt_publish appends the PUBLISH 
+ * packet to the spool instead of the send buffer. Once connected the client drains the 
+ * spool into the send buffer, at most \c drain_rate messages per second, ahead of new 
+ * publishes. Meanwhile \ref mqtt_publish_reserve fails with \ref MQTT_ERROR_SPOOL_ACTIVE.
+ * 
+ * Packets are appended to segment files named \c <path>.<number>; a segment is 
+ * deleted once it has been drained. \c <path>.head records the oldest segment so a spool
+ * that is reopened picks up where it left off. Messages of the segment that was being 
+ * drained when the process stopped are sent again, and a message whose append was cut 
+ * short is cut off its segment. An error reading the spool is returned by 
+ * \ref mqtt_sync once the send buffer has been sent, so it never holds up the connection.
+ * 
+ * Each spooled message is packed (in the client's scratch buffer, see 
+ * \ref mqtt_set_scratch_buffer) and written to its segment in one write, so it is on disk
+ * when \ref mqtt_publish returns.
+ * 
+ * @note The spool is protected by the client's mutex, and its file I/O is done while 
+ *       holding it: appending in \ref mqtt_publish, and draining in \ref mqtt_sync (which 
+ *       holds \c io_mutex as well). While the client is disconnected, other threads 
+ *       publishing or syncing it wait for the disk. Put the spool on a local disk, or 
+ *       publish from a single thread if that matters.
+ */
+struct mqtt_spool {
+    /** @brief The prefix of the spool's file names. */
+    char path[MQTT_SPOOL_MAX_PATH];
+
+    /** @brief The size at which a new segment file is started. */
+    size_t segment_size;
+
+    /** @brief The most bytes the spool's segments may use. */
+    size_t max_bytes;
+
+    /** @brief What to do when a new message doesn't fit in \c max_bytes. */
+    enum MQTTSpoolDropPolicy drop_policy;
+
+    /**
+     * @brief The most spooled messages moved into the send buffer per second. 
+     * 
+     * @note This member is initialized to 0 (unlimited) but it can be manually set at any
+     *       time.
+     */
+    size_t drain_rate;
+
+    /** @brief The number of the oldest segment, which is being drained. */
+    uint32_t first_segment;
+
+    /** @brief The number of the segment being appended to. */
+    uint32_t last_segment;
+
+    /** @brief The segment being drained. \c NULL if it isn't open. */
+    FILE *read_file;
+
+    /** @brief The segment being appended to. \c NULL if it isn't open. */
+    FILE *write_file;
+
+    /** @brief The size of the segment being appended to. */
+    size_t write_offset;
+
+    /** @brief The number of bytes in all segments. */
+    size_t bytes_on_disk;
+
+    /** @brief The number of messages waiting to be drained. */
+    size_t length;
+
+    /** @brief The number of messages that may be drained before \c time_of_last_drain ends. */
+    size_t drain_budget;
+
+    /** @brief The second in which messages were last drained. */
+    mqtt_pal_time_t time_of_last_drain;
+
+    /** @brief The number of messages that were appended. */
+    size_t number_of_spooled;
+
+    /** @brief The number of messages moved into the send buffer. */
+    size_t number_of_drained;
+
+    /** @brief The number of messages deleted to make room for new ones. */
+    size_t number_of_dropped_oldest;
+
+    /** @brief The number of new messages discarded because the spool was full. */
+    size_t number_of_dropped_newest;
+};
+
+/**
+ * @brief Open a spool, picking up any messages left in it.
+ * @ingroup api
+ * 
+ * @param[out] spool The spool.
+ * @param[in] path The prefix of the spool's file names, e.g. \c "/var/spool/sensor/out".
+ * @param[in] segment_size The size at which a new segment file is started.
+ * @param[in] max_bytes The most bytes the spool may use on disk.
+ * @param[in] drop_policy What to do with new messages once \p max_bytes is reached.
+ * 
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_SPOOL_IO otherwise.
+ */
+enum MQTTErrors mqtt_spool_open(struct mqtt_spool *spool, const char *path, size_t segment_size, 
+                                size_t max_bytes, enum MQTTSpoolDropPolicy drop_policy);
+
+/**
+ * @brief Close a spool. Messages that weren't drained stay on disk.
+ * @ingroup api
+ * 
+ * @pre No client may be using \p spool.
+ */
+void mqtt_spool_close(struct mqtt_spool *spool);
+
+/* CLIENT */
+
+/**
+ * @brief The send buffer watermarks.
+ * @ingroup api
+ * 
+ * @see mqtt_client::send_buffer_watermark_callback
+ */
+enum MQTTSendBufferWatermarks {
+    MQTT_SEND_BUFFER_LOW_WATERMARK,
+    MQTT_SEND_BUFFER_HIGH_WATERMARK
+};
+
+/**
+ * @brief The states of a \ref mqtt_publish_handle.
+ * @ingroup api
+ */
+enum MQTTPublishHandleState {
+    /** @brief The PUBLISH is waiting for its PUBACK (QoS 1) or PUBCOMP (QoS 2). */
+    MQTT_PUBLISH_HANDLE_PENDING,
+    /** @brief The broker acknowledged the PUBLISH. */
+    MQTT_PUBLISH_HANDLE_ACKNOWLEDGED,
+    /** @brief The PUBLISH was dropped before it was acknowledged, e.g. by \ref mqtt_reinit. */
+    MQTT_PUBLISH_HANDLE_DROPPED,
+    /** @brief There is nothing to wait for: the PUBLISH is QoS 0 or went to the spool. */
+    MQTT_PUBLISH_HANDLE_UNTRACKED
+};
+
+/**
+ * @brief Tracks the acknowledgement of a single PUBLISH.
+ * @ingroup api
+ *
+ * Filled in by \ref mqtt_publish_with_handle, except for \c cookie which the application
+ * sets beforehand. While the handle is pending it is linked into the client's list of 
+ * handles, so it must stay valid until it isn't pending anymore.
+ *
+ * @see mqtt_publish_handle_status
+ * @see mqtt_publish_handle_wait
+ */
+struct mqtt_publish_handle {
+    /** @brief The client the PUBLISH was queued with. */
+    struct mqtt_client *client;
+
+    /** @brief The packet ID of the PUBLISH. */
+    uint16_t packet_id;
+
+    /** @brief The QoS of the PUBLISH. */
+    uint8_t qos;
+
+    /** @brief Set by the application, passed back in \ref mqtt_delivery::cookie. */
+    void *cookie;
+
+    /** @brief The \ref MQTTPublishHandleState of the PUBLISH, protected by the client's mutex. */
+    int state;
+
+    /** @brief The number of threads waiting in \ref mqtt_publish_handle_wait. */
+    int number_of_waiters;
+
+    /** @brief The next pending handle of the client. */
+    struct mqtt_publish_handle *next;
+};
+
+/**
+ * @brief An acknowledged PUBLISH, as reported to \ref mqtt_client::delivery_callback.
+ * @ingroup api
+ */
+struct mqtt_delivery {
+    /** @brief The packet ID of the PUBLISH. */
+    uint16_t packet_id;
+
+    /** @brief The QoS of the PUBLISH (1 or 2). */
+    uint8_t qos;
+
+    /** @brief The \ref mqtt_publish_handle::cookie of the PUBLISH, \c NULL if it has no handle. */
+    void *cookie;
+
+    /**
+     * @brief The time from the last send of the acknowledged packet to its PUBACK or 
+     *        PUBCOMP, in microseconds.
+     * 
+     * The acknowledged packet is the PUBLISH for QoS 1 and the PUBREL for QoS 2. It is 
+     * the same with or without a handle, and a resend restarts it, so it approximates the
+     * round trip rather than the time since the PUBLISH was queued.
+     */
+    uint64_t latency_us;
+};
+
+/**
+ * @brief The most deliveries that are passed to \ref mqtt_client::delivery_callback at once.
+ * @ingroup details
+ */
+#define MQTT_DELIVERY_BATCH_SIZE 16
+
+/**
+ * @brief The longest topic that can be given a topic alias, or remembered for one the 
+ *        broker gives.
+ * @ingroup details
+ */
+#ifndef MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE
+#define MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE 128
+#endif
+
+/**
+ * @brief A topic alias (MQTT v5.0), see \ref mqtt_set_topic_aliases.
+ * @ingroup details
+ * 
+ * Entry \c i of a table holds the topic of alias <tt>i + 1</tt>.
+ */
+struct mqtt_topic_alias {
+    /** @brief When the alias was last used, 0 if it isn't mapped. */
+    uint32_t last_use;
+
+    /** @brief The size of \c topic, 0 if the alias isn't mapped. */
+    uint16_t topic_size;
+
+    /** @brief The topic (not null terminated). */
+    char topic[MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE];
+};
+
+/**
+ * @brief An MQTT client.
+ * @ingroup details
+ * 
+ * @note All members can be manipulated via the related functions.
+ */
+struct mqtt_client {
+    /** @brief The socket connecting to the MQTT broker. */
+    mqtt_pal_socket_handle socketfd;
+
+    /** @brief The LFSR state used to generate packet ID's. */
+    uint16_t pid_lfsr;
+
+    /** 
+     * @brief The keep-alive time in seconds. 
+     * 
+     * @note With MQTT v5.0 the broker may replace it in its CONNACK (Server Keep Alive).
+     */
+    uint16_t keep_alive;
+
+    /**
+     * @brief The protocol level the client speaks, \ref MQTT_PROTOCOL_LEVEL (MQTT v3.1.1)
+     *        or \ref MQTT_PROTOCOL_LEVEL_5 (MQTT v5.0).
+     * 
+     * @note This member is initialized to \ref MQTT_PROTOCOL_LEVEL. It can be changed before 
+     *       \ref mqtt_connect is called.
+     */
+    uint8_t protocol_level;
+
+    /**
+     * @brief The limits the broker announced in its CONNACK (MQTT v5.0 only).
+     * 
+     * They are reset by \ref mqtt_connect and filled in when the CONNACK arrives.
+     */
+    struct {
+        /** 
+         * @brief The most QoS 1 and QoS 2 PUBLISHes the broker accepts in flight at once,
+         *        0 for no limit. 
+         * 
+         * The in-flight windows (\c max_inflight_qos1 and \c max_inflight_qos2) together 
+         * never exceed it.
+         */
+        uint16_t receive_maximum;
+
+        /** 
+         * @brief The largest packet the broker accepts, 0 for no limit. 
+         * 
+         * Larger publishes are refused with \c MQTT_ERROR_PACKET_TOO_LARGE.
+         */
+        uint32_t maximum_packet_size;
+
+        /** @brief The highest topic alias the broker accepts, 0 for none. */
+        uint16_t topic_alias_maximum;
+    } broker_limits;
+
+    /**
+     * @brief The topic aliases of the connection (MQTT v5.0 only).
+     * 
+     * They're forgotten by \ref mqtt_connect.
+     * 
+     * @see mqtt_set_topic_aliases
+     */
+    struct {
+        /** @brief The aliases the client gives its topics, \c NULL for none. */
+        struct mqtt_topic_alias *outbound;
+
+        /** @brief The number of \c outbound aliases. */
+        uint16_t number_of_outbound;
+
+        /** @brief The aliases the broker gives its topics, \c NULL for none. */
+        struct mqtt_topic_alias *inbound;
+
+        /** @brief The number of \c inbound aliases, announced as the client's Topic Alias Maximum. */
+        uint16_t number_of_inbound;
+
+        /** @brief Counts the uses of \c outbound aliases, for least recently used replacement. */
+        uint32_t clock;
+
+        /** 
+         * @brief The bytes the outbound aliases saved: the topics left out of PUBLISHes less 
+         *        the Topic Alias properties that replaced them.
+         */
+        int64_t bytes_saved;
+    } topic_aliases;
+
+    /** 
+     * @brief A counter counting pings that have been sent to keep the connection alive. 
+     * @see keep_alive
+     */
+    int number_of_keep_alives;
+
+    /** 
+     * @brief The timestamp of the last message sent to the buffer.
+     * 
+     * This is used to detect the need for keep-alive pings: a PINGREQ is only sent once
+     * nothing else has been sent for three quarters of \c keep_alive, and never while one 
+     * is still waiting for its PINGRESP. The broker requires the client to send something 
+     * within every keep-alive period, so received traffic doesn't replace the pings.
+     * 
+     * @see keep_alive
+    */
+    mqtt_pal_time_t time_of_last_send;
+
+    /**
+     * @brief When bytes were last received from the broker, in \ref mqtt_pal_clock_us time.
+     *        Written with both \c io_mutex and \c mutex held, so holding either one is 
+     *        enough to read it.
+     * 
+     * Traffic from the broker shows it's alive while a PINGRESP is outstanding.
+     * 
+     * @see keep_alive_response_fraction
+     */
+    uint64_t time_of_last_recv_us;
+
+    /**
+     * @brief How long to wait for a PINGRESP, as a fraction of \c keep_alive.
+     * 
+     * If neither the PINGRESP nor anything else arrives from the broker within this time 
+     * of sending a PINGREQ, the broker is considered dead and the client's error is set to 
+     * \c MQTT_ERROR_KEEP_ALIVE_TIMEOUT (so the reconnect callback is called). 0 resends 
+     * PINGREQs like any other message instead.
+     * 
+     * @note The default value is 0.5 but you can change it at any time.
+     */
+    double keep_alive_response_fraction;
+
+    /** 
+     * @brief The error state of the client. 
+     * 
+     * error should be MQTT_OK for the entirety of the connection.
+     * 
+     * @note The error state will be MQTT_ERROR_CONNECT_NOT_CALLED until
+     *       you call mqtt_connect.
+     */
+    enum MQTTErrors error;
+
+    /** 
+     * @brief The longest retransmission timeout in seconds.
+     * 
+     * If the broker doesn't return an ACK within the retransmission timeout 
+     * (\ref mqtt_client.rto) a timeout will occur and the message will be retransmitted.
+     * The timeout starts at response_timeout and is never larger.
+     * 
+     * @note The default value is 30 [seconds] but you can change it at any time.
+     */
+    int response_timeout;
+
+    /**
+     * @brief The retransmission timeout estimate, protected by the client's mutex.
+     * 
+     * It is estimated like TCP's (RFC 6298) from the round trips of the ACKs and PINGRESPs 
+     * of messages that weren't resent: the smoothed round trip plus four times its mean 
+     * deviation, kept between \c min_us and \c response_timeout. Each pass of 
+     * \ref __mqtt_send that resends messages doubles it, until the next round trip is 
+     * sampled.
+     */
+    struct {
+        /** @brief The smoothed round trip time in microseconds, 0 before the first sample. */
+        uint64_t srtt_us;
+
+        /** @brief The mean deviation of the round trip time in microseconds. */
+        uint64_t rttvar_us;
+
+        /** @brief The current retransmission timeout in microseconds, including the backoff. */
+        uint64_t rto_us;
+
+        /** 
+         * @brief The shortest retransmission timeout in microseconds.
+         * 
+         * @note The default value is 200 [milliseconds] but you can change it at any time.
+         */
+        uint64_t min_us;
+
+        /** @brief The number of times the timeout has been doubled since the last sample. */
+        int backoff;
+    } rto;
+
+    /** @brief A counter counting the number of timeouts that have occurred. */
+    int number_of_timeouts;
+
+    /**
+     * @brief Only resend messages after a reconnect, as MQTT requires.
+     * 
+     * Normally a message that isn't acknowledged in time is resent on the same connection.
+     * TCP already retransmits what was lost, so when the broker is merely slow the 
+     * duplicates only add to its load. When this is set a connection never resends 
+     * anything: the unacknowledged QoS 1 and QoS 2 PUBLISHes (with DUP set) and PUBRELs 
+     * are resent after \ref mqtt_reinit, which keeps them if it is given the same send 
+     * buffer as before (or when a session store is used).
+     * 
+     * @note The default value is 0, but you can change it at any time.
+     */
+    int resend_only_on_reconnect;
+
+    /** 
+     * @brief A counter counting the messages that timed out but weren't resent because of 
+     *        \c resend_only_on_reconnect.
+     */
+    int number_of_resends_avoided;
+
+    /**
+     * @brief Approximately much time it has typically taken to receive responses from the 
+     *        broker.
+     * 
+     * @note This is tracked using a exponential-averaging.
+     */
+    double typical_response_time;
+
+    /**
+     * @brief The most QoS 1 PUBLISHes that may be awaiting their PUBACK at once.
+     * 
+     * Further QoS 1 PUBLISHes stay queued (in order) until PUBACKs make room.
+     * 
+     * @note The default value is 0, which means no limit, but you can change it at any
+     *       time. It is tuned automatically after \ref mqtt_set_qos1_window_autotune.
+     */
+    int max_inflight_qos1;
+
+    /**
+     * @brief The state of the automatic tuning of \c max_inflight_qos1, protected by the 
+     *        client's mutex.
+     * 
+     * One QoS 1 PUBLISH at a time is timed from sending to its PUBACK. If its round trip 
+     * took less than twice the shortest one seen, the window grows by one, otherwise (or
+     * if a QoS 1 PUBLISH timed out) it is halved. That's additive increase and 
+     * multiplicative decrease once per round trip.
+     * 
+     * @see mqtt_set_qos1_window_autotune
+     */
+    struct {
+        /** @brief Whether the window is tuned. */
+        int enabled;
+
+        /** @brief The smallest window. */
+        int min_window;
+
+        /** @brief The largest window. */
+        int max_window;
+
+        /** @brief Whether a PUBLISH is being timed. */
+        int probe_active;
+
+        /** @brief The packet ID of the PUBLISH that is being timed. */
+        uint16_t probe_packet_id;
+
+        /** @brief When the timed PUBLISH was sent, in \ref mqtt_pal_clock_us time. */
+        uint64_t probe_sent_us;
+
+        /** @brief The shortest round trip seen, in microseconds (0 if none yet). */
+        uint64_t min_rtt_us;
+
+        /** @brief The last round trip measured, in microseconds. */
+        uint64_t last_rtt_us;
+    } qos1_window;
+
+    /**
+     * @brief The most QoS 2 PUBLISHes whose exchange may be in flight at once.
+     * 
+     * A QoS 2 PUBLISH is in flight from the moment it is sent until its PUBCOMP arrives.
+     * Further QoS 2 PUBLISHes stay queued (in order) until PUBCOMPs make room. Every
+     * exchange is tracked by its own packet ID, so the window only limits how many 
+     * round trips overlap.
+     * 
+     * @note The default value is 1 but you can change it at any time. 0 means no limit.
+     */
+    int max_inflight_qos2;
+
+    /**
+     * @brief The callback that is called whenever a publish is received from the broker.
+     * 
+     * Any topics that you have subscribed to will be returned from the broker as 
+     * mqtt_response_publish messages. All the publishes received from the broker will 
+     * be passed to this function.
+     * 
+     * @note A pointer to publish_response_callback_state is always passed to the callback.
+     *       Use publish_response_callback_state to keep track of any state information you
+     *       need.
+     * @note The callback is called without the client's mutex held, so other threads can
+     *       keep publishing while it runs and the callback itself may publish.
+     */
+    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
+
+    /**
+     * @brief A pointer to any publish_response_callback state information you need.
+     * 
+     * @note A pointer to this pointer will always be publish_response_callback upon 
+     *       receiving a publish message from the broker.
+     */
+    void* publish_response_callback_state;
+
+    /**
+     * @brief A user-specified callback, triggered on each \ref mqtt_sync, allowing
+     *        the user to perform state inspections (and custom socket error detection)
+     *        on the client.
+     * 
+     * This callback is triggered on each call to \ref mqtt_sync. If it returns MQTT_OK
+     * then \ref mqtt_sync will continue normally (performing reads and writes). If it
+     * returns an error then \ref mqtt_sync will not call reads and writes.
+     * 
+     * This callback can be used to perform custom error detection, namely platform
+     * specific socket error detection, and force the client into an error state.
+     * 
+     * This member is always initialized to NULL but it can be manually set at any 
+     * time.
+     */
+    enum MQTTErrors (*inspector_callback)(struct mqtt_client*);
+
+    /**
+     * @brief A callback that is called whenever the client is in an error state.
+     * 
+     * This callback is responsible for: application level error handling, closing
+     * previous sockets, and reestabilishing the connection to the broker and 
+     * session configurations (i.e. subscriptions).  
+     */
+    void (*reconnect_callback)(struct mqtt_client*, void**);
+
+    /**
+     * @brief A pointer to some state. A pointer to this member is passed to 
+     *        \ref mqtt_client.reconnect_callback.
+     */
+    void* reconnect_state;
+
+    /**
+     * @brief Where publishes go while the client is disconnected. \c NULL if publishing 
+     *        while disconnected fails.
+     * 
+     * @see mqtt_set_spool
+     */
+    struct mqtt_spool *spool;
+
+    /**
+     * @brief The file the send buffer lives in. \c NULL if the send buffer is in memory.
+     * 
+     * @see mqtt_set_session_store
+     */
+    struct mqtt_session_store *session_store;
+
+    /**
+     * @brief The pool \c recv_buffer is borrowed from. \c NULL if the client has its own.
+     * 
+     * @see mqtt_set_recv_buffer_pool
+     */
+    struct mqtt_recv_buffer_pool *recv_buffer_pool;
+
+    /**
+     * @brief The buffer where ingress data is temporarily stored.
+     * 
+     * The buffer can be allowed to grow by setting \c max_size. When the fixed header
+     * of an incoming packet says it won't fit, the buffer is moved into memory from 
+     * \c allocator that is at least twice as large (but no larger than \c max_size). 
+     * Once no data has been received for \c idle_trim_time seconds it moves back to
+     * the buffer given to \ref mqtt_init or \ref mqtt_reinit.
+     * 
+     * @note When \c recv_buffer_pool is set \c mem_start is \c NULL while the client 
+     *       isn't holding a block, and the buffer never grows.
+     */
+    struct {
+        /** @brief The start of the receive buffer's memory. */
+        uint8_t *mem_start;
+
+        /** @brief The size of the receive buffer's memory. */
+        size_t mem_size;
+
+        /** @brief A pointer to the next writtable location in the receive buffer. */
+        uint8_t *curr;
+
+        /** @brief The number of bytes that are still writable at curr. */
+        size_t curr_sz;
+
+        /** @brief The buffer given to \ref mqtt_init or \ref mqtt_reinit. */
+        uint8_t *base_start;
+
+        /** @brief The size of \c base_start. */
+        size_t base_size;
+
+        /** 
+         * @brief The largest size the buffer may grow to. 
+         * 
+         * @note This member is initialized to 0, which disables growth, but it can be 
+         *       manually set at any time.
+         */
+        size_t max_size;
+
+        /** 
+         * @brief The number of seconds without incoming data after which a grown buffer
+         *        is released.
+         * 
+         * @note This member is initialized to 30 but it can be manually set at any time.
+         */
+        int idle_trim_time;
+
+        /** @brief The last time data was received. */
+        mqtt_pal_time_t time_of_last_use;
+    } recv_buffer;
+
+    /**
+     * @brief The buffer QoS 0 PUBLISH packets are staged in until they are sent.
+     * 
+     * Staged packets don't take up room in \c mq; the whole buffer is written to the 
+     * socket and released on the next \ref mqtt_sync, right after the messages in \c mq. 
+     * 
+     * @see mqtt_set_qos0_buffer
+     */
+    struct {
+        /** @brief The start of the staging buffer's memory. \c NULL if staging is disabled. */
+        uint8_t *mem_start;
+
+        /** @brief The size of the staging buffer's memory. */
+        size_t mem_size;
+
+        /** @brief A pointer to the next writtable location in the staging buffer. */
+        uint8_t *curr;
+
+        /** @brief The number of bytes that are still writable at curr. */
+        size_t curr_sz;
+    } qos0_buffer;
+
+    /** 
+     * @brief A variable passed to support thread-safety.
+     * 
+     * A pointer to this variable is passed to \c MQTT_PAL_MUTEX_LOCK, and
+     * \c MQTT_PAL_MUTEX_UNLOCK.
+     *
+     * This mutex protects the message queue, the error state, and the other state shared
+     * with producers. It is only held for short critical sections so that publishers never
+     * wait for inbound traffic to be parsed or for the socket to be written.
+     */
+    mqtt_pal_mutex_t mutex;
+
+    /**
+     * @brief Serializes the socket and the receive buffer.
+     *
+     * Held by \ref __mqtt_send and \ref __mqtt_recv for their whole duration. When both
+     * mutexes are needed, \c io_mutex must be locked before \c mutex. The publish response
+     * callback is called with only \c io_mutex held, so it may publish.
+     */
+    mqtt_pal_mutex_t io_mutex;
+
+    /**
+     * @brief Non-zero while \ref __mqtt_send writes to the socket from the message queue 
+     *        and the QoS 0 staging buffer without holding \c mutex.
+     *
+     * Producers may queue and stage messages meanwhile, but the bytes being written must 
+     * stay where they are: a producer that needs the queue cleaned or grown (because it is 
+     * full) waits for \c send_done first. Protected by \c mutex.
+     */
+    int sending;
+
+    /** @brief Broadcast when \c sending is cleared. */
+    mqtt_pal_cond_t send_done;
+
+    /**
+     * @brief The I/O thread started with \ref mqtt_start_io_thread.
+     */
+    struct {
+        /** @brief The thread. */
+        mqtt_pal_thread_t thread;
+
+        /** @brief Signalled when there is something to send, or to stop the thread. */
+        mqtt_pal_wakeup_handle wakeup;
+
+        /** @brief Non-zero while the thread is running. */
+        int running;
+
+        /** @brief Non-zero once the thread has been asked to stop. */
+        int stopping;
+
+        /** @brief Non-zero if \c wakeup was signalled since the thread last synced. */
+        int signalled;
+
+        /** @brief The longest time the thread blocks without syncing, in milliseconds. */
+        int max_wait_ms;
+    } io_thread;
+
+    /**
+     * @brief The client's state in the \ref mqtt_reactor it was added to.
+     */
+    struct {
+        /** @brief The reactor, \c NULL if the client isn't in one. */
+        struct mqtt_reactor *reactor;
+
+        /** @brief The socket that is registered with the reactor's poller. */
+        mqtt_pal_socket_handle socketfd;
+
+        /** @brief Non-zero if \c socketfd is registered. */
+        int registered;
+
+        /** @brief When the client has to be synced even if its socket is idle, 0 if never. */
+        mqtt_pal_time_t deadline;
+
+        /** @brief The clients before and after this one in its timer wheel slot. */
+        struct mqtt_client *prev, *next;
+
+        /** @brief Non-zero while the client is on the reactor's pending list. */
+        int pending;
+
+        /** @brief The next client on the reactor's pending list. */
+        struct mqtt_client *next_pending;
+
+        /** @brief Non-zero while the client is on a reactor's list of removals. */
+        int removal_requested;
+
+        /** @brief The next client on the reactor's list of removals. */
+        struct mqtt_client *next_removal;
 
-    /** @brief The LFSR state used to generate packet ID's. */
-    uint16_t pid_lfsr;
+        /** @brief The time spent syncing the client in measurement interval \c work_interval (us). */
+        uint64_t work_us;
 
-    /** @brief The keep-alive time in seconds. */
-    uint16_t keep_alive;
+        /** @brief The time spent syncing the client in the interval before \c work_interval (us). */
+        uint64_t last_work_us;
 
-    /** 
-     * @brief A counter counting pings that have been sent to keep the connection alive. 
-     * @see keep_alive
+        /** @brief The reactor's measurement interval \c work_us belongs to. */
+        size_t work_interval;
+    } reactor;
+
+    /**
+     * @brief The \ref mqtt_publish_handle "publish handles" that are still pending.
      */
-    int number_of_keep_alives;
+    struct {
+        /** @brief The oldest pending handle. Acks mostly arrive in order so it is matched first. */
+        struct mqtt_publish_handle *head;
 
-    /** 
-     * @brief The timestamp of the last message sent to the buffer.
-     * 
-     * This is used to detect the need for keep-alive pings.
-     * 
-     * @see keep_alive
-    */
-    mqtt_pal_time_t time_of_last_send;
+        /** @brief The newest pending handle. */
+        struct mqtt_publish_handle *tail;
 
-    /** 
-     * @brief The error state of the client. 
-     * 
-     * error should be MQTT_OK for the entirety of the connection.
-     * 
-     * @note The error state will be MQTT_ERROR_CONNECT_NOT_CALLED until
-     *       you call mqtt_connect.
-     */
-    enum MQTTErrors error;
+        /** @brief Broadcast when a handle that is waited for stops being pending. */
+        mqtt_pal_cond_t done;
+    } publish_handles;
 
-    /** 
-     * @brief The timeout period in seconds.
+    /**
+     * @brief A callback that is called with the PUBLISHes the broker has acknowledged.
      * 
-     * If the broker doesn't return an ACK within response_timeout seconds a timeout
-     * will occur and the message will be retransmitted. 
+     * Every QoS 1 and QoS 2 PUBLISH is reported once its PUBACK or PUBCOMP arrives, with 
+     * how long it took and, if it was queued with \ref mqtt_publish_with_handle, the cookie
+     * of its handle (\c NULL otherwise). Deliveries are collected while the received 
+     * packets are processed and passed on in batches of up to \ref MQTT_DELIVERY_BATCH_SIZE.
      * 
-     * @note The default value is 30 [seconds] but you can change it at any time.
+     * @note The callback is called with only \c io_mutex held (like the publish response
+     *       callback), so it may publish.
+     * @note This member is always initialized to NULL but it can be manually set at any 
+     *       time.
      */
-    int response_timeout;
-
-    /** @brief A counter counting the number of timeouts that have occurred. */
-    int number_of_timeouts;
+    void (*delivery_callback)(void** state, const struct mqtt_delivery *deliveries, size_t number_of_deliveries);
 
     /**
-     * @brief Approximately much time it has typically taken to receive responses from the 
-     *        broker.
-     * 
-     * @note This is tracked using a exponential-averaging.
+     * @brief A pointer to some state. A pointer to this member is passed to 
+     *        \ref mqtt_client.delivery_callback.
      */
-    double typical_response_time;
+    void* delivery_callback_state;
 
     /**
-     * @brief The callback that is called whenever a publish is received from the broker.
-     * 
-     * Any topics that you have subscribed to will be returned from the broker as 
-     * mqtt_response_publish messages. All the publishes received from the broker will 
-     * be passed to this function.
-     * 
-     * @note A pointer to publish_response_callback_state is always passed to the callback.
-     *       Use publish_response_callback_state to keep track of any state information you 
-     *       need.
+     * @brief The deliveries that haven't been passed to \c delivery_callback yet, 
+     *        protected by \c io_mutex.
      */
-    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
+    struct {
+        /** @brief The deliveries. */
+        struct mqtt_delivery batch[MQTT_DELIVERY_BATCH_SIZE];
+
+        /** @brief The number of deliveries in \c batch. */
+        size_t length;
+    } deliveries;
+
+    /** @brief The sending message queue. */
+    struct mqtt_message_queue mq;
 
     /**
-     * @brief A pointer to any publish_response_callback state information you need.
+     * @brief The allocator all of the client's dynamic memory comes from.
      * 
-     * @note A pointer to this pointer will always be publish_response_callback upon 
-     *       receiving a publish message from the broker.
+     * Initialized to \c heap_allocator.
+     * 
+     * @see mqtt_set_allocator
      */
-    void* publish_response_callback_state;
+    struct mqtt_allocator *allocator;
+
+    /** @brief The default allocator. */
+    struct mqtt_allocator heap_allocator;
 
     /**
-     * @brief A user-specified callback, triggered on each \ref mqtt_sync, allowing
-     *        the user to perform state inspections (and custom socket error detection)
-     *        on the client.
-     * 
-     * This callback is triggered on each call to \ref mqtt_sync. If it returns MQTT_OK
-     * then \ref mqtt_sync will continue normally (performing reads and writes). If it
-     * returns an error then \ref mqtt_sync will not call reads and writes.
-     * 
-     * This callback can be used to perform custom error detection, namely platform
-     * specific socket error detection, and force the client into an error state.
+     * @brief An arena for data that doesn't outlive a call, such as a message being 
+     *        spooled. Protected by \c mutex and reset on every send.
      * 
-     * This member is always initialized to NULL but it can be manually set at any 
-     * time.
+     * Empty unless \ref mqtt_set_scratch_buffer is called, in which case \c allocator is 
+     * used instead (as it is for anything that doesn't fit).
      */
-    enum MQTTErrors (*inspector_callback)(struct mqtt_client*);
+    struct mqtt_allocator scratch;
+
+    /** @brief The state of \c scratch. */
+    struct mqtt_arena scratch_arena;
 
     /**
-     * @brief A callback that is called whenever the client is in an error state.
+     * @brief A callback that is called when the send buffer usage crosses a watermark.
      * 
-     * This callback is responsible for: application level error handling, closing
-     * previous sockets, and reestabilishing the connection to the broker and 
-     * session configurations (i.e. subscriptions).  
+     * The callback is called with \ref MQTT_SEND_BUFFER_HIGH_WATERMARK once the number of 
+     * bytes used in \c mq rises to \c send_buffer_high_watermark, and with 
+     * \ref MQTT_SEND_BUFFER_LOW_WATERMARK once it has fallen back to 
+     * \c send_buffer_low_watermark. Producers can use it to throttle themselves before
+     * publishes start failing with \ref MQTT_ERROR_SEND_BUFFER_IS_FULL.
+     * 
+     * @note The callback is called while the client's mutex is held; it must not call 
+     *       back into the client.
+     * @note This member is always initialized to NULL but it can be manually set at any 
+     *       time.
      */
-    void (*reconnect_callback)(struct mqtt_client*, void**);
+    void (*send_buffer_watermark_callback)(void** state, enum MQTTSendBufferWatermarks watermark, size_t bytes_used);
 
     /**
      * @brief A pointer to some state. A pointer to this member is passed to 
-     *        \ref mqtt_client.reconnect_callback.
+     *        \ref mqtt_client.send_buffer_watermark_callback.
      */
-    void* reconnect_state;
+    void* send_buffer_watermark_callback_state;
+
+    /** @brief The send buffer high watermark in bytes. 0 (the default) disables watermarks. */
+    size_t send_buffer_high_watermark;
+
+    /** @brief The send buffer low watermark in bytes. */
+    size_t send_buffer_low_watermark;
+
+    /** @brief Set while the send buffer is above its high watermark. */
+    int send_buffer_above_high_watermark;
 
     /**
-     * @brief The buffer where ingress data is temporarily stored.
+     * @brief The PUBLISH that is currently reserved in \c mq.
+     *
+     * @see mqtt_publish_reserve
      */
     struct {
-        /** @brief The start of the receive buffer's memory. */
-        uint8_t *mem_start;
+        /** @brief The start of the reserved PUBLISH packet. \c NULL if nothing is reserved. */
+        uint8_t *start;
 
-        /** @brief The size of the receive buffer's memory. */
-        size_t mem_size;
+        /** @brief The size of the reserved packet's fixed header. */
+        size_t fixed_header_size;
 
-        /** @brief A pointer to the next writtable location in the receive buffer. */
-        uint8_t *curr;
+        /** @brief The size of the reserved packet's variable header. */
+        size_t variable_header_size;
 
-        /** @brief The number of bytes that are still writable at curr. */
-        size_t curr_sz;
-    } recv_buffer;
+        /** @brief The maximum size of the application message. */
+        size_t max_application_message_size;
 
-    /** 
-     * @brief A variable passed to support thread-safety.
-     * 
-     * A pointer to this variable is passed to \c MQTT_PAL_MUTEX_LOCK, and
-     * \c MQTT_PAL_MUTEX_UNLOCK.
-     */
-    mqtt_pal_mutex_t mutex;
+        /** @brief The reserved packet's flags. */
+        uint8_t publish_flags;
 
-    /** @brief The sending message queue. */
-    struct mqtt_message_queue mq;
+        /** @brief The reserved packet's packet ID. */
+        uint16_t packet_id;
+    } publish_reservation;
 };
 
 /**
@@ -1221,10 +2851,75 @@ struct mqtt_client {
  */
 uint16_t __mqtt_next_pid(struct mqtt_client *client);
 
+/**
+ * @brief Calls the send buffer watermark callback if a watermark was crossed.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ */
+void __mqtt_check_send_buffer_watermarks(struct mqtt_client *client);
+
+/**
+ * @brief Records the shape of the queue in the session store's header.
+ * @ingroup details
+ * 
+ * Does nothing if \p client has no session store.
+ * 
+ * @param client The MQTT client.
+ */
+void __mqtt_session_store_update(struct mqtt_client *client);
+
+/**
+ * @brief Prepares the messages in a session store's queue to be sent on a new connection.
+ * @ingroup details
+ * 
+ * QoS 1 and 2 PUBLISH messages and PUBREL messages that are in flight are marked for 
+ * resending (PUBLISH messages with the DUP flag set). Everything else is discarded.
+ * 
+ * @param client The MQTT client.
+ */
+void __mqtt_session_store_resume(struct mqtt_client *client);
+
+/**
+ * @brief Syncs the session store file if messages were queued since the last sync.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns MQTT_OK upon success, \ref MQTT_ERROR_SESSION_STORE_IO otherwise.
+ */
+enum MQTTErrors __mqtt_session_store_commit(struct mqtt_client *client);
+
+/**
+ * @brief Append a PUBLISH to \p spool, applying its drop policy if it is full.
+ * @ingroup details
+ * 
+ * @returns \c MQTT_OK if the message was spooled or dropped by the drop policy, an 
+ *          \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors __mqtt_spool_append(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags);
+
+/**
+ * @brief Move spooled messages into the send buffer, as far as the drain rate and the 
+ *        send buffer allow.
+ * @ingroup details
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. A message that couldn't
+ *          be read stays in the spool and is read again by the next call.
+ */
+enum MQTTErrors __mqtt_spool_drain(struct mqtt_client *client);
+
 /**
  * @brief Handles egress client traffic.
  * @ingroup details
  * 
+ * The socket is written with the client's mutex released (see 
+ * \ref mqtt_client.sending), so producers don't wait for it.
+ * 
  * @param client The MQTT client.
  * 
  * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
@@ -1374,15 +3069,244 @@ void mqtt_init_reconnect(struct mqtt_client *client,
  * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker.
  * @param[in] recvbufsz The size of \p recvbuf in bytes.
  * 
+ * @note Unacknowledged messages are kept for the new connection if a session store is used, 
+ *       or if \ref mqtt_client.resend_only_on_reconnect is set and \p sendbuf is the buffer
+ *       the client already uses. Otherwise they're dropped.
+ * 
  * @post Call \ref mqtt_connect.
  * 
  * @attention This function should be used in conjunction with clients that have been 
  *            initialzed with \ref mqtt_init_reconnect.  
  */
-void mqtt_reinit(struct mqtt_client* client,
-                 mqtt_pal_socket_handle socketfd,
-                 uint8_t *sendbuf, size_t sendbufsz,
-                 uint8_t *recvbuf, size_t recvbufsz);
+void mqtt_reinit(struct mqtt_client* client,
+                 mqtt_pal_socket_handle socketfd,
+                 uint8_t *sendbuf, size_t sendbufsz,
+                 uint8_t *recvbuf, size_t recvbufsz);
+
+/**
+ * @brief Keep \p client's send buffer in a session store file.
+ * @ingroup api
+ * 
+ * The message queue moves into \p store; the send buffer passed to \ref mqtt_init is 
+ * no longer used. If \p store held a session, its in-flight messages are queued again
+ * to be resent after the CONNECT (see \ref mqtt_session_store). \ref mqtt_reinit keeps
+ * the store and likewise queues the in-flight messages again.
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect,
+ *      before \ref mqtt_connect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] store The session store. Must outlive \p client.
+ * 
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_SESSION_STORE_CORRUPT if the file 
+ *          held an unreadable session (the store is still attached, but empty).
+ */
+enum MQTTErrors mqtt_set_session_store(struct mqtt_client *client, struct mqtt_session_store *store);
+
+/**
+ * @brief Spool \p client's publishes to disk while it is disconnected.
+ * @ingroup api
+ * 
+ * See \ref mqtt_spool.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] spool The spool. Must outlive \p client.
+ */
+void mqtt_set_spool(struct mqtt_client *client, struct mqtt_spool *spool);
+
+/**
+ * @brief Sync \p client's session store now.
+ * @ingroup api
+ * 
+ * Messages are committed automatically before they are sent; this is only needed to 
+ * make messages durable earlier than that. 
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_session_store_commit(struct mqtt_client *client);
+
+/**
+ * @brief Make \p client borrow its receive buffer from \p pool.
+ * @ingroup api
+ * 
+ * From then on the receive buffer passed to \ref mqtt_init or \ref mqtt_reinit is not
+ * used (\ref mqtt_reinit accepts \c NULL). A block is borrowed at the start of each read and returned as soon as no partial 
+ * packet is left in it. If the pool is empty the client skips reading until the next 
+ * \ref mqtt_sync.
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] pool The pool. Must outlive \p client.
+ */
+void mqtt_set_recv_buffer_pool(struct mqtt_client *client, struct mqtt_recv_buffer_pool *pool);
+
+/**
+ * @brief Start a thread that calls \ref mqtt_sync whenever there is work for it.
+ * @ingroup api
+ * 
+ * This replaces the usual loop of \ref mqtt_sync and a sleep. The thread blocks until the 
+ * socket is readable or a message is queued (queueing a message signals the thread), 
+ * so a publish is sent right away rather than up to one sleep later. It also wakes up 
+ * every \c io_thread.max_wait_ms (1000 by default) for keep-alives and resends.
+ * 
+ * @pre \ref mqtt_connect must have been called, or \p client was initialized with
+ *      \ref mqtt_init_reconnect (the thread then connects it).
+ * 
+ * @note \ref mqtt_sync must not be called while the thread is running.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_IO_THREAD if the thread is already 
+ *          running or can't be started.
+ */
+enum MQTTErrors mqtt_start_io_thread(struct mqtt_client *client);
+
+/**
+ * @brief Stop the thread started with \ref mqtt_start_io_thread and wait for it to exit.
+ * @ingroup api
+ * 
+ * Whatever is still queued stays in the queue. Does nothing if the thread isn't running.
+ * 
+ * @note This must not be called from a callback run by the I/O thread.
+ * 
+ * @param[in,out] client The MQTT client.
+ */
+void mqtt_stop_io_thread(struct mqtt_client *client);
+
+/**
+ * @brief Signals the I/O thread (or the reactor) that there is something to send.
+ * @ingroup details
+ * 
+ * @pre The client's mutex must be held.
+ */
+void __mqtt_io_thread_notify(struct mqtt_client *client);
+
+/**
+ * @brief Give \p client a buffer to stage QoS 0 publishes in.
+ * @ingroup api
+ * 
+ * QoS 0 PUBLISH's are packed into \p buf instead of the send buffer and are released 
+ * as soon as they have been written to the socket, so high-rate QoS 0 traffic neither 
+ * takes room from messages awaiting acknowledgement nor lengthens the send buffer scans.
+ * When \p buf fills up its contents are moved into the send buffer (as a single message)
+ * to make room, and a QoS 0 PUBLISH larger than \p buf is queued in the send buffer as 
+ * usual. \ref mqtt_publish_reserve, which always packs into the send buffer, moves the 
+ * staged PUBLISH's there first. Either way QoS 0 PUBLISH's stay in order.
+ * 
+ * @note Staged QoS 0 PUBLISH's are sent after the send buffer's messages, i.e. QoS 1 and 
+ *       QoS 2 messages that \ref mqtt_publish queues after them may overtake them.
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] buf The staging buffer. \c NULL disables staging.
+ * @param[in] bufsz The size of \p buf in bytes.
+ */
+void mqtt_set_qos0_buffer(struct mqtt_client *client, uint8_t *buf, size_t bufsz);
+
+/**
+ * @brief Let \p client tune \ref mqtt_client.max_inflight_qos1 to the link.
+ * @ingroup api
+ * 
+ * The window starts at \p min_window and is then adjusted between \p min_window and 
+ * \p max_window from the measured PUBACK round trips, see \ref mqtt_client.qos1_window.
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] min_window The smallest window, at least 1.
+ * @param[in] max_window The largest window, e.g. the broker's in-flight limit. 0 turns 
+ *            the tuning off (and leaves \ref mqtt_client.max_inflight_qos1 as it is).
+ */
+void mqtt_set_qos1_window_autotune(struct mqtt_client *client, int min_window, int max_window);
+
+/**
+ * @brief Let \p client use topic aliases (MQTT v5.0).
+ * @ingroup api
+ * 
+ * QoS 0 PUBLISHes carry the topic and an alias the first time a topic is published, and 
+ * only the alias after that. When all aliases are in use the least recently used one is
+ * given to the new topic. No more than the broker's Topic Alias Maximum are used, and 
+ * topics longer than \ref MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE (or too short to gain 
+ * anything) are always sent in full.
+ * 
+ * QoS 1 and QoS 2 PUBLISHes always carry their topic: they may be resent after the alias 
+ * was given to another topic, or on a new connection that no longer knows it.
+ * 
+ * Aliases the broker gives its topics are resolved before the publish callback is 
+ * called, so \ref mqtt_response_publish::topic_name is always the full topic. A PUBLISH 
+ * that gives an alias a topic longer than \ref MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE is still 
+ * delivered, but the topic isn't remembered: a later PUBLISH that carries only that alias
+ * fails with \ref MQTT_ERROR_TOPIC_ALIAS_INVALID (until a PUBLISH maps it again).
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] outbound The aliases for the client's topics, \c NULL for none.
+ * @param[in] number_of_outbound The number of \p outbound aliases.
+ * @param[in] inbound The aliases for the broker's topics, \c NULL for none.
+ * @param[in] number_of_inbound The number of \p inbound aliases.
+ */
+void mqtt_set_topic_aliases(struct mqtt_client *client, 
+                            struct mqtt_topic_alias *outbound, uint16_t number_of_outbound,
+                            struct mqtt_topic_alias *inbound, uint16_t number_of_inbound);
+
+/**
+ * @brief Called when the PUBACK of the PUBLISH with \p packet_id arrives, to adjust the
+ *        QoS 1 window.
+ * @ingroup details
+ * 
+ * @pre The client's mutex must be held.
+ */
+void __mqtt_qos1_window_acknowledge(struct mqtt_client *client, uint16_t packet_id);
+
+/**
+ * @brief Make \p client allocate its dynamic memory from \p allocator.
+ * @ingroup api
+ * 
+ * @pre The client must not hold any dynamic memory yet, i.e. this should be called right
+ *      after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] allocator The allocator. Must outlive \p client.
+ */
+void mqtt_set_allocator(struct mqtt_client *client, struct mqtt_allocator *allocator);
+
+/**
+ * @brief Give \p client memory for short-lived data (see \ref mqtt_client.scratch).
+ * @ingroup api
+ * 
+ * Without it, such data comes from the client's allocator. A buffer that fits the largest 
+ * message that is spooled saves an allocation per spooled message.
+ * 
+ * @pre This should be called right after \ref mqtt_init or \ref mqtt_init_reconnect.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] buf The memory. Must outlive \p client.
+ * @param[in] bufsz The size of \p buf in bytes.
+ */
+void mqtt_set_scratch_buffer(struct mqtt_client *client, void *buf, size_t bufsz);
+
+/**
+ * @brief Release any memory the client allocated on its own.
+ * @ingroup api
+ * 
+ * Only needed if the send buffer or receive buffer was allowed to grow (see 
+ * \ref mqtt_message_queue.growth_segment_size and \ref mqtt_client.recv_buffer). 
+ * Messages that are still queued are discarded. The I/O thread is stopped if it is running, 
+ * and the client is removed from its reactor (see \ref mqtt_reactor_group_remove if the 
+ * reactor is in a group).
+ * 
+ * @pre The client must not be in use by any other thread. A client in a reactor that isn't
+ *      in a group must be deinitialized as \ref mqtt_reactor_remove requires: from the 
+ *      thread that runs \ref mqtt_reactor_run_once, or while no thread runs it.
+ * 
+ * @param[in,out] client The MQTT client.
+ */
+void mqtt_deinit(struct mqtt_client *client);
 
 /**
  * @brief Establishes a session with the MQTT broker.
@@ -1448,6 +3372,149 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
                              size_t application_message_size,
                              uint8_t publish_flags);
 
+/**
+ * @brief Reserve space for an application message directly in the send buffer.
+ * @ingroup api
+ *
+ * The first half of a two-phase publish. The PUBLISH packet is staged in the client's
+ * message queue with room for up to \p max_application_message_size bytes of application
+ * message, and \p application_message is set to point to that room. Serialize the
+ * application message there and then call \ref mqtt_publish_commit with the number of bytes
+ * that were actually written (or \ref mqtt_publish_cancel). This avoids copying the
+ * application message from a scratch buffer into the message queue.
+ *
+ * @pre mqtt_connect must have been called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] max_application_message_size An upper bound on the size of the application
+ *            message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, see \ref mqtt_publish.
+ * @param[out] application_message Set to the first byte of the reserved application message.
+ *
+ * @post If \c MQTT_OK was returned, \ref mqtt_publish_commit or \ref mqtt_publish_cancel
+ *       \em must be called.
+ *
+ * @attention The client's mutex is held from a successful call to this function until the
+ *            matching call to \ref mqtt_publish_commit or \ref mqtt_publish_cancel. Do not
+ *            call any other API function in between.
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_SPOOL_ACTIVE if the client has a spool
+ *          that \ref mqtt_publish would spool the message to (the reserved packet would
+ *          have to go into the send buffer, ahead of the spooled messages; publish it with
+ *          \ref mqtt_publish instead), an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_publish_reserve(struct mqtt_client *client,
+                                     const char* topic_name,
+                                     size_t max_application_message_size,
+                                     uint8_t publish_flags,
+                                     void** application_message);
+
+/**
+ * @brief Finalize and queue a PUBLISH that was staged with \ref mqtt_publish_reserve.
+ * @ingroup api
+ *
+ * The fixed header is rewritten with the remaining length that corresponds to
+ * \p application_message_size before the packet is queued.
+ *
+ * @pre mqtt_publish_reserve must have returned \c MQTT_OK.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] application_message_size The number of bytes that were written to the
+ *            reserved application message. Must not exceed the reserved size.
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_MALFORMED_REQUEST if 
+ *          \p application_message_size exceeds the reserved size (the reservation is 
+ *          dropped, but the client's \c error is left alone).
+ */
+enum MQTTErrors mqtt_publish_commit(struct mqtt_client *client,
+                                    size_t application_message_size);
+
+/**
+ * @brief Drop a PUBLISH that was staged with \ref mqtt_publish_reserve.
+ * @ingroup api
+ *
+ * @pre mqtt_publish_reserve must have returned \c MQTT_OK.
+ *
+ * @param[in,out] client The MQTT client.
+ */
+void mqtt_publish_cancel(struct mqtt_client *client);
+
+/**
+ * @brief Publish an application message and track its acknowledgement.
+ * @ingroup api
+ *
+ * Like \ref mqtt_publish, but \p handle is filled in so that the application can find
+ * out when the broker has acknowledged the message, with \ref mqtt_publish_handle_status
+ * or \ref mqtt_publish_handle_wait. Producers can queue many messages and only wait for
+ * the last one. The message is also reported to \ref mqtt_client::delivery_callback 
+ * once it is acknowledged.
+ *
+ * @pre mqtt_connect must have been called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message The data to be published.
+ * @param[in] application_message_size The size of \p application_message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, see \ref mqtt_publish.
+ * @param[in,out] handle The handle, with its \c cookie set. Only valid if \c MQTT_OK is 
+ *             returned, in which case it must stay valid until it isn't pending anymore.
+ *
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_publish_with_handle(struct mqtt_client *client,
+                                         const char* topic_name,
+                                         void* application_message,
+                                         size_t application_message_size,
+                                         uint8_t publish_flags,
+                                         struct mqtt_publish_handle *handle);
+
+/**
+ * @brief Returns the \ref MQTTPublishHandleState of a publish handle without blocking.
+ * @ingroup api
+ *
+ * @param[in] handle A handle filled in by \ref mqtt_publish_with_handle.
+ */
+enum MQTTPublishHandleState mqtt_publish_handle_status(struct mqtt_publish_handle *handle);
+
+/**
+ * @brief Blocks until a publish handle isn't pending anymore or \p timeout_ms passes.
+ * @ingroup api
+ *
+ * @note The acknowledgement is received by whoever syncs the client, so another thread
+ *       (e.g. the one started with \ref mqtt_start_io_thread or a \ref mqtt_reactor) must
+ *       be syncing it while this function waits.
+ *
+ * @param[in] handle A handle filled in by \ref mqtt_publish_with_handle.
+ * @param[in] timeout_ms The longest time to wait, in milliseconds.
+ *
+ * @returns The \ref MQTTPublishHandleState of the handle, \ref MQTT_PUBLISH_HANDLE_PENDING
+ *          if the wait timed out.
+ */
+enum MQTTPublishHandleState mqtt_publish_handle_wait(struct mqtt_publish_handle *handle, int timeout_ms);
+
+/**
+ * @brief Marks the pending publish handle with \p packet_id as acknowledged, if there is one.
+ * @ingroup details
+ *
+ * The handle's delivery is added to the client's batch of deliveries if the client has a
+ * delivery callback, timed from when the acknowledged packet at index \p msg of the 
+ * client's queue was last sent.
+ *
+ * @pre The client's mutex and \c io_mutex must be held.
+ *
+ * @returns 1 if a handle was acknowledged, 0 if none has \p packet_id.
+ */
+int __mqtt_publish_handle_acknowledge(struct mqtt_client *client, size_t msg, uint16_t packet_id);
+
+/**
+ * @brief Marks every pending publish handle as dropped.
+ * @ingroup details
+ *
+ * @pre The client's mutex must be held.
+ */
+void __mqtt_publish_handles_drop(struct mqtt_client *client);
+
 /**
  * @brief Acknowledge an ingree publish with QOS==1.
  * @ingroup details
@@ -1556,4 +3623,419 @@ enum MQTTErrors __mqtt_ping(struct mqtt_client *client);
  */
 enum MQTTErrors mqtt_disconnect(struct mqtt_client *client);
 
+/* CLIENT POOL */
+
+/**
+ * @brief One of the clients in a \ref mqtt_client_pool.
+ * @ingroup details
+ */
+struct mqtt_client_pool_member {
+    /** @brief The client. */
+    struct mqtt_client client;
+
+    /** @brief The number of messages published through the pool with this client. */
+    size_t number_of_publishes;
+
+    /** @brief The number of times this client reconnected after an error. */
+    size_t number_of_reconnects;
+};
+
+/**
+ * @brief Several connections to the same broker that publishes are sharded across.
+ * @ingroup api
+ *
+ * A single connection is limited by one TCP stream and by how fast the broker handles a
+ * single connection. A pool spreads publishes over several clients, each with its own
+ * client id (the pool's prefix followed by \c "-" and the client's index). A publish is
+ * routed by a hash of its topic, so messages published to the same topic always use the
+ * same connection and keep their order.
+ *
+ * All clients are connected and reconnected by the pool's reconnect callback. It is
+ * called like the one passed to \ref mqtt_init_reconnect, but is also given the index of
+ * the client and the client id to connect with.
+ *
+ * @note Each client has its own mutex, so producers publishing to different topics
+ *       rarely contend with each other.
+ */
+struct mqtt_client_pool {
+    /** @brief The clients. */
+    struct mqtt_client_pool_member *clients;
+
+    /** @brief The number of clients. */
+    size_t number_of_clients;
+
+    /** @brief The prefix of the clients' ids. */
+    const char *client_id_prefix;
+
+    /** @brief The callback that connects/reconnects the client at \p index. */
+    void (*reconnect_callback)(struct mqtt_client_pool *pool, size_t index, const char *client_id, void **state);
+
+    /** @brief A pointer to any state information the reconnect callback needs. */
+    void *reconnect_state;
+};
+
+/**
+ * @brief The statistics of all the clients in a \ref mqtt_client_pool.
+ * @ingroup api
+ */
+struct mqtt_client_pool_stats {
+    /** @brief The number of clients that are not in an error state. */
+    size_t number_of_connected_clients;
+
+    /** @brief The sum of \ref mqtt_client_pool_member.number_of_publishes. */
+    size_t number_of_publishes;
+
+    /** @brief The sum of \ref mqtt_client_pool_member.number_of_reconnects. */
+    size_t number_of_reconnects;
+
+    /** @brief The sum of the clients' \c number_of_keep_alives. */
+    size_t number_of_keep_alives;
+
+    /** @brief The sum of the clients' \c number_of_timeouts. */
+    size_t number_of_timeouts;
+
+    /** @brief The number of bytes used in all the clients' send buffers. */
+    size_t send_buffer_bytes_in_use;
+
+    /** @brief The mean of the clients' \c typical_response_time. */
+    double typical_response_time;
+};
+
+/**
+ * @brief The longest client id prefix a \ref mqtt_client_pool accepts.
+ * @ingroup details
+ */
+#define MQTT_CLIENT_POOL_MAX_CLIENT_ID_PREFIX 64
+
+/**
+ * @brief Initialize a client pool.
+ * @ingroup api
+ *
+ * Every client is initialized with \ref mqtt_init_reconnect, so the pool's reconnect
+ * callback is called for each of them on the first call to \ref mqtt_client_pool_sync.
+ * It should open a socket, call \ref mqtt_reinit on \c pool->clients[index].client and
+ * then \ref mqtt_connect with \p client_id.
+ *
+ * @param[out] pool The pool.
+ * @param[in] clients The clients. Must outlive \p pool.
+ * @param[in] number_of_clients The number of clients.
+ * @param[in] client_id_prefix The prefix of the clients' ids. Must outlive \p pool.
+ * @param[in] reconnect_callback The callback that connects/reconnects a client.
+ * @param[in] reconnect_state A pointer to some state data for \p reconnect_callback.
+ * @param[in] publish_response_callback The callback that is called when any client
+ *            receives a publish.
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_NULLPTR if an argument is \c NULL or
+ *          there are no clients, \ref MQTT_ERROR_CLIENT_ID_TOO_LONG if the prefix is
+ *          longer than \ref MQTT_CLIENT_POOL_MAX_CLIENT_ID_PREFIX.
+ */
+enum MQTTErrors mqtt_client_pool_init(struct mqtt_client_pool *pool,
+                                      struct mqtt_client_pool_member *clients, size_t number_of_clients,
+                                      const char *client_id_prefix,
+                                      void (*reconnect_callback)(struct mqtt_client_pool *, size_t, const char *, void **),
+                                      void *reconnect_state,
+                                      void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+
+/**
+ * @brief Returns the client that publishes to \p topic_name go through.
+ * @ingroup api
+ *
+ * Use this to publish with \ref mqtt_publish_reserve or to subscribe.
+ */
+struct mqtt_client* mqtt_client_pool_route(struct mqtt_client_pool *pool, const char *topic_name);
+
+/**
+ * @brief Publish a message with the client \p topic_name is routed to.
+ * @ingroup api
+ *
+ * @see mqtt_publish
+ *
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_client_pool_publish(struct mqtt_client_pool *pool,
+                                         const char* topic_name,
+                                         void* application_message,
+                                         size_t application_message_size,
+                                         uint8_t publish_flags);
+
+/**
+ * @brief Call \ref mqtt_sync for every client in the pool.
+ * @ingroup api
+ *
+ * Every client is synced even if an earlier one fails.
+ *
+ * @returns \c MQTT_OK if every client synced, the first error otherwise.
+ */
+enum MQTTErrors mqtt_client_pool_sync(struct mqtt_client_pool *pool);
+
+/**
+ * @brief Add up the statistics of every client in the pool.
+ * @ingroup api
+ *
+ * @param[in] pool The pool.
+ * @param[out] stats The statistics.
+ */
+void mqtt_client_pool_get_stats(struct mqtt_client_pool *pool, struct mqtt_client_pool_stats *stats);
+
+/**
+ * @brief Call \ref mqtt_deinit for every client in the pool.
+ * @ingroup api
+ */
+void mqtt_client_pool_deinit(struct mqtt_client_pool *pool);
+
+/* REACTOR */
+
+/**
+ * @brief The number of one second slots in a \ref mqtt_reactor's timer wheel.
+ * @ingroup details
+ */
+#define MQTT_REACTOR_WHEEL_SIZE 64
+
+/**
+ * @brief Drives many clients from a single thread.
+ * @ingroup api
+ *
+ * Calling \ref mqtt_sync on every client in a loop costs time for every client on every 
+ * pass, even when they are all idle. A reactor waits for the sockets of all of its 
+ * clients at once (with epoll on Linux), and keeps the next keep-alive or resend of each 
+ * client in a timer wheel. Each \ref mqtt_reactor_run_once only syncs the clients 
+ * whose sockets are readable, whose deadline has passed, or that queued something to 
+ * send since they were last synced.
+ *
+ * A client that reconnects is followed to its new socket. While a client is in an error 
+ * state it is synced (and so reconnected) once a second.
+ *
+ * The time spent syncing clients is measured over intervals of \c interval_ms, which 
+ * gives the reactor's \c utilization and the work of each client (used by 
+ * \ref mqtt_reactor_group to move clients between reactors).
+ *
+ * @note Clients in a reactor can be published to, and added with \ref mqtt_reactor_add, 
+ *       from any thread. \ref mqtt_reactor_remove and \ref mqtt_reactor_run_once must be 
+ *       called from the same thread, and not from a callback.
+ */
+struct mqtt_reactor {
+    /** @brief The sockets of the clients. */
+    mqtt_pal_poller_handle poller;
+
+    /** @brief Signalled when a client is put on the pending list. */
+    mqtt_pal_wakeup_handle wakeup;
+
+    /** @brief Protects the pending list, \c number_of_clients, \c utilization, \c steal_request and \c removals. */
+    mqtt_pal_mutex_t mutex;
+
+    /** @brief The clients that queued something to send. */
+    struct mqtt_client *pending;
+
+    /** @brief The clients, by their deadline modulo \ref MQTT_REACTOR_WHEEL_SIZE. */
+    struct mqtt_client *wheel[MQTT_REACTOR_WHEEL_SIZE];
+
+    /** @brief The last second whose slot of the wheel was expired. */
+    mqtt_pal_time_t wheel_time;
+
+    /** @brief The number of clients in the reactor. */
+    size_t number_of_clients;
+
+    /** @brief The number of times a client was synced. */
+    size_t number_of_syncs;
+
+    /** @brief The number of times a client was synced because its deadline passed. */
+    size_t number_of_expirations;
+
+    /** @brief The length of a measurement interval, in milliseconds. Initialized to 100. */
+    int interval_ms;
+
+    /** @brief The number of the current measurement interval. */
+    size_t interval;
+
+    /** @brief When the current interval started (see \ref mqtt_pal_clock_us). */
+    uint64_t interval_start_us;
+
+    /** @brief The time spent syncing clients in the current interval (us). */
+    uint64_t busy_us;
+
+    /** @brief The time spent syncing clients in the last interval (us). */
+    uint64_t last_busy_us;
+
+    /** @brief The fraction of the last interval that was spent syncing clients. */
+    double utilization;
+
+    /** @brief The group the reactor is in, \c NULL if none. */
+    struct mqtt_reactor_group *group;
+
+    /** @brief The thread running the reactor in its group. */
+    mqtt_pal_thread_t thread;
+
+    /** @brief The index of the reactor in the group that asked for a client, -1 if none. */
+    int steal_request;
+
+    /** @brief The clients \ref mqtt_reactor_group_remove asked the reactor's thread to remove. */
+    struct mqtt_client *removals;
+
+    /** @brief Broadcast whenever a requested removal was done. */
+    mqtt_pal_cond_t removals_done;
+
+    /** @brief The number of clients the reactor gave to other reactors of its group. */
+    size_t number_of_migrations;
+};
+
+/**
+ * @brief Initialize a reactor.
+ * @ingroup api
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_REACTOR if the poller can't be created.
+ */
+enum MQTTErrors mqtt_reactor_init(struct mqtt_reactor *reactor);
+
+/**
+ * @brief Add a client to a reactor.
+ * @ingroup api
+ *
+ * The client is synced on the next \ref mqtt_reactor_run_once. It may already be 
+ * connected, or initialized with \ref mqtt_init_reconnect.
+ *
+ * @param[in,out] reactor The reactor.
+ * @param[in,out] client The client. Must stay in place until it is removed.
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_REACTOR if the client is already in a 
+ *          reactor or its I/O thread is running.
+ */
+enum MQTTErrors mqtt_reactor_add(struct mqtt_reactor *reactor, struct mqtt_client *client);
+
+/**
+ * @brief Remove a client from its reactor. \ref mqtt_deinit does this too.
+ * @ingroup api
+ *
+ * The reactor's poller and timer wheel are changed without a lock, so this races with a 
+ * concurrent \ref mqtt_reactor_run_once.
+ *
+ * @pre Called from the thread that runs \ref mqtt_reactor_run_once (but not from a 
+ *      callback), or while no thread runs it.
+ *
+ * @note While the reactor's group runs, use \ref mqtt_reactor_group_remove instead.
+ */
+void mqtt_reactor_remove(struct mqtt_reactor *reactor, struct mqtt_client *client);
+
+/**
+ * @brief Wait for work and sync the clients that have some.
+ * @ingroup api
+ *
+ * @param[in,out] reactor The reactor.
+ * @param[in] timeout_ms The longest time to wait if there is nothing to do, in 
+ *            milliseconds. Waits never last past the next second, when deadlines may pass.
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_REACTOR if waiting failed. Errors of 
+ *          the clients are left in their \c error.
+ */
+enum MQTTErrors mqtt_reactor_run_once(struct mqtt_reactor *reactor, int timeout_ms);
+
+/**
+ * @brief Remove every client from a reactor and free its resources.
+ * @ingroup api
+ */
+void mqtt_reactor_deinit(struct mqtt_reactor *reactor);
+
+/**
+ * @brief Puts \p client on its reactor's pending list.
+ * @ingroup details
+ *
+ * @pre The client's mutex must be held.
+ */
+void __mqtt_reactor_notify(struct mqtt_client *client);
+
+/**
+ * @brief Several reactors, each run by its own thread, that share their clients' work.
+ * @ingroup api
+ *
+ * Clients are added to the reactor with the fewest clients. Since how busy a client is 
+ * changes, this alone leaves some threads idle while others are saturated. So at the end 
+ * of each measurement interval, a reactor whose \c utilization is \c steal_threshold below 
+ * that of the busiest reactor asks it for a client. The busiest reactor then hands over 
+ * the client that was the busiest in its last interval, as long as that client's work is 
+ * at most half of the reactor's (moving a client that does most of the work would only 
+ * move the problem).
+ *
+ * Each reactor's \c utilization, \c number_of_syncs and \c number_of_migrations can be 
+ * read while the group runs (\c utilization under the reactor's mutex).
+ *
+ * @note Clients are removed while the group runs with \ref mqtt_reactor_group_remove, 
+ *       which \ref mqtt_deinit uses.
+ */
+struct mqtt_reactor_group {
+    /** @brief The reactors. */
+    struct mqtt_reactor *reactors;
+
+    /** @brief The number of reactors. */
+    size_t number_of_reactors;
+
+    /** @brief Protects \c running and \c stopping. */
+    mqtt_pal_mutex_t mutex;
+
+    /** @brief Non-zero while the threads are running. */
+    int running;
+
+    /** @brief Non-zero once the threads have been asked to stop. */
+    int stopping;
+
+    /** @brief How much less utilized a reactor must be to take a client. Initialized to 0.25. */
+    double steal_threshold;
+};
+
+/**
+ * @brief Initialize a reactor group and its reactors.
+ * @ingroup api
+ *
+ * @param[out] group The group.
+ * @param[out] reactors The reactors. Must outlive \p group.
+ * @param[in] number_of_reactors The number of reactors (and threads).
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_NULLPTR if there are no reactors, 
+ *          \ref MQTT_ERROR_REACTOR if a reactor can't be initialized.
+ */
+enum MQTTErrors mqtt_reactor_group_init(struct mqtt_reactor_group *group, 
+                                        struct mqtt_reactor *reactors, size_t number_of_reactors);
+
+/**
+ * @brief Start a thread for every reactor in the group.
+ * @ingroup api
+ *
+ * @returns \c MQTT_OK upon success, \ref MQTT_ERROR_REACTOR if the group is already 
+ *          running or a thread can't be started.
+ */
+enum MQTTErrors mqtt_reactor_group_start(struct mqtt_reactor_group *group);
+
+/**
+ * @brief Add a client to the reactor of the group with the fewest clients.
+ * @ingroup api
+ *
+ * May be called from any thread.
+ *
+ * @see mqtt_reactor_add
+ */
+enum MQTTErrors mqtt_reactor_group_add(struct mqtt_reactor_group *group, struct mqtt_client *client);
+
+/**
+ * @brief Remove a client from the reactor of the group it is in.
+ * @ingroup api
+ *
+ * While the group runs, only a reactor's thread may take a client out of it, so the 
+ * removal is handed to the thread of the reactor that owns the client and waited for 
+ * (again if the client moved to another reactor in the meantime). Otherwise the client is 
+ * removed right away. Does nothing if the client is in no reactor.
+ *
+ * May be called from any thread, but not from a callback of the group's clients.
+ */
+void mqtt_reactor_group_remove(struct mqtt_reactor_group *group, struct mqtt_client *client);
+
+/**
+ * @brief Stop the group's threads and wait for them to exit. The clients stay in their reactors.
+ * @ingroup api
+ */
+void mqtt_reactor_group_stop(struct mqtt_reactor_group *group);
+
+/**
+ * @brief Stop the group and deinitialize its reactors.
+ * @ingroup api
+ */
+void mqtt_reactor_group_deinit(struct mqtt_reactor_group *group);
+
 #endif
@@ -40,13 +40,20 @@ SOFTWARE.
  * mqtt_pal.h:
  *  - Types:
  *      - \c size_t, \c ssize_t
- *      - \c uint8_t, \c uint16_t, \c uint32_t
+ *      - \c uint8_t, \c uint16_t, \c uint32_t, \c uintptr_t
  *      - \c va_list
  *      - \c mqtt_pal_time_t : return type of \c MQTT_PAL_TIME() 
  *      - \c mqtt_pal_mutex_t : type of the argument that is passed to \c MQTT_PAL_MUTEX_LOCK and 
  *        \c MQTT_PAL_MUTEX_RELEASE
+ *      - \c mqtt_pal_cond_t : a condition variable that is waited for with 
+ *        \ref mqtt_pal_cond_wait
+ *      - \c mqtt_pal_file_handle : the handle of a file mapped with \ref mqtt_pal_map_file
+ *      - \c mqtt_pal_thread_t : a thread started with \ref mqtt_pal_thread_start
+ *      - \c mqtt_pal_wakeup_handle : an event that \ref mqtt_pal_wait can be woken up with
  *  - Functions:
- *      - \c memcpy, \c strlen
+ *      - \c memcpy, \c memmove, \c strlen
+ *      - \c fopen, \c fread, \c fwrite, \c fseek, \c ftell, \c fflush, \c fclose, \c remove 
+ *        and \c snprintf (only used by the spool and the client pool)
  *      - \c va_start, \c va_arg, \c va_end
  *  - Constants:
  *      - \c INT_MIN
@@ -58,15 +65,33 @@ SOFTWARE.
  *  - \c MQTT_PAL_MUTEX_LOCK(mtx_pointer) : macro that locks the mutex pointed to by \c mtx_pointer.
  *  - \c MQTT_PAL_MUTEX_RELEASE(mtx_pointer) : macro that unlocks the mutex pointed to by 
  *    \c mtx_pointer.
+ *  - \c MQTT_PAL_COND_BROADCAST(cond_pointer) : macro that wakes up every thread waiting
+ *    for the condition variable pointed to by \c cond_pointer.
+ *  - \c MQTT_PAL_MALLOC(size) : allocates \c size bytes of memory.
+ *  - \c MQTT_PAL_FREE(ptr) : frees memory that was allocated with \c MQTT_PAL_MALLOC.
+ * 
+ * A platform whose \ref mqtt_pal_sendall only queues data may also define 
+ * \c MQTT_PAL_FLUSH(fd), which is called once each \ref mqtt_sync has queued everything 
+ * and returns an \ref MQTTErrors if the queued data couldn't be sent.
  * 
  * Lastly, \ref mqtt_pal_sendall and \ref mqtt_pal_recvall, must be implemented in mqtt_pal.c 
- * for sending and receiving data using the platforms socket calls.
+ * for sending and receiving data using the platforms socket calls. \ref mqtt_pal_map_file,
+ * \ref mqtt_pal_sync_file and \ref mqtt_pal_unmap_file are only needed by the session store,
+ * and \ref mqtt_pal_truncate_file by the spool (see \ref mqtt_spool).
+ * The thread and wakeup functions and \ref mqtt_pal_wait are only needed by the I/O thread
+ * (see \ref mqtt_start_io_thread), and the poller functions and \ref mqtt_pal_clock_us by 
+ * the reactor (see \ref mqtt_reactor). \ref mqtt_pal_cond_init and \ref mqtt_pal_cond_wait 
+ * are needed by \ref mqtt_publish_handle_wait and by producers that wait for a send to 
+ * finish before they clean a full send buffer.
  */
 
 
 /* UNIX-like platform support */
 #ifdef __unix__
     #include <limits.h>
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
     #include <string.h>
     #include <stdarg.h>
     #include <time.h>
@@ -80,21 +105,45 @@ SOFTWARE.
 
     typedef time_t mqtt_pal_time_t;
     typedef pthread_mutex_t mqtt_pal_mutex_t;
+    typedef pthread_cond_t mqtt_pal_cond_t;
+    typedef int mqtt_pal_file_handle;
+    typedef pthread_t mqtt_pal_thread_t;
+
+    /* an eventfd on Linux (both ends are the same descriptor), a pipe elsewhere */
+    typedef struct {
+        int read_fd;
+        int write_fd;
+    } mqtt_pal_wakeup_handle;
+
+    /* an epoll instance on Linux, an array of sockets for poll() elsewhere */
+    typedef struct mqtt_pal_poller* mqtt_pal_poller_handle;
 
     #define MQTT_PAL_MUTEX_INIT(mtx_ptr) pthread_mutex_init(mtx_ptr, NULL)
     #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) pthread_mutex_lock(mtx_ptr)
     #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) pthread_mutex_unlock(mtx_ptr)
+    #define MQTT_PAL_COND_BROADCAST(cond_ptr) pthread_cond_broadcast(cond_ptr)
+
+    #define MQTT_PAL_MALLOC(size) malloc(size)
+    #define MQTT_PAL_FREE(ptr) free(ptr)
 
     #ifndef MQTT_USE_CUSTOM_SOCKET_HANDLE
         #ifdef MQTT_USE_BIO
             #include <openssl/bio.h>
             typedef BIO* mqtt_pal_socket_handle;
+        #elif defined(MQTT_USE_IO_URING)
+            typedef struct mqtt_pal_uring* mqtt_pal_socket_handle;
+            #define MQTT_PAL_FLUSH(fd) mqtt_pal_flush(fd)
         #else
             typedef int mqtt_pal_socket_handle;
         #endif
     #endif
 #endif
 
+#ifndef MQTT_PAL_FLUSH
+    /* sends are complete when mqtt_pal_sendall returns */
+    #define MQTT_PAL_FLUSH(fd) 0
+#endif
+
 /**
  * @brief Sends all the bytes in a buffer.
  * @ingroup pal
@@ -121,4 +170,299 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
  */
 ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags);
 
+/**
+ * @brief Maps a file into memory so that writes to the memory reach the file.
+ * @ingroup pal
+ * 
+ * The file is created if it doesn't exist and extended with zeros if it is shorter than
+ * \p size bytes.
+ * 
+ * @param[in] path The path of the file.
+ * @param[in] size The number of bytes to map.
+ * @param[out] handle The handle to pass to \ref mqtt_pal_sync_file and 
+ *             \ref mqtt_pal_unmap_file.
+ * 
+ * @returns A pointer to the mapped memory, or \c NULL if an error occurred.
+ */
+void* mqtt_pal_map_file(const char *path, size_t size, mqtt_pal_file_handle *handle);
+
+/**
+ * @brief Blocks until the changes to a mapped file have reached the disk.
+ * @ingroup pal
+ * 
+ * @param[in] mem The memory returned by \ref mqtt_pal_map_file.
+ * @param[in] size The size that was passed to \ref mqtt_pal_map_file.
+ * @param[in] handle The file's handle.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_sync_file(void *mem, size_t size, mqtt_pal_file_handle handle);
+
+/**
+ * @brief Unmaps and closes a file mapped with \ref mqtt_pal_map_file.
+ * @ingroup pal
+ */
+void mqtt_pal_unmap_file(void *mem, size_t size, mqtt_pal_file_handle handle);
+
+/**
+ * @brief Cuts a file down to \p size bytes.
+ * @ingroup pal
+ * 
+ * Used by the spool to drop a message that was only partly appended.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_truncate_file(const char *path, size_t size);
+
+/**
+ * @brief Starts a thread that calls \p routine with \p arg.
+ * @ingroup pal
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_thread_start(mqtt_pal_thread_t *thread, void* (*routine)(void*), void *arg);
+
+/**
+ * @brief Waits for a thread started with \ref mqtt_pal_thread_start to return.
+ * @ingroup pal
+ */
+void mqtt_pal_thread_join(mqtt_pal_thread_t thread);
+
+/**
+ * @brief Creates an event that wakes up \ref mqtt_pal_wait.
+ * @ingroup pal
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_wakeup_open(mqtt_pal_wakeup_handle *wakeup);
+
+/**
+ * @brief Signals an event. Signals that haven't been waited for yet are coalesced.
+ * @ingroup pal
+ */
+void mqtt_pal_wakeup_signal(mqtt_pal_wakeup_handle wakeup);
+
+/**
+ * @brief Destroys an event created with \ref mqtt_pal_wakeup_open.
+ * @ingroup pal
+ */
+void mqtt_pal_wakeup_close(mqtt_pal_wakeup_handle wakeup);
+
+/**
+ * @brief Blocks until \p fd is readable, \p wakeup is signalled or \p timeout_ms passes.
+ * @ingroup pal
+ * 
+ * A pending signal of \p wakeup is consumed.
+ * 
+ * @param[in] fd The socket.
+ * @param[in] watch_socket Zero to only wait for \p wakeup (e.g. while the socket is broken).
+ * @param[in] wakeup The event.
+ * @param[in] timeout_ms The longest time to wait, in milliseconds.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_wait(mqtt_pal_socket_handle fd, int watch_socket, mqtt_pal_wakeup_handle wakeup, int timeout_ms);
+
+/**
+ * @brief Creates a set of sockets that are waited for together.
+ * @ingroup pal
+ * 
+ * @param[in] wakeup An event that also wakes up \ref mqtt_pal_poller_wait. Must outlive 
+ *            the poller.
+ * 
+ * @returns The poller, or \c NULL if it can't be created.
+ */
+mqtt_pal_poller_handle mqtt_pal_poller_open(mqtt_pal_wakeup_handle wakeup);
+
+/**
+ * @brief Adds a socket to a poller.
+ * @ingroup pal
+ * 
+ * @param[in] poller The poller.
+ * @param[in] fd The socket.
+ * @param[in] data What \ref mqtt_pal_poller_wait reports when \p fd is readable. Must not 
+ *            be \c NULL.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_poller_add(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd, void *data);
+
+/**
+ * @brief Removes a socket from a poller. Sockets are removed when they are closed anyway.
+ * @ingroup pal
+ */
+void mqtt_pal_poller_remove(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd);
+
+/**
+ * @brief Blocks until sockets are readable, the poller's event is signalled or 
+ *        \p timeout_ms passes.
+ * @ingroup pal
+ * 
+ * A pending signal of the event is consumed. Only the sockets that are ready are looked 
+ * at (on Linux), so waiting doesn't get slower as sockets are added.
+ * 
+ * @param[in] poller The poller.
+ * @param[out] ready The data of the sockets that are readable.
+ * @param[in] max_ready The size of \p ready.
+ * @param[in] timeout_ms The longest time to wait, in milliseconds.
+ * 
+ * @returns The number of sockets in \p ready, -1 on error.
+ */
+int mqtt_pal_poller_wait(mqtt_pal_poller_handle poller, void **ready, int max_ready, int timeout_ms);
+
+/**
+ * @brief Destroys a poller. The sockets and the event are not closed.
+ * @ingroup pal
+ */
+void mqtt_pal_poller_close(mqtt_pal_poller_handle poller);
+
+/**
+ * @brief Returns a monotonic clock in microseconds, for measuring short durations.
+ * @ingroup pal
+ */
+uint64_t mqtt_pal_clock_us(void);
+
+/**
+ * @brief Initializes a condition variable that is waited for against \ref mqtt_pal_clock_us.
+ * @ingroup pal
+ */
+void mqtt_pal_cond_init(mqtt_pal_cond_t *cond);
+
+/**
+ * @brief Waits for a condition variable until it is signalled or the time is \p deadline_us.
+ * @ingroup pal
+ * 
+ * @pre \p mutex must be locked. It is unlocked while waiting.
+ * 
+ * @param[in] cond The condition variable.
+ * @param[in] mutex The mutex that protects the condition.
+ * @param[in] deadline_us When to stop waiting, in \ref mqtt_pal_clock_us time.
+ * 
+ * @returns 0 if woken up (which may be spurious), -1 once \p deadline_us has passed.
+ */
+int mqtt_pal_cond_wait(mqtt_pal_cond_t *cond, mqtt_pal_mutex_t *mutex, uint64_t deadline_us);
+
+#ifdef MQTT_USE_IO_URING
+
+/**
+ * @brief A socket whose traffic goes through an io_uring (Linux only).
+ * @ingroup pal
+ * 
+ * Built with \c MQTT_USE_IO_URING, the socket handle passed to \ref mqtt_init is one of 
+ * these (see \ref mqtt_pal_uring_open) instead of a file descriptor. 
+ *  - \ref mqtt_pal_sendall copies packets into a send buffer, and \ref mqtt_pal_flush 
+ *    sends all of them with a single submission, so each 
+ *    \ref mqtt_sync makes one system call to send instead of one per packet. 
+ *  - A multishot receive is kept armed with a ring of registered receive blocks. The 
+ *    kernel posts data as it arrives, so \ref mqtt_pal_recvall only reads shared memory 
+ *    and makes no system call at all while there is nothing to receive.
+ * 
+ * If the ring can't be set up, or it is disabled when opening, plain \c send and 
+ * \c recv are used instead.
+ */
+struct mqtt_pal_uring {
+    /** @brief The socket. */
+    int sockfd;
+
+    /** @brief The ring's file descriptor, -1 if plain \c send and \c recv are used. */
+    int ring_fd;
+
+    /** @brief The submission queue's head, tail, mask and index array. */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+
+    /** @brief The submission queue entries. */
+    void *sqes;
+
+    /** @brief The completion queue's head, tail and mask. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+
+    /** @brief The completion queue entries. */
+    void *cqes;
+
+    /** @brief The mapped submission ring, its entries, and the completion ring. */
+    void *sq_ring, *cq_ring;
+
+    /** @brief The sizes of \c sq_ring, \c sqes and \c cq_ring. */
+    size_t sq_ring_size, sqes_size, cq_ring_size;
+
+    /** @brief The send buffer. */
+    uint8_t *send_buffer;
+
+    /** @brief The size of \c send_buffer. */
+    size_t send_buffer_size;
+
+    /** @brief The number of bytes waiting in \c send_buffer for \ref mqtt_pal_flush. */
+    size_t send_buffer_used;
+
+    /** @brief The ring of receive blocks the kernel picks from. */
+    void *recv_ring;
+
+    /** @brief The receive blocks. */
+    uint8_t *recv_blocks;
+
+    /** @brief The size of each receive block. */
+    size_t recv_block_size;
+
+    /** @brief The number of receive blocks (a power of 2). */
+    unsigned recv_block_count;
+
+    /** @brief Receive completions that haven't been copied out yet (result and flags). */
+    int32_t *recv_results;
+    uint32_t *recv_flags;
+
+    /** @brief The first pending receive completion and the number of them. */
+    unsigned recv_first, recv_length;
+
+    /** @brief The number of bytes of the first pending completion already copied out. */
+    size_t recv_offset;
+
+    /** @brief Non-zero while the multishot receive is armed. */
+    int recv_armed;
+
+    /** @brief Non-zero once the peer closed the connection. */
+    int recv_closed;
+
+    /** @brief The result of the last send, set when its completion is reaped. */
+    int32_t send_result;
+
+    /** @brief Non-zero once the last send's completion was reaped. */
+    int send_done;
+
+    /** @brief The number of \c io_uring_enter calls. */
+    size_t number_of_enters;
+};
+
+/**
+ * @brief Wraps a connected socket in an io_uring.
+ * @ingroup pal
+ * 
+ * @param[in] sockfd The connected socket. When the ring is used the socket is made 
+ *            blocking (the ring waits for it, the client never does).
+ * @param[in] use_ring Zero to use plain \c send and \c recv (e.g. to compare).
+ * @param[in] send_buffer_size The size of the send buffer. Packets are sent 
+ *            once this much is queued, even before \ref mqtt_pal_flush.
+ * @param[in] recv_block_size The size of each receive block.
+ * @param[in] recv_block_count The number of receive blocks, a power of 2.
+ * 
+ * @returns The handle to pass to \ref mqtt_init, or \c NULL if out of memory.
+ */
+mqtt_pal_socket_handle mqtt_pal_uring_open(int sockfd, int use_ring, size_t send_buffer_size, 
+                                           size_t recv_block_size, unsigned recv_block_count);
+
+/**
+ * @brief Tears down the ring. The socket itself is not closed.
+ * @ingroup pal
+ */
+void mqtt_pal_uring_close(mqtt_pal_socket_handle fd);
+
+/**
+ * @brief Sends everything \ref mqtt_pal_sendall has queued.
+ * @ingroup pal
+ * 
+ * @returns 0 if successful, an \ref MQTTErrors otherwise.
+ */
+ssize_t mqtt_pal_flush(mqtt_pal_socket_handle fd);
+
+#endif
+
 #endif
\ No newline at end of file
@@ -35,6 +35,7 @@ SOFTWARE.
 enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     /* Recover from any errors */
     enum MQTTErrors err;
+    MQTT_PAL_MUTEX_LOCK(&client->io_mutex); /* the socket and receive buffer are replaced */
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     if (client->error != MQTT_OK && client->reconnect_callback != NULL) {
         client->reconnect_callback(client, &client->reconnect_state);
@@ -42,6 +43,7 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     } else {
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     }
+    MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
 
     /* Call inspector callback if necessary */
     
@@ -69,7 +71,7 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     /* LFSR taps taken from: https://en.wikipedia.org/wiki/Linear-feedback_shift_register */
     
     do {
-        struct mqtt_queued_message *curr;
+        size_t i;
         unsigned lsb = client->pid_lfsr & 1;
         (client->pid_lfsr) >>= 1;
         if (lsb) {
@@ -78,8 +80,8 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
 
         /* check that the PID is unique */
         pid_exists = 0;
-        for(curr = mqtt_mq_get(&(client->mq), 0); curr >= client->mq.queue_tail; --curr) {
-            if (curr->packet_id == client->pid_lfsr) {
+        for(i = 0; i < client->mq.length; ++i) {
+            if (client->mq.packet_id[i] == client->pid_lfsr) {
                 pid_exists = 1;
                 break;
             }
@@ -89,6 +91,126 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     return client->pid_lfsr;
 }
 
+void __mqtt_check_send_buffer_watermarks(struct mqtt_client *client)
+{
+    size_t used;
+    if (client->send_buffer_high_watermark == 0) {
+        return;
+    }
+
+    used = mqtt_mq_bytes_used(&client->mq);
+    if (!client->send_buffer_above_high_watermark && used >= client->send_buffer_high_watermark) {
+        client->send_buffer_above_high_watermark = 1;
+        if (client->send_buffer_watermark_callback) {
+            client->send_buffer_watermark_callback(&client->send_buffer_watermark_callback_state, MQTT_SEND_BUFFER_HIGH_WATERMARK, used);
+        }
+    } else if (client->send_buffer_above_high_watermark && used <= client->send_buffer_low_watermark) {
+        client->send_buffer_above_high_watermark = 0;
+        if (client->send_buffer_watermark_callback) {
+            client->send_buffer_watermark_callback(&client->send_buffer_watermark_callback_state, MQTT_SEND_BUFFER_LOW_WATERMARK, used);
+        }
+    }
+}
+
+/**
+ * Points the receive buffer at \p buf, releasing any memory it grew into.
+ */
+static void __mqtt_recv_buffer_reset(struct mqtt_client *client, uint8_t *buf, size_t bufsz)
+{
+    if (client->recv_buffer.mem_start != NULL && client->recv_buffer.mem_start != client->recv_buffer.base_start) {
+        mqtt_allocator_free(client->allocator, client->recv_buffer.mem_start, client->recv_buffer.mem_size);
+    }
+    client->recv_buffer.base_start = buf;
+    client->recv_buffer.base_size = bufsz;
+    client->recv_buffer.mem_start = buf;
+    client->recv_buffer.mem_size = bufsz;
+    client->recv_buffer.curr = buf;
+    client->recv_buffer.curr_sz = bufsz;
+    client->recv_buffer.time_of_last_use = MQTT_PAL_TIME();
+}
+
+/**
+ * Moves the receive buffer into larger memory if the partially received packet in it
+ * won't fit. Returns 1 if the buffer grew, 0 if it didn't need to, or an \ref MQTTErrors.
+ */
+static ssize_t __mqtt_recv_buffer_grow(struct mqtt_client *client)
+{
+    struct mqtt_response response;
+    size_t used = client->recv_buffer.curr - client->recv_buffer.mem_start;
+    size_t header_size, needed = 0, new_size;
+    uint8_t *mem;
+    ssize_t rv;
+
+    if (used == 0) {
+        return 0;
+    }
+    rv = mqtt_unpack_fixed_header(&response, client->recv_buffer.mem_start, used);
+    if (rv < 0) {
+        return rv;
+    }
+
+    /* the packet's size is known once the remaining length field has been received */
+    for(header_size = 2; header_size <= used && header_size <= 5; ++header_size) {
+        if (!(client->recv_buffer.mem_start[header_size - 1] & 0x80)) {
+            needed = header_size + response.fixed_header.remaining_length;
+            break;
+        }
+    }
+    if (needed == 0) {
+        if (client->recv_buffer.curr_sz > 0) {
+            /* wait for the rest of the fixed header */
+            return 0;
+        }
+        needed = client->recv_buffer.mem_size + 1;
+    }
+    if (needed <= client->recv_buffer.mem_size) {
+        return 0;
+    } else if (needed > client->recv_buffer.max_size) {
+        return MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
+    }
+
+    /* grow geometrically so a run of large packets doesn't reallocate every time */
+    new_size = 2 * client->recv_buffer.mem_size;
+    if (new_size < needed) {
+        new_size = needed;
+    }
+    if (new_size > client->recv_buffer.max_size) {
+        new_size = client->recv_buffer.max_size;
+    }
+    mem = (uint8_t*) mqtt_allocator_alloc(client->allocator, new_size);
+    if (mem == NULL) {
+        return MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
+    }
+    memcpy(mem, client->recv_buffer.mem_start, used);
+    if (client->recv_buffer.mem_start != client->recv_buffer.base_start) {
+        mqtt_allocator_free(client->allocator, client->recv_buffer.mem_start, client->recv_buffer.mem_size);
+    }
+    client->recv_buffer.mem_start = mem;
+    client->recv_buffer.mem_size = new_size;
+    client->recv_buffer.curr = mem + used;
+    client->recv_buffer.curr_sz = new_size - used;
+    return 1;
+}
+
+/**
+ * Moves the receive buffer back to its base memory if what's in it fits.
+ */
+static void __mqtt_recv_buffer_trim(struct mqtt_client *client)
+{
+    size_t used = client->recv_buffer.curr - client->recv_buffer.mem_start;
+    if (used > client->recv_buffer.base_size) {
+        return;
+    }
+    if (used > 0) {
+        memcpy(client->recv_buffer.base_start, client->recv_buffer.mem_start, used);
+    }
+    mqtt_allocator_free(client->allocator, client->recv_buffer.mem_start, client->recv_buffer.mem_size);
+    client->recv_buffer.mem_start = client->recv_buffer.base_start;
+    client->recv_buffer.mem_size = client->recv_buffer.base_size;
+    client->recv_buffer.curr = client->recv_buffer.base_start + used;
+    client->recv_buffer.curr_sz = client->recv_buffer.base_size - used;
+}
+
 enum MQTTErrors mqtt_init(struct mqtt_client *client,
                mqtt_pal_socket_handle sockfd,
                uint8_t *sendbuf, size_t sendbufsz,
@@ -101,22 +223,63 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
 
     /* initialize mutex */
     MQTT_PAL_MUTEX_INIT(&client->mutex);
+    MQTT_PAL_MUTEX_INIT(&client->io_mutex);
+    client->io_thread.running = 0;
+    client->io_thread.stopping = 0;
+    client->io_thread.signalled = 0;
+    client->io_thread.max_wait_ms = 1000;
+    client->reactor.reactor = NULL;
+    client->reactor.removal_requested = 0;
+    client->publish_handles.head = NULL;
+    client->publish_handles.tail = NULL;
+    mqtt_pal_cond_init(&client->publish_handles.done);
+    client->sending = 0;
+    mqtt_pal_cond_init(&client->send_done);
     MQTT_PAL_MUTEX_LOCK(&client->mutex); /* unlocked during CONNECT */
 
     client->socketfd = sockfd;
 
+    mqtt_heap_allocator_init(&client->heap_allocator);
+    client->allocator = &client->heap_allocator;
+    mqtt_arena_allocator_init(&client->scratch, &client->scratch_arena, NULL, 0);
+
     mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    client->mq.allocator = client->allocator;
+
+    client->spool = NULL;
+    client->session_store = NULL;
+    client->recv_buffer_pool = NULL;
+    client->recv_buffer.mem_start = NULL;
+    client->recv_buffer.max_size = 0;
+    client->recv_buffer.idle_trim_time = 30;
+    __mqtt_recv_buffer_reset(client, recvbuf, recvbufsz);
 
-    client->recv_buffer.mem_start = recvbuf;
-    client->recv_buffer.mem_size = recvbufsz;
-    client->recv_buffer.curr = client->recv_buffer.mem_start;
-    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+    mqtt_set_qos0_buffer(client, NULL, 0);
 
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
     client->response_timeout = 30;
     client->number_of_timeouts = 0;
+    client->resend_only_on_reconnect = 0;
+    client->number_of_resends_avoided = 0;
     client->number_of_keep_alives = 0;
+    client->time_of_last_send = MQTT_PAL_TIME();
+    client->time_of_last_recv_us = 0;
+    client->keep_alive_response_fraction = 0.5;
     client->typical_response_time = -1.0;
+    client->rto.srtt_us = 0;
+    client->rto.rttvar_us = 0;
+    client->rto.rto_us = 0;
+    client->rto.min_us = 200000;
+    client->rto.backoff = 0;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    client->broker_limits.receive_maximum = 0;
+    client->broker_limits.maximum_packet_size = 0;
+    client->broker_limits.topic_alias_maximum = 0;
+    mqtt_set_topic_aliases(client, NULL, 0, NULL, 0);
+    client->qos1_window.enabled = 0;
+    client->qos1_window.probe_active = 0;
     client->publish_response_callback = publish_response_callback;
     client->pid_lfsr = 0;
 
@@ -124,6 +287,18 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
     client->reconnect_callback = NULL;
     client->reconnect_state = NULL;
 
+    client->send_buffer_watermark_callback = NULL;
+    client->send_buffer_watermark_callback_state = NULL;
+    client->send_buffer_high_watermark = 0;
+    client->send_buffer_low_watermark = 0;
+    client->send_buffer_above_high_watermark = 0;
+
+    client->delivery_callback = NULL;
+    client->delivery_callback_state = NULL;
+    client->deliveries.length = 0;
+
+    client->publish_reservation.start = NULL;
+
     return MQTT_OK;
 }
 
@@ -134,26 +309,79 @@ void mqtt_init_reconnect(struct mqtt_client *client,
 {
     /* initialize mutex */
     MQTT_PAL_MUTEX_INIT(&client->mutex);
+    MQTT_PAL_MUTEX_INIT(&client->io_mutex);
+    client->io_thread.running = 0;
+    client->io_thread.stopping = 0;
+    client->io_thread.signalled = 0;
+    client->io_thread.max_wait_ms = 1000;
+    client->reactor.reactor = NULL;
+    client->reactor.removal_requested = 0;
+    client->publish_handles.head = NULL;
+    client->publish_handles.tail = NULL;
+    mqtt_pal_cond_init(&client->publish_handles.done);
+    client->sending = 0;
+    mqtt_pal_cond_init(&client->send_done);
 
     client->socketfd = (mqtt_pal_socket_handle) -1;
 
+    mqtt_heap_allocator_init(&client->heap_allocator);
+    client->allocator = &client->heap_allocator;
+    mqtt_arena_allocator_init(&client->scratch, &client->scratch_arena, NULL, 0);
+
     mqtt_mq_init(&client->mq, NULL, 0);
+    client->mq.allocator = client->allocator;
 
+    client->spool = NULL;
+    client->session_store = NULL;
+    client->recv_buffer_pool = NULL;
     client->recv_buffer.mem_start = NULL;
-    client->recv_buffer.mem_size = 0;
-    client->recv_buffer.curr = NULL;
-    client->recv_buffer.curr_sz = 0;
+    client->recv_buffer.max_size = 0;
+    client->recv_buffer.idle_trim_time = 30;
+    __mqtt_recv_buffer_reset(client, NULL, 0);
+
+    mqtt_set_qos0_buffer(client, NULL, 0);
 
     client->error = MQTT_ERROR_INITIAL_RECONNECT;
     client->response_timeout = 30;
     client->number_of_timeouts = 0;
+    client->resend_only_on_reconnect = 0;
+    client->number_of_resends_avoided = 0;
     client->number_of_keep_alives = 0;
+    client->time_of_last_send = MQTT_PAL_TIME();
+    client->time_of_last_recv_us = 0;
+    client->keep_alive_response_fraction = 0.5;
     client->typical_response_time = -1.0;
+    client->rto.srtt_us = 0;
+    client->rto.rttvar_us = 0;
+    client->rto.rto_us = 0;
+    client->rto.min_us = 200000;
+    client->rto.backoff = 0;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    client->broker_limits.receive_maximum = 0;
+    client->broker_limits.maximum_packet_size = 0;
+    client->broker_limits.topic_alias_maximum = 0;
+    mqtt_set_topic_aliases(client, NULL, 0, NULL, 0);
+    client->qos1_window.enabled = 0;
+    client->qos1_window.probe_active = 0;
     client->publish_response_callback = publish_response_callback;
 
     client->inspector_callback = NULL;
     client->reconnect_callback = reconnect;
     client->reconnect_state = reconnect_state;
+
+    client->send_buffer_watermark_callback = NULL;
+    client->send_buffer_watermark_callback_state = NULL;
+    client->send_buffer_high_watermark = 0;
+    client->send_buffer_low_watermark = 0;
+    client->send_buffer_above_high_watermark = 0;
+
+    client->delivery_callback = NULL;
+    client->delivery_callback_state = NULL;
+    client->deliveries.length = 0;
+
+    client->publish_reservation.start = NULL;
 }
 
 void mqtt_reinit(struct mqtt_client* client,
@@ -161,15 +389,355 @@ void mqtt_reinit(struct mqtt_client* client,
                  uint8_t *sendbuf, size_t sendbufsz,
                  uint8_t *recvbuf, size_t recvbufsz)
 {
+    size_t growth_segment_size = client->mq.growth_segment_size;
+    size_t growth_max_size = client->mq.growth_max_size;
+
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
     client->socketfd = socketfd;
 
-    mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    if (client->session_store != NULL) {
+        /* keep the in-flight messages to resend them on the new connection */
+        __mqtt_session_store_resume(client);
+    } else if (client->resend_only_on_reconnect && sendbuf == client->mq.base_start && sendbufsz == client->mq.base_size) {
+        /* this is the only time they're resent */
+        mqtt_mq_resume(&client->mq);
+    } else {
+        /* drop any memory the old queue grew into but keep the growth settings */
+        mqtt_mq_deinit(&client->mq);
+        mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+        client->mq.allocator = client->allocator;
+        client->mq.growth_segment_size = growth_segment_size;
+        client->mq.growth_max_size = growth_max_size;
+        /* the messages the handles were waiting on are gone */
+        __mqtt_publish_handles_drop(client);
+    }
+    client->send_buffer_above_high_watermark = 0;
+    client->publish_reservation.start = NULL;
+    client->qos1_window.probe_active = 0;
+    client->deliveries.length = 0;
+
+    if (client->recv_buffer_pool != NULL) {
+        /* drop whatever was left of the old connection's data */
+        mqtt_set_recv_buffer_pool(client, client->recv_buffer_pool);
+    } else {
+        __mqtt_recv_buffer_reset(client, recvbuf, recvbufsz);
+    }
+
+    /* drop anything staged for the old connection */
+    mqtt_set_qos0_buffer(client, client->qos0_buffer.mem_start, client->qos0_buffer.mem_size);
+}
+
+void mqtt_set_spool(struct mqtt_client *client, struct mqtt_spool *spool)
+{
+    client->spool = spool;
+}
+
+void mqtt_set_recv_buffer_pool(struct mqtt_client *client, struct mqtt_recv_buffer_pool *pool)
+{
+    if (client->recv_buffer_pool != NULL && client->recv_buffer.mem_start != NULL) {
+        mqtt_recv_buffer_pool_release(client->recv_buffer_pool, client->recv_buffer.mem_start);
+        client->recv_buffer.mem_start = NULL;
+    }
+    __mqtt_recv_buffer_reset(client, NULL, 0);
+    client->recv_buffer_pool = pool;
+}
+
+void mqtt_set_qos0_buffer(struct mqtt_client *client, uint8_t *buf, size_t bufsz)
+{
+    client->qos0_buffer.mem_start = buf;
+    client->qos0_buffer.mem_size = bufsz;
+    client->qos0_buffer.curr = buf;
+    client->qos0_buffer.curr_sz = bufsz;
+}
+
+void mqtt_set_qos1_window_autotune(struct mqtt_client *client, int min_window, int max_window)
+{
+    if (max_window <= 0) {
+        client->qos1_window.enabled = 0;
+    } else {
+        if (min_window < 1) {
+            min_window = 1;
+        }
+        client->qos1_window.enabled = 1;
+        client->qos1_window.min_window = min_window;
+        client->qos1_window.max_window = max_window > min_window ? max_window : min_window;
+        client->qos1_window.probe_active = 0;
+        client->qos1_window.min_rtt_us = 0;
+        client->qos1_window.last_rtt_us = 0;
+        client->max_inflight_qos1 = min_window;
+    }
+}
+
+/** Halves the QoS 1 window, but not below its minimum. */
+static void __mqtt_qos1_window_decrease(struct mqtt_client *client)
+{
+    client->max_inflight_qos1 /= 2;
+    if (client->max_inflight_qos1 < client->qos1_window.min_window) {
+        client->max_inflight_qos1 = client->qos1_window.min_window;
+    }
+}
+
+void __mqtt_qos1_window_acknowledge(struct mqtt_client *client, uint16_t packet_id)
+{
+    uint64_t rtt;
+    if (!client->qos1_window.probe_active || client->qos1_window.probe_packet_id != packet_id) {
+        return;
+    }
+    client->qos1_window.probe_active = 0;
+    rtt = mqtt_pal_clock_us() - client->qos1_window.probe_sent_us;
+    client->qos1_window.last_rtt_us = rtt;
+    if (client->qos1_window.min_rtt_us == 0 || rtt < client->qos1_window.min_rtt_us) {
+        client->qos1_window.min_rtt_us = rtt;
+    }
+
+    /* a growing round trip means the window fills a queue somewhere */
+    if (rtt < 2 * client->qos1_window.min_rtt_us) {
+        if (client->max_inflight_qos1 < client->qos1_window.max_window) {
+            client->max_inflight_qos1 += 1;
+        }
+    } else {
+        __mqtt_qos1_window_decrease(client);
+    }
+}
+
+/** Returns the retransmission timeout in microseconds. */
+static uint64_t __mqtt_rto(struct mqtt_client *client)
+{
+    uint64_t max_us = (uint64_t) client->response_timeout * 1000000u;
+    if (client->rto.rto_us == 0 || client->rto.rto_us > max_us) {
+        return max_us;
+    }
+    return client->rto.rto_us;
+}
+
+/** Doubles the retransmission timeout, but not beyond response_timeout. */
+static void __mqtt_rto_backoff(struct mqtt_client *client)
+{
+    client->rto.rto_us = 2 * __mqtt_rto(client);
+    client->rto.backoff += 1;
+}
+
+/**
+ * Samples the round trip of the queued message \p msg whose ACK (or PINGRESP) arrived.
+ */
+static void __mqtt_rtt_sample(struct mqtt_client *client, size_t msg)
+{
+    uint64_t now = mqtt_pal_clock_us();
+    uint64_t rtt = now > client->mq.time_sent[msg] ? now - client->mq.time_sent[msg] : 0;
+    uint64_t deviation;
+
+    /* update response time */
+    if (client->typical_response_time < 0) {
+        client->typical_response_time = (double) rtt / 1e6;
+    } else {
+        client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * ((double) rtt / 1e6);
+    }
+
+    /* the ACK of a resent message may belong to any of its sends (Karn's rule) */
+    if (client->mq.resends[msg] > 0) {
+        return;
+    }
+    if (rtt == 0) {
+        rtt = 1;
+    }
+    if (client->rto.srtt_us == 0) {
+        client->rto.srtt_us = rtt;
+        client->rto.rttvar_us = rtt / 2;
+    } else {
+        deviation = client->rto.srtt_us > rtt ? client->rto.srtt_us - rtt : rtt - client->rto.srtt_us;
+        client->rto.rttvar_us = (3 * client->rto.rttvar_us + deviation) / 4;
+        client->rto.srtt_us = (7 * client->rto.srtt_us + rtt) / 8;
+    }
+    client->rto.rto_us = client->rto.srtt_us + 4 * client->rto.rttvar_us;
+    if (client->rto.rto_us < client->rto.min_us) {
+        client->rto.rto_us = client->rto.min_us;
+    }
+    client->rto.backoff = 0;
+}
+
+/**
+ * Forgets the topic aliases of the last connection.
+ */
+static void __mqtt_topic_aliases_reset(struct mqtt_client *client)
+{
+    uint16_t i;
+    for (i = 0; i < client->topic_aliases.number_of_outbound; ++i) {
+        client->topic_aliases.outbound[i].last_use = 0;
+        client->topic_aliases.outbound[i].topic_size = 0;
+    }
+    for (i = 0; i < client->topic_aliases.number_of_inbound; ++i) {
+        client->topic_aliases.inbound[i].last_use = 0;
+        client->topic_aliases.inbound[i].topic_size = 0;
+    }
+    client->topic_aliases.clock = 0;
+}
+
+void mqtt_set_topic_aliases(struct mqtt_client *client, 
+                            struct mqtt_topic_alias *outbound, uint16_t number_of_outbound,
+                            struct mqtt_topic_alias *inbound, uint16_t number_of_inbound)
+{
+    client->topic_aliases.outbound = outbound;
+    client->topic_aliases.number_of_outbound = outbound != NULL ? number_of_outbound : 0;
+    client->topic_aliases.inbound = inbound;
+    client->topic_aliases.number_of_inbound = inbound != NULL ? number_of_inbound : 0;
+    client->topic_aliases.bytes_saved = 0;
+    __mqtt_topic_aliases_reset(client);
+}
+
+void mqtt_set_allocator(struct mqtt_client *client, struct mqtt_allocator *allocator)
+{
+    client->allocator = allocator;
+    client->mq.allocator = allocator;
+}
+
+void mqtt_set_scratch_buffer(struct mqtt_client *client, void *buf, size_t bufsz)
+{
+    mqtt_arena_allocator_init(&client->scratch, &client->scratch_arena, buf, bufsz);
+}
+
+/**
+ * Allocates memory that is freed before the client's mutex is released, from the scratch
+ * arena if it fits and from the client's allocator otherwise.
+ */
+static void* __mqtt_scratch_alloc(struct mqtt_client *client, size_t size)
+{
+    void *ptr = NULL;
+    if (size <= client->scratch_arena.size - client->scratch_arena.used) {
+        ptr = mqtt_allocator_alloc(&client->scratch, size);
+    }
+    return ptr != NULL ? ptr : mqtt_allocator_alloc(client->allocator, size);
+}
+
+/**
+ * Frees memory from \ref __mqtt_scratch_alloc.
+ */
+static void __mqtt_scratch_free(struct mqtt_client *client, void *ptr, size_t size)
+{
+    uint8_t *mem = client->scratch_arena.mem;
+    if (mem != NULL && (uint8_t*) ptr >= mem && (uint8_t*) ptr < mem + client->scratch_arena.size) {
+        mqtt_allocator_free(&client->scratch, ptr, size);
+    } else {
+        mqtt_allocator_free(client->allocator, ptr, size);
+    }
+}
+
+void mqtt_deinit(struct mqtt_client *client)
+{
+    struct mqtt_reactor *reactor;
+    if (client->io_thread.running) {
+        mqtt_stop_io_thread(client);
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    reactor = client->reactor.reactor;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    if (reactor != NULL && reactor->group != NULL) {
+        mqtt_reactor_group_remove(reactor->group, client);
+    } else if (reactor != NULL) {
+        mqtt_reactor_remove(reactor, client);
+    }
+    if (client->recv_buffer_pool != NULL) {
+        mqtt_set_recv_buffer_pool(client, client->recv_buffer_pool);
+    } else {
+        __mqtt_recv_buffer_reset(client, client->recv_buffer.base_start, client->recv_buffer.base_size);
+    }
+    mqtt_mq_deinit(&client->mq);
+    client->publish_reservation.start = NULL;
+    client->send_buffer_above_high_watermark = 0;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    __mqtt_publish_handles_drop(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+/**
+ * Syncs the client whenever the socket is readable or a message was queued, until
+ * \ref mqtt_stop_io_thread is called.
+ */
+static void* __mqtt_io_thread(void *arg)
+{
+    struct mqtt_client *client = (struct mqtt_client*) arg;
+    while(1) {
+        enum MQTTErrors rv;
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        if (client->io_thread.stopping) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            break;
+        }
+        /* anything queued from now on signals the thread again */
+        client->io_thread.signalled = 0;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+        rv = mqtt_sync(client);
+
+        /* a broken socket is always readable, so only wait for new work until it's replaced */
+        if (mqtt_pal_wait(client->socketfd, rv == MQTT_OK, client->io_thread.wakeup, client->io_thread.max_wait_ms) != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+enum MQTTErrors mqtt_start_io_thread(struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->io_thread.running || mqtt_pal_wakeup_open(&client->io_thread.wakeup) != 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_IO_THREAD;
+    }
+    client->io_thread.running = 1;
+    client->io_thread.stopping = 0;
+    client->io_thread.signalled = 0;
+    if (mqtt_pal_thread_start(&client->io_thread.thread, __mqtt_io_thread, client) != 0) {
+        mqtt_pal_wakeup_close(client->io_thread.wakeup);
+        client->io_thread.running = 0;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_IO_THREAD;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_stop_io_thread(struct mqtt_client *client)
+{
+    mqtt_pal_thread_t thread;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (!client->io_thread.running || client->io_thread.stopping) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return;
+    }
+    client->io_thread.stopping = 1;
+    mqtt_pal_wakeup_signal(client->io_thread.wakeup);
+    thread = client->io_thread.thread;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    mqtt_pal_thread_join(thread);
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    mqtt_pal_wakeup_close(client->io_thread.wakeup);
+    client->io_thread.running = 0;
+    client->io_thread.stopping = 0;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+void __mqtt_io_thread_notify(struct mqtt_client *client)
+{
+    if (client->io_thread.running && !client->io_thread.signalled) {
+        client->io_thread.signalled = 1;
+        mqtt_pal_wakeup_signal(client->io_thread.wakeup);
+    }
+    if (client->reactor.reactor != NULL) {
+        __mqtt_reactor_notify(client);
+    }
+}
 
-    client->recv_buffer.mem_start = recvbuf;
-    client->recv_buffer.mem_size = recvbufsz;
-    client->recv_buffer.curr = client->recv_buffer.mem_start;
-    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+/**
+ * Waits until \ref __mqtt_send is done writing from the queue and the QoS 0 staging buffer,
+ * so their bytes can be moved. Called with the client's mutex held.
+ */
+static void __mqtt_wait_for_send(struct mqtt_client *client)
+{
+    while (client->sending) {
+        mqtt_pal_cond_wait(&client->send_done, &client->mutex, UINT64_MAX);
+    }
 }
 
 /** 
@@ -177,10 +745,23 @@ void mqtt_reinit(struct mqtt_client* client,
  *      1) Checks that the client isn't in an error state.
  *      2) Attempts to pack to client's message queue.
  *          a) handles errors
- *          b) if mq buffer is too small, cleans it and tries again
- *      3) Upon successful pack, registers the new message.
+ *          b) if mq buffer is too small, cleans it (once any send that is writing from it
+ *             is done) and tries again
+ *          c) if it is still too small, grows it (if allowed) and tries again
+ *      3) Upon successful pack, registers the new message (and wakes up the I/O thread).
  */
 #define MQTT_CLIENT_TRY_PACK(tmp, msg, client, pack_call, release)  \
+    MQTT_CLIENT_TRY_PACK_NO_REGISTER(tmp, client, pack_call, release) \
+    msg = mqtt_mq_register(&client->mq, tmp);                       \
+    __mqtt_check_send_buffer_watermarks(client);                    \
+    __mqtt_session_store_update(client);                            \
+    __mqtt_io_thread_notify(client);                                \
+
+
+/** 
+ * Same as MQTT_CLIENT_TRY_PACK but the packed message is not registered.
+ */
+#define MQTT_CLIENT_TRY_PACK_NO_REGISTER(tmp, client, pack_call, release) \
     if (client->error < 0) {                                        \
         if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
         return client->error;                                       \
@@ -191,8 +772,13 @@ void mqtt_reinit(struct mqtt_client* client,
         if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
         return tmp;                                                 \
     } else if (tmp == 0) {                                          \
+        __mqtt_wait_for_send(client);                               \
         mqtt_mq_clean(&client->mq);                                 \
+        __mqtt_session_store_update(client);                        \
         tmp = pack_call;                                            \
+        while (tmp == 0 && mqtt_mq_grow(&client->mq)) {             \
+            tmp = pack_call;                                        \
+        }                                                           \
         if (tmp < 0) {                                              \
             client->error = tmp;                                    \
             if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
@@ -203,9 +789,47 @@ void mqtt_reinit(struct mqtt_client* client,
             return MQTT_ERROR_SEND_BUFFER_IS_FULL;                  \
         }                                                           \
     }                                                               \
-    msg = mqtt_mq_register(&client->mq, tmp);                       \
 
 
+/**
+ * Packs the \p n bytes of already serialized packets at \p src into \p buf.
+ */
+static ssize_t __mqtt_pack_packets(uint8_t *buf, size_t bufsz, const uint8_t *src, size_t n)
+{
+    if (bufsz < n) {
+        return 0;
+    }
+    memcpy(buf, src, n);
+    return (ssize_t) n;
+}
+
+/**
+ * Moves the staged QoS 0 messages into the queue, as a single message, and empties the
+ * staging buffer.
+ */
+static enum MQTTErrors __mqtt_qos0_buffer_spill(struct mqtt_client *client)
+{
+    ssize_t rv;
+    size_t msg;
+
+    /* the staged messages may be being written */
+    __mqtt_wait_for_send(client);
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client,
+        __mqtt_pack_packets(
+            client->mq.curr, client->mq.curr_sz,
+            client->qos0_buffer.mem_start,
+            client->qos0_buffer.curr - client->qos0_buffer.mem_start
+        ),
+        0
+    );
+    (void) msg;
+
+    client->qos0_buffer.curr = client->qos0_buffer.mem_start;
+    client->qos0_buffer.curr_sz = client->qos0_buffer.mem_size;
+    return MQTT_OK;
+}
+
 enum MQTTErrors mqtt_connect(struct mqtt_client *client,
                      const char* client_id,
                      const char* will_topic,
@@ -217,10 +841,13 @@ enum MQTTErrors mqtt_connect(struct mqtt_client *client,
                      uint16_t keep_alive)
 {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* Note: Current thread already has mutex locked. */
 
+    /* the CONNECT is moved ahead of messages that may be being written */
+    __mqtt_wait_for_send(client);
+
     /* update the client's state */
     client->keep_alive = keep_alive;
     if (client->error == MQTT_ERROR_CONNECT_NOT_CALLED) {
@@ -228,41 +855,283 @@ enum MQTTErrors mqtt_connect(struct mqtt_client *client,
     }
     
     /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(rv, msg, client, 
-        mqtt_pack_connection_request(
-            client->mq.curr, client->mq.curr_sz,
-            client_id, will_topic, will_message, 
-            will_message_size,user_name, password, 
-            connect_flags, keep_alive
-        ), 
-        1
-    );
-    /* save the control type of the message */
-    msg->control_type = MQTT_CONTROL_CONNECT;
+    if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        struct mqtt_property properties[2];
+        size_t num_properties = 0;
+        uint32_t maximum_packet_size;
+
+        /* tell the broker not to send packets that can't fit into the receive buffer */
+        if (client->recv_buffer_pool != NULL) {
+            maximum_packet_size = (uint32_t) client->recv_buffer_pool->block_size;
+        } else if (client->recv_buffer.max_size > client->recv_buffer.base_size) {
+            maximum_packet_size = (uint32_t) client->recv_buffer.max_size;
+        } else {
+            maximum_packet_size = (uint32_t) client->recv_buffer.base_size;
+        }
+        if (maximum_packet_size > 0) {
+            properties[num_properties].identifier = MQTT_PROPERTY_MAXIMUM_PACKET_SIZE;
+            properties[num_properties].value.integer = maximum_packet_size;
+            ++num_properties;
+        }
+        /* and how many of its topics it may alias */
+        if (client->topic_aliases.number_of_inbound > 0) {
+            properties[num_properties].identifier = MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM;
+            properties[num_properties].value.integer = client->topic_aliases.number_of_inbound;
+            ++num_properties;
+        }
+        client->broker_limits.receive_maximum = 0;
+        client->broker_limits.maximum_packet_size = 0;
+        client->broker_limits.topic_alias_maximum = 0;
+        __mqtt_topic_aliases_reset(client);
+        MQTT_CLIENT_TRY_PACK(rv, msg, client, 
+            mqtt_pack_connection_request_v5(
+                client->mq.curr, client->mq.curr_sz,
+                client_id, will_topic, will_message, 
+                will_message_size,user_name, password, 
+                connect_flags, keep_alive,
+                properties, num_properties
+            ), 
+            1
+        );
+    } else {
+        MQTT_CLIENT_TRY_PACK(rv, msg, client, 
+            mqtt_pack_connection_request(
+                client->mq.curr, client->mq.curr_sz,
+                client_id, will_topic, will_message, 
+                will_message_size,user_name, password, 
+                connect_flags, keep_alive
+            ), 
+            1
+        );
+    }
+
+    /* the CONNECT goes ahead of messages kept from a previous connection */
+    if (msg > 0) {
+        mqtt_mq_move_to_front(&client->mq, msg);
+        __mqtt_session_store_update(client);
+    }
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_publish(struct mqtt_client *client,
-                     const char* topic_name,
-                     void* application_message,
-                     size_t application_message_size,
-                     uint8_t publish_flags)
+/**
+ * Packs a PUBLISH in the client's protocol version. A non-zero \p topic_alias (MQTT v5.0 
+ * only) is sent along with \p topic_name, which is empty for alias-only PUBLISHes.
+ */
+static ssize_t __mqtt_pack_client_publish(struct mqtt_client *client, uint8_t *buf, size_t bufsz,
+                                          const char* topic_name, uint16_t topic_alias, uint16_t packet_id,
+                                          void* application_message, size_t application_message_size,
+                                          uint8_t publish_flags)
 {
-    struct mqtt_queued_message *msg;
-    ssize_t rv;
-    uint16_t packet_id;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    packet_id = __mqtt_next_pid(client);
+    if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        struct mqtt_property property;
+        property.identifier = MQTT_PROPERTY_TOPIC_ALIAS;
+        property.value.integer = topic_alias;
+        return mqtt_pack_publish_request_v5(buf, bufsz, topic_name, packet_id, application_message, 
+                                            application_message_size, publish_flags, 
+                                            &property, topic_alias != 0 ? 1 : 0);
+    }
+    return mqtt_pack_publish_request(buf, bufsz, topic_name, packet_id, application_message, 
+                                     application_message_size, publish_flags);
+}
 
+/**
+ * Returns the size of the PUBLISH that \ref __mqtt_pack_client_publish packs.
+ */
+static size_t __mqtt_publish_packet_size(struct mqtt_client *client, const char* topic_name, 
+                                         size_t application_message_size, uint8_t publish_flags)
+{
+    size_t remaining_length = __mqtt_packed_cstrlen(topic_name) + application_message_size;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        remaining_length += 2;
+    }
+    if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        remaining_length += 1; /* no properties */
+    }
+    return 1 + __mqtt_packed_varint_size(remaining_length) + remaining_length;
+}
 
-    /* try to pack the message */
+/**
+ * Returns non-zero if a PUBLISH is larger than the broker accepts.
+ */
+static int __mqtt_publish_too_large(struct mqtt_client *client, const char* topic_name, 
+                                    size_t application_message_size, uint8_t publish_flags)
+{
+    return client->broker_limits.maximum_packet_size > 0 
+        && topic_name != NULL
+        && __mqtt_publish_packet_size(client, topic_name, application_message_size, publish_flags) > client->broker_limits.maximum_packet_size;
+}
+
+/**
+ * Returns the alias to publish \p topic_name with, or 0 if it should be sent in full. 
+ * \p alias_only is set if the broker already knows the alias.
+ * 
+ * The aliases are only updated by \ref __mqtt_topic_alias_use once the PUBLISH is packed.
+ */
+static uint16_t __mqtt_topic_alias_lookup(struct mqtt_client *client, const char* topic_name, 
+                                          uint8_t publish_flags, int *alias_only)
+{
+    struct mqtt_topic_alias *aliases = client->topic_aliases.outbound;
+    uint16_t number_of_aliases = client->topic_aliases.number_of_outbound;
+    size_t topic_size;
+    uint16_t i, victim = 0;
+
+    *alias_only = 0;
+    if (client->protocol_level != MQTT_PROTOCOL_LEVEL_5 
+        || (publish_flags & MQTT_PUBLISH_QOS_MASK) != MQTT_PUBLISH_QOS_0) 
+    {
+        return 0;
+    }
+    if (number_of_aliases > client->broker_limits.topic_alias_maximum) {
+        number_of_aliases = client->broker_limits.topic_alias_maximum;
+    }
+    topic_size = strlen(topic_name);
+    /* the Topic Alias property takes 3 bytes */
+    if (number_of_aliases == 0 || topic_size <= 3 || topic_size > MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE) {
+        return 0;
+    }
+
+    for (i = 0; i < number_of_aliases; ++i) {
+        if (aliases[i].topic_size == topic_size && memcmp(aliases[i].topic, topic_name, topic_size) == 0) {
+            *alias_only = 1;
+            return i + 1;
+        }
+        /* unmapped aliases have never been used */
+        if (aliases[i].last_use < aliases[victim].last_use) {
+            victim = i;
+        }
+    }
+    return victim + 1;
+}
+
+/**
+ * Records that a PUBLISH of \p topic_name with \p topic_alias was packed.
+ */
+static void __mqtt_topic_alias_use(struct mqtt_client *client, const char* topic_name, 
+                                   uint16_t topic_alias, int alias_only)
+{
+    struct mqtt_topic_alias *alias = &client->topic_aliases.outbound[topic_alias - 1];
+    if (alias_only) {
+        client->topic_aliases.bytes_saved += alias->topic_size - 3;
+    } else {
+        alias->topic_size = (uint16_t) strlen(topic_name);
+        memcpy(alias->topic, topic_name, alias->topic_size);
+        client->topic_aliases.bytes_saved -= 3;
+    }
+    alias->last_use = ++client->topic_aliases.clock;
+}
+
+/**
+ * Returns non-zero if a publish should go to the client's spool: the client isn't 
+ * connected (it has an error or hasn't received its CONNACK), or earlier messages are 
+ * still spooled.
+ */
+static int __mqtt_spool_accepts(struct mqtt_client *client)
+{
+    if (client->spool->length > 0) {
+        return 1;
+    }
+    if (client->error != MQTT_OK && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+        return 1;
+    }
+    return mqtt_mq_find(&client->mq, MQTT_CONTROL_CONNECT, NULL) >= 0;
+}
+
+/**
+ * Publishes a message, filling in \p handle (if it isn't \c NULL) once it is queued.
+ */
+static enum MQTTErrors __mqtt_publish(struct mqtt_client *client,
+                                      const char* topic_name,
+                                      void* application_message,
+                                      size_t application_message_size,
+                                      uint8_t publish_flags,
+                                      struct mqtt_publish_handle *handle)
+{
+    size_t msg;
+    ssize_t rv;
+    uint16_t packet_id;
+    uint16_t topic_alias;
+    int alias_only;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    if (handle != NULL) {
+        handle->client = client;
+        handle->packet_id = 0;
+        handle->state = MQTT_PUBLISH_HANDLE_UNTRACKED;
+        handle->number_of_waiters = 0;
+        handle->next = NULL;
+    }
+
+    /* spool messages while disconnected, and after that until the spool has drained */
+    if (client->spool != NULL && __mqtt_spool_accepts(client)) {
+        rv = __mqtt_spool_append(client, topic_name, application_message, application_message_size, publish_flags);
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    /* the broker would close the connection over it */
+    if (__mqtt_publish_too_large(client, topic_name, application_message_size, publish_flags)) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_PACKET_TOO_LARGE;
+    }
+
+    /* 
+    QoS 0 PUBLISHes keep their order whether they're staged or queued, so a topic's alias
+    always reaches the broker before the PUBLISHes that only carry the alias.
+    */
+    topic_alias = __mqtt_topic_alias_lookup(client, topic_name, publish_flags, &alias_only);
+
+    /* stage QoS 0 messages outside of the queue */
+    if ((publish_flags & MQTT_PUBLISH_QOS_MASK) == MQTT_PUBLISH_QOS_0 && client->qos0_buffer.mem_start != NULL) {
+        if (client->error < 0) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return client->error;
+        }
+        rv = __mqtt_pack_client_publish(
+            client, client->qos0_buffer.curr, client->qos0_buffer.curr_sz,
+            alias_only ? "" : topic_name, topic_alias, 0, 
+            application_message, application_message_size, publish_flags
+        );
+        if (rv == 0 && client->qos0_buffer.curr != client->qos0_buffer.mem_start) {
+            /* make room by moving what's staged into the queue */
+            rv = __mqtt_qos0_buffer_spill(client);
+            if (rv != MQTT_OK) {
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                return rv;
+            }
+            rv = __mqtt_pack_client_publish(
+                client, client->qos0_buffer.curr, client->qos0_buffer.curr_sz,
+                alias_only ? "" : topic_name, topic_alias, 0, 
+                application_message, application_message_size, publish_flags
+            );
+        }
+        if (rv < 0) {
+            client->error = rv;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return rv;
+        } else if (rv > 0) {
+            client->qos0_buffer.curr += rv;
+            client->qos0_buffer.curr_sz -= rv;
+            if (topic_alias != 0) {
+                __mqtt_topic_alias_use(client, topic_name, topic_alias, alias_only);
+            }
+            __mqtt_io_thread_notify(client);
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_OK;
+        }
+        /* too large to ever be staged, queue it as usual */
+    }
+
+    packet_id = __mqtt_next_pid(client);
+
+    /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_publish_request(
-            client->mq.curr, client->mq.curr_sz,
-            topic_name,
+        __mqtt_pack_client_publish(
+            client, client->mq.curr, client->mq.curr_sz,
+            alias_only ? "" : topic_name,
+            topic_alias,
             packet_id,
             application_message,
             application_message_size,
@@ -270,17 +1139,275 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
         ), 
         1
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBLISH;
-    msg->packet_id = packet_id;
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
+    if (topic_alias != 0) {
+        __mqtt_topic_alias_use(client, topic_name, topic_alias, alias_only);
+    }
+
+    /* track QoS 1 and 2 messages until they're acknowledged */
+    if (handle != NULL && client->mq.qos[msg] != 0) {
+        handle->packet_id = packet_id;
+        handle->qos = client->mq.qos[msg];
+        handle->state = MQTT_PUBLISH_HANDLE_PENDING;
+        if (client->publish_handles.tail != NULL) {
+            client->publish_handles.tail->next = handle;
+        } else {
+            client->publish_handles.head = handle;
+        }
+        client->publish_handles.tail = handle;
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_publish(struct mqtt_client *client,
+                     const char* topic_name,
+                     void* application_message,
+                     size_t application_message_size,
+                     uint8_t publish_flags)
+{
+    return __mqtt_publish(client, topic_name, application_message, application_message_size, publish_flags, NULL);
+}
+
+enum MQTTErrors mqtt_publish_with_handle(struct mqtt_client *client,
+                                         const char* topic_name,
+                                         void* application_message,
+                                         size_t application_message_size,
+                                         uint8_t publish_flags,
+                                         struct mqtt_publish_handle *handle)
+{
+    if (handle == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    return __mqtt_publish(client, topic_name, application_message, application_message_size, publish_flags, handle);
+}
+
+enum MQTTPublishHandleState mqtt_publish_handle_status(struct mqtt_publish_handle *handle)
+{
+    enum MQTTPublishHandleState state;
+    MQTT_PAL_MUTEX_LOCK(&handle->client->mutex);
+    state = (enum MQTTPublishHandleState) handle->state;
+    MQTT_PAL_MUTEX_UNLOCK(&handle->client->mutex);
+    return state;
+}
+
+enum MQTTPublishHandleState mqtt_publish_handle_wait(struct mqtt_publish_handle *handle, int timeout_ms)
+{
+    struct mqtt_client *client = handle->client;
+    uint64_t deadline_us = mqtt_pal_clock_us() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    enum MQTTPublishHandleState state;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    handle->number_of_waiters += 1;
+    while (handle->state == MQTT_PUBLISH_HANDLE_PENDING) {
+        if (mqtt_pal_cond_wait(&client->publish_handles.done, &client->mutex, deadline_us) != 0) {
+            break;
+        }
+    }
+    handle->number_of_waiters -= 1;
+    state = (enum MQTTPublishHandleState) handle->state;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return state;
+}
+
+/**
+ * Adds a delivery to the batch, timed from when the acknowledged packet \p msg was last 
+ * sent. Called with both mutexes held.
+ */
+static void __mqtt_deliveries_add(struct mqtt_client *client, size_t msg, uint16_t packet_id, uint8_t qos, void *cookie)
+{
+    struct mqtt_delivery *delivery;
+    uint64_t now = mqtt_pal_clock_us();
+    if (client->delivery_callback == NULL) {
+        return;
+    }
+    delivery = &client->deliveries.batch[client->deliveries.length++];
+    delivery->packet_id = packet_id;
+    delivery->qos = qos;
+    delivery->cookie = cookie;
+    delivery->latency_us = now > client->mq.time_sent[msg] ? now - client->mq.time_sent[msg] : 0;
+}
+
+int __mqtt_publish_handle_acknowledge(struct mqtt_client *client, size_t msg, uint16_t packet_id)
+{
+    struct mqtt_publish_handle *prev = NULL, *handle = client->publish_handles.head;
+
+    /* acks mostly arrive in publish order, so this is usually the first handle */
+    while (handle != NULL && handle->packet_id != packet_id) {
+        prev = handle;
+        handle = handle->next;
+    }
+    if (handle == NULL) {
+        return 0;
+    }
+    if (prev != NULL) {
+        prev->next = handle->next;
+    } else {
+        client->publish_handles.head = handle->next;
+    }
+    if (client->publish_handles.tail == handle) {
+        client->publish_handles.tail = prev;
+    }
+    handle->next = NULL;
+    handle->state = MQTT_PUBLISH_HANDLE_ACKNOWLEDGED;
+    /* copied, since the handle may be reused as soon as the mutex is released */
+    __mqtt_deliveries_add(client, msg, packet_id, handle->qos, handle->cookie);
+    if (handle->number_of_waiters > 0) {
+        MQTT_PAL_COND_BROADCAST(&client->publish_handles.done);
+    }
+    return 1;
+}
+
+void __mqtt_publish_handles_drop(struct mqtt_client *client)
+{
+    struct mqtt_publish_handle *handle = client->publish_handles.head;
+    int waited_for = 0;
+
+    while (handle != NULL) {
+        struct mqtt_publish_handle *next = handle->next;
+        handle->next = NULL;
+        handle->state = MQTT_PUBLISH_HANDLE_DROPPED;
+        waited_for |= handle->number_of_waiters > 0;
+        handle = next;
+    }
+    client->publish_handles.head = NULL;
+    client->publish_handles.tail = NULL;
+    if (waited_for) {
+        MQTT_PAL_COND_BROADCAST(&client->publish_handles.done);
+    }
+}
+
+enum MQTTErrors mqtt_publish_reserve(struct mqtt_client *client,
+                                     const char* topic_name,
+                                     size_t max_application_message_size,
+                                     uint8_t publish_flags,
+                                     void** application_message)
+{
+    ssize_t rv;
+    uint16_t packet_id;
+    struct mqtt_response response;
+    uint32_t remaining_length;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* the packet is reserved in the queue, where it would overtake the spooled messages */
+    if (client->spool != NULL && __mqtt_spool_accepts(client)) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_SPOOL_ACTIVE;
+    }
+    if (__mqtt_publish_too_large(client, topic_name, max_application_message_size, publish_flags)) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_PACKET_TOO_LARGE;
+    }
+
+    /* the queue is sent before the staged QoS 0 messages, which must not be overtaken */
+    if (client->qos0_buffer.curr != client->qos0_buffer.mem_start) {
+        rv = __mqtt_qos0_buffer_spill(client);
+        if (rv != MQTT_OK) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return rv;
+        }
+    }
+    packet_id = __mqtt_next_pid(client);
+
+    /* try to pack the message without its application message */
+    MQTT_CLIENT_TRY_PACK_NO_REGISTER(
+        rv, client,
+        __mqtt_pack_client_publish(
+            client, client->mq.curr, client->mq.curr_sz,
+            topic_name,
+            0,
+            packet_id,
+            NULL,
+            max_application_message_size,
+            publish_flags
+        ),
+        1
+    );
+
+    /* remember where everything is so the packet can be finalized on commit */
+    mqtt_unpack_fixed_header(&response, client->mq.curr, (size_t) rv);
+    remaining_length = response.fixed_header.remaining_length;
+    client->publish_reservation.start = client->mq.curr;
+    client->publish_reservation.fixed_header_size = (size_t) rv - remaining_length;
+    client->publish_reservation.variable_header_size = remaining_length - max_application_message_size;
+    client->publish_reservation.max_application_message_size = max_application_message_size;
+    client->publish_reservation.publish_flags = client->mq.curr[0] & 0x0F;
+    client->publish_reservation.packet_id = packet_id;
+
+    *application_message = client->mq.curr + (rv - max_application_message_size);
+
+    /* Note: the mutex is released in mqtt_publish_commit/mqtt_publish_cancel */
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_publish_commit(struct mqtt_client *client,
+                                    size_t application_message_size)
+{
+    struct mqtt_fixed_header fixed_header;
+    size_t msg;
+    uint8_t *start = client->publish_reservation.start;
+    size_t packet_size;
+    ssize_t rv;
+
+    /* Note: Current thread already has mutex locked. */
+    if (start == NULL) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    client->publish_reservation.start = NULL;
+    if (application_message_size > client->publish_reservation.max_application_message_size) {
+        /* the caller's mistake, the connection is fine and nothing was registered */
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+
+    /* 
+    The fixed header was packed for the maximum remaining length. It can only shrink, 
+    so the final fixed header is packed such that it ends where the variable header starts.
+    */
+    fixed_header.control_type = MQTT_CONTROL_PUBLISH;
+    fixed_header.control_flags = client->publish_reservation.publish_flags;
+    fixed_header.remaining_length = client->publish_reservation.variable_header_size + application_message_size;
+    packet_size = client->publish_reservation.fixed_header_size + fixed_header.remaining_length;
+    rv = mqtt_pack_fixed_header(start, packet_size, &fixed_header);
+    if (rv <= 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    if ((size_t) rv != client->publish_reservation.fixed_header_size) {
+        size_t skipped = client->publish_reservation.fixed_header_size - (size_t) rv;
+        memmove(start + skipped, start, (size_t) rv);
+
+        /* the skipped bytes are registered with the message but never sent */
+        msg = mqtt_mq_register(&client->mq, packet_size);
+        client->mq.offset[msg] += skipped;
+        client->mq.size[msg] -= skipped;
+    } else {
+        msg = mqtt_mq_register(&client->mq, packet_size);
+    }
+
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = client->publish_reservation.packet_id;
+    __mqtt_check_send_buffer_watermarks(client);
+    __mqtt_session_store_update(client);
+    __mqtt_io_thread_notify(client);
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
+void mqtt_publish_cancel(struct mqtt_client *client)
+{
+    /* Note: Current thread already has mutex locked. Nothing was registered. */
+    client->publish_reservation.start = NULL;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
 ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -292,16 +1419,15 @@ ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
         ),
         0
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBACK;
-    msg->packet_id = packet_id;
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     return MQTT_OK;
 }
 
 ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id) {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -313,16 +1439,15 @@ ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id) {
         ),
         0
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBREC;
-    msg->packet_id = packet_id;
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     return MQTT_OK;
 }
 
 ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -334,16 +1459,15 @@ ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
         ),
         0
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBREL;
-    msg->packet_id = packet_id;
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     return MQTT_OK;
 }
 
 ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -355,9 +1479,8 @@ ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
         ),
         0
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBCOMP;
-    msg->packet_id = packet_id;
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     return MQTT_OK;
 }
@@ -368,25 +1491,39 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
 {
     ssize_t rv;
     uint16_t packet_id;
-    struct mqtt_queued_message *msg;
+    size_t msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     packet_id = __mqtt_next_pid(client);
 
     /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_subscribe_request(
-            client->mq.curr, client->mq.curr_sz,
-            packet_id,
-            topic_name,
-            max_qos_level,
-            (const char*)NULL
-        ), 
-        1
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_SUBSCRIBE;
-    msg->packet_id = packet_id;
+    if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        MQTT_CLIENT_TRY_PACK(
+            rv, msg, client, 
+            mqtt_pack_subscribe_request_v5(
+                client->mq.curr, client->mq.curr_sz,
+                packet_id,
+                NULL, 0,
+                topic_name,
+                max_qos_level,
+                (const char*)NULL
+            ), 
+            1
+        );
+    } else {
+        MQTT_CLIENT_TRY_PACK(
+            rv, msg, client, 
+            mqtt_pack_subscribe_request(
+                client->mq.curr, client->mq.curr_sz,
+                packet_id,
+                topic_name,
+                max_qos_level,
+                (const char*)NULL
+            ), 
+            1
+        );
+    }
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
@@ -397,23 +1534,36 @@ enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
 {
     uint16_t packet_id = __mqtt_next_pid(client);
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
 
     /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_unsubscribe_request(
-            client->mq.curr, client->mq.curr_sz,
-            packet_id,
-            topic_name,
-            (const char*)NULL
-        ), 
-        1
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_UNSUBSCRIBE;
-    msg->packet_id = packet_id;
+    if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        MQTT_CLIENT_TRY_PACK(
+            rv, msg, client, 
+            mqtt_pack_unsubscribe_request_v5(
+                client->mq.curr, client->mq.curr_sz,
+                packet_id,
+                NULL, 0,
+                topic_name,
+                (const char*)NULL
+            ), 
+            1
+        );
+    } else {
+        MQTT_CLIENT_TRY_PACK(
+            rv, msg, client, 
+            mqtt_pack_unsubscribe_request(
+                client->mq.curr, client->mq.curr_sz,
+                packet_id,
+                topic_name,
+                (const char*)NULL
+            ), 
+            1
+        );
+    }
+    /* save the packet id of the message */
+    client->mq.packet_id[msg] = packet_id;
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
@@ -430,7 +1580,7 @@ enum MQTTErrors mqtt_ping(struct mqtt_client *client) {
 enum MQTTErrors __mqtt_ping(struct mqtt_client *client) 
 {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -440,9 +1590,7 @@ enum MQTTErrors __mqtt_ping(struct mqtt_client *client)
         ),
         0
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PINGREQ;
-
+    (void) msg;
     
     return MQTT_OK;
 }
@@ -450,7 +1598,7 @@ enum MQTTErrors __mqtt_ping(struct mqtt_client *client)
 enum MQTTErrors mqtt_disconnect(struct mqtt_client *client) 
 {
     ssize_t rv;
-    struct mqtt_queued_message *msg;
+    size_t msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
 
     /* try to pack the message */
@@ -461,53 +1609,162 @@ enum MQTTErrors mqtt_disconnect(struct mqtt_client *client)
         ), 
         1
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_DISCONNECT;
+    (void) msg;
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
+/**
+ * Returns when the broker is considered dead if the PINGREQ at \p ping stays unanswered, 
+ * in \ref mqtt_pal_clock_us time. Anything received from the broker since it was sent 
+ * restarts the wait.
+ */
+static uint64_t __mqtt_keep_alive_deadline(struct mqtt_client *client, size_t ping)
+{
+    uint64_t since = client->mq.time_sent[ping];
+    if (client->time_of_last_recv_us > since) {
+        since = client->time_of_last_recv_us;
+    }
+    return since + (uint64_t) (client->keep_alive_response_fraction * client->keep_alive * 1e6);
+}
+
+/**
+ * Ends the part of \ref __mqtt_send that writes without holding the client's mutex, and 
+ * wakes up the producers waiting for it. Called with the client's mutex held.
+ */
+static void __mqtt_send_done(struct mqtt_client *client)
+{
+    client->sending = 0;
+    MQTT_PAL_COND_BROADCAST(&client->send_done);
+}
+
 ssize_t __mqtt_send(struct mqtt_client *client) 
 {
     uint8_t inspected;
     ssize_t len;
+    int inflight_qos1 = 0;
     int inflight_qos2 = 0;
+    int timed_out = 0;
+    uint64_t now_us, rto_us;
+    enum MQTTErrors spool_error = MQTT_OK;
     int i = 0;
     
+    MQTT_PAL_MUTEX_LOCK(&client->io_mutex);
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* nothing allocated from the scratch arena is still in use */
+    mqtt_arena_reset(&client->scratch);
     
     if (client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
         return client->error;
     }
 
-    /* loop through all messages in the queue */
+    /* move spooled messages into the queue once connected */
+    if (client->spool != NULL && client->spool->length > 0 && mqtt_mq_find(&client->mq, MQTT_CONTROL_CONNECT, NULL) < 0) {
+        /* the connection is fine, so this isn't a client error and the queue is still sent */
+        spool_error = __mqtt_spool_drain(client);
+    }
+
+    /* make what is about to be sent durable first */
+    if (client->session_store != NULL && client->session_store->dirty) {
+        enum MQTTErrors rv = __mqtt_session_store_commit(client);
+        if (rv != MQTT_OK) {
+            client->error = rv;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+            return rv;
+        }
+    }
+
+    /* count the exchanges that are in flight, QoS 2 ones last until PUBCOMP */
     len = mqtt_mq_length(&client->mq);
-    for(; i < len; ++i) {
-        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_message_queue *mq = &client->mq;
+        if (mq->control_type[i] == MQTT_CONTROL_PUBLISH && mq->state[i] == MQTT_QUEUED_AWAITING_ACK) {
+            if (mq->qos[i] == 1) {
+                ++inflight_qos1;
+            } else if (mq->qos[i] == 2) {
+                ++inflight_qos2;
+            }
+        } else if (mq->control_type[i] == MQTT_CONTROL_PUBREL && mq->state[i] != MQTT_QUEUED_COMPLETE) {
+            ++inflight_qos2;
+        }
+    }
+
+    /* 
+    Write without holding the client's mutex, so producers only wait for it while they 
+    queue. They may append messages meanwhile, but don't move the queue until sending 
+    is cleared (see __mqtt_wait_for_send).
+    */
+    client->sending = 1;
+
+    /* loop through all messages in the queue */
+    now_us = mqtt_pal_clock_us();
+    rto_us = __mqtt_rto(client);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_message_queue *mq = &client->mq;
         int resend = 0;
-        if (msg->state == MQTT_QUEUED_UNSENT) {
+        if (mq->state[i] == MQTT_QUEUED_UNSENT) {
             /* message has not been sent to lets send it */
             resend = 1;
-        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+        } else if (mq->state[i] == MQTT_QUEUED_AWAITING_ACK) {
             /* check for timeout */
-            if (MQTT_PAL_TIME() > msg->time_sent + client->response_timeout) {
-                resend = 1;
+            if (mq->control_type[i] == MQTT_CONTROL_PINGREQ && client->keep_alive_response_fraction > 0) {
+                /* an unanswered PINGREQ means the broker is dead, see the keep-alive check */
+            } else if (now_us > mq->time_sent[i] + rto_us && !(client->resend_only_on_reconnect && mq->resends[i] > 0)) {
                 client->number_of_timeouts += 1;
+                if (mq->resends[i] < UINT8_MAX) {
+                    mq->resends[i] += 1;
+                }
+                if (client->resend_only_on_reconnect) {
+                    /* TCP delivers it or the connection breaks, a duplicate would only add load */
+                    client->number_of_resends_avoided += 1;
+                } else {
+                    resend = 1;
+                    timed_out = 1;
+                    if (mq->control_type[i] == MQTT_CONTROL_PUBLISH) {
+                        mqtt_mq_start(mq, i)[0] |= MQTT_PUBLISH_DUP;
+                    }
+                }
+                /* a lost QoS 1 PUBLISH shrinks the window, and a resent one can't be timed */
+                if (client->qos1_window.enabled && mq->control_type[i] == MQTT_CONTROL_PUBLISH && mq->qos[i] == 1) {
+                    __mqtt_qos1_window_decrease(client);
+                    if (client->qos1_window.probe_packet_id == mq->packet_id[i]) {
+                        client->qos1_window.probe_active = 0;
+                    }
+                }
             }
         }
 
-        /* only send QoS 2 message if there are no inflight QoS 2 PUBLISH messages */
-        if (msg->control_type == MQTT_CONTROL_PUBLISH
-            && (msg->state == MQTT_QUEUED_UNSENT || msg->state == MQTT_QUEUED_AWAITING_ACK)) 
-        {
-            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
-            if (inspected == 2) {
-                if (inflight_qos2) {
+        /* only start a QoS 1 or QoS 2 PUBLISH if its window has room */
+        if (mq->control_type[i] == MQTT_CONTROL_PUBLISH && mq->state[i] == MQTT_QUEUED_UNSENT) {
+            inspected = mq->qos[i];
+            if (inspected != 0 && client->broker_limits.receive_maximum > 0
+                && inflight_qos1 + inflight_qos2 >= client->broker_limits.receive_maximum)
+            {
+                /* the broker's receive maximum is shared by both QoS levels */
+                resend = 0;
+            } else if (inspected == 1) {
+                if (client->max_inflight_qos1 > 0 && inflight_qos1 >= client->max_inflight_qos1) {
+                    resend = 0;
+                } else {
+                    ++inflight_qos1;
+                    /* time one PUBLISH per round trip */
+                    if (client->qos1_window.enabled && !client->qos1_window.probe_active) {
+                        client->qos1_window.probe_active = 1;
+                        client->qos1_window.probe_packet_id = mq->packet_id[i];
+                        client->qos1_window.probe_sent_us = mqtt_pal_clock_us();
+                    }
+                }
+            } else if (inspected == 2) {
+                if (client->max_inflight_qos2 > 0 && inflight_qos2 >= client->max_inflight_qos2) {
                     resend = 0;
+                } else {
+                    ++inflight_qos2;
                 }
-                inflight_qos2 = 1;
             }
         }
 
@@ -518,17 +1775,24 @@ ssize_t __mqtt_send(struct mqtt_client *client)
 
         /* we're sending the message */
         {
-          ssize_t tmp = mqtt_pal_sendall(client->socketfd, msg->start, msg->size, 0);
+          uint8_t *start = mqtt_mq_start(mq, i);
+          size_t size = mq->size[i];
+          ssize_t tmp;
+          MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+          tmp = mqtt_pal_sendall(client->socketfd, start, size, 0);
+          MQTT_PAL_MUTEX_LOCK(&client->mutex);
           if (tmp < 0) {
             client->error = tmp;
+            __mqtt_send_done(client);
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
             return tmp;
           }
         }
 
         /* update timeout watcher */
         client->time_of_last_send = MQTT_PAL_TIME();
-        msg->time_sent = client->time_of_last_send;
+        mq->time_sent[i] = mqtt_pal_clock_us();
 
         /* 
         Determine the state to put the message in.
@@ -548,22 +1812,18 @@ ssize_t __mqtt_send(struct mqtt_client *client)
         MQTT_CONTROL_PINGRESP    -> n/a
         MQTT_CONTROL_DISCONNECT  -> complete
         */
-        switch (msg->control_type) {
+        switch (mq->control_type[i]) {
         case MQTT_CONTROL_PUBACK:
         case MQTT_CONTROL_PUBCOMP:
         case MQTT_CONTROL_DISCONNECT:
-            msg->state = MQTT_QUEUED_COMPLETE;
+            mq->state[i] = MQTT_QUEUED_COMPLETE;
             break;
         case MQTT_CONTROL_PUBLISH:
-            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
+            inspected = mq->qos[i];
             if (inspected == 0) {
-                msg->state = MQTT_QUEUED_COMPLETE;
-            } else if (inspected == 1) {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-                /*set DUP flag for subsequent sends */ 
-                msg->start[1] |= MQTT_PUBLISH_DUP;
+                mq->state[i] = MQTT_QUEUED_COMPLETE;
             } else {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
+                mq->state[i] = MQTT_QUEUED_AWAITING_ACK;
             }
             break;
         case MQTT_CONTROL_CONNECT:
@@ -572,72 +1832,277 @@ ssize_t __mqtt_send(struct mqtt_client *client)
         case MQTT_CONTROL_SUBSCRIBE:
         case MQTT_CONTROL_UNSUBSCRIBE:
         case MQTT_CONTROL_PINGREQ:
-            msg->state = MQTT_QUEUED_AWAITING_ACK;
+            mq->state[i] = MQTT_QUEUED_AWAITING_ACK;
             break;
         default:
             client->error = MQTT_ERROR_MALFORMED_REQUEST;
+            __mqtt_send_done(client);
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
             return MQTT_ERROR_MALFORMED_REQUEST;
         }
     }
 
-    /* check for keep-alive */
+    /* back off once per pass however many messages timed out, like a single TCP timer */
+    if (timed_out) {
+        __mqtt_rto_backoff(client);
+    }
+
+    /* flush the staged QoS 0 messages (after the queue, which holds the CONNECT) */
+    if (client->qos0_buffer.curr != client->qos0_buffer.mem_start) {
+        size_t staged = client->qos0_buffer.curr - client->qos0_buffer.mem_start;
+        ssize_t tmp;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        tmp = mqtt_pal_sendall(client->socketfd, client->qos0_buffer.mem_start, staged, 0);
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        if (tmp < 0) {
+            client->error = tmp;
+            __mqtt_send_done(client);
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+            return tmp;
+        }
+        client->time_of_last_send = MQTT_PAL_TIME();
+        /* keep what was staged while the socket was written */
+        memmove(client->qos0_buffer.mem_start, client->qos0_buffer.mem_start + staged, 
+                client->qos0_buffer.curr - client->qos0_buffer.mem_start - staged);
+        client->qos0_buffer.curr -= staged;
+        client->qos0_buffer.curr_sz += staged;
+    }
+
+    /* send whatever the PAL queued rather than sent, which may still point into the queue */
     {
-        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive) * 0.75);
-        if (MQTT_PAL_TIME() > keep_alive_timeout) {
-          ssize_t rv = __mqtt_ping(client);
-          if (rv != MQTT_OK) {
-            client->error = rv;
+        ssize_t tmp;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        tmp = MQTT_PAL_FLUSH(client->socketfd);
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        __mqtt_send_done(client);
+        if (tmp < 0) {
+            client->error = tmp;
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return rv;
-          }
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+            return tmp;
         }
     }
 
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+    /* reclaim what was acknowledged so a grown queue can shrink and watermarks can fall */
+    if (client->mq.mem_start != client->mq.base_start || client->send_buffer_above_high_watermark) {
+        mqtt_mq_clean(&client->mq);
+        __mqtt_check_send_buffer_watermarks(client);
+        __mqtt_session_store_update(client);
+    }
+
+    /* check for keep-alive, a keep_alive of 0 turns it off */
+    if (client->keep_alive > 0) {
+        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive) * 0.75);
+        ssize_t ping = mqtt_mq_find(&client->mq, MQTT_CONTROL_PINGREQ, NULL);
+        if (ping >= 0) {
+            /* one PINGREQ at a time, and a dead broker once it goes unanswered */
+            if (client->mq.state[ping] == MQTT_QUEUED_AWAITING_ACK 
+                && client->keep_alive_response_fraction > 0
+                && mqtt_pal_clock_us() > __mqtt_keep_alive_deadline(client, (size_t) ping))
+            {
+                client->error = MQTT_ERROR_KEEP_ALIVE_TIMEOUT;
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+                return MQTT_ERROR_KEEP_ALIVE_TIMEOUT;
+            }
+        } else if (MQTT_PAL_TIME() > keep_alive_timeout) {
+          ssize_t rv = __mqtt_ping(client);
+          if (rv != MQTT_OK) {
+            client->error = rv;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+            return rv;
+          }
+        }
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+    return spool_error;
+}
+
+/**
+ * Passes the collected deliveries to the delivery callback. Called with only io_mutex held.
+ */
+static void __mqtt_deliveries_flush(struct mqtt_client *client)
+{
+    if (client->deliveries.length > 0 && client->delivery_callback != NULL) {
+        client->delivery_callback(&client->delivery_callback_state, client->deliveries.batch, client->deliveries.length);
+    }
+    client->deliveries.length = 0;
+}
+
+/**
+ * Passes on the collected deliveries and releases the I/O mutex. Every return of
+ * \ref __mqtt_recv goes through here, so no acknowledgement is left unreported.
+ */
+static ssize_t __mqtt_recv_exit(struct mqtt_client *client, ssize_t rv)
+{
+    __mqtt_deliveries_flush(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->io_mutex);
+    return rv;
+}
+
+/**
+ * Records \p error as the client's error and leaves \ref __mqtt_recv, which doesn't hold
+ * the client's mutex while reading.
+ */
+static ssize_t __mqtt_recv_error(struct mqtt_client *client, ssize_t error)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->error = (enum MQTTErrors) error;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return __mqtt_recv_exit(client, error);
+}
+
+/**
+ * Maps the topic alias of a received PUBLISH (MQTT v5.0) to its topic, and remembers the
+ * topic when the PUBLISH carries both. A topic too long to remember unmaps the alias.
+ */
+static enum MQTTErrors __mqtt_topic_alias_resolve(struct mqtt_client *client, struct mqtt_response_publish *publish)
+{
+    struct mqtt_property property;
+    struct mqtt_topic_alias *alias;
+
+    if (!mqtt_properties_find(&publish->properties, MQTT_PROPERTY_TOPIC_ALIAS, &property)) {
+        return publish->topic_name_size > 0 ? MQTT_OK : MQTT_ERROR_TOPIC_ALIAS_INVALID;
+    }
+    if (property.value.integer == 0 || property.value.integer > client->topic_aliases.number_of_inbound) {
+        return MQTT_ERROR_TOPIC_ALIAS_INVALID;
+    }
+    alias = &client->topic_aliases.inbound[property.value.integer - 1];
+    if (publish->topic_name_size > MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE) {
+        /* too long to keep, only PUBLISHes that rely on the alias fail */
+        alias->topic_size = 0;
+    } else if (publish->topic_name_size > 0) {
+        memcpy(alias->topic, publish->topic_name, publish->topic_name_size);
+        alias->topic_size = publish->topic_name_size;
+    } else if (alias->topic_size == 0) {
+        return MQTT_ERROR_TOPIC_ALIAS_INVALID;
+    } else {
+        publish->topic_name = alias->topic;
+        publish->topic_name_size = alias->topic_size;
+    }
+    return MQTT_OK;
+}
+
+/**
+ * Applies the limits a MQTT 5.0 broker sent in its CONNACK.
+ */
+static void __mqtt_apply_connack_properties(struct mqtt_client *client, const struct mqtt_properties *properties)
+{
+    struct mqtt_property property;
+
+    if (mqtt_properties_find(properties, MQTT_PROPERTY_RECEIVE_MAXIMUM, &property)) {
+        client->broker_limits.receive_maximum = (uint16_t) property.value.integer;
+        if (client->qos1_window.enabled && client->qos1_window.max_window > (int) property.value.integer) {
+            client->qos1_window.max_window = (int) property.value.integer;
+            if (client->qos1_window.min_window > client->qos1_window.max_window) {
+                client->qos1_window.min_window = client->qos1_window.max_window;
+            }
+            if (client->max_inflight_qos1 > client->qos1_window.max_window) {
+                client->max_inflight_qos1 = client->qos1_window.max_window;
+            }
+        }
+    }
+    if (mqtt_properties_find(properties, MQTT_PROPERTY_MAXIMUM_PACKET_SIZE, &property)) {
+        client->broker_limits.maximum_packet_size = property.value.integer;
+    }
+    if (mqtt_properties_find(properties, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, &property)) {
+        client->broker_limits.topic_alias_maximum = (uint16_t) property.value.integer;
+    }
+    if (mqtt_properties_find(properties, MQTT_PROPERTY_SERVER_KEEP_ALIVE, &property)) {
+        client->keep_alive = (uint16_t) property.value.integer;
+    }
 }
 
 ssize_t __mqtt_recv(struct mqtt_client *client) 
 {
     struct mqtt_response response;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    MQTT_PAL_MUTEX_LOCK(&client->io_mutex);
 
     /* read until there is nothing left to read */
     while(1) {
         /* read in as many bytes as possible */
         ssize_t rv, consumed;
-        struct mqtt_queued_message *msg = NULL;
+        ssize_t msg = -1;
+        int deliver = 0;
+
+        /* borrow a buffer from the pool */
+        if (client->recv_buffer_pool != NULL && client->recv_buffer.mem_start == NULL) {
+            uint8_t *block = mqtt_recv_buffer_pool_acquire(client->recv_buffer_pool);
+            if (block == NULL) {
+                /* try again next time */
+                return __mqtt_recv_exit(client, MQTT_OK);
+            }
+            client->recv_buffer.mem_start = block;
+            client->recv_buffer.mem_size = client->recv_buffer_pool->block_size;
+            client->recv_buffer.curr = block;
+            client->recv_buffer.curr_sz = client->recv_buffer_pool->block_size;
+        }
 
         rv = mqtt_pal_recvall(client->socketfd, client->recv_buffer.curr, client->recv_buffer.curr_sz, 0);
         if (rv < 0) {
             /* an error occurred */
-            client->error = rv;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return rv;
+            return __mqtt_recv_error(client, rv);
         } else {
             client->recv_buffer.curr += rv;
             client->recv_buffer.curr_sz -= rv;
+            if (rv > 0) {
+                client->recv_buffer.time_of_last_use = MQTT_PAL_TIME();
+                MQTT_PAL_MUTEX_LOCK(&client->mutex); /* read by the reactor under the mutex alone */
+                client->time_of_last_recv_us = mqtt_pal_clock_us();
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            }
         }
 
         /* attempt to parse */
-        consumed = mqtt_unpack_response(&response, client->recv_buffer.mem_start, client->recv_buffer.curr - client->recv_buffer.mem_start);
+        if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+            consumed = mqtt_unpack_response_v5(&response, client->recv_buffer.mem_start, client->recv_buffer.curr - client->recv_buffer.mem_start);
+        } else {
+            consumed = mqtt_unpack_response(&response, client->recv_buffer.mem_start, client->recv_buffer.curr - client->recv_buffer.mem_start);
+        }
 
         if (consumed < 0) {
-            client->error = consumed;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return consumed;
+            return __mqtt_recv_error(client, consumed);
         } else if (consumed == 0) {
+            /* make room for the packet if the buffer may grow */
+            if (client->recv_buffer_pool == NULL && client->recv_buffer.max_size > client->recv_buffer.mem_size) {
+                MQTT_PAL_MUTEX_LOCK(&client->mutex); /* for the allocator */
+                rv = __mqtt_recv_buffer_grow(client);
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                if (rv < 0) {
+                    return __mqtt_recv_error(client, rv);
+                } else if (rv > 0) {
+                    /* read the rest of the packet into the bigger buffer */
+                    continue;
+                }
+            }
+
             /* if curr_sz is 0 then the buffer is too small to ever fit the message */
             if (client->recv_buffer.curr_sz == 0) {
-                client->error = MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
+                return __mqtt_recv_error(client, MQTT_ERROR_RECV_BUFFER_TOO_SMALL);
+            }
+
+            /* give the buffer back to the pool unless part of a packet is in it */
+            if (client->recv_buffer_pool != NULL && client->recv_buffer.curr == client->recv_buffer.mem_start) {
+                mqtt_set_recv_buffer_pool(client, client->recv_buffer_pool);
+            }
+
+            /* release a grown buffer once the connection has been quiet for a while */
+            if (client->recv_buffer.mem_start != client->recv_buffer.base_start
+                && client->recv_buffer_pool == NULL
+                && MQTT_PAL_TIME() >= client->recv_buffer.time_of_last_use + client->recv_buffer.idle_trim_time)
+            {
+                MQTT_PAL_MUTEX_LOCK(&client->mutex); /* for the allocator */
+                __mqtt_recv_buffer_trim(client);
                 MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                return MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
             }
 
             /* just need to wait for the rest of the data */
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return MQTT_OK;
+            return __mqtt_recv_exit(client, MQTT_OK);
         }
 
         /* response was unpacked successfully */
@@ -669,163 +2134,188 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             -> release UNSUBSCRIBE
         MQTT_CONTROL_PINGRESP:
             -> release PINGREQ
+        MQTT_CONTROL_DISCONNECT (MQTT 5.0 only):
+            -> close the connection
+
+        Only the bookkeeping below needs the client's mutex, the socket and the receive
+        buffer are protected by io_mutex.
         */
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
         switch (response.fixed_header.control_type) {
             case MQTT_CONTROL_CONNACK:
                 /* release associated CONNECT */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_CONNECT, NULL);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* initialize typical response time */
-                client->typical_response_time = (double) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time = -1.0;
+                __mqtt_rtt_sample(client, msg);
                 /* check that connection was successful */
                 if (response.decoded.connack.return_code != MQTT_CONNACK_ACCEPTED) {
-                    client->error = MQTT_ERROR_CONNECTION_REFUSED;
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_CONNECTION_REFUSED;
+                    return __mqtt_recv_error(client, MQTT_ERROR_CONNECTION_REFUSED);
+                }
+                if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+                    __mqtt_apply_connack_properties(client, &response.decoded.connack.properties);
                 }
                 break;
             case MQTT_CONTROL_PUBLISH:
+                /* give the callback the full topic */
+                if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5 && __mqtt_topic_alias_resolve(client, &response.decoded.publish) != MQTT_OK) {
+                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                    return __mqtt_recv_error(client, MQTT_ERROR_TOPIC_ALIAS_INVALID);
+                }
                 /* stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2 */
                 if (response.decoded.publish.qos_level == 1) {
                     rv = __mqtt_puback(client, response.decoded.publish.packet_id);
                     if (rv != MQTT_OK) {
-                        client->error = rv;
                         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                        return rv;
+                        return __mqtt_recv_error(client, rv);
                     }
                 } else if (response.decoded.publish.qos_level == 2) {
                     /* check if this is a duplicate */
-                    if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.publish.packet_id) != NULL) {
+                    if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.publish.packet_id) >= 0) {
                         break;
                     }
 
                     rv = __mqtt_pubrec(client, response.decoded.publish.packet_id);
                     if (rv != MQTT_OK) {
-                        client->error = rv;
                         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                        return rv;
+                        return __mqtt_recv_error(client, rv);
                     }
                 }
-                /* call publish callback */
-                client->publish_response_callback(&client->publish_response_callback_state, &response.decoded.publish);
+                /* call publish callback (once the mutex is released) */
+                deliver = 1;
                 break;
             case MQTT_CONTROL_PUBACK:
                 /* release associated PUBLISH */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.puback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
+                /* complete its handle, or report it without one */
+                if (client->publish_handles.head == NULL || !__mqtt_publish_handle_acknowledge(client, (size_t) msg, response.decoded.puback.packet_id)) {
+                    __mqtt_deliveries_add(client, (size_t) msg, response.decoded.puback.packet_id, 1, NULL);
+                }
+                if (client->qos1_window.enabled) {
+                    __mqtt_qos1_window_acknowledge(client, response.decoded.puback.packet_id);
+                }
                 break;
             case MQTT_CONTROL_PUBREC:
                 /* check if this is a duplicate */
-                if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubrec.packet_id) != NULL) {
+                if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubrec.packet_id) >= 0) {
                     break;
                 }
                 /* release associated PUBLISH */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.pubrec.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
                 /* stage PUBREL */
                 rv = __mqtt_pubrel(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
-                    client->error = rv;
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return rv;
+                    return __mqtt_recv_error(client, rv);
                 }
                 break;
             case MQTT_CONTROL_PUBREL:
                 /* release associated PUBREC */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.pubrel.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
                 /* stage PUBCOMP */
                 rv = __mqtt_pubcomp(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
-                    client->error = rv;
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return rv;
+                    return __mqtt_recv_error(client, rv);
                 }
                 break;
             case MQTT_CONTROL_PUBCOMP:
                 /* release associated PUBREL */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubcomp.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
+                /* complete the PUBLISH's handle, or report it without one */
+                if (client->publish_handles.head == NULL || !__mqtt_publish_handle_acknowledge(client, (size_t) msg, response.decoded.pubcomp.packet_id)) {
+                    __mqtt_deliveries_add(client, (size_t) msg, response.decoded.pubcomp.packet_id, 2, NULL);
+                }
                 break;
             case MQTT_CONTROL_SUBACK:
                 /* release associated SUBSCRIBE */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_SUBSCRIBE, &response.decoded.suback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
                 /* check that subscription was successful (not currently only one subscribe at a time) */
-                if (response.decoded.suback.return_codes[0] == MQTT_SUBACK_FAILURE) {
-                    client->error = MQTT_ERROR_SUBSCRIBE_FAILED;
+                if (response.decoded.suback.return_codes[0] >= MQTT_SUBACK_FAILURE) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_SUBSCRIBE_FAILED;
+                    return __mqtt_recv_error(client, MQTT_ERROR_SUBSCRIBE_FAILED);
                 }
                 break;
             case MQTT_CONTROL_UNSUBACK:
                 /* release associated UNSUBSCRIBE */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_UNSUBSCRIBE, &response.decoded.unsuback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
                 break;
             case MQTT_CONTROL_PINGRESP:
                 /* release associated PINGREQ */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PINGREQ, NULL);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (msg < 0) {
                     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                    return __mqtt_recv_error(client, MQTT_ERROR_ACK_OF_UNKNOWN);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
+                client->mq.state[msg] = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_rtt_sample(client, msg);
                 break;
+            case MQTT_CONTROL_DISCONNECT:
+                /* the broker is closing the connection */
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                return __mqtt_recv_error(client, MQTT_ERROR_CONNECTION_CLOSED);
             default:
-                client->error = MQTT_ERROR_MALFORMED_RESPONSE;
                 MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                return MQTT_ERROR_MALFORMED_RESPONSE;
+                return __mqtt_recv_error(client, MQTT_ERROR_MALFORMED_RESPONSE);
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+        /* publishers can carry on while the application handles the message */
+        if (deliver) {
+            client->publish_response_callback(&client->publish_response_callback_state, &response.decoded.publish);
+        }
+        /* at most one delivery is added per packet, so there's always room for the next */
+        if (client->deliveries.length == MQTT_DELIVERY_BATCH_SIZE) {
+            __mqtt_deliveries_flush(client);
         }
         {
           /* we've handled the response, now clean the buffer */
@@ -839,8 +2329,7 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
     }
 
     /* never hit (always return once there's nothing left. */
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+    return __mqtt_recv_exit(client, MQTT_OK);
 }
 
 /* FIXED HEADER */
@@ -1045,21 +2534,287 @@ ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fix
     return buf - start;
 }
 
+/* PROPERTIES */
+
+#define MQTT_PROPERTY_TYPE_BYTE 1
+#define MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER 2
+#define MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER 3
+#define MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER 4
+#define MQTT_PROPERTY_TYPE_BINARY 5
+#define MQTT_PROPERTY_TYPE_PAIR 6
+
+/* the type of each property identifier, 0 if it isn't one (strings are binary data here) */
+static const uint8_t mqtt_property_types[0x2B] = {
+    0,                                          /* 0x00 */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_PAYLOAD_FORMAT_INDICATOR */
+    MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER,       /* MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_CONTENT_TYPE */
+    0, 0, 0, 0,                                 /* 0x04 - 0x07 */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_RESPONSE_TOPIC */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_CORRELATION_DATA */
+    0,                                          /* 0x0A */
+    MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER,   /* MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER */
+    0, 0, 0, 0, 0,                              /* 0x0C - 0x10 */
+    MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER,       /* MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER */
+    MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER,        /* MQTT_PROPERTY_SERVER_KEEP_ALIVE */
+    0,                                          /* 0x14 */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_AUTHENTICATION_METHOD */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_AUTHENTICATION_DATA */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_REQUEST_PROBLEM_INFORMATION */
+    MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER,       /* MQTT_PROPERTY_WILL_DELAY_INTERVAL */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_REQUEST_RESPONSE_INFORMATION */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_RESPONSE_INFORMATION */
+    0,                                          /* 0x1B */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_SERVER_REFERENCE */
+    0, 0,                                       /* 0x1D - 0x1E */
+    MQTT_PROPERTY_TYPE_BINARY,                  /* MQTT_PROPERTY_REASON_STRING */
+    0,                                          /* 0x20 */
+    MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER,        /* MQTT_PROPERTY_RECEIVE_MAXIMUM */
+    MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER,        /* MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM */
+    MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER,        /* MQTT_PROPERTY_TOPIC_ALIAS */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_MAXIMUM_QOS */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_RETAIN_AVAILABLE */
+    MQTT_PROPERTY_TYPE_PAIR,                    /* MQTT_PROPERTY_USER_PROPERTY */
+    MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER,       /* MQTT_PROPERTY_MAXIMUM_PACKET_SIZE */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE */
+    MQTT_PROPERTY_TYPE_BYTE,                    /* MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE */
+    MQTT_PROPERTY_TYPE_BYTE                     /* MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE */
+};
+
+#define mqtt_property_type(identifier) ((identifier) < sizeof(mqtt_property_types) ? mqtt_property_types[identifier] : 0)
+
+/**
+ * Returns the number of bytes \p property is packed in (identifier included), or 
+ * MQTT_ERROR_MALFORMED_PROPERTIES if its identifier is unknown.
+ */
+static ssize_t __mqtt_property_size(const struct mqtt_property *property)
+{
+    switch (mqtt_property_type(property->identifier)) {
+        case MQTT_PROPERTY_TYPE_BYTE:
+            return 2;
+        case MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER:
+            return 3;
+        case MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER:
+            return 5;
+        case MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+            return 1 + __mqtt_packed_varint_size(property->value.integer);
+        case MQTT_PROPERTY_TYPE_BINARY:
+            return 3 + property->value.binary.size;
+        case MQTT_PROPERTY_TYPE_PAIR:
+            return 5 + property->value.pair.name_size + property->value.pair.value_size;
+        default:
+            return MQTT_ERROR_MALFORMED_PROPERTIES;
+    }
+}
+
+/** Returns the number of bytes of \p properties, without the property length. */
+static ssize_t __mqtt_properties_length(const struct mqtt_property *properties, size_t num_properties)
+{
+    size_t length = 0;
+    size_t i;
+    for (i = 0; i < num_properties; ++i) {
+        ssize_t rv = __mqtt_property_size(&properties[i]);
+        if (rv < 0) {
+            return rv;
+        }
+        length += (size_t) rv;
+    }
+    return (ssize_t) length;
+}
+
+ssize_t mqtt_properties_size(const struct mqtt_property *properties, size_t num_properties)
+{
+    ssize_t length = __mqtt_properties_length(properties, num_properties);
+    if (length < 0) {
+        return length;
+    }
+    return __mqtt_packed_varint_size((size_t) length) + length;
+}
+
+ssize_t mqtt_pack_properties(uint8_t *buf, size_t bufsz, const struct mqtt_property *properties, size_t num_properties)
+{
+    const uint8_t *const start = buf;
+    ssize_t length = __mqtt_properties_length(properties, num_properties);
+    size_t i;
+    if (buf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (length < 0) {
+        return length;
+    }
+    if (bufsz < (size_t) (__mqtt_packed_varint_size((size_t) length) + length)) {
+        return 0;
+    }
+
+    buf += __mqtt_pack_varint(buf, (uint32_t) length);
+    for (i = 0; i < num_properties; ++i) {
+        const struct mqtt_property *property = &properties[i];
+        *buf++ = property->identifier;
+        switch (mqtt_property_type(property->identifier)) {
+            case MQTT_PROPERTY_TYPE_BYTE:
+                *buf++ = (uint8_t) property->value.integer;
+                break;
+            case MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER:
+                buf += __mqtt_pack_uint16(buf, (uint16_t) property->value.integer);
+                break;
+            case MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER:
+                buf += __mqtt_pack_uint16(buf, (uint16_t) (property->value.integer >> 16));
+                buf += __mqtt_pack_uint16(buf, (uint16_t) property->value.integer);
+                break;
+            case MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+                buf += __mqtt_pack_varint(buf, property->value.integer);
+                break;
+            case MQTT_PROPERTY_TYPE_BINARY:
+                buf += __mqtt_pack_uint16(buf, property->value.binary.size);
+                memcpy(buf, property->value.binary.data, property->value.binary.size);
+                buf += property->value.binary.size;
+                break;
+            default: /* MQTT_PROPERTY_TYPE_PAIR */
+                buf += __mqtt_pack_uint16(buf, property->value.pair.name_size);
+                memcpy(buf, property->value.pair.name, property->value.pair.name_size);
+                buf += property->value.pair.name_size;
+                buf += __mqtt_pack_uint16(buf, property->value.pair.value_size);
+                memcpy(buf, property->value.pair.value, property->value.pair.value_size);
+                buf += property->value.pair.value_size;
+                break;
+        }
+    }
+    return buf - start;
+}
+
+/**
+ * Decodes the property at the start of the \p bufsz bytes at \p buf into \p property.
+ * Returns the number of bytes consumed, or MQTT_ERROR_MALFORMED_PROPERTIES.
+ */
+static ssize_t __mqtt_unpack_property(struct mqtt_property *property, const uint8_t *buf, size_t bufsz)
+{
+    const uint8_t *const start = buf;
+    ssize_t rv;
+    if (bufsz < 2) {
+        return MQTT_ERROR_MALFORMED_PROPERTIES;
+    }
+    property->identifier = *buf++;
+    bufsz -= 1;
+    switch (mqtt_property_type(property->identifier)) {
+        case MQTT_PROPERTY_TYPE_BYTE:
+            property->value.integer = *buf++;
+            break;
+        case MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER:
+            if (bufsz < 2) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            property->value.integer = __mqtt_unpack_uint16(buf);
+            buf += 2;
+            break;
+        case MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER:
+            if (bufsz < 4) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            property->value.integer = ((uint32_t) __mqtt_unpack_uint16(buf) << 16) | __mqtt_unpack_uint16(buf + 2);
+            buf += 4;
+            break;
+        case MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+            rv = __mqtt_unpack_varint(buf, bufsz, &property->value.integer);
+            if (rv < 0) return rv;
+            buf += rv;
+            break;
+        case MQTT_PROPERTY_TYPE_BINARY:
+            if (bufsz < 2) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            property->value.binary.size = __mqtt_unpack_uint16(buf);
+            property->value.binary.data = buf + 2;
+            if (bufsz < 2u + property->value.binary.size) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            buf += 2 + property->value.binary.size;
+            break;
+        case MQTT_PROPERTY_TYPE_PAIR:
+            if (bufsz < 4) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            property->value.pair.name_size = __mqtt_unpack_uint16(buf);
+            property->value.pair.name = buf + 2;
+            if (bufsz < 4u + property->value.pair.name_size) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            buf += 2 + property->value.pair.name_size;
+            property->value.pair.value_size = __mqtt_unpack_uint16(buf);
+            property->value.pair.value = buf + 2;
+            if (bufsz < 4u + property->value.pair.name_size + property->value.pair.value_size) return MQTT_ERROR_MALFORMED_PROPERTIES;
+            buf += 2 + property->value.pair.value_size;
+            break;
+        default:
+            return MQTT_ERROR_MALFORMED_PROPERTIES;
+    }
+    return buf - start;
+}
+
+ssize_t mqtt_unpack_properties(struct mqtt_properties *properties, const uint8_t *buf, size_t bufsz)
+{
+    struct mqtt_property property;
+    uint32_t length;
+    size_t offset;
+    ssize_t rv = __mqtt_unpack_varint(buf, bufsz, &length);
+    if (rv < 0) {
+        return rv;
+    }
+    if (bufsz - (size_t) rv < length) {
+        return MQTT_ERROR_MALFORMED_PROPERTIES;
+    }
+    properties->start = buf + rv;
+    properties->size = length;
+
+    /* check them all now so that they can be read without checks later */
+    for (offset = 0; offset < length; ) {
+        ssize_t consumed = __mqtt_unpack_property(&property, properties->start + offset, length - offset);
+        if (consumed < 0) {
+            return consumed;
+        }
+        offset += (size_t) consumed;
+    }
+    return rv + (ssize_t) length;
+}
+
+int mqtt_properties_next(const struct mqtt_properties *properties, size_t *offset, struct mqtt_property *property)
+{
+    if (*offset >= properties->size) {
+        return 0;
+    }
+    *offset += (size_t) __mqtt_unpack_property(property, properties->start + *offset, properties->size - *offset);
+    return 1;
+}
+
+int mqtt_properties_find(const struct mqtt_properties *properties, uint8_t identifier, struct mqtt_property *property)
+{
+    size_t offset = 0;
+    while (mqtt_properties_next(properties, &offset, property)) {
+        if (property->identifier == identifier) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /* CONNECT */
-ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz, 
-                                     const char* client_id,
-                                     const char* will_topic,
-                                     const void* will_message,
-                                     size_t will_message_size,
-                                     const char* user_name,
-                                     const char* password,
-                                     uint8_t connect_flags, 
-                                     uint16_t keep_alive)
+
+/**
+ * Packs a CONNECT for \p protocol_level. The properties are only packed for MQTT v5.0.
+ */
+static ssize_t __mqtt_pack_connection_request(uint8_t* buf, size_t bufsz, 
+                                              const char* client_id,
+                                              const char* will_topic,
+                                              const void* will_message,
+                                              size_t will_message_size,
+                                              const char* user_name,
+                                              const char* password,
+                                              uint8_t connect_flags, 
+                                              uint16_t keep_alive,
+                                              uint8_t protocol_level,
+                                              const struct mqtt_property *properties,
+                                              size_t num_properties)
 { 
     struct mqtt_fixed_header fixed_header;
     size_t remaining_length;
     const uint8_t *const start = buf;
     ssize_t rv;
+    ssize_t properties_size = 0;
+
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        properties_size = mqtt_properties_size(properties, num_properties);
+        if (properties_size < 0) {
+            return properties_size;
+        }
+    }
 
     /* pack the fixed headr */
     fixed_header.control_type = MQTT_CONTROL_CONNECT;
@@ -1067,7 +2822,7 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
 
     /* calculate remaining length and build connect_flags at the same time */
     connect_flags = connect_flags & ~MQTT_CONNECT_RESERVED;
-    remaining_length = 10; /* size of variable header */
+    remaining_length = 10 + properties_size; /* size of variable header */
 
     if (client_id == NULL) {
         /* client_id is a mandatory parameter */
@@ -1088,6 +2843,9 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
             return MQTT_ERROR_CONNECT_NULL_WILL_MESSAGE;
         }
         remaining_length += 2 + will_message_size; /* size of will_message */
+        if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+            remaining_length += 1; /* no will properties */
+        }
 
         /* assert that the will QOS is valid (i.e. not 3) */
         temp = connect_flags & 0x18; /* mask to QOS */   
@@ -1142,13 +2900,19 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     *buf++ = (uint8_t) 'Q';
     *buf++ = (uint8_t) 'T';
     *buf++ = (uint8_t) 'T';
-    *buf++ = MQTT_PROTOCOL_LEVEL;
+    *buf++ = protocol_level;
     *buf++ = connect_flags;
     buf += __mqtt_pack_uint16(buf, keep_alive);
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+    }
 
     /* pack the payload */
     buf += __mqtt_pack_str(buf, client_id);
     if (connect_flags & MQTT_CONNECT_WILL_FLAG) {
+        if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+            *buf++ = 0x00;
+        }
         buf += __mqtt_pack_str(buf, will_topic);
         buf += __mqtt_pack_uint16(buf, will_message_size);
         memcpy(buf, will_message, will_message_size);
@@ -1165,6 +2929,38 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     return buf - start;
 }
 
+ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz, 
+                                     const char* client_id,
+                                     const char* will_topic,
+                                     const void* will_message,
+                                     size_t will_message_size,
+                                     const char* user_name,
+                                     const char* password,
+                                     uint8_t connect_flags, 
+                                     uint16_t keep_alive)
+{
+    return __mqtt_pack_connection_request(buf, bufsz, client_id, will_topic, will_message, will_message_size,
+                                          user_name, password, connect_flags, keep_alive,
+                                          MQTT_PROTOCOL_LEVEL, NULL, 0);
+}
+
+ssize_t mqtt_pack_connection_request_v5(uint8_t* buf, size_t bufsz, 
+                                        const char* client_id,
+                                        const char* will_topic,
+                                        const void* will_message,
+                                        size_t will_message_size,
+                                        const char* user_name,
+                                        const char* password,
+                                        uint8_t connect_flags, 
+                                        uint16_t keep_alive,
+                                        const struct mqtt_property *properties,
+                                        size_t num_properties)
+{
+    return __mqtt_pack_connection_request(buf, bufsz, client_id, will_topic, will_message, will_message_size,
+                                          user_name, password, connect_flags, keep_alive,
+                                          MQTT_PROTOCOL_LEVEL_5, properties, num_properties);
+}
+
 /* CONNACK */
 ssize_t mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const uint8_t *buf) {
     const uint8_t *const start = buf;
@@ -1190,6 +2986,71 @@ ssize_t mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const
     } else {
         response->return_code = (enum MQTTConnackReturnCode) *buf++;
     }
+    response->properties.start = NULL;
+    response->properties.size = 0;
+    return buf - start;
+}
+
+/**
+ * Unpacks the properties that fill the rest of a packet, from \p buf up to \p end. Returns the
+ * number of bytes consumed or a negative value if the properties are malformed or don't end
+ * where the packet does.
+ */
+static ssize_t __mqtt_unpack_trailing_properties(struct mqtt_properties *properties, const uint8_t *buf, const uint8_t *end)
+{
+    ssize_t rv;
+    if (buf == end) {
+        /* the property length may be left out */
+        properties->start = NULL;
+        properties->size = 0;
+        return 0;
+    }
+    rv = mqtt_unpack_properties(properties, buf, (size_t) (end - buf));
+    if (rv >= 0 && buf + rv != end) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    return rv;
+}
+
+static ssize_t __mqtt_unpack_connack_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_connack *response = &(mqtt_response->decoded.connack);
+    ssize_t rv;
+
+    if (mqtt_response->fixed_header.remaining_length < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    if (*buf & 0xFE) {
+        /* only bit 1 can be set */
+        return MQTT_ERROR_CONNACK_FORBIDDEN_FLAGS;
+    }
+    response->session_present_flag = *buf++;
+    response->return_code = (enum MQTTConnackReturnCode) *buf++;
+
+    rv = __mqtt_unpack_trailing_properties(&response->properties, buf, end);
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
+    return buf - start;
+}
+
+static ssize_t __mqtt_unpack_disconnect_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_disconnect *response = &(mqtt_response->decoded.disconnect);
+    ssize_t rv;
+
+    response->reason_code = 0;
+    if (buf != end) {
+        response->reason_code = *buf++;
+    }
+    rv = __mqtt_unpack_trailing_properties(&response->properties, buf, end);
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
     return buf - start;
 }
 
@@ -1202,6 +3063,33 @@ ssize_t mqtt_pack_disconnect(uint8_t *buf, size_t bufsz) {
     return mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
 }
 
+ssize_t mqtt_pack_disconnect_v5(uint8_t *buf, size_t bufsz, uint8_t reason_code,
+                                const struct mqtt_property *properties, size_t num_properties) {
+    const uint8_t *const start = buf;
+    struct mqtt_fixed_header fixed_header;
+    ssize_t properties_size;
+    ssize_t rv;
+
+    if (reason_code == 0 && num_properties == 0) {
+        return mqtt_pack_disconnect(buf, bufsz);
+    }
+    properties_size = mqtt_properties_size(properties, num_properties);
+    if (properties_size < 0) {
+        return properties_size;
+    }
+    fixed_header.control_type = MQTT_CONTROL_DISCONNECT;
+    fixed_header.control_flags = 0;
+    fixed_header.remaining_length = 1 + properties_size;
+    rv = mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
+    if (rv <= 0) {
+        return rv;
+    }
+    buf += rv;
+    *buf++ = reason_code;
+    buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+    return buf - start;
+}
+
 /* PING */
 ssize_t mqtt_pack_ping_request(uint8_t *buf, size_t bufsz) {
     struct mqtt_fixed_header fixed_header;
@@ -1212,24 +3100,39 @@ ssize_t mqtt_pack_ping_request(uint8_t *buf, size_t bufsz) {
 }
 
 /* PUBLISH */
-ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
-                                  const char* topic_name,
-                                  uint16_t packet_id,
-                                  void* application_message,
-                                  size_t application_message_size,
-                                  uint8_t publish_flags)
+
+/**
+ * Packs a PUBLISH for \p protocol_level. The properties are only packed for MQTT v5.0.
+ */
+static ssize_t __mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
+                                           const char* topic_name,
+                                           uint16_t packet_id,
+                                           void* application_message,
+                                           size_t application_message_size,
+                                           uint8_t publish_flags,
+                                           uint8_t protocol_level,
+                                           const struct mqtt_property *properties,
+                                           size_t num_properties)
 {
     const uint8_t *const start = buf;
     ssize_t rv;
     struct mqtt_fixed_header fixed_header;
-    uint16_t remaining_length;
+    uint32_t remaining_length;
     uint8_t inspected_qos;
+    ssize_t properties_size = 0;
 
     /* check for null pointers */
     if(buf == NULL || topic_name == NULL) {
         return MQTT_ERROR_NULLPTR;
     }
 
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        properties_size = mqtt_properties_size(properties, num_properties);
+        if (properties_size < 0) {
+            return properties_size;
+        }
+    }
+
     /* inspect QoS level */
     inspected_qos = (publish_flags & 0x06) >> 1; /* mask */
 
@@ -1241,6 +3144,7 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     if (inspected_qos > 0) {
         remaining_length += 2;
     }
+    remaining_length += properties_size;
     remaining_length += application_message_size;
     fixed_header.remaining_length = remaining_length;
 
@@ -1274,14 +3178,45 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     if (inspected_qos > 0) {
         buf += __mqtt_pack_uint16(buf, packet_id);
     }
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+    }
 
-    /* pack payload */
-    memcpy(buf, application_message, application_message_size);
+    /* pack payload (unless the caller is only reserving space for it) */
+    if (application_message != NULL) {
+        memcpy(buf, application_message, application_message_size);
+    }
     buf += application_message_size;
 
     return buf - start;
 }
 
+ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
+                                  const char* topic_name,
+                                  uint16_t packet_id,
+                                  void* application_message,
+                                  size_t application_message_size,
+                                  uint8_t publish_flags)
+{
+    return __mqtt_pack_publish_request(buf, bufsz, topic_name, packet_id, application_message,
+                                       application_message_size, publish_flags, 
+                                       MQTT_PROTOCOL_LEVEL, NULL, 0);
+}
+
+ssize_t mqtt_pack_publish_request_v5(uint8_t *buf, size_t bufsz,
+                                     const char* topic_name,
+                                     uint16_t packet_id,
+                                     void* application_message,
+                                     size_t application_message_size,
+                                     uint8_t publish_flags,
+                                     const struct mqtt_property *properties,
+                                     size_t num_properties)
+{
+    return __mqtt_pack_publish_request(buf, bufsz, topic_name, packet_id, application_message,
+                                       application_message_size, publish_flags, 
+                                       MQTT_PROTOCOL_LEVEL_5, properties, num_properties);
+}
+
 ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const uint8_t *buf)
 {    
     const uint8_t *const start = buf;
@@ -1320,11 +3255,56 @@ ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const
         response->application_message_size = fixed_header->remaining_length - response->topic_name_size - 4;
     }
     buf += response->application_message_size;
+    response->properties.start = NULL;
+    response->properties.size = 0;
     
     /* return number of bytes consumed */
     return buf - start;
 }
 
+static ssize_t __mqtt_unpack_publish_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf)
+{    
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_fixed_header *fixed_header = &(mqtt_response->fixed_header);
+    struct mqtt_response_publish *response = &(mqtt_response->decoded.publish);
+    ssize_t rv;
+
+    /* get flags */
+    response->dup_flag = (fixed_header->control_flags & MQTT_PUBLISH_DUP) >> 3;
+    response->qos_level = (fixed_header->control_flags & 0x06) >> 1;
+    response->retain_flag = fixed_header->control_flags & MQTT_PUBLISH_RETAIN;
+
+    /* parse variable header */
+    if (end - buf < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->topic_name_size = __mqtt_unpack_uint16(buf);
+    buf += 2;
+    response->topic_name = buf;
+    if (end - buf < (ssize_t) response->topic_name_size + (response->qos_level > 0 ? 2 : 0)) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    buf += response->topic_name_size;
+
+    if (response->qos_level > 0) {
+        response->packet_id = __mqtt_unpack_uint16(buf);
+        buf += 2;
+    }
+
+    rv = mqtt_unpack_properties(&response->properties, buf, (size_t) (end - buf));
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
+
+    /* the payload is the rest */
+    response->application_message = buf;
+    response->application_message_size = (size_t) (end - buf);
+    buf = end;
+    return buf - start;
+}
+
 /* PUBXXX */
 ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz, 
                                  enum MQTTControlPacketType control_type,
@@ -1361,6 +3341,90 @@ ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz,
     return buf - start;
 }
 
+ssize_t mqtt_pack_pubxxx_request_v5(uint8_t *buf, size_t bufsz, 
+                                    enum MQTTControlPacketType control_type,
+                                    uint16_t packet_id,
+                                    uint8_t reason_code,
+                                    const struct mqtt_property *properties,
+                                    size_t num_properties) 
+{
+    const uint8_t *const start = buf;
+    struct mqtt_fixed_header fixed_header;
+    ssize_t properties_size;
+    ssize_t rv;
+
+    /* the reason code and properties may be left out */
+    if (reason_code == 0 && num_properties == 0) {
+        return mqtt_pack_pubxxx_request(buf, bufsz, control_type, packet_id);
+    }
+    if (buf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    properties_size = mqtt_properties_size(properties, num_properties);
+    if (properties_size < 0) {
+        return properties_size;
+    }
+
+    /* pack fixed header */
+    fixed_header.control_type = control_type;
+    if (control_type == MQTT_CONTROL_PUBREL) {
+        fixed_header.control_flags = 0x02;
+    } else {
+        fixed_header.control_flags = 0;
+    }
+    fixed_header.remaining_length = 3 + properties_size;
+    rv = mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
+    if (rv <= 0) {
+        return rv;
+    }
+    buf += rv;
+
+    buf += __mqtt_pack_uint16(buf, packet_id);
+    *buf++ = reason_code;
+    buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+
+    return buf - start;
+}
+
+/** Returns the decoded PUBXXX response that has the same layout for every type. */
+static struct mqtt_response_puback* __mqtt_pubxxx_response(struct mqtt_response *mqtt_response)
+{
+    switch (mqtt_response->fixed_header.control_type) {
+        case MQTT_CONTROL_PUBACK:
+            return &mqtt_response->decoded.puback;
+        case MQTT_CONTROL_PUBREC:
+            return (struct mqtt_response_puback*) &mqtt_response->decoded.pubrec;
+        case MQTT_CONTROL_PUBREL:
+            return (struct mqtt_response_puback*) &mqtt_response->decoded.pubrel;
+        default:
+            return (struct mqtt_response_puback*) &mqtt_response->decoded.pubcomp;
+    }
+}
+
+static ssize_t __mqtt_unpack_pubxxx_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_puback *response = __mqtt_pubxxx_response(mqtt_response);
+    ssize_t rv;
+
+    if (mqtt_response->fixed_header.remaining_length < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->packet_id = __mqtt_unpack_uint16(buf);
+    buf += 2;
+    response->reason_code = 0;
+    if (buf != end) {
+        response->reason_code = *buf++;
+    }
+    rv = __mqtt_unpack_trailing_properties(&response->properties, buf, end);
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
+    return buf - start;
+}
+
 ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const uint8_t *buf) 
 {
     const uint8_t *const start = buf;
@@ -1384,6 +3448,9 @@ ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const u
     } else {
         mqtt_response->decoded.pubcomp.packet_id = packet_id;
     }
+    __mqtt_pubxxx_response(mqtt_response)->reason_code = 0;
+    __mqtt_pubxxx_response(mqtt_response)->properties.start = NULL;
+    __mqtt_pubxxx_response(mqtt_response)->properties.size = 0;
 
     return buf - start;
 }
@@ -1407,13 +3474,50 @@ ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const
     mqtt_response->decoded.suback.num_return_codes = (size_t) remaining_length;
     mqtt_response->decoded.suback.return_codes = buf;
     buf += remaining_length;
+    mqtt_response->decoded.suback.properties.start = NULL;
+    mqtt_response->decoded.suback.properties.size = 0;
+
+    return buf - start;
+}
+
+static ssize_t __mqtt_unpack_suback_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_suback *response = &(mqtt_response->decoded.suback);
+    ssize_t rv;
+
+    if (mqtt_response->fixed_header.remaining_length < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->packet_id = __mqtt_unpack_uint16(buf);
+    buf += 2;
+    rv = mqtt_unpack_properties(&response->properties, buf, (size_t) (end - buf));
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
 
+    /* at least one reason code */
+    if (buf == end) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->return_codes = buf;
+    response->num_return_codes = (size_t) (end - buf);
+    buf = end;
     return buf - start;
 }
 
 /* SUBSCRIBE */
-ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
-    va_list args;
+
+/**
+ * Packs a SUBSCRIBE for \p protocol_level from the topics in \p args. The properties are 
+ * only packed for MQTT v5.0.
+ */
+static ssize_t __mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, 
+                                             uint8_t protocol_level,
+                                             const struct mqtt_property *properties,
+                                             size_t num_properties,
+                                             va_list args) {
     const uint8_t *const start = buf;
     ssize_t rv;
     struct mqtt_fixed_header fixed_header;
@@ -1421,9 +3525,16 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     unsigned int i;
     const char *topic[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
     uint8_t max_qos[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
+    ssize_t properties_size = 0;
+
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        properties_size = mqtt_properties_size(properties, num_properties);
+        if (properties_size < 0) {
+            return properties_size;
+        }
+    }
 
     /* parse all subscriptions */
-    va_start(args, packet_id);
     while(1) {
         topic[num_subs] = va_arg(args, const char*);
         if (topic[num_subs] == NULL) {
@@ -1438,12 +3549,11 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
             return MQTT_ERROR_SUBSCRIBE_TOO_MANY_TOPICS;
         }
     }
-    va_end(args);
 
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_SUBSCRIBE;
     fixed_header.control_flags = 2u;
-    fixed_header.remaining_length = 2u; /* size of variable header */
+    fixed_header.remaining_length = 2u + properties_size; /* size of variable header */
     for(i = 0; i < num_subs; ++i) {
         /* payload is topic name + max qos (1 byte) */
         fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]) + 1;
@@ -1465,6 +3575,9 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, packet_id);
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+    }
 
 
     /* pack payload */
@@ -1476,6 +3589,25 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     return buf - start;
 }
 
+ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
+    va_list args;
+    ssize_t rv;
+    va_start(args, packet_id);
+    rv = __mqtt_pack_subscribe_request(buf, bufsz, packet_id, MQTT_PROTOCOL_LEVEL, NULL, 0, args);
+    va_end(args);
+    return rv;
+}
+
+ssize_t mqtt_pack_subscribe_request_v5(uint8_t *buf, size_t bufsz, unsigned int packet_id, 
+                                       const struct mqtt_property *properties, size_t num_properties, ...) {
+    va_list args;
+    ssize_t rv;
+    va_start(args, num_properties);
+    rv = __mqtt_pack_subscribe_request(buf, bufsz, packet_id, MQTT_PROTOCOL_LEVEL_5, properties, num_properties, args);
+    va_end(args);
+    return rv;
+}
+
 /* UNSUBACK */
 ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const uint8_t *buf) 
 {
@@ -1488,22 +3620,64 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
     /* parse packet_id */
     mqtt_response->decoded.unsuback.packet_id = __mqtt_unpack_uint16(buf);
     buf += 2;
+    mqtt_response->decoded.unsuback.reason_codes = NULL;
+    mqtt_response->decoded.unsuback.num_reason_codes = 0;
+    mqtt_response->decoded.unsuback.properties.start = NULL;
+    mqtt_response->decoded.unsuback.properties.size = 0;
+
+    return buf - start;
+}
+
+static ssize_t __mqtt_unpack_unsuback_response_v5(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    const uint8_t *const start = buf;
+    const uint8_t *const end = buf + mqtt_response->fixed_header.remaining_length;
+    struct mqtt_response_unsuback *response = &(mqtt_response->decoded.unsuback);
+    ssize_t rv;
 
+    if (mqtt_response->fixed_header.remaining_length < 2) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    response->packet_id = __mqtt_unpack_uint16(buf);
+    buf += 2;
+    rv = mqtt_unpack_properties(&response->properties, buf, (size_t) (end - buf));
+    if (rv < 0) {
+        return rv;
+    }
+    buf += rv;
+    response->reason_codes = buf;
+    response->num_reason_codes = (size_t) (end - buf);
+    buf = end;
     return buf - start;
 }
 
 /* UNSUBSCRIBE */
-ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
-    va_list args;
+
+/**
+ * Packs an UNSUBSCRIBE for \p protocol_level from the topics in \p args. The properties are
+ * only packed for MQTT v5.0.
+ */
+static ssize_t __mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, 
+                                               uint8_t protocol_level,
+                                               const struct mqtt_property *properties,
+                                               size_t num_properties,
+                                               va_list args) {
     const uint8_t *const start = buf;
     ssize_t rv;
     struct mqtt_fixed_header fixed_header;
     unsigned int num_subs = 0;
     unsigned int i;
     const char *topic[MQTT_UNSUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
+    ssize_t properties_size = 0;
+
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        properties_size = mqtt_properties_size(properties, num_properties);
+        if (properties_size < 0) {
+            return properties_size;
+        }
+    }
 
     /* parse all subscriptions */
-    va_start(args, packet_id);
     while(1) {
         topic[num_subs] = va_arg(args, const char*);
         if (topic[num_subs] == NULL) {
@@ -1516,12 +3690,11 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
             return MQTT_ERROR_UNSUBSCRIBE_TOO_MANY_TOPICS;
         }
     }
-    va_end(args);
 
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_UNSUBSCRIBE;
     fixed_header.control_flags = 2u;
-    fixed_header.remaining_length = 2u; /* size of variable header */
+    fixed_header.remaining_length = 2u + properties_size; /* size of variable header */
     for(i = 0; i < num_subs; ++i) {
         /* payload is topic name */
         fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]);
@@ -1542,6 +3715,9 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
 
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, packet_id);
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        buf += mqtt_pack_properties(buf, (size_t) properties_size, properties, num_properties);
+    }
 
 
     /* pack payload */
@@ -1552,91 +3728,1906 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
     return buf - start;
 }
 
+ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
+    va_list args;
+    ssize_t rv;
+    va_start(args, packet_id);
+    rv = __mqtt_pack_unsubscribe_request(buf, bufsz, packet_id, MQTT_PROTOCOL_LEVEL, NULL, 0, args);
+    va_end(args);
+    return rv;
+}
+
+ssize_t mqtt_pack_unsubscribe_request_v5(uint8_t *buf, size_t bufsz, unsigned int packet_id, 
+                                         const struct mqtt_property *properties, size_t num_properties, ...) {
+    va_list args;
+    ssize_t rv;
+    va_start(args, num_properties);
+    rv = __mqtt_pack_unsubscribe_request(buf, bufsz, packet_id, MQTT_PROTOCOL_LEVEL_5, properties, num_properties, args);
+    va_end(args);
+    return rv;
+}
+
 /* MESSAGE QUEUE */
-void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz) 
+
+/* the descriptor arrays always have room for a multiple of this many messages */
+#define MQTT_MQ_CAPACITY_STEP 8
+
+/**
+ * Points the queue at the \p size bytes at \p mem. The end of the memory is aligned for the 
+ * descriptor arrays. The queue is left empty.
+ */
+static void __mqtt_mq_set_memory(struct mqtt_message_queue *mq, void *mem, size_t size)
 {
-    mq->mem_start = buf;
-    mq->mem_end = (unsigned char*)buf + bufsz;
-    mq->curr = buf;
-    mq->queue_tail = mq->mem_end;
+    uintptr_t end = ((uintptr_t) mem + size) & ~((uintptr_t) MQTT_MQ_DESCRIPTOR_ALIGNMENT - 1);
+    mq->mem_start = mem;
+    mq->mem_end = end < (uintptr_t) mem ? mem : (void*) end;
+    mq->curr = (uint8_t*) mem;
+    mq->length = 0;
+    mq->capacity = 0;
+    mq->time_sent = (uint64_t*) mq->mem_end;
+    mq->offset = (uint32_t*) mq->mem_end;
+    mq->size = (uint32_t*) mq->mem_end;
+    mq->packet_id = (uint16_t*) mq->mem_end;
+    mq->state = (uint8_t*) mq->mem_end;
+    mq->control_type = (uint8_t*) mq->mem_end;
+    mq->qos = (uint8_t*) mq->mem_end;
+    mq->resends = (uint8_t*) mq->mem_end;
     mq->curr_sz = mqtt_mq_currsz(mq);
 }
 
-struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes)
+/** Points the descriptor arrays at room for \p capacity messages starting at \p start. */
+static void __mqtt_mq_layout(struct mqtt_message_queue *mq, uint8_t *start, size_t capacity)
 {
-    /* make queued message header */
-    --(mq->queue_tail);
-    mq->queue_tail->start = mq->curr;
-    mq->queue_tail->size = nbytes;
-    mq->queue_tail->state = MQTT_QUEUED_UNSENT;
+    mq->capacity = capacity;
+    mq->time_sent = (uint64_t*) start;
+    mq->offset = (uint32_t*) (mq->time_sent + capacity);
+    mq->size = mq->offset + capacity;
+    mq->packet_id = (uint16_t*) (mq->size + capacity);
+    mq->state = (uint8_t*) (mq->packet_id + capacity);
+    mq->control_type = mq->state + capacity;
+    mq->qos = mq->control_type + capacity;
+    mq->resends = mq->qos + capacity;
+}
 
-    /* move curr and recalculate curr_sz */
-    mq->curr += nbytes;
+/**
+ * Resizes the descriptor arrays in place. Since the capacity is always a multiple of
+ * MQTT_MQ_CAPACITY_STEP every array moves down when the capacity grows (so they are moved 
+ * first to last) and up when it shrinks (so they are moved last to first).
+ */
+static void __mqtt_mq_set_capacity(struct mqtt_message_queue *mq, size_t capacity)
+{
+    struct mqtt_message_queue old = *mq;
+    size_t n = mq->length;
+    __mqtt_mq_layout(mq, mqtt_mq_descriptors_start(mq, capacity), capacity);
+    if (capacity > old.capacity) {
+        memmove(mq->time_sent, old.time_sent, n * sizeof(uint64_t));
+        memmove(mq->offset, old.offset, n * sizeof(uint32_t));
+        memmove(mq->size, old.size, n * sizeof(uint32_t));
+        memmove(mq->packet_id, old.packet_id, n * sizeof(uint16_t));
+        memmove(mq->state, old.state, n);
+        memmove(mq->control_type, old.control_type, n);
+        memmove(mq->qos, old.qos, n);
+        memmove(mq->resends, old.resends, n);
+    } else {
+        memmove(mq->resends, old.resends, n);
+        memmove(mq->qos, old.qos, n);
+        memmove(mq->control_type, old.control_type, n);
+        memmove(mq->state, old.state, n);
+        memmove(mq->packet_id, old.packet_id, n * sizeof(uint16_t));
+        memmove(mq->size, old.size, n * sizeof(uint32_t));
+        memmove(mq->offset, old.offset, n * sizeof(uint32_t));
+        memmove(mq->time_sent, old.time_sent, n * sizeof(uint64_t));
+    }
+}
+
+uint8_t* mqtt_mq_descriptors_start(const struct mqtt_message_queue *mq, size_t capacity)
+{
+    size_t mem_size = (uint8_t*) mq->mem_end - (uint8_t*) mq->mem_start;
+    if (capacity * MQTT_MQ_DESCRIPTOR_SIZE > mem_size) {
+        return NULL;
+    }
+    return (uint8_t*) mq->mem_end - capacity * MQTT_MQ_DESCRIPTOR_SIZE;
+}
+
+size_t mqtt_mq_currsz(const struct mqtt_message_queue *mq)
+{
+    size_t capacity = mq->capacity;
+    uint8_t *descriptors;
+    if (mq->length == capacity) {
+        capacity += MQTT_MQ_CAPACITY_STEP;
+    }
+    descriptors = mqtt_mq_descriptors_start(mq, capacity);
+    if (descriptors == NULL || descriptors <= mq->curr) {
+        return 0;
+    }
+    return descriptors - mq->curr;
+}
+
+void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz) 
+{
+    __mqtt_mq_set_memory(mq, buf, bufsz);
+    mq->base_start = buf;
+    mq->base_size = bufsz;
+    mq->allocator = NULL;
+    mq->growth_segment_size = 0;
+    mq->growth_max_size = 0;
+    mq->pinned = 0;
+    mq->head_of_line_blocked_bytes = 0;
+    mq->max_head_of_line_blocked_bytes = 0;
+}
+
+void mqtt_mq_deinit(struct mqtt_message_queue *mq)
+{
+    if (mq->mem_start != mq->base_start) {
+        mqtt_allocator_free(mq->allocator, mq->mem_start, (uint8_t*) mq->mem_end - (uint8_t*) mq->mem_start);
+    }
+    __mqtt_mq_set_memory(mq, mq->base_start, mq->base_size);
+}
+
+/**
+ * Moves the queue into the \p size bytes at \p mem (which must not overlap the queue's
+ * current memory). Packets stay at the front and the descriptors move to the back.
+ * Memory the queue had allocated itself is freed.
+ */
+static void __mqtt_mq_move(struct mqtt_message_queue *mq, uint8_t *mem, size_t size)
+{
+    struct mqtt_message_queue old = *mq;
+    size_t old_size = (uint8_t*) old.mem_end - (uint8_t*) old.mem_start;
+    size_t data_size = old.curr - (uint8_t*) old.mem_start;
+    size_t n = old.length;
+    size_t capacity = old.capacity;
+    uint8_t *descriptors;
+
+    __mqtt_mq_set_memory(mq, mem, size);
+    if (data_size > 0) {
+        memcpy(mem, old.mem_start, data_size);
+    }
+    mq->curr = mem + data_size;
+
+    /* keep the capacity if there is room for it, otherwise fit the arrays to the queue */
+    descriptors = mqtt_mq_descriptors_start(mq, capacity);
+    if (descriptors == NULL || descriptors < mq->curr) {
+        capacity = (n + MQTT_MQ_CAPACITY_STEP - 1) / MQTT_MQ_CAPACITY_STEP * MQTT_MQ_CAPACITY_STEP;
+        descriptors = mqtt_mq_descriptors_start(mq, capacity);
+    }
+    __mqtt_mq_layout(mq, descriptors, capacity);
+    mq->length = n;
+    if (n > 0) {
+        memcpy(mq->time_sent, old.time_sent, n * sizeof(uint64_t));
+        memcpy(mq->offset, old.offset, n * sizeof(uint32_t));
+        memcpy(mq->size, old.size, n * sizeof(uint32_t));
+        memcpy(mq->packet_id, old.packet_id, n * sizeof(uint16_t));
+        memcpy(mq->state, old.state, n);
+        memcpy(mq->control_type, old.control_type, n);
+        memcpy(mq->qos, old.qos, n);
+        memcpy(mq->resends, old.resends, n);
+    }
     mq->curr_sz = mqtt_mq_currsz(mq);
 
-    return mq->queue_tail;
+    if (old.mem_start != old.base_start) {
+        mqtt_allocator_free(mq->allocator, old.mem_start, old_size);
+    }
 }
 
-void mqtt_mq_clean(struct mqtt_message_queue *mq) {
-    struct mqtt_queued_message *new_head;
+int mqtt_mq_grow(struct mqtt_message_queue *mq)
+{
+    size_t size = (uint8_t*) mq->mem_end - (uint8_t*) mq->mem_start;
+    size_t new_size;
+    uint8_t *mem;
+
+    if (mq->pinned || mq->allocator == NULL || mq->growth_segment_size == 0 || size >= mq->growth_max_size) {
+        return 0;
+    }
+    new_size = size + mq->growth_segment_size;
+    if (new_size > mq->growth_max_size) {
+        new_size = mq->growth_max_size;
+    }
+    new_size -= new_size % MQTT_MQ_DESCRIPTOR_ALIGNMENT;
+    if (new_size <= size) {
+        return 0;
+    }
 
-    for(new_head = mqtt_mq_get(mq, 0); new_head >= mq->queue_tail; --new_head) {
-        if (new_head->state != MQTT_QUEUED_COMPLETE) break;
+    mem = (uint8_t*) mqtt_allocator_alloc(mq->allocator, new_size);
+    if (mem == NULL) {
+        return 0;
     }
-    
-    /* check if everything can be removed */
-    if (new_head < mq->queue_tail) {
-        mq->curr = mq->mem_start;
-        mq->queue_tail = mq->mem_end;
-        mq->curr_sz = mqtt_mq_currsz(mq);
-        return;
-    } else if (new_head == mqtt_mq_get(mq, 0)) {
-        /* do nothing */
+    __mqtt_mq_move(mq, mem, new_size);
+    return 1;
+}
+
+/**
+ * Shrinks a queue that has grown once enough of it has drained. The queue moves back 
+ * into its original buffer when it is at most half full, otherwise it gives back all but
+ * one or two segments of free space.
+ */
+static void __mqtt_mq_shrink(struct mqtt_message_queue *mq)
+{
+    size_t size, used, new_size;
+    uint8_t *mem;
+
+    if (mq->mem_start == mq->base_start) {
         return;
     }
 
-    /* move buffered data */
-    {
-        size_t n = mq->curr - new_head->start;
-        size_t removing = new_head->start - (uint8_t*) mq->mem_start;
-        memmove(mq->mem_start, new_head->start, n);
-        mq->curr = (unsigned char*)mq->mem_start + n;
-      
+    size = (uint8_t*) mq->mem_end - (uint8_t*) mq->mem_start;
+    used = mqtt_mq_bytes_used(mq);
+    if (used <= mq->base_size / 2) {
+        __mqtt_mq_move(mq, (uint8_t*) mq->base_start, mq->base_size);
+    } else if (mq->growth_segment_size > 0 && size - used >= 2 * mq->growth_segment_size) {
+        new_size = size - ((size - used) / mq->growth_segment_size - 1) * mq->growth_segment_size;
+        new_size -= new_size % MQTT_MQ_DESCRIPTOR_ALIGNMENT;
+        mem = (uint8_t*) mqtt_allocator_alloc(mq->allocator, new_size);
+        if (mem != NULL) {
+            __mqtt_mq_move(mq, mem, new_size);
+        }
+    }
+}
 
-        /* move queue */
-        {
-            ssize_t new_tail_idx = new_head - mq->queue_tail;
-            memmove(mqtt_mq_get(mq, new_tail_idx), mq->queue_tail, sizeof(struct mqtt_queued_message) * (new_tail_idx + 1));
-            mq->queue_tail = mqtt_mq_get(mq, new_tail_idx);
-          
-            {
-                /* bump back start's */
-                ssize_t i = 0;
-                for(; i < new_tail_idx + 1; ++i) {
-                    mqtt_mq_get(mq, i)->start -= removing;
-                }
-            }
+size_t mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes)
+{
+    size_t i = mq->length;
+
+    /* make room for the descriptor, doubling the arrays if the packets leave enough room */
+    if (i == mq->capacity) {
+        size_t capacity = mq->capacity ? 2 * mq->capacity : MQTT_MQ_CAPACITY_STEP;
+        uint8_t *descriptors = mqtt_mq_descriptors_start(mq, capacity);
+        if (descriptors == NULL || descriptors < mq->curr + nbytes) {
+            capacity = mq->capacity + MQTT_MQ_CAPACITY_STEP;
         }
+        __mqtt_mq_set_capacity(mq, capacity);
     }
 
-    /* get curr_sz */
+    /* fill in the descriptor */
+    mq->time_sent[i] = 0;
+    mq->offset[i] = (uint32_t) (mq->curr - (uint8_t*) mq->mem_start);
+    mq->size[i] = (uint32_t) nbytes;
+    mq->packet_id[i] = 0;
+    mq->state[i] = MQTT_QUEUED_UNSENT;
+    mq->control_type[i] = mq->curr[0] >> 4;
+    mq->qos[i] = mq->control_type[i] == MQTT_CONTROL_PUBLISH ? 0x03 & (mq->curr[0] >> 1) : 0;
+    mq->resends[i] = 0;
+    mq->length += 1;
+
+    /* move curr and recalculate curr_sz */
+    mq->curr += nbytes;
     mq->curr_sz = mqtt_mq_currsz(mq);
+
+    return i;
 }
 
-struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id)
-{
-    struct mqtt_queued_message *curr;
-    for(curr = mqtt_mq_get(mq, 0); curr >= mq->queue_tail; --curr) {
-        if (curr->control_type == control_type) {
-            if ((packet_id == NULL && curr->state != MQTT_QUEUED_COMPLETE) ||
-                (packet_id != NULL && *packet_id == curr->packet_id)) {
-                return curr;
+void mqtt_mq_clean(struct mqtt_message_queue *mq) {
+    size_t i, n = 0, blocked_bytes = 0;
+    uint32_t data_end = 0;
+    int blocked = 0;
+
+    /* 
+     * Compact the queue in place, keeping the order of the remaining messages. Completed
+     * messages are removed wherever they are so that a message that is still waiting on 
+     * its ack doesn't pin everything queued after it.
+     */
+    for(i = 0; i < mq->length; ++i) {
+        if (mq->state[i] == MQTT_QUEUED_COMPLETE) {
+            if (blocked) {
+                blocked_bytes += mq->size[i];
             }
+            continue;
         }
+        blocked = 1;
+        if (n != i) {
+            memmove((uint8_t*) mq->mem_start + data_end, mqtt_mq_start(mq, i), mq->size[i]);
+            mq->time_sent[n] = mq->time_sent[i];
+            mq->size[n] = mq->size[i];
+            mq->packet_id[n] = mq->packet_id[i];
+            mq->state[n] = mq->state[i];
+            mq->control_type[n] = mq->control_type[i];
+            mq->qos[n] = mq->qos[i];
+            mq->resends[n] = mq->resends[i];
+        } else if (mq->offset[i] != data_end) {
+            /* bytes skipped by mqtt_publish_commit are dropped too */
+            memmove((uint8_t*) mq->mem_start + data_end, mqtt_mq_start(mq, i), mq->size[i]);
+        }
+        mq->offset[n] = data_end;
+        data_end += mq->size[n];
+        ++n;
     }
-    return NULL;
+
+    mq->head_of_line_blocked_bytes = blocked_bytes;
+    if (blocked_bytes > mq->max_head_of_line_blocked_bytes) {
+        mq->max_head_of_line_blocked_bytes = blocked_bytes;
+    }
+    if (n == mq->length) {
+        /* nothing was removed */
+        return;
+    }
+    mq->length = n;
+    mq->curr = (uint8_t*) mq->mem_start + data_end;
+
+    /* give the packets back the room of descriptors that are no longer needed */
+    if (mq->length * 4 <= mq->capacity) {
+        size_t capacity = (2 * mq->length + MQTT_MQ_CAPACITY_STEP - 1) / MQTT_MQ_CAPACITY_STEP * MQTT_MQ_CAPACITY_STEP;
+        if (capacity < mq->capacity) {
+            __mqtt_mq_set_capacity(mq, capacity);
+        }
+    }
+
+    /* get curr_sz */
+    mq->curr_sz = mqtt_mq_currsz(mq);
+    __mqtt_mq_shrink(mq);
+}
+
+/**
+ * Reverses the \p n bytes at \p buf.
+ */
+static void __mqtt_reverse_bytes(uint8_t *buf, size_t n)
+{
+    uint8_t *end = buf + n;
+    while (buf + 1 < end) {
+        uint8_t tmp = *buf;
+        *buf++ = *--end;
+        *end = tmp;
+    }
+}
+
+void mqtt_mq_resume(struct mqtt_message_queue *mq)
+{
+    size_t i;
+
+    for(i = 0; i < mq->length; ++i) {
+        if (mq->state[i] == MQTT_QUEUED_COMPLETE) {
+            continue;
+        }
+        if (mq->control_type[i] == MQTT_CONTROL_PUBLISH && mq->qos[i] > 0) {
+            /* the broker may have received it before the connection was lost */
+            if (mq->state[i] == MQTT_QUEUED_AWAITING_ACK) {
+                mqtt_mq_start(mq, i)[0] |= MQTT_PUBLISH_DUP;
+            }
+            mq->state[i] = MQTT_QUEUED_UNSENT;
+        } else if (mq->control_type[i] == MQTT_CONTROL_PUBREL) {
+            mq->state[i] = MQTT_QUEUED_UNSENT;
+        } else {
+            /* anything else belonged to the old connection */
+            mq->state[i] = MQTT_QUEUED_COMPLETE;
+        }
+    }
+    mqtt_mq_clean(mq);
+}
+
+void mqtt_mq_move_to_front(struct mqtt_message_queue *mq, size_t index)
+{
+    uint64_t time_sent = mq->time_sent[index];
+    uint32_t offset = mq->offset[index];
+    uint32_t size = mq->size[index];
+    uint16_t packet_id = mq->packet_id[index];
+    uint8_t state = mq->state[index];
+    uint8_t control_type = mq->control_type[index];
+    uint8_t qos = mq->qos[index];
+    uint8_t resends = mq->resends[index];
+    uint8_t *start = (uint8_t*) mq->mem_start;
+    size_t i;
+
+    /* rotate the packets in place: the message's bytes end up first */
+    __mqtt_reverse_bytes(start, offset);
+    __mqtt_reverse_bytes(start + offset, size);
+    __mqtt_reverse_bytes(start, offset + size);
+
+    memmove(mq->time_sent + 1, mq->time_sent, index * sizeof(uint64_t));
+    memmove(mq->offset + 1, mq->offset, index * sizeof(uint32_t));
+    memmove(mq->size + 1, mq->size, index * sizeof(uint32_t));
+    memmove(mq->packet_id + 1, mq->packet_id, index * sizeof(uint16_t));
+    memmove(mq->state + 1, mq->state, index);
+    memmove(mq->control_type + 1, mq->control_type, index);
+    memmove(mq->qos + 1, mq->qos, index);
+    memmove(mq->resends + 1, mq->resends, index);
+    for(i = 1; i <= index; ++i) {
+        mq->offset[i] += size;
+    }
+    mq->time_sent[0] = time_sent;
+    mq->offset[0] = 0;
+    mq->size[0] = size;
+    mq->packet_id[0] = packet_id;
+    mq->state[0] = state;
+    mq->control_type[0] = control_type;
+    mq->qos[0] = qos;
+    mq->resends[0] = resends;
+}
+
+int mqtt_mq_restore(struct mqtt_message_queue *mq, size_t length, size_t capacity, size_t data_size)
+{
+    uint8_t *descriptors = mqtt_mq_descriptors_start(mq, capacity);
+    size_t i;
+
+    if (length > capacity || descriptors == NULL || descriptors < (uint8_t*) mq->mem_start + data_size) {
+        return 0;
+    }
+    __mqtt_mq_layout(mq, descriptors, capacity);
+    for(i = 0; i < length; ++i) {
+        if ((size_t) mq->offset[i] + mq->size[i] > data_size || mq->state[i] > MQTT_QUEUED_COMPLETE) {
+            __mqtt_mq_layout(mq, (uint8_t*) mq->mem_end, 0);
+            return 0;
+        }
+    }
+    mq->length = length;
+    mq->curr = (uint8_t*) mq->mem_start + data_size;
+    mq->curr_sz = mqtt_mq_currsz(mq);
+    return 1;
+}
+
+ssize_t mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id)
+{
+    size_t i;
+    for(i = 0; i < mq->length; ++i) {
+        if (mq->control_type[i] == control_type) {
+            if ((packet_id == NULL && mq->state[i] != MQTT_QUEUED_COMPLETE) ||
+                (packet_id != NULL && *packet_id == mq->packet_id[i])) {
+                return (ssize_t) i;
+            }
+        }
+    }
+    return -1;
+}
+
+
+/* SESSION STORE */
+
+/** 
+ * The header at the start of a session store file. Everything else in the header's 
+ * state lives in the queue's descriptor arrays. 
+ */
+struct mqtt_session_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t data_size;
+    uint16_t pid_lfsr;
+};
+
+#define MQTT_SESSION_STORE_MAGIC 0x5353514du
+#define MQTT_SESSION_STORE_VERSION 2u
+
+enum MQTTErrors mqtt_session_store_open(struct mqtt_session_store *store, const char *path, size_t size)
+{
+    struct mqtt_session_store_header header;
+    if (size <= MQTT_SESSION_STORE_HEADER_SIZE || size > UINT32_MAX) {
+        return MQTT_ERROR_SESSION_STORE_IO;
+    }
+    store->mem = (uint8_t*) mqtt_pal_map_file(path, size, &store->handle);
+    if (store->mem == NULL) {
+        return MQTT_ERROR_SESSION_STORE_IO;
+    }
+    store->size = size;
+    store->dirty = 0;
+    store->number_of_restored_messages = 0;
+    store->number_of_commits = 0;
+
+    /* a new file is all zeros */
+    memcpy(&header, store->mem, sizeof(header));
+    store->restored = header.magic == MQTT_SESSION_STORE_MAGIC;
+    return MQTT_OK;
+}
+
+void mqtt_session_store_close(struct mqtt_session_store *store)
+{
+    mqtt_pal_unmap_file(store->mem, store->size, store->handle);
+    store->mem = NULL;
+}
+
+enum MQTTErrors mqtt_set_session_store(struct mqtt_client *client, struct mqtt_session_store *store)
+{
+    struct mqtt_session_store_header header;
+    struct mqtt_allocator *allocator = client->mq.allocator;
+    enum MQTTErrors rv = MQTT_OK;
+
+    memcpy(&header, store->mem, sizeof(header));
+    mqtt_mq_deinit(&client->mq);
+    mqtt_mq_init(&client->mq, store->mem + MQTT_SESSION_STORE_HEADER_SIZE, store->size - MQTT_SESSION_STORE_HEADER_SIZE);
+    client->mq.allocator = allocator;
+    client->mq.pinned = 1;
+    client->session_store = store;
+
+    if (store->restored) {
+        if (header.version == MQTT_SESSION_STORE_VERSION && header.size == store->size
+            && mqtt_mq_restore(&client->mq, header.length, header.capacity, header.data_size)) 
+        {
+            client->pid_lfsr = header.pid_lfsr;
+            __mqtt_session_store_resume(client);
+            store->number_of_restored_messages = client->mq.length;
+        } else {
+            rv = MQTT_ERROR_SESSION_STORE_CORRUPT;
+        }
+        store->restored = 0;
+    }
+
+    __mqtt_session_store_update(client);
+    if (__mqtt_session_store_commit(client) != MQTT_OK) {
+        rv = MQTT_ERROR_SESSION_STORE_IO;
+    }
+    return rv;
+}
+
+enum MQTTErrors mqtt_session_store_commit(struct mqtt_client *client)
+{
+    enum MQTTErrors rv;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    rv = __mqtt_session_store_commit(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return rv;
+}
+
+void __mqtt_session_store_update(struct mqtt_client *client)
+{
+    struct mqtt_session_store_header header;
+    if (client->session_store == NULL) {
+        return;
+    }
+    header.magic = MQTT_SESSION_STORE_MAGIC;
+    header.version = MQTT_SESSION_STORE_VERSION;
+    header.size = (uint32_t) client->session_store->size;
+    header.length = (uint32_t) client->mq.length;
+    header.capacity = (uint32_t) client->mq.capacity;
+    header.data_size = (uint32_t) (client->mq.curr - (uint8_t*) client->mq.mem_start);
+    header.pid_lfsr = client->pid_lfsr;
+    memcpy(client->session_store->mem, &header, sizeof(header));
+    client->session_store->dirty = 1;
+}
+
+void __mqtt_session_store_resume(struct mqtt_client *client)
+{
+    mqtt_mq_resume(&client->mq);
+    __mqtt_session_store_update(client);
+}
+
+enum MQTTErrors __mqtt_session_store_commit(struct mqtt_client *client)
+{
+    struct mqtt_session_store *store = client->session_store;
+    if (store == NULL || !store->dirty) {
+        return MQTT_OK;
+    }
+    if (mqtt_pal_sync_file(store->mem, store->size, store->handle) != 0) {
+        return MQTT_ERROR_SESSION_STORE_IO;
+    }
+    store->dirty = 0;
+    store->number_of_commits += 1;
+    return MQTT_OK;
+}
+
+/* SPOOL */
+
+/**
+ * Writes the name of segment \p n of \p spool to \p name.
+ */
+static void __mqtt_spool_segment_name(const struct mqtt_spool *spool, uint32_t n, char *name)
+{
+    snprintf(name, MQTT_SPOOL_MAX_PATH + 16, "%s.%08lx", spool->path, (unsigned long) n);
+}
+
+/**
+ * Counts the complete messages in segment \p n and stores the size of its file in 
+ * \p file_size. Returns the number of bytes the complete messages take up, or -1 if the
+ * segment doesn't exist. The two sizes differ if the last message was cut short by a 
+ * crash in the middle of an append.
+ */
+static long __mqtt_spool_scan(const struct mqtt_spool *spool, uint32_t n, size_t *count, long *file_size)
+{
+    char name[MQTT_SPOOL_MAX_PATH + 16];
+    uint32_t packet_size;
+    long size = 0;
+    FILE *f;
+
+    __mqtt_spool_segment_name(spool, n, name);
+    f = fopen(name, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    *count = 0;
+    if (fseek(f, 0, SEEK_END) != 0 || (*file_size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        *file_size = 0;
+    }
+    /* seeking past the end of the file succeeds, so check that each message fits */
+    while (*file_size - size >= (long) sizeof(packet_size)
+           && fread(&packet_size, sizeof(packet_size), 1, f) == 1
+           && packet_size <= (unsigned long) (*file_size - size) - sizeof(packet_size)
+           && fseek(f, (long) packet_size, SEEK_CUR) == 0) 
+    {
+        size += (long) (sizeof(packet_size) + packet_size);
+        *count += 1;
+    }
+    fclose(f);
+    return size;
+}
+
+/**
+ * Records the oldest segment in the spool's head file.
+ */
+static enum MQTTErrors __mqtt_spool_write_head(const struct mqtt_spool *spool)
+{
+    char name[MQTT_SPOOL_MAX_PATH + 16];
+    FILE *f;
+    int ok;
+
+    snprintf(name, sizeof(name), "%s.head", spool->path);
+    f = fopen(name, "wb");
+    if (f == NULL) {
+        return MQTT_ERROR_SPOOL_IO;
+    }
+    ok = fwrite(&spool->first_segment, sizeof(spool->first_segment), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    return ok ? MQTT_OK : MQTT_ERROR_SPOOL_IO;
+}
+
+/**
+ * Deletes the oldest segment. Returns the number of undrained messages that were in it.
+ */
+static size_t __mqtt_spool_remove_first(struct mqtt_spool *spool)
+{
+    char name[MQTT_SPOOL_MAX_PATH + 16];
+    size_t count = 0, drained = 0;
+    long size, file_size;
+
+    size = __mqtt_spool_scan(spool, spool->first_segment, &count, &file_size);
+    if (spool->read_file != NULL) {
+        /* count the messages that were already drained */
+        long position = ftell(spool->read_file);
+        uint32_t packet_size;
+        fseek(spool->read_file, 0, SEEK_SET);
+        while (ftell(spool->read_file) < position && fread(&packet_size, sizeof(packet_size), 1, spool->read_file) == 1) {
+            fseek(spool->read_file, (long) packet_size, SEEK_CUR);
+            ++drained;
+        }
+        fclose(spool->read_file);
+        spool->read_file = NULL;
+    }
+    if (spool->first_segment == spool->last_segment) {
+        if (spool->write_file != NULL) {
+            fclose(spool->write_file);
+            spool->write_file = NULL;
+        }
+        spool->write_offset = 0;
+        spool->last_segment += 1;
+    }
+    __mqtt_spool_segment_name(spool, spool->first_segment, name);
+    remove(name);
+    spool->first_segment += 1;
+    __mqtt_spool_write_head(spool);
+
+    if (size > 0) {
+        spool->bytes_on_disk -= (size_t) size;
+    }
+    count = count > drained ? count - drained : 0;
+    count = count < spool->length ? count : spool->length;
+    spool->length -= count;
+    return count;
+}
+
+enum MQTTErrors mqtt_spool_open(struct mqtt_spool *spool, const char *path, size_t segment_size, 
+                                size_t max_bytes, enum MQTTSpoolDropPolicy drop_policy)
+{
+    char name[MQTT_SPOOL_MAX_PATH + 16];
+    size_t path_length = strlen(path);
+    size_t count;
+    uint32_t n;
+    long size = 0, file_size;
+    FILE *f;
+
+    if (path_length >= MQTT_SPOOL_MAX_PATH) {
+        return MQTT_ERROR_SPOOL_IO;
+    }
+    memcpy(spool->path, path, path_length + 1);
+    spool->segment_size = segment_size;
+    spool->max_bytes = max_bytes;
+    spool->drop_policy = drop_policy;
+    spool->drain_rate = 0;
+    spool->read_file = NULL;
+    spool->write_file = NULL;
+    spool->bytes_on_disk = 0;
+    spool->length = 0;
+    spool->drain_budget = 0;
+    spool->time_of_last_drain = 0;
+    spool->number_of_spooled = 0;
+    spool->number_of_drained = 0;
+    spool->number_of_dropped_oldest = 0;
+    spool->number_of_dropped_newest = 0;
+
+    /* find the oldest segment */
+    spool->first_segment = 0;
+    snprintf(name, sizeof(name), "%s.head", spool->path);
+    f = fopen(name, "rb");
+    if (f != NULL) {
+        if (fread(&spool->first_segment, sizeof(spool->first_segment), 1, f) != 1) {
+            spool->first_segment = 0;
+        }
+        fclose(f);
+    } else if (__mqtt_spool_write_head(spool) != MQTT_OK) {
+        return MQTT_ERROR_SPOOL_IO;
+    }
+
+    /* count what the segments hold */
+    spool->last_segment = spool->first_segment;
+    spool->write_offset = 0;
+    for(n = spool->first_segment; (size = __mqtt_spool_scan(spool, n, &count, &file_size)) >= 0; ++n) {
+        if (size < file_size) {
+            /* cut off a message whose append didn't finish, so new ones follow whole ones */
+            __mqtt_spool_segment_name(spool, n, name);
+            if (mqtt_pal_truncate_file(name, (size_t) size) != 0) {
+                return MQTT_ERROR_SPOOL_IO;
+            }
+        }
+        spool->bytes_on_disk += (size_t) size;
+        spool->length += count;
+        spool->last_segment = n;
+        spool->write_offset = (size_t) size;
+    }
+    return MQTT_OK;
+}
+
+void mqtt_spool_close(struct mqtt_spool *spool)
+{
+    if (spool->read_file != NULL) {
+        fclose(spool->read_file);
+        spool->read_file = NULL;
+    }
+    if (spool->write_file != NULL) {
+        fclose(spool->write_file);
+        spool->write_file = NULL;
+    }
+}
+
+/**
+ * Cuts off what a failed append left at the end of the last segment, so later messages 
+ * follow whole ones. If that fails too, the segment is closed for good and the next append
+ * starts a new one; the drain skips the partial message at its end.
+ */
+static void __mqtt_spool_undo_append(struct mqtt_spool *spool)
+{
+    char name[MQTT_SPOOL_MAX_PATH + 16];
+    fclose(spool->write_file);
+    spool->write_file = NULL;
+    __mqtt_spool_segment_name(spool, spool->last_segment, name);
+    if (mqtt_pal_truncate_file(name, spool->write_offset) != 0) {
+        spool->last_segment += 1;
+        spool->write_offset = 0;
+    }
+}
+
+enum MQTTErrors __mqtt_spool_append(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags)
+{
+    struct mqtt_spool *spool = client->spool;
+    size_t packet_size;
+    uint32_t record_size, packet_length;
+    uint8_t *record;
+    ssize_t rv;
+    int ok;
+
+    if (topic_name == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    } else if ((publish_flags & MQTT_PUBLISH_QOS_MASK) == MQTT_PUBLISH_QOS_MASK) {
+        return MQTT_ERROR_PUBLISH_FORBIDDEN_QOS;
+    }
+
+    /* work out the size of the packet */
+    packet_size = __mqtt_publish_packet_size(client, topic_name, application_message_size, publish_flags);
+    record_size = (uint32_t) (sizeof(uint32_t) + packet_size);
+
+    /* make room according to the drop policy */
+    while (spool->bytes_on_disk + record_size > spool->max_bytes) {
+        if (spool->drop_policy == MQTT_SPOOL_DROP_NEWEST || spool->bytes_on_disk == 0) {
+            spool->number_of_dropped_newest += 1;
+            return MQTT_OK;
+        }
+        spool->number_of_dropped_oldest += __mqtt_spool_remove_first(spool);
+    }
+
+    /* start a new segment once this one is full */
+    if (spool->write_offset > 0 && spool->write_offset + record_size > spool->segment_size) {
+        if (spool->write_file != NULL) {
+            fclose(spool->write_file);
+            spool->write_file = NULL;
+        }
+        spool->last_segment += 1;
+        spool->write_offset = 0;
+    }
+    if (spool->write_file == NULL) {
+        char name[MQTT_SPOOL_MAX_PATH + 16];
+        __mqtt_spool_segment_name(spool, spool->last_segment, name);
+        spool->write_file = fopen(name, "ab");
+        if (spool->write_file == NULL) {
+            return MQTT_ERROR_SPOOL_IO;
+        }
+        /* records are written whole, so a buffer would only copy them once more */
+        setvbuf(spool->write_file, NULL, _IONBF, 0);
+    }
+
+    /* pack the size and the packet together (the packet id is filled in when it's drained) */
+    record = (uint8_t*) __mqtt_scratch_alloc(client, record_size);
+    if (record == NULL) {
+        return MQTT_ERROR_SPOOL_IO;
+    }
+    rv = __mqtt_pack_client_publish(client, record + sizeof(packet_length), packet_size, topic_name, 0, 0, application_message, application_message_size, publish_flags);
+    if (rv != (ssize_t) packet_size) {
+        __mqtt_scratch_free(client, record, record_size);
+        return rv < 0 ? (enum MQTTErrors) rv : MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    packet_length = (uint32_t) packet_size;
+    memcpy(record, &packet_length, sizeof(packet_length));
+    ok = fwrite(record, record_size, 1, spool->write_file) == 1 && fflush(spool->write_file) == 0;
+    __mqtt_scratch_free(client, record, record_size);
+    if (!ok) {
+        __mqtt_spool_undo_append(spool);
+        return MQTT_ERROR_SPOOL_IO;
+    }
+
+    spool->write_offset += record_size;
+    spool->bytes_on_disk += record_size;
+    spool->length += 1;
+    spool->number_of_spooled += 1;
+    return MQTT_OK;
+}
+
+enum MQTTErrors __mqtt_spool_drain(struct mqtt_client *client)
+{
+    struct mqtt_spool *spool = client->spool;
+    struct mqtt_response response;
+    mqtt_pal_time_t now = MQTT_PAL_TIME();
+    uint32_t packet_size;
+    uint16_t packet_id;
+    long record_start;
+    size_t msg;
+    ssize_t rv;
+
+    if (spool->drain_rate > 0 && now != spool->time_of_last_drain) {
+        spool->time_of_last_drain = now;
+        spool->drain_budget = spool->drain_rate;
+    }
+
+    while (spool->length > 0 && (spool->drain_rate == 0 || spool->drain_budget > 0)) {
+        if (spool->read_file == NULL) {
+            char name[MQTT_SPOOL_MAX_PATH + 16];
+            __mqtt_spool_segment_name(spool, spool->first_segment, name);
+            spool->read_file = fopen(name, "rb");
+            if (spool->read_file == NULL) {
+                return MQTT_ERROR_SPOOL_IO;
+            }
+        }
+
+        /* pick up what was appended since the last read */
+        fseek(spool->read_file, 0, SEEK_CUR);
+        record_start = ftell(spool->read_file);
+        if (fread(&packet_size, sizeof(packet_size), 1, spool->read_file) != 1) {
+            if (spool->first_segment == spool->last_segment) {
+                /* try again on the next send */
+                clearerr(spool->read_file);
+                fseek(spool->read_file, record_start, SEEK_SET);
+                return MQTT_ERROR_SPOOL_IO;
+            }
+            /* this segment is drained */
+            __mqtt_spool_remove_first(spool);
+            continue;
+        }
+
+        /* read the packet straight into the queue */
+        if (packet_size > client->mq.curr_sz) {
+            mqtt_mq_clean(&client->mq);
+            while (packet_size > client->mq.curr_sz && mqtt_mq_grow(&client->mq));
+            __mqtt_session_store_update(client);
+            if (packet_size > client->mq.curr_sz) {
+                /* try again once the queue has drained */
+                fseek(spool->read_file, record_start, SEEK_SET);
+                break;
+            }
+        }
+        if (fread(client->mq.curr, packet_size, 1, spool->read_file) != 1) {
+            if (spool->first_segment != spool->last_segment) {
+                /* a partial message that couldn't be cut off ends the segment */
+                __mqtt_spool_remove_first(spool);
+                continue;
+            }
+            /* try again on the next send */
+            clearerr(spool->read_file);
+            fseek(spool->read_file, record_start, SEEK_SET);
+            return MQTT_ERROR_SPOOL_IO;
+        }
+        rv = mqtt_unpack_fixed_header(&response, client->mq.curr, packet_size);
+        if (rv <= 0 || response.fixed_header.control_type != MQTT_CONTROL_PUBLISH) {
+            return MQTT_ERROR_SPOOL_IO;
+        }
+        packet_id = 0;
+        if (response.fixed_header.control_flags & MQTT_PUBLISH_QOS_MASK) {
+            size_t topic_length = ((size_t) client->mq.curr[rv] << 8) | client->mq.curr[rv + 1];
+            packet_id = __mqtt_next_pid(client);
+            __mqtt_pack_uint16(client->mq.curr + rv + 2 + topic_length, packet_id);
+        }
+        msg = mqtt_mq_register(&client->mq, packet_size);
+        client->mq.packet_id[msg] = packet_id;
+        __mqtt_check_send_buffer_watermarks(client);
+        __mqtt_session_store_update(client);
+
+        spool->length -= 1;
+        spool->number_of_drained += 1;
+        if (spool->drain_budget > 0) {
+            spool->drain_budget -= 1;
+        }
+    }
+
+    /* everything has been drained, start over with empty segments */
+    if (spool->length == 0) {
+        while (spool->first_segment != spool->last_segment) {
+            __mqtt_spool_remove_first(spool);
+        }
+        __mqtt_spool_remove_first(spool);
+        spool->bytes_on_disk = 0;
+    }
+    return MQTT_OK;
+}
+
+/* RECEIVE BUFFER POOL */
+size_t mqtt_recv_buffer_pool_init(struct mqtt_recv_buffer_pool *pool, void *buf, size_t bufsz, size_t block_size)
+{
+    uint8_t *block = (uint8_t*) buf;
+    MQTT_PAL_MUTEX_INIT(&pool->mutex);
+    pool->block_size = block_size;
+    pool->free_list = NULL;
+    pool->number_of_blocks = 0;
+    pool->number_of_exhaustions = 0;
+    for(; bufsz >= block_size; bufsz -= block_size, block += block_size) {
+        /* the free list's links are stored in the blocks themselves */
+        memcpy(block, &pool->free_list, sizeof(uint8_t*));
+        pool->free_list = block;
+        pool->number_of_blocks += 1;
+    }
+    pool->number_of_free_blocks = pool->number_of_blocks;
+    return pool->number_of_blocks;
+}
+
+uint8_t* mqtt_recv_buffer_pool_acquire(struct mqtt_recv_buffer_pool *pool)
+{
+    uint8_t *block;
+    MQTT_PAL_MUTEX_LOCK(&pool->mutex);
+    block = pool->free_list;
+    if (block != NULL) {
+        memcpy(&pool->free_list, block, sizeof(uint8_t*));
+        pool->number_of_free_blocks -= 1;
+    } else {
+        pool->number_of_exhaustions += 1;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&pool->mutex);
+    return block;
+}
+
+void mqtt_recv_buffer_pool_release(struct mqtt_recv_buffer_pool *pool, uint8_t *block)
+{
+    MQTT_PAL_MUTEX_LOCK(&pool->mutex);
+    memcpy(block, &pool->free_list, sizeof(uint8_t*));
+    pool->free_list = block;
+    pool->number_of_free_blocks += 1;
+    MQTT_PAL_MUTEX_UNLOCK(&pool->mutex);
+}
+
+/* CLIENT POOL */
+
+/**
+ * Connects/reconnects one of the pool's clients through the pool's reconnect callback.
+ * Installed as the reconnect callback of every client in the pool.
+ */
+static void __mqtt_client_pool_reconnect(struct mqtt_client *client, void **state)
+{
+    struct mqtt_client_pool *pool = (struct mqtt_client_pool*) *state;
+    struct mqtt_client_pool_member *member = (struct mqtt_client_pool_member*) client;
+    size_t index = (size_t) (member - pool->clients);
+    char client_id[MQTT_CLIENT_POOL_MAX_CLIENT_ID_PREFIX + 24];
+
+    if (client->error != MQTT_ERROR_INITIAL_RECONNECT) {
+        member->number_of_reconnects += 1;
+    }
+    snprintf(client_id, sizeof(client_id), "%s-%lu", pool->client_id_prefix, (unsigned long) index);
+    pool->reconnect_callback(pool, index, client_id, &pool->reconnect_state);
+}
+
+enum MQTTErrors mqtt_client_pool_init(struct mqtt_client_pool *pool,
+                                      struct mqtt_client_pool_member *clients, size_t number_of_clients,
+                                      const char *client_id_prefix,
+                                      void (*reconnect_callback)(struct mqtt_client_pool *, size_t, const char *, void **),
+                                      void *reconnect_state,
+                                      void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    size_t i;
+    if (pool == NULL || clients == NULL || number_of_clients == 0 || client_id_prefix == NULL || reconnect_callback == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (strlen(client_id_prefix) > MQTT_CLIENT_POOL_MAX_CLIENT_ID_PREFIX) {
+        return MQTT_ERROR_CLIENT_ID_TOO_LONG;
+    }
+
+    pool->clients = clients;
+    pool->number_of_clients = number_of_clients;
+    pool->client_id_prefix = client_id_prefix;
+    pool->reconnect_callback = reconnect_callback;
+    pool->reconnect_state = reconnect_state;
+    for(i = 0; i < number_of_clients; ++i) {
+        mqtt_init_reconnect(&clients[i].client, __mqtt_client_pool_reconnect, pool, publish_response_callback);
+        clients[i].number_of_publishes = 0;
+        clients[i].number_of_reconnects = 0;
+    }
+    return MQTT_OK;
+}
+
+struct mqtt_client* mqtt_client_pool_route(struct mqtt_client_pool *pool, const char *topic_name)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    const uint8_t *c;
+    for(c = (const uint8_t*) topic_name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return &pool->clients[hash % pool->number_of_clients].client;
+}
+
+enum MQTTErrors mqtt_client_pool_publish(struct mqtt_client_pool *pool,
+                                         const char* topic_name,
+                                         void* application_message,
+                                         size_t application_message_size,
+                                         uint8_t publish_flags)
+{
+    struct mqtt_client *client = mqtt_client_pool_route(pool, topic_name);
+    enum MQTTErrors rv = mqtt_publish(client, topic_name, application_message, application_message_size, publish_flags);
+    if (rv == MQTT_OK) {
+        /* the member's counters are protected by its client's mutex */
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        ((struct mqtt_client_pool_member*) client)->number_of_publishes += 1;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    }
+    return rv;
+}
+
+enum MQTTErrors mqtt_client_pool_sync(struct mqtt_client_pool *pool)
+{
+    enum MQTTErrors rv = MQTT_OK;
+    size_t i;
+    for(i = 0; i < pool->number_of_clients; ++i) {
+        enum MQTTErrors err = mqtt_sync(&pool->clients[i].client);
+        if (err != MQTT_OK && rv == MQTT_OK) {
+            rv = err;
+        }
+    }
+    return rv;
+}
+
+void mqtt_client_pool_get_stats(struct mqtt_client_pool *pool, struct mqtt_client_pool_stats *stats)
+{
+    size_t i;
+    memset(stats, 0, sizeof(*stats));
+    for(i = 0; i < pool->number_of_clients; ++i) {
+        struct mqtt_client_pool_member *member = &pool->clients[i];
+        MQTT_PAL_MUTEX_LOCK(&member->client.mutex);
+        if (member->client.error == MQTT_OK) {
+            stats->number_of_connected_clients += 1;
+        }
+        stats->number_of_publishes += member->number_of_publishes;
+        stats->number_of_reconnects += member->number_of_reconnects;
+        stats->number_of_keep_alives += (size_t) member->client.number_of_keep_alives;
+        stats->number_of_timeouts += (size_t) member->client.number_of_timeouts;
+        stats->send_buffer_bytes_in_use += mqtt_mq_bytes_used(&member->client.mq);
+        stats->typical_response_time += member->client.typical_response_time;
+        MQTT_PAL_MUTEX_UNLOCK(&member->client.mutex);
+    }
+    stats->typical_response_time /= (double) pool->number_of_clients;
+}
+
+void mqtt_client_pool_deinit(struct mqtt_client_pool *pool)
+{
+    size_t i;
+    for(i = 0; i < pool->number_of_clients; ++i) {
+        mqtt_deinit(&pool->clients[i].client);
+    }
+}
+
+/* REACTOR */
+
+enum MQTTErrors mqtt_reactor_init(struct mqtt_reactor *reactor)
+{
+    size_t i;
+    if (reactor == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (mqtt_pal_wakeup_open(&reactor->wakeup) != 0) {
+        return MQTT_ERROR_REACTOR;
+    }
+    reactor->poller = mqtt_pal_poller_open(reactor->wakeup);
+    if (reactor->poller == NULL) {
+        mqtt_pal_wakeup_close(reactor->wakeup);
+        return MQTT_ERROR_REACTOR;
+    }
+    MQTT_PAL_MUTEX_INIT(&reactor->mutex);
+    reactor->pending = NULL;
+    for(i = 0; i < MQTT_REACTOR_WHEEL_SIZE; ++i) {
+        reactor->wheel[i] = NULL;
+    }
+    reactor->wheel_time = MQTT_PAL_TIME();
+    reactor->number_of_clients = 0;
+    reactor->number_of_syncs = 0;
+    reactor->number_of_expirations = 0;
+    reactor->interval_ms = 100;
+    reactor->interval = 0;
+    reactor->interval_start_us = mqtt_pal_clock_us();
+    reactor->busy_us = 0;
+    reactor->last_busy_us = 0;
+    reactor->utilization = 0.0;
+    reactor->group = NULL;
+    reactor->steal_request = -1;
+    reactor->removals = NULL;
+    mqtt_pal_cond_init(&reactor->removals_done);
+    reactor->number_of_migrations = 0;
+    return MQTT_OK;
+}
+
+/**
+ * Takes \p client out of the timer wheel.
+ */
+static void __mqtt_reactor_unschedule(struct mqtt_reactor *reactor, struct mqtt_client *client)
+{
+    if (client->reactor.deadline == 0) {
+        return;
+    }
+    if (client->reactor.prev != NULL) {
+        client->reactor.prev->reactor.next = client->reactor.next;
+    } else {
+        reactor->wheel[client->reactor.deadline % MQTT_REACTOR_WHEEL_SIZE] = client->reactor.next;
+    }
+    if (client->reactor.next != NULL) {
+        client->reactor.next->reactor.prev = client->reactor.prev;
+    }
+    client->reactor.deadline = 0;
+}
+
+/**
+ * Puts \p client in the timer wheel slot of \p deadline.
+ */
+static void __mqtt_reactor_schedule(struct mqtt_reactor *reactor, struct mqtt_client *client, mqtt_pal_time_t deadline)
+{
+    struct mqtt_client **slot;
+    __mqtt_reactor_unschedule(reactor, client);
+
+    /* the slots up to wheel_time were already expired */
+    if (deadline <= reactor->wheel_time) {
+        deadline = reactor->wheel_time + 1;
+    }
+    slot = &reactor->wheel[deadline % MQTT_REACTOR_WHEEL_SIZE];
+    client->reactor.deadline = deadline;
+    client->reactor.prev = NULL;
+    client->reactor.next = *slot;
+    if (*slot != NULL) {
+        (*slot)->reactor.prev = client;
+    }
+    *slot = client;
+}
+
+/**
+ * Returns when \ref mqtt_sync has to be called next for a keep-alive or a resend.
+ */
+static mqtt_pal_time_t __mqtt_reactor_next_deadline(struct mqtt_client *client)
+{
+    mqtt_pal_time_t deadline;
+    uint64_t now_us = mqtt_pal_clock_us();
+    uint64_t resend_us = UINT64_MAX;
+    uint64_t rto_us;
+    ssize_t i;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    /* __mqtt_send pings, resends and gives up on the broker once these times have passed */
+    deadline = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive) * 0.75) + 1;
+    rto_us = __mqtt_rto(client);
+    for(i = 0; i < mqtt_mq_length(&client->mq); ++i) {
+        uint64_t t;
+        if (client->mq.state[i] != MQTT_QUEUED_AWAITING_ACK) {
+            continue;
+        }
+        if (client->mq.control_type[i] == MQTT_CONTROL_PINGREQ && client->keep_alive_response_fraction > 0) {
+            t = __mqtt_keep_alive_deadline(client, (size_t) i);
+        } else {
+            t = client->mq.time_sent[i] + rto_us;
+        }
+        if (t < resend_us) {
+            resend_us = t;
+        }
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    if (resend_us != UINT64_MAX) {
+        /* the wheel counts whole seconds */
+        mqtt_pal_time_t resend = MQTT_PAL_TIME() + (mqtt_pal_time_t) ((resend_us > now_us ? resend_us - now_us : 0) / 1000000u) + 1;
+        if (resend < deadline) {
+            deadline = resend;
+        }
+    }
+    return deadline;
+}
+
+/**
+ * Returns the time spent syncing \p client in the reactor's last measurement interval.
+ */
+static uint64_t __mqtt_reactor_last_work(struct mqtt_reactor *reactor, struct mqtt_client *client)
+{
+    if (client->reactor.work_interval == reactor->interval) {
+        return client->reactor.last_work_us;
+    } else if (client->reactor.work_interval + 1 == reactor->interval) {
+        return client->reactor.work_us;
+    }
+    return 0;
+}
+
+/**
+ * Syncs \p client, keeps its socket registered and schedules its next deadline.
+ */
+static void __mqtt_reactor_sync(struct mqtt_reactor *reactor, struct mqtt_client *client)
+{
+    enum MQTTErrors rv;
+    int broken;
+    uint64_t start, work;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    broken = client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    start = mqtt_pal_clock_us();
+    rv = mqtt_sync(client);
+    work = mqtt_pal_clock_us() - start;
+    reactor->number_of_syncs += 1;
+
+    /* charge the work to the client's current interval */
+    if (client->reactor.work_interval != reactor->interval) {
+        client->reactor.last_work_us = __mqtt_reactor_last_work(reactor, client);
+        client->reactor.work_us = 0;
+        client->reactor.work_interval = reactor->interval;
+    }
+    client->reactor.work_us += work;
+    reactor->busy_us += work;
+
+    /* a reconnect may have replaced the socket with one that has the same descriptor */
+    if (client->reactor.registered && (broken || rv != MQTT_OK || client->reactor.socketfd != client->socketfd)) {
+        mqtt_pal_poller_remove(reactor->poller, client->reactor.socketfd);
+        client->reactor.registered = 0;
+    }
+    if (rv == MQTT_OK && !client->reactor.registered) {
+        client->reactor.socketfd = client->socketfd;
+        client->reactor.registered = mqtt_pal_poller_add(reactor->poller, client->socketfd, client) == 0;
+    }
+
+    /* a broken socket is always readable, so it's left out and retried every second */
+    __mqtt_reactor_schedule(reactor, client, rv == MQTT_OK ? __mqtt_reactor_next_deadline(client) : MQTT_PAL_TIME() + 1);
+}
+
+void __mqtt_reactor_notify(struct mqtt_client *client)
+{
+    struct mqtt_reactor *reactor = client->reactor.reactor;
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    if (!client->reactor.pending) {
+        client->reactor.pending = 1;
+        client->reactor.next_pending = reactor->pending;
+        /* the list is only empty while the reactor might be waiting */
+        if (reactor->pending == NULL) {
+            mqtt_pal_wakeup_signal(reactor->wakeup);
+        }
+        reactor->pending = client;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+}
+
+enum MQTTErrors mqtt_reactor_add(struct mqtt_reactor *reactor, struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->reactor.reactor != NULL || client->io_thread.running) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_REACTOR;
+    }
+    client->reactor.reactor = reactor;
+    client->reactor.registered = 0;
+    client->reactor.deadline = 0;
+    client->reactor.pending = 0;
+    client->reactor.work_us = 0;
+    client->reactor.last_work_us = 0;
+    client->reactor.work_interval = 0;
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    reactor->number_of_clients += 1;
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+
+    /* the first sync registers the socket */
+    __mqtt_reactor_notify(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_reactor_remove(struct mqtt_reactor *reactor, struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->reactor.reactor != reactor) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return;
+    }
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    if (client->reactor.pending) {
+        struct mqtt_client **link = &reactor->pending;
+        while (*link != client) {
+            link = &(*link)->reactor.next_pending;
+        }
+        *link = client->reactor.next_pending;
+        client->reactor.pending = 0;
+    }
+    reactor->number_of_clients -= 1;
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+    client->reactor.reactor = NULL;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    /* the poller and the wheel are only touched by the thread running the reactor */
+    if (client->reactor.registered) {
+        mqtt_pal_poller_remove(reactor->poller, client->reactor.socketfd);
+        client->reactor.registered = 0;
+    }
+    __mqtt_reactor_unschedule(reactor, client);
+}
+
+enum MQTTErrors mqtt_reactor_run_once(struct mqtt_reactor *reactor, int timeout_ms)
+{
+    void *ready[64];
+    struct mqtt_client *client, *expired = NULL;
+    mqtt_pal_time_t now;
+    uint64_t now_us;
+    int n, i;
+
+    if (timeout_ms < 0 || timeout_ms > 1000) {
+        timeout_ms = 1000;
+    }
+    n = mqtt_pal_poller_wait(reactor->poller, ready, sizeof(ready) / sizeof(ready[0]), timeout_ms);
+    if (n < 0) {
+        return MQTT_ERROR_REACTOR;
+    }
+
+    /* the clients whose sockets are readable */
+    for(i = 0; i < n; ++i) {
+        __mqtt_reactor_sync(reactor, (struct mqtt_client*) ready[i]);
+    }
+
+    /* the clients that queued something to send */
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    client = reactor->pending;
+    reactor->pending = NULL;
+    for(; client != NULL; client = client->reactor.next_pending) {
+        client->reactor.pending = 0;
+        __mqtt_reactor_unschedule(reactor, client);
+        client->reactor.next = expired;
+        expired = client;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+
+    /* the clients whose deadline passed (each slot is visited once per lap of the wheel) */
+    now = MQTT_PAL_TIME();
+    if (now > reactor->wheel_time) {
+        mqtt_pal_time_t t = reactor->wheel_time + 1;
+        if (now - reactor->wheel_time > MQTT_REACTOR_WHEEL_SIZE) {
+            t = now - MQTT_REACTOR_WHEEL_SIZE + 1;
+        }
+        for(; t <= now; ++t) {
+            struct mqtt_client *next;
+            for(client = reactor->wheel[t % MQTT_REACTOR_WHEEL_SIZE]; client != NULL; client = next) {
+                next = client->reactor.next;
+                if (client->reactor.deadline <= now) {
+                    __mqtt_reactor_unschedule(reactor, client);
+                    client->reactor.next = expired;
+                    expired = client;
+                    reactor->number_of_expirations += 1;
+                }
+            }
+        }
+        reactor->wheel_time = now;
+    }
+
+    /* sync them once everything is unlinked, since syncing reschedules */
+    while (expired != NULL) {
+        client = expired;
+        expired = client->reactor.next;
+        __mqtt_reactor_sync(reactor, client);
+    }
+
+    /* end the measurement interval */
+    now_us = mqtt_pal_clock_us();
+    if (now_us - reactor->interval_start_us >= (uint64_t) reactor->interval_ms * 1000) {
+        MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+        reactor->utilization = (double) reactor->busy_us / (double) (now_us - reactor->interval_start_us);
+        MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+        reactor->last_busy_us = reactor->busy_us;
+        reactor->busy_us = 0;
+        reactor->interval += 1;
+        reactor->interval_start_us = now_us;
+    }
+    return MQTT_OK;
+}
+
+void mqtt_reactor_deinit(struct mqtt_reactor *reactor)
+{
+    size_t i;
+    while (reactor->pending != NULL) {
+        mqtt_reactor_remove(reactor, reactor->pending);
+    }
+    for(i = 0; i < MQTT_REACTOR_WHEEL_SIZE; ++i) {
+        while (reactor->wheel[i] != NULL) {
+            mqtt_reactor_remove(reactor, reactor->wheel[i]);
+        }
+    }
+    mqtt_pal_poller_close(reactor->poller);
+    mqtt_pal_wakeup_close(reactor->wakeup);
+}
+
+enum MQTTErrors mqtt_reactor_group_init(struct mqtt_reactor_group *group, 
+                                        struct mqtt_reactor *reactors, size_t number_of_reactors)
+{
+    size_t i;
+    if (group == NULL || reactors == NULL || number_of_reactors == 0) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    for(i = 0; i < number_of_reactors; ++i) {
+        if (mqtt_reactor_init(&reactors[i]) != MQTT_OK) {
+            while (i > 0) {
+                mqtt_reactor_deinit(&reactors[--i]);
+            }
+            return MQTT_ERROR_REACTOR;
+        }
+        reactors[i].group = group;
+    }
+    group->reactors = reactors;
+    group->number_of_reactors = number_of_reactors;
+    MQTT_PAL_MUTEX_INIT(&group->mutex);
+    group->running = 0;
+    group->stopping = 0;
+    group->steal_threshold = 0.25;
+    return MQTT_OK;
+}
+
+/**
+ * Moves the busiest client of \p reactor that is worth moving to \p thief.
+ */
+static void __mqtt_reactor_give_client(struct mqtt_reactor *reactor, struct mqtt_reactor *thief)
+{
+    struct mqtt_client *client, *hottest = NULL;
+    uint64_t hottest_work = 0;
+    size_t i, number_of_clients;
+
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    number_of_clients = reactor->number_of_clients;
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+    if (number_of_clients < 2) {
+        return;
+    }
+
+    /* every client that was synced is in the wheel */
+    for(i = 0; i < MQTT_REACTOR_WHEEL_SIZE; ++i) {
+        for(client = reactor->wheel[i]; client != NULL; client = client->reactor.next) {
+            uint64_t work = __mqtt_reactor_last_work(reactor, client);
+            if (work > hottest_work && 2 * work <= reactor->last_busy_us) {
+                hottest = client;
+                hottest_work = work;
+            }
+        }
+    }
+    if (hottest != NULL) {
+        mqtt_reactor_remove(reactor, hottest);
+        mqtt_reactor_add(thief, hottest);
+        reactor->number_of_migrations += 1;
+    }
+}
+
+/**
+ * Asks the busiest reactor of the group for a client if \p reactor is much less busy.
+ */
+static void __mqtt_reactor_group_balance(struct mqtt_reactor_group *group, struct mqtt_reactor *reactor)
+{
+    struct mqtt_reactor *busiest = NULL;
+    double utilization, busiest_utilization = 0.0;
+    size_t i;
+
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    utilization = reactor->utilization;
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+    for(i = 0; i < group->number_of_reactors; ++i) {
+        struct mqtt_reactor *other = &group->reactors[i];
+        double other_utilization;
+        if (other == reactor) {
+            continue;
+        }
+        MQTT_PAL_MUTEX_LOCK(&other->mutex);
+        other_utilization = other->utilization;
+        MQTT_PAL_MUTEX_UNLOCK(&other->mutex);
+        if (other_utilization > busiest_utilization) {
+            busiest = other;
+            busiest_utilization = other_utilization;
+        }
+    }
+
+    if (busiest != NULL && busiest_utilization - utilization > group->steal_threshold) {
+        MQTT_PAL_MUTEX_LOCK(&busiest->mutex);
+        if (busiest->steal_request < 0) {
+            busiest->steal_request = (int) (reactor - group->reactors);
+            mqtt_pal_wakeup_signal(busiest->wakeup);
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&busiest->mutex);
+    }
+}
+
+/**
+ * Removes the clients \ref mqtt_reactor_group_remove asked for. A client that moved to 
+ * another reactor in the meantime is left alone; its remover asks that reactor next.
+ */
+static void __mqtt_reactor_remove_requested(struct mqtt_reactor *reactor)
+{
+    struct mqtt_client *client;
+    MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+    client = reactor->removals;
+    reactor->removals = NULL;
+    MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+    while (client != NULL) {
+        /* the remover may return as soon as its request is done */
+        struct mqtt_client *next = client->reactor.next_removal;
+        mqtt_reactor_remove(reactor, client);
+        MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+        client->reactor.removal_requested = 0;
+        MQTT_PAL_COND_BROADCAST(&reactor->removals_done);
+        MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+        client = next;
+    }
+}
+
+/**
+ * Runs one reactor of a group until \ref mqtt_reactor_group_stop is called.
+ */
+static void* __mqtt_reactor_group_thread(void *arg)
+{
+    struct mqtt_reactor *reactor = (struct mqtt_reactor*) arg;
+    struct mqtt_reactor_group *group = reactor->group;
+    while(1) {
+        size_t interval = reactor->interval;
+        int thief;
+
+        MQTT_PAL_MUTEX_LOCK(&group->mutex);
+        if (group->stopping) {
+            MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+            break;
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+
+        __mqtt_reactor_remove_requested(reactor);
+
+        /* hand a client to a reactor that asked for one */
+        MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+        thief = reactor->steal_request;
+        reactor->steal_request = -1;
+        MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+        if (thief >= 0) {
+            __mqtt_reactor_give_client(reactor, &group->reactors[thief]);
+        }
+
+        if (mqtt_reactor_run_once(reactor, reactor->interval_ms) != MQTT_OK) {
+            break;
+        }
+        if (reactor->interval != interval) {
+            __mqtt_reactor_group_balance(group, reactor);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stops and joins the threads of the first \p number_of_threads reactors.
+ */
+static void __mqtt_reactor_group_join(struct mqtt_reactor_group *group, size_t number_of_threads)
+{
+    size_t i;
+    MQTT_PAL_MUTEX_LOCK(&group->mutex);
+    group->stopping = 1;
+    MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+    for(i = 0; i < number_of_threads; ++i) {
+        mqtt_pal_wakeup_signal(group->reactors[i].wakeup);
+    }
+    for(i = 0; i < number_of_threads; ++i) {
+        mqtt_pal_thread_join(group->reactors[i].thread);
+    }
+    MQTT_PAL_MUTEX_LOCK(&group->mutex);
+    /* the threads are gone, so removals that were asked for since are done here */
+    for(i = 0; i < group->number_of_reactors; ++i) {
+        __mqtt_reactor_remove_requested(&group->reactors[i]);
+    }
+    group->running = 0;
+    group->stopping = 0;
+    MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+}
+
+enum MQTTErrors mqtt_reactor_group_start(struct mqtt_reactor_group *group)
+{
+    size_t i;
+    MQTT_PAL_MUTEX_LOCK(&group->mutex);
+    if (group->running) {
+        MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+        return MQTT_ERROR_REACTOR;
+    }
+    group->running = 1;
+    group->stopping = 0;
+    MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+
+    for(i = 0; i < group->number_of_reactors; ++i) {
+        if (mqtt_pal_thread_start(&group->reactors[i].thread, __mqtt_reactor_group_thread, &group->reactors[i]) != 0) {
+            __mqtt_reactor_group_join(group, i);
+            return MQTT_ERROR_REACTOR;
+        }
+    }
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_reactor_group_add(struct mqtt_reactor_group *group, struct mqtt_client *client)
+{
+    struct mqtt_reactor *target = NULL;
+    size_t i, fewest = 0;
+    for(i = 0; i < group->number_of_reactors; ++i) {
+        size_t number_of_clients;
+        MQTT_PAL_MUTEX_LOCK(&group->reactors[i].mutex);
+        number_of_clients = group->reactors[i].number_of_clients;
+        MQTT_PAL_MUTEX_UNLOCK(&group->reactors[i].mutex);
+        if (target == NULL || number_of_clients < fewest) {
+            target = &group->reactors[i];
+            fewest = number_of_clients;
+        }
+    }
+    return mqtt_reactor_add(target, client);
+}
+
+void mqtt_reactor_group_remove(struct mqtt_reactor_group *group, struct mqtt_client *client)
+{
+    while(1) {
+        struct mqtt_reactor *reactor;
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        reactor = client->reactor.reactor;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        if (reactor == NULL) {
+            return;
+        }
+
+        MQTT_PAL_MUTEX_LOCK(&group->mutex);
+        if (!group->running) {
+            /* no thread runs the reactor, and none is started while the mutex is held */
+            mqtt_reactor_remove(reactor, client);
+            MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+            return;
+        }
+        MQTT_PAL_MUTEX_LOCK(&reactor->mutex);
+        MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+        client->reactor.removal_requested = 1;
+        client->reactor.next_removal = reactor->removals;
+        reactor->removals = client;
+        mqtt_pal_wakeup_signal(reactor->wakeup);
+        while (client->reactor.removal_requested) {
+            mqtt_pal_cond_wait(&reactor->removals_done, &reactor->mutex, UINT64_MAX);
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&reactor->mutex);
+    }
+}
+
+void mqtt_reactor_group_stop(struct mqtt_reactor_group *group)
+{
+    MQTT_PAL_MUTEX_LOCK(&group->mutex);
+    if (!group->running || group->stopping) {
+        MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+        return;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&group->mutex);
+    __mqtt_reactor_group_join(group, group->number_of_reactors);
+}
+
+void mqtt_reactor_group_deinit(struct mqtt_reactor_group *group)
+{
+    size_t i;
+    mqtt_reactor_group_stop(group);
+    for(i = 0; i < group->number_of_reactors; ++i) {
+        mqtt_reactor_deinit(&group->reactors[i]);
+    }
+}
+
+/* ALLOCATORS */
+void* mqtt_allocator_alloc(struct mqtt_allocator *allocator, size_t size)
+{
+    void *ptr = allocator->alloc(allocator->state, size);
+    if (ptr == NULL) {
+        allocator->number_of_failures += 1;
+        return NULL;
+    }
+    allocator->number_of_allocations += 1;
+    allocator->bytes_in_use += size;
+    if (allocator->bytes_in_use > allocator->peak_bytes_in_use) {
+        allocator->peak_bytes_in_use = allocator->bytes_in_use;
+    }
+    return ptr;
+}
+
+void mqtt_allocator_free(struct mqtt_allocator *allocator, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    allocator->free(allocator->state, ptr, size);
+    allocator->number_of_frees += 1;
+    allocator->bytes_in_use -= size;
+}
+
+static void __mqtt_allocator_init(struct mqtt_allocator *allocator,
+                                  void* (*alloc)(void*, size_t),
+                                  void (*free)(void*, void*, size_t),
+                                  void *state)
+{
+    allocator->alloc = alloc;
+    allocator->free = free;
+    allocator->state = state;
+    allocator->bytes_in_use = 0;
+    allocator->peak_bytes_in_use = 0;
+    allocator->number_of_allocations = 0;
+    allocator->number_of_frees = 0;
+    allocator->number_of_failures = 0;
+}
+
+static void* __mqtt_heap_alloc(void *state, size_t size)
+{
+    return MQTT_PAL_MALLOC(size);
+}
+
+static void __mqtt_heap_free(void *state, void *ptr, size_t size)
+{
+    MQTT_PAL_FREE(ptr);
+}
+
+void mqtt_heap_allocator_init(struct mqtt_allocator *allocator)
+{
+    __mqtt_allocator_init(allocator, __mqtt_heap_alloc, __mqtt_heap_free, NULL);
+}
+
+/* arena allocations are aligned to the largest scalar type */
+#define MQTT_ARENA_ALIGNMENT (2 * sizeof(void*))
+
+static void* __mqtt_arena_alloc(void *state, size_t size)
+{
+    struct mqtt_arena *arena = (struct mqtt_arena*) state;
+    size_t offset = (arena->used + MQTT_ARENA_ALIGNMENT - 1) & ~(MQTT_ARENA_ALIGNMENT - 1);
+    if (offset > arena->size || size > arena->size - offset) {
+        return NULL;
+    }
+    arena->used = offset + size;
+    return arena->mem + offset;
+}
+
+static void __mqtt_arena_free(void *state, void *ptr, size_t size)
+{
+    struct mqtt_arena *arena = (struct mqtt_arena*) state;
+    /* only the most recent allocation can be given back */
+    if ((uint8_t*) ptr + size == arena->mem + arena->used) {
+        arena->used = (uint8_t*) ptr - arena->mem;
+    }
+}
+
+void mqtt_arena_allocator_init(struct mqtt_allocator *allocator, struct mqtt_arena *arena, void *buf, size_t bufsz)
+{
+    arena->mem = (uint8_t*) buf;
+    arena->size = bufsz;
+    arena->used = 0;
+    __mqtt_allocator_init(allocator, __mqtt_arena_alloc, __mqtt_arena_free, arena);
+}
+
+void mqtt_arena_reset(struct mqtt_allocator *allocator)
+{
+    ((struct mqtt_arena*) allocator->state)->used = 0;
+    allocator->bytes_in_use = 0;
+}
+
+/**
+ * The header at the start of every slab in a pool. Its size keeps the blocks that follow
+ * it aligned.
+ */
+struct mqtt_pool_slab {
+    struct mqtt_pool_slab *next;
+    size_t size;
+};
+
+/** Returns the size class of \p size or -1 if it is too large for the pool. */
+static int __mqtt_pool_size_class(size_t size)
+{
+    int i = 0;
+    size_t block_size = MQTT_POOL_MIN_BLOCK_SIZE;
+    while (block_size < size) {
+        block_size <<= 1;
+        if (++i == MQTT_POOL_NUM_SIZE_CLASSES) {
+            return -1;
+        }
+    }
+    return i;
+}
+
+static void* __mqtt_pool_alloc(void *state, size_t size)
+{
+    struct mqtt_pool *pool = (struct mqtt_pool*) state;
+    int size_class = __mqtt_pool_size_class(size);
+    void *block;
+
+    if (size_class < 0) {
+        return mqtt_allocator_alloc(pool->backing, size);
+    }
+
+    if (pool->free_lists[size_class] == NULL) {
+        /* carve a new slab into blocks of this size class */
+        size_t block_size = (size_t) MQTT_POOL_MIN_BLOCK_SIZE << size_class;
+        size_t slab_size = pool->slab_size;
+        struct mqtt_pool_slab *slab;
+        uint8_t *curr, *end;
+        if (slab_size < sizeof(struct mqtt_pool_slab) + block_size) {
+            slab_size = sizeof(struct mqtt_pool_slab) + block_size;
+        }
+        slab = (struct mqtt_pool_slab*) mqtt_allocator_alloc(pool->backing, slab_size);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = (struct mqtt_pool_slab*) pool->slabs;
+        slab->size = slab_size;
+        pool->slabs = slab;
+
+        curr = (uint8_t*) (slab + 1);
+        end = (uint8_t*) slab + slab_size;
+        for(; curr + block_size <= end; curr += block_size) {
+            *(void**) curr = pool->free_lists[size_class];
+            pool->free_lists[size_class] = curr;
+        }
+    }
+
+    block = pool->free_lists[size_class];
+    pool->free_lists[size_class] = *(void**) block;
+    return block;
+}
+
+static void __mqtt_pool_free(void *state, void *ptr, size_t size)
+{
+    struct mqtt_pool *pool = (struct mqtt_pool*) state;
+    int size_class = __mqtt_pool_size_class(size);
+
+    if (size_class < 0) {
+        mqtt_allocator_free(pool->backing, ptr, size);
+        return;
+    }
+    *(void**) ptr = pool->free_lists[size_class];
+    pool->free_lists[size_class] = ptr;
+}
+
+void mqtt_pool_allocator_init(struct mqtt_allocator *allocator, struct mqtt_pool *pool, struct mqtt_allocator *backing, size_t slab_size)
+{
+    int i;
+    pool->backing = backing;
+    pool->slab_size = slab_size;
+    for(i = 0; i < MQTT_POOL_NUM_SIZE_CLASSES; ++i) {
+        pool->free_lists[i] = NULL;
+    }
+    pool->slabs = NULL;
+    __mqtt_allocator_init(allocator, __mqtt_pool_alloc, __mqtt_pool_free, pool);
 }
 
+void mqtt_pool_deinit(struct mqtt_allocator *allocator)
+{
+    struct mqtt_pool *pool = (struct mqtt_pool*) allocator->state;
+    struct mqtt_pool_slab *slab = (struct mqtt_pool_slab*) pool->slabs;
+    int i;
+
+    while (slab != NULL) {
+        struct mqtt_pool_slab *next = slab->next;
+        mqtt_allocator_free(pool->backing, slab, slab->size);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    for(i = 0; i < MQTT_POOL_NUM_SIZE_CLASSES; ++i) {
+        pool->free_lists[i] = NULL;
+    }
+    allocator->bytes_in_use = 0;
+}
 
 /* RESPONSE UNPACKING */
 ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf, size_t bufsz) {
@@ -1680,6 +5671,44 @@ ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf,
     return buf - start;
 }
 
+ssize_t mqtt_unpack_response_v5(struct mqtt_response* response, const uint8_t *buf, size_t bufsz) {
+    const uint8_t *const start = buf;
+    ssize_t rv = mqtt_unpack_fixed_header(response, buf, bufsz);
+    if (rv <= 0) return rv;
+    else buf += rv;
+    switch(response->fixed_header.control_type) {
+        case MQTT_CONTROL_CONNACK:
+            rv = __mqtt_unpack_connack_response_v5(response, buf);
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            rv = __mqtt_unpack_publish_response_v5(response, buf);
+            break;
+        case MQTT_CONTROL_PUBACK:
+        case MQTT_CONTROL_PUBREC:
+        case MQTT_CONTROL_PUBREL:
+        case MQTT_CONTROL_PUBCOMP:
+            rv = __mqtt_unpack_pubxxx_response_v5(response, buf);
+            break;
+        case MQTT_CONTROL_SUBACK:
+            rv = __mqtt_unpack_suback_response_v5(response, buf);
+            break;
+        case MQTT_CONTROL_UNSUBACK:
+            rv = __mqtt_unpack_unsuback_response_v5(response, buf);
+            break;
+        case MQTT_CONTROL_PINGRESP:
+            return rv;
+        case MQTT_CONTROL_DISCONNECT:
+            rv = __mqtt_unpack_disconnect_response_v5(response, buf);
+            break;
+        default:
+            return MQTT_ERROR_RESPONSE_INVALID_CONTROL_TYPE;
+    }
+
+    if (rv < 0) return rv;
+    buf += rv;
+    return buf - start;
+}
+
 /* EXTRA DETAILS */
 ssize_t __mqtt_pack_uint16(uint8_t *buf, uint16_t integer)
 {
@@ -1695,6 +5724,30 @@ uint16_t __mqtt_unpack_uint16(const uint8_t *buf)
   return MQTT_PAL_NTOHS(integer_htons);
 }
 
+ssize_t __mqtt_pack_varint(uint8_t *buf, uint32_t integer)
+{
+    const uint8_t *const start = buf;
+    do {
+        *buf = integer & 0x7F;
+        integer >>= 7;
+        if (integer > 0) *buf |= 0x80;
+    } while (*buf++ & 0x80);
+    return buf - start;
+}
+
+ssize_t __mqtt_unpack_varint(const uint8_t *buf, size_t bufsz, uint32_t *integer)
+{
+    size_t i;
+    *integer = 0;
+    for (i = 0; i < 4 && i < bufsz; ++i) {
+        *integer |= (uint32_t) (buf[i] & 0x7F) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            return (ssize_t) i + 1;
+        }
+    }
+    return MQTT_ERROR_MALFORMED_PROPERTIES;
+}
+
 ssize_t __mqtt_pack_str(uint8_t *buf, const char* str) {
     uint16_t length = strlen(str);
     int i = 0;
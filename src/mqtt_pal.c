@@ -71,6 +71,317 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
     return (ssize_t)(buf - start);
 }
 
+#elif defined(MQTT_USE_IO_URING)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* the user_data of the two kinds of requests */
+#define MQTT_PAL_URING_SEND 1
+#define MQTT_PAL_URING_RECV 2
+
+static int __mqtt_pal_uring_enter(struct mqtt_pal_uring *ring, unsigned to_submit, unsigned min_complete) {
+    int rv;
+    do {
+        ring->number_of_enters += 1;
+        rv = (int) syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete, 
+                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rv < 0 && errno == EINTR);
+    return rv;
+}
+
+static struct io_uring_sqe* __mqtt_pal_uring_get_sqe(struct mqtt_pal_uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*) ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void __mqtt_pal_uring_push_sqe(struct mqtt_pal_uring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static void __mqtt_pal_uring_provide_block(struct mqtt_pal_uring *ring, uint16_t bid) {
+    struct io_uring_buf_ring *br = (struct io_uring_buf_ring*) ring->recv_ring;
+    uint16_t tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (ring->recv_block_count - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ring->recv_blocks + (size_t) bid * ring->recv_block_size);
+    buf->len = (uint32_t) ring->recv_block_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+static int __mqtt_pal_uring_arm_recv(struct mqtt_pal_uring *ring) {
+    struct io_uring_sqe *sqe = __mqtt_pal_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ring->sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = MQTT_PAL_URING_RECV;
+    __mqtt_pal_uring_push_sqe(ring);
+    if (__mqtt_pal_uring_enter(ring, 1, 0) < 0) {
+        return -1;
+    }
+    ring->recv_armed = 1;
+    return 0;
+}
+
+/* Moves the completions out of the completion queue. */
+static void __mqtt_pal_uring_reap(struct mqtt_pal_uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head) {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe*) ring->cqes + (head & *ring->cq_mask);
+        if (cqe->user_data == MQTT_PAL_URING_SEND) {
+            ring->send_result = cqe->res;
+            ring->send_done = 1;
+        } else {
+            /* there is at most one completion per block plus the final one */
+            unsigned i = (ring->recv_first + ring->recv_length) % (ring->recv_block_count + 1);
+            ring->recv_results[i] = cqe->res;
+            ring->recv_flags[i] = cqe->flags;
+            ring->recv_length += 1;
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                ring->recv_armed = 0;
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void* __mqtt_pal_uring_map(int fd, size_t size, off_t offset) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+/* Sets up the ring, returns -1 (with nothing left to undo but the ring's fd) on failure. */
+static int __mqtt_pal_uring_setup(struct mqtt_pal_uring *ring) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = (int) syscall(__NR_io_uring_setup, 8, &params);
+    if (ring->ring_fd < 0) {
+        return -1;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring = __mqtt_pal_uring_map(ring->ring_fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->sqes = __mqtt_pal_uring_map(ring->ring_fd, ring->sqes_size, IORING_OFF_SQES);
+    ring->cq_ring = __mqtt_pal_uring_map(ring->ring_fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    if (ring->sq_ring == NULL || ring->sqes == NULL || ring->cq_ring == NULL) {
+        return -1;
+    }
+    ring->sq_head = (unsigned*) ((uint8_t*) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned*) ((uint8_t*) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) ((uint8_t*) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) ((uint8_t*) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*) ((uint8_t*) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*) ((uint8_t*) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) ((uint8_t*) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (uint8_t*) ring->cq_ring + params.cq_off.cqes;
+
+    /* the receive blocks are buffer group 0 */
+    ring->recv_ring = mmap(NULL, ring->recv_block_count * sizeof(struct io_uring_buf), 
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->recv_ring == MAP_FAILED) {
+        ring->recv_ring = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->recv_ring;
+    reg.ring_entries = ring->recv_block_count;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+    for(i = 0; i < ring->recv_block_count; ++i) {
+        __mqtt_pal_uring_provide_block(ring, (uint16_t) i);
+    }
+
+    /* the ring waits for the socket */
+    fcntl(ring->sockfd, F_SETFL, fcntl(ring->sockfd, F_GETFL) & ~O_NONBLOCK);
+    return __mqtt_pal_uring_arm_recv(ring);
+}
+
+static void __mqtt_pal_uring_teardown(struct mqtt_pal_uring *ring) {
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+    }
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->recv_ring != NULL) munmap(ring->recv_ring, ring->recv_block_count * sizeof(struct io_uring_buf));
+    ring->sq_ring = ring->sqes = ring->cq_ring = ring->recv_ring = NULL;
+}
+
+mqtt_pal_socket_handle mqtt_pal_uring_open(int sockfd, int use_ring, size_t send_buffer_size, 
+                                           size_t recv_block_size, unsigned recv_block_count) {
+    struct mqtt_pal_uring *ring = (struct mqtt_pal_uring*) MQTT_PAL_MALLOC(sizeof(struct mqtt_pal_uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->sockfd = sockfd;
+    ring->ring_fd = -1;
+    if (!use_ring || recv_block_count == 0 || (recv_block_count & (recv_block_count - 1)) != 0 || recv_block_count > 32768) {
+        return ring;
+    }
+
+    ring->send_buffer_size = send_buffer_size;
+    ring->send_buffer = (uint8_t*) MQTT_PAL_MALLOC(send_buffer_size);
+    ring->recv_block_size = recv_block_size;
+    ring->recv_block_count = recv_block_count;
+    ring->recv_blocks = (uint8_t*) MQTT_PAL_MALLOC(recv_block_size * recv_block_count);
+    ring->recv_results = (int32_t*) MQTT_PAL_MALLOC(sizeof(int32_t) * (recv_block_count + 1));
+    ring->recv_flags = (uint32_t*) MQTT_PAL_MALLOC(sizeof(uint32_t) * (recv_block_count + 1));
+    if (ring->send_buffer == NULL || ring->recv_blocks == NULL || ring->recv_results == NULL || ring->recv_flags == NULL
+        || __mqtt_pal_uring_setup(ring) != 0) 
+    {
+        /* fall back to plain send and recv */
+        __mqtt_pal_uring_teardown(ring);
+    }
+    return ring;
+}
+
+void mqtt_pal_uring_close(mqtt_pal_socket_handle fd) {
+    __mqtt_pal_uring_teardown(fd);
+    MQTT_PAL_FREE(fd->send_buffer);
+    MQTT_PAL_FREE(fd->recv_blocks);
+    MQTT_PAL_FREE(fd->recv_results);
+    MQTT_PAL_FREE(fd->recv_flags);
+    MQTT_PAL_FREE(fd);
+}
+
+ssize_t mqtt_pal_flush(mqtt_pal_socket_handle fd) {
+    size_t sent = 0;
+    while (sent < fd->send_buffer_used) {
+        struct io_uring_sqe *sqe = __mqtt_pal_uring_get_sqe(fd);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd->sockfd;
+        sqe->addr = (uint64_t) (uintptr_t) (fd->send_buffer + sent);
+        sqe->len = (uint32_t) (fd->send_buffer_used - sent);
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = MQTT_PAL_URING_SEND;
+        __mqtt_pal_uring_push_sqe(fd);
+
+        /* submit and wait in the same call */
+        fd->send_done = 0;
+        if (__mqtt_pal_uring_enter(fd, 1, 1) < 0) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        __mqtt_pal_uring_reap(fd);
+        while (!fd->send_done) {
+            if (__mqtt_pal_uring_enter(fd, 0, 1) < 0) {
+                return MQTT_ERROR_SOCKET_ERROR;
+            }
+            __mqtt_pal_uring_reap(fd);
+        }
+        if (fd->send_result <= 0) {
+            fd->send_buffer_used = 0;
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        sent += (size_t) fd->send_result;
+    }
+    fd->send_buffer_used = 0;
+    return 0;
+}
+
+ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags) {
+    size_t sent = 0;
+    if (fd->ring_fd < 0) {
+        while(sent < len) {
+            ssize_t tmp = send(fd->sockfd, (const uint8_t*) buf + sent, len - sent, flags);
+            if (tmp < 1) {
+                return MQTT_ERROR_SOCKET_ERROR;
+            }
+            sent += (size_t) tmp;
+        }
+        return sent;
+    }
+
+    /* queue the bytes, sending what's queued whenever the buffer fills up */
+    while (sent < len) {
+        size_t n = fd->send_buffer_size - fd->send_buffer_used;
+        if (n == 0) {
+            ssize_t rv = mqtt_pal_flush(fd);
+            if (rv != 0) {
+                return rv;
+            }
+            continue;
+        }
+        if (n > len - sent) {
+            n = len - sent;
+        }
+        memcpy(fd->send_buffer + fd->send_buffer_used, (const uint8_t*) buf + sent, n);
+        fd->send_buffer_used += n;
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags) {
+    size_t received = 0;
+    if (fd->ring_fd < 0) {
+        ssize_t rv;
+        do {
+            rv = recv(fd->sockfd, (uint8_t*) buf + received, bufsz - received, flags);
+            if (rv > 0) {
+                received += (size_t) rv;
+            } else if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return MQTT_ERROR_SOCKET_ERROR;
+            }
+        } while (rv > 0);
+        return (ssize_t) received;
+    }
+
+    __mqtt_pal_uring_reap(fd);
+    while (fd->recv_length > 0 && received < bufsz) {
+        int32_t res = fd->recv_results[fd->recv_first];
+        uint32_t cqe_flags = fd->recv_flags[fd->recv_first];
+        if (res > 0 && (cqe_flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bid = (uint16_t) (cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+            size_t n = (size_t) res - fd->recv_offset;
+            if (n > bufsz - received) {
+                n = bufsz - received;
+            }
+            memcpy((uint8_t*) buf + received, fd->recv_blocks + (size_t) bid * fd->recv_block_size + fd->recv_offset, n);
+            received += n;
+            fd->recv_offset += n;
+            if (fd->recv_offset < (size_t) res) {
+                /* the caller's buffer is full */
+                break;
+            }
+            __mqtt_pal_uring_provide_block(fd, bid);
+        } else if (res == 0) {
+            fd->recv_closed = 1;
+        } else if (res < 0 && res != -ENOBUFS) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        /* -ENOBUFS: every block was in use, the receive is re-armed below */
+        fd->recv_offset = 0;
+        fd->recv_first = (fd->recv_first + 1) % (fd->recv_block_count + 1);
+        fd->recv_length -= 1;
+    }
+
+    if (!fd->recv_armed && !fd->recv_closed && fd->recv_length == 0) {
+        if (__mqtt_pal_uring_arm_recv(fd) != 0) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+    }
+    return (ssize_t) received;
+}
+
 #else
 #include <errno.h>
 
@@ -106,6 +417,326 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
 
 #endif
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void* mqtt_pal_map_file(const char *path, size_t size, mqtt_pal_file_handle *handle) {
+    struct stat st;
+    void *mem;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || ((size_t) st.st_size < size && ftruncate(fd, (off_t) size) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    *handle = fd;
+    return mem;
+}
+
+int mqtt_pal_sync_file(void *mem, size_t size, mqtt_pal_file_handle handle) {
+    return msync(mem, size, MS_SYNC) == 0 ? 0 : -1;
+}
+
+void mqtt_pal_unmap_file(void *mem, size_t size, mqtt_pal_file_handle handle) {
+    munmap(mem, size);
+    close(handle);
+}
+
+int mqtt_pal_truncate_file(const char *path, size_t size) {
+    return truncate(path, (off_t) size) == 0 ? 0 : -1;
+}
+
+#include <errno.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+int mqtt_pal_thread_start(mqtt_pal_thread_t *thread, void* (*routine)(void*), void *arg) {
+    return pthread_create(thread, NULL, routine, arg) == 0 ? 0 : -1;
+}
+
+void mqtt_pal_thread_join(mqtt_pal_thread_t thread) {
+    pthread_join(thread, NULL);
+}
+
+int mqtt_pal_wakeup_open(mqtt_pal_wakeup_handle *wakeup) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    wakeup->read_fd = fd;
+    wakeup->write_fd = fd;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    wakeup->read_fd = fds[0];
+    wakeup->write_fd = fds[1];
+#endif
+    return 0;
+}
+
+void mqtt_pal_wakeup_signal(mqtt_pal_wakeup_handle wakeup) {
+    uint64_t one = 1;
+    /* a full pipe (or counter) is already signalled */
+    ssize_t rv = write(wakeup.write_fd, &one, wakeup.read_fd == wakeup.write_fd ? sizeof(one) : 1);
+    (void) rv;
+}
+
+void mqtt_pal_wakeup_close(mqtt_pal_wakeup_handle wakeup) {
+    close(wakeup.read_fd);
+    if (wakeup.write_fd != wakeup.read_fd) {
+        close(wakeup.write_fd);
+    }
+}
+
+int mqtt_pal_wait(mqtt_pal_socket_handle fd, int watch_socket, mqtt_pal_wakeup_handle wakeup, int timeout_ms) {
+    struct pollfd fds[2];
+    uint64_t drained;
+    int rv;
+
+    fds[0].fd = wakeup.read_fd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+#ifdef MQTT_USE_BIO
+    /* data that was already read from the socket isn't seen by poll */
+    if (watch_socket && BIO_pending(fd) > 0) {
+        return 0;
+    }
+    fds[1].fd = watch_socket ? (int) BIO_get_fd(fd, NULL) : -1;
+#elif defined(MQTT_USE_IO_URING)
+    /* the ring reads the socket, so wait for its completions instead */
+    if (watch_socket && fd->ring_fd >= 0) {
+        __mqtt_pal_uring_reap(fd);
+        if (fd->recv_length > 0) {
+            return 0;
+        }
+    }
+    fds[1].fd = !watch_socket ? -1 : (fd->ring_fd >= 0 ? fd->ring_fd : fd->sockfd);
+#else
+    fds[1].fd = watch_socket ? fd : -1;
+#endif
+    rv = poll(fds, 2, timeout_ms);
+    if (rv < 0 && errno != EINTR) {
+        return -1;
+    }
+    if (rv > 0 && (fds[0].revents & POLLIN)) {
+        while (read(wakeup.read_fd, &drained, sizeof(drained)) > 0);
+    }
+    return 0;
+}
+
+/* the descriptor the poller waits on for a socket */
+static int __mqtt_pal_socket_fd(mqtt_pal_socket_handle fd) {
+#ifdef MQTT_USE_BIO
+    return (int) BIO_get_fd(fd, NULL);
+#elif defined(MQTT_USE_IO_URING)
+    return fd->ring_fd >= 0 ? fd->ring_fd : fd->sockfd;
+#else
+    return fd;
+#endif
+}
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+struct mqtt_pal_poller {
+    int epoll_fd;
+    int wakeup_fd;
+};
+
+mqtt_pal_poller_handle mqtt_pal_poller_open(mqtt_pal_wakeup_handle wakeup) {
+    struct epoll_event event;
+    struct mqtt_pal_poller *poller = (struct mqtt_pal_poller*) MQTT_PAL_MALLOC(sizeof(struct mqtt_pal_poller));
+    if (poller == NULL) {
+        return NULL;
+    }
+    poller->wakeup_fd = wakeup.read_fd;
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    /* the wakeup is the only entry without data */
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (poller->epoll_fd < 0 || epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, wakeup.read_fd, &event) != 0) {
+        if (poller->epoll_fd >= 0) close(poller->epoll_fd);
+        MQTT_PAL_FREE(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+int mqtt_pal_poller_add(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd, void *data) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    return epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, __mqtt_pal_socket_fd(fd), &event) == 0 ? 0 : -1;
+}
+
+void mqtt_pal_poller_remove(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd) {
+    struct epoll_event event;
+    /* a closed socket was already removed */
+    epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, __mqtt_pal_socket_fd(fd), &event);
+}
+
+int mqtt_pal_poller_wait(mqtt_pal_poller_handle poller, void **ready, int max_ready, int timeout_ms) {
+    struct epoll_event events[64];
+    uint64_t drained;
+    int rv, i, n = 0;
+
+    rv = epoll_wait(poller->epoll_fd, events, max_ready < 64 ? max_ready : 64, timeout_ms);
+    if (rv < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for(i = 0; i < rv; ++i) {
+        if (events[i].data.ptr == NULL) {
+            while (read(poller->wakeup_fd, &drained, sizeof(drained)) > 0);
+        } else {
+            ready[n++] = events[i].data.ptr;
+        }
+    }
+    return n;
+}
+
+void mqtt_pal_poller_close(mqtt_pal_poller_handle poller) {
+    close(poller->epoll_fd);
+    MQTT_PAL_FREE(poller);
+}
+
+#else
+
+/* poll() over every socket, fds[0] is the wakeup */
+struct mqtt_pal_poller {
+    struct pollfd *fds;
+    void **data;
+    size_t length;
+    size_t capacity;
+};
+
+mqtt_pal_poller_handle mqtt_pal_poller_open(mqtt_pal_wakeup_handle wakeup) {
+    struct mqtt_pal_poller *poller = (struct mqtt_pal_poller*) MQTT_PAL_MALLOC(sizeof(struct mqtt_pal_poller));
+    if (poller == NULL) {
+        return NULL;
+    }
+    poller->capacity = 16;
+    poller->fds = (struct pollfd*) MQTT_PAL_MALLOC(sizeof(struct pollfd) * poller->capacity);
+    poller->data = (void**) MQTT_PAL_MALLOC(sizeof(void*) * poller->capacity);
+    if (poller->fds == NULL || poller->data == NULL) {
+        MQTT_PAL_FREE(poller->fds);
+        MQTT_PAL_FREE(poller->data);
+        MQTT_PAL_FREE(poller);
+        return NULL;
+    }
+    poller->fds[0].fd = wakeup.read_fd;
+    poller->fds[0].events = POLLIN;
+    poller->data[0] = NULL;
+    poller->length = 1;
+    return poller;
+}
+
+int mqtt_pal_poller_add(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd, void *data) {
+    if (poller->length == poller->capacity) {
+        size_t capacity = 2 * poller->capacity;
+        struct pollfd *fds = (struct pollfd*) MQTT_PAL_MALLOC(sizeof(struct pollfd) * capacity);
+        void **datas = (void**) MQTT_PAL_MALLOC(sizeof(void*) * capacity);
+        if (fds == NULL || datas == NULL) {
+            MQTT_PAL_FREE(fds);
+            MQTT_PAL_FREE(datas);
+            return -1;
+        }
+        memcpy(fds, poller->fds, sizeof(struct pollfd) * poller->length);
+        memcpy(datas, poller->data, sizeof(void*) * poller->length);
+        MQTT_PAL_FREE(poller->fds);
+        MQTT_PAL_FREE(poller->data);
+        poller->fds = fds;
+        poller->data = datas;
+        poller->capacity = capacity;
+    }
+    poller->fds[poller->length].fd = __mqtt_pal_socket_fd(fd);
+    poller->fds[poller->length].events = POLLIN;
+    poller->data[poller->length] = data;
+    poller->length += 1;
+    return 0;
+}
+
+void mqtt_pal_poller_remove(mqtt_pal_poller_handle poller, mqtt_pal_socket_handle fd) {
+    int sockfd = __mqtt_pal_socket_fd(fd);
+    size_t i;
+    for(i = 1; i < poller->length; ++i) {
+        if (poller->fds[i].fd == sockfd) {
+            poller->length -= 1;
+            poller->fds[i] = poller->fds[poller->length];
+            poller->data[i] = poller->data[poller->length];
+            return;
+        }
+    }
+}
+
+int mqtt_pal_poller_wait(mqtt_pal_poller_handle poller, void **ready, int max_ready, int timeout_ms) {
+    uint64_t drained;
+    size_t i;
+    int rv, n = 0;
+
+    rv = poll(poller->fds, (nfds_t) poller->length, timeout_ms);
+    if (rv < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (poller->fds[0].revents & POLLIN) {
+        while (read(poller->fds[0].fd, &drained, sizeof(drained)) > 0);
+    }
+    for(i = 1; i < poller->length && n < max_ready; ++i) {
+        if (poller->fds[i].revents != 0) {
+            ready[n++] = poller->data[i];
+        }
+    }
+    return n;
+}
+
+void mqtt_pal_poller_close(mqtt_pal_poller_handle poller) {
+    MQTT_PAL_FREE(poller->fds);
+    MQTT_PAL_FREE(poller->data);
+    MQTT_PAL_FREE(poller);
+}
+
+#endif
+
+uint64_t mqtt_pal_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+void mqtt_pal_cond_init(mqtt_pal_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    /* deadlines are in mqtt_pal_clock_us time */
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int mqtt_pal_cond_wait(mqtt_pal_cond_t *cond, mqtt_pal_mutex_t *mutex, uint64_t deadline_us) {
+    struct timespec ts;
+    if (mqtt_pal_clock_us() >= deadline_us) {
+        return -1;
+    }
+    ts.tv_sec = (time_t) (deadline_us / 1000000);
+    ts.tv_nsec = (long) (deadline_us % 1000000) * 1000;
+    return pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT ? -1 : 0;
+}
+
 #endif
 
 /** @endcond */
\ No newline at end of file
@@ -16,6 +16,8 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <mqtt.h>
 #include "examples/templates/posix_sockets.h"
@@ -432,6 +434,122 @@ static void TEST__framing__ping(void** state) {
     assert_true(fixed_header->remaining_length == 0);
 }
 
+static void TEST__framing__properties(void** state) {
+    uint8_t buf[64];
+    ssize_t rv;
+    size_t offset = 0;
+    struct mqtt_property properties[4];
+    struct mqtt_property property;
+    struct mqtt_properties unpacked;
+    const uint8_t correct_bytes[] = {
+        24,
+        MQTT_PROPERTY_RECEIVE_MAXIMUM, 0, 10,
+        MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER, 0xAC, 0x02,
+        MQTT_PROPERTY_CONTENT_TYPE, 0, 4, 't', 'e', 'x', 't',
+        MQTT_PROPERTY_USER_PROPERTY, 0, 1, 'k', 0, 5, 'v', 'a', 'l', 'u', 'e'
+    };
+
+    properties[0].identifier = MQTT_PROPERTY_RECEIVE_MAXIMUM;
+    properties[0].value.integer = 10;
+    properties[1].identifier = MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER;
+    properties[1].value.integer = 300;
+    properties[2].identifier = MQTT_PROPERTY_CONTENT_TYPE;
+    properties[2].value.binary.data = "text";
+    properties[2].value.binary.size = 4;
+    properties[3].identifier = MQTT_PROPERTY_USER_PROPERTY;
+    properties[3].value.pair.name = "k";
+    properties[3].value.pair.name_size = 1;
+    properties[3].value.pair.value = "value";
+    properties[3].value.pair.value_size = 5;
+
+    assert_true(mqtt_properties_size(properties, 4) == sizeof(correct_bytes));
+    rv = mqtt_pack_properties(buf, sizeof(buf), properties, 4);
+    assert_true(rv == sizeof(correct_bytes));
+    assert_true(memcmp(buf, correct_bytes, sizeof(correct_bytes)) == 0);
+    assert_true(mqtt_pack_properties(buf, 10, properties, 4) == 0);
+
+    /* unpacking and walking the properties */
+    assert_true(mqtt_unpack_properties(&unpacked, buf, rv) == rv);
+    assert_true(unpacked.size == 24);
+    assert_true(mqtt_properties_next(&unpacked, &offset, &property) == 1);
+    assert_true(property.identifier == MQTT_PROPERTY_RECEIVE_MAXIMUM && property.value.integer == 10);
+    assert_true(mqtt_properties_next(&unpacked, &offset, &property) == 1);
+    assert_true(property.identifier == MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER && property.value.integer == 300);
+    assert_true(mqtt_properties_next(&unpacked, &offset, &property) == 1);
+    assert_true(property.value.binary.size == 4 && memcmp(property.value.binary.data, "text", 4) == 0);
+    assert_true(mqtt_properties_next(&unpacked, &offset, &property) == 1);
+    assert_true(property.value.pair.name_size == 1 && memcmp(property.value.pair.name, "k", 1) == 0);
+    assert_true(property.value.pair.value_size == 5 && memcmp(property.value.pair.value, "value", 5) == 0);
+    assert_true(mqtt_properties_next(&unpacked, &offset, &property) == 0);
+    assert_true(mqtt_properties_find(&unpacked, MQTT_PROPERTY_CONTENT_TYPE, &property) == 1);
+    assert_true(mqtt_properties_find(&unpacked, MQTT_PROPERTY_TOPIC_ALIAS, &property) == 0);
+
+    /* truncated or unknown properties are rejected */
+    assert_true(mqtt_unpack_properties(&unpacked, buf, rv - 1) == MQTT_ERROR_MALFORMED_PROPERTIES);
+    buf[1] = 0x7F;
+    assert_true(mqtt_unpack_properties(&unpacked, buf, rv) == MQTT_ERROR_MALFORMED_PROPERTIES);
+}
+
+static void TEST__framing__v5(void** state) {
+    uint8_t buf[256];
+    ssize_t rv;
+    struct mqtt_property property;
+    struct mqtt_response response;
+    const uint8_t connect_bytes[] = {
+        (MQTT_CONTROL_CONNECT << 4) | 0, 17,
+        0, 4, 'M', 'Q', 'T', 'T', MQTT_PROTOCOL_LEVEL_5, 0, 0, 120u, 
+        0,
+        0, 4, 'l', 'i', 'a', 'm'
+    };
+    const uint8_t publish_bytes[] = {
+        (MQTT_CONTROL_PUBLISH << 4) | MQTT_PUBLISH_QOS_1, 26,
+        0, 6, 't', 'o', 'p', 'i', 'c', '1',
+        0, 23,
+        5, MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL, 0, 0, 0, 60,
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'
+    };
+    const uint8_t connack_bytes[] = {
+        (MQTT_CONTROL_CONNACK << 4) | 0, 14,
+        0, MQTT_CONNACK_ACCEPTED,
+        11,
+        MQTT_PROPERTY_RECEIVE_MAXIMUM, 0, 10,
+        MQTT_PROPERTY_MAXIMUM_PACKET_SIZE, 0, 0, 1, 0,
+        MQTT_PROPERTY_SERVER_KEEP_ALIVE, 0, 15
+    };
+    const uint8_t puback_bytes[] = {
+        (MQTT_CONTROL_PUBACK << 4) | 0, 2, 0, 23
+    };
+
+    rv = mqtt_pack_connection_request_v5(buf, sizeof(buf), "liam", NULL, NULL, 0, NULL, NULL, 0, 120u, NULL, 0);
+    assert_true(rv == sizeof(connect_bytes));
+    assert_true(memcmp(buf, connect_bytes, sizeof(connect_bytes)) == 0);
+
+    property.identifier = MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL;
+    property.value.integer = 60;
+    rv = mqtt_pack_publish_request_v5(buf, sizeof(buf), "topic1", 23, "0123456789", 10, MQTT_PUBLISH_QOS_1, &property, 1);
+    assert_true(rv == sizeof(publish_bytes));
+    assert_true(memcmp(buf, publish_bytes, sizeof(publish_bytes)) == 0);
+    rv = mqtt_unpack_response_v5(&response, buf, rv);
+    assert_true(rv == sizeof(publish_bytes));
+    assert_true(response.decoded.publish.packet_id == 23);
+    assert_true(response.decoded.publish.application_message_size == 10);
+    assert_true(memcmp(response.decoded.publish.application_message, "0123456789", 10) == 0);
+    assert_true(mqtt_properties_find(&response.decoded.publish.properties, MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL, &property) == 1);
+    assert_true(property.value.integer == 60);
+
+    rv = mqtt_unpack_response_v5(&response, connack_bytes, sizeof(connack_bytes));
+    assert_true(rv == sizeof(connack_bytes));
+    assert_true(response.decoded.connack.return_code == MQTT_CONNACK_ACCEPTED);
+    assert_true(mqtt_properties_find(&response.decoded.connack.properties, MQTT_PROPERTY_MAXIMUM_PACKET_SIZE, &property) == 1);
+    assert_true(property.value.integer == 256);
+
+    /* the reason code may be left out of acknowledgements */
+    rv = mqtt_unpack_response_v5(&response, puback_bytes, sizeof(puback_bytes));
+    assert_true(rv == sizeof(puback_bytes));
+    assert_true(response.decoded.puback.packet_id == 23);
+    assert_true(response.decoded.puback.reason_code == 0);
+}
+
 static void TEST__utility__ping(void** state) {
     uint8_t buf[256];
     struct mqtt_client client;
@@ -473,91 +591,155 @@ static void TEST__utility__ping(void** state) {
     close(client.socketfd);
 }
 
-#define QM_SZ (int) sizeof(struct mqtt_queued_message)
+#define QM_SZ (int) MQTT_MQ_DESCRIPTOR_SIZE
 static void TEST__utility__message_queue(void **unused) {
-    uint8_t mem[32 + 4*QM_SZ];
+    union {
+        mqtt_pal_time_t align;
+        uint8_t bytes[32 + 8*QM_SZ];
+    } mem;
     struct mqtt_message_queue mq;
-    struct mqtt_queued_message *tail;
-    mqtt_mq_init(&mq, mem, sizeof(mem));
+    size_t msg;
+    mqtt_mq_init(&mq, mem.bytes, sizeof(mem.bytes));
 
-    /* check that it fills up correctly */
+    /* check that it fills up correctly (the first register makes room for 8 descriptors) */
     assert_true(mqtt_mq_length(&mq) == 0);
-    assert_true(mq.curr_sz == 32 + 3*QM_SZ);
+    assert_true(mq.curr_sz == 32);
     memset(mq.curr, 0, 8);
-    tail = mqtt_mq_register(&mq, 8);
-    tail->control_type = 2;
-    tail->packet_id = 111;
+    mq.curr[0] = 2 << 4;
+    msg = mqtt_mq_register(&mq, 8);
+    mq.packet_id[msg] = 111;
     assert_true(mqtt_mq_length(&mq) == 1);
-    assert_true(mq.curr_sz == 24 + 2*QM_SZ);
+    assert_true(mq.capacity == 8);
+    assert_true(mq.curr_sz == 24);
     memset(mq.curr, 1, 8);
-    tail = mqtt_mq_register(&mq, 8);
-    tail->control_type = 3;
-    tail->packet_id = 222;
+    mq.curr[0] = 3 << 4;
+    msg = mqtt_mq_register(&mq, 8);
+    mq.packet_id[msg] = 222;
     assert_true(mqtt_mq_length(&mq) == 2);
-    assert_true(mq.curr_sz == 16 + 1*QM_SZ);
+    assert_true(mq.curr_sz == 16);
     memset(mq.curr, 2, 8);
-    tail = mqtt_mq_register(&mq, 8);
-    tail->control_type = 4;
-    tail->packet_id = 333;
+    mq.curr[0] = 4 << 4;
+    msg = mqtt_mq_register(&mq, 8);
+    mq.packet_id[msg] = 333;
     assert_true(mqtt_mq_length(&mq) == 3);
     assert_true(mq.curr_sz == 8);
     memset(mq.curr, 3, 8);
-    tail = mqtt_mq_register(&mq, 8);
-    tail->control_type = 5;
-    tail->packet_id = 444;
+    mq.curr[0] = 5 << 4;
+    msg = mqtt_mq_register(&mq, 8);
+    mq.packet_id[msg] = 444;
     assert_true(mqtt_mq_length(&mq) == 4);
     assert_true(mq.curr_sz == 0);
-    assert_true(mq.curr == (uint8_t*) mq.queue_tail);
+    assert_true(mq.curr == (uint8_t*) mq.time_sent);
 
     /* check that start's are correct */
     for(unsigned int i = 0; i < 4; ++i) {
-        assert_true(mqtt_mq_get(&mq, i)->start == (uint8_t*) mq.mem_start + 8*i);
-        for(int j = 0; j < 8; ++j) {
-            assert_true(mqtt_mq_get(&mq, i)->start[j] == i);
+        assert_true(mqtt_mq_start(&mq, i) == (uint8_t*) mq.mem_start + 8*i);
+        assert_true(mq.size[i] == 8);
+        assert_true(mqtt_mq_start(&mq, i)[0] == (i + 2) << 4);
+        for(int j = 1; j < 8; ++j) {
+            assert_true(mqtt_mq_start(&mq, i)[j] == i);
         }
 
-        assert_true(mqtt_mq_get(&mq, i)->control_type == i + 2);
-        assert_true(mqtt_mq_get(&mq, i)->packet_id == 111 * (i + 1));
+        assert_true(mq.control_type[i] == i + 2);
+        assert_true(mq.packet_id[i] == 111 * (i + 1));
     }
 
     /* check that it cleans correctly */
     mqtt_mq_clean(&mq);   /* should do nothing */
     assert_true(mqtt_mq_length(&mq) == 4);
     assert_true(mq.curr_sz == 0);
-    assert_true(mq.curr == (uint8_t*) mq.queue_tail);
+    assert_true(mq.curr == (uint8_t*) mq.time_sent);
 
-    /* try clearing middle (should do nothing) */
-    mqtt_mq_get(&mq, 1)->state = MQTT_QUEUED_COMPLETE;
-    mqtt_mq_get(&mq, 0)->state = MQTT_QUEUED_AWAITING_ACK;
+    /* clearing the middle works even though the head is incomplete */
+    mq.state[1] = MQTT_QUEUED_COMPLETE;
+    mq.state[0] = MQTT_QUEUED_AWAITING_ACK;
     mqtt_mq_clean(&mq);
-    assert_true(mqtt_mq_length(&mq) == 4);
-    assert_true(mq.curr_sz == 0);
-    assert_true(mq.curr == (uint8_t*) mq.queue_tail);
-
-    /* complete first then clean (should clear 2) */
-    mqtt_mq_get(&mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    assert_true(mqtt_mq_length(&mq) == 3);
+    assert_true(mq.head_of_line_blocked_bytes == 8);
+    assert_true(mq.max_head_of_line_blocked_bytes == 8);
+    assert_true(mq.curr == mem.bytes + 24);
+    assert_true(mq.control_type[0] == 2 && mq.control_type[1] == 4 && mq.control_type[2] == 5);
+    assert_true(mq.offset[1] == 8 && mq.offset[2] == 16);
+    assert_true(mqtt_mq_start(&mq, 1)[1] == 2);
+
+    /* complete first then clean (should clear 1) */
+    mq.state[0] = MQTT_QUEUED_COMPLETE;
     mqtt_mq_clean(&mq);
+    assert_true(mq.head_of_line_blocked_bytes == 0);
+    assert_true(mq.max_head_of_line_blocked_bytes == 8);
     assert_true(mqtt_mq_length(&mq) == 2);
-    assert_true(mq.curr_sz == 16 + 1*QM_SZ);
-    assert_true(mq.curr == mem + 16);
+    assert_true(mq.curr_sz == 16);
+    assert_true(mq.curr == mem.bytes + 16);
 
     /* check that start's are correct */
     for(unsigned int i = 0; i < 2; ++i) {
-        assert_true(mqtt_mq_get(&mq, i)->start == (uint8_t*) mq.mem_start + 8*i);
-        for(int j = 0; j < 8; ++j) {
-            assert_true(mqtt_mq_get(&mq, i)->start[j] == i+2); /* check value */
+        assert_true(mqtt_mq_start(&mq, i) == (uint8_t*) mq.mem_start + 8*i);
+        for(int j = 1; j < 8; ++j) {
+            assert_true(mqtt_mq_start(&mq, i)[j] == i+2); /* check value */
         }
-        assert_true(mqtt_mq_get(&mq, i)->control_type == i + 4);
-        assert_true(mqtt_mq_get(&mq, i)->packet_id == 111 * (i + 3));
+        assert_true(mq.control_type[i] == i + 4);
+        assert_true(mq.packet_id[i] == 111 * (i + 3));
     }
 
-    /* remove the last two */
-    mqtt_mq_get(&mq, 0)->state = MQTT_QUEUED_COMPLETE;
-    mqtt_mq_get(&mq, 1)->state = MQTT_QUEUED_COMPLETE;
+    /* remove the last two (the descriptor arrays are released too) */
+    mq.state[0] = MQTT_QUEUED_COMPLETE;
+    mq.state[1] = MQTT_QUEUED_COMPLETE;
     mqtt_mq_clean(&mq); 
     assert_true(mqtt_mq_length(&mq) == 0);
-    assert_true(mq.curr_sz == 32 + 3*QM_SZ);
-    assert_true((void*) mq.queue_tail == mq.mem_end);
+    assert_true(mq.capacity == 0);
+    assert_true(mq.curr_sz == 32);
+    assert_true((void*) mq.time_sent == mq.mem_end);
+}
+
+static void TEST__utility__message_queue_descriptors(void **unused) {
+    union {
+        mqtt_pal_time_t align;
+        uint8_t bytes[1024];
+    } mem;
+    struct mqtt_message_queue mq;
+    size_t msg;
+    uint16_t pid;
+    unsigned int i;
+    mqtt_mq_init(&mq, mem.bytes, sizeof(mem.bytes));
+
+    /* the descriptor arrays double when there is room */
+    for(i = 0; i < 9; ++i) {
+        mq.curr[0] = MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_QOS_1;
+        msg = mqtt_mq_register(&mq, 1);
+        mq.packet_id[msg] = i + 1;
+        mq.state[msg] = MQTT_QUEUED_AWAITING_ACK;
+        mq.time_sent[msg] = i;
+    }
+    assert_true(mq.capacity == 16);
+    assert_true(mq.curr_sz == (size_t) ((uint8_t*) mq.time_sent - mq.curr));
+    for(i = 0; i < 9; ++i) {
+        assert_true(mq.offset[i] == i);
+        assert_true(mq.size[i] == 1);
+        assert_true(mq.packet_id[i] == i + 1);
+        assert_true(mq.state[i] == MQTT_QUEUED_AWAITING_ACK);
+        assert_true(mq.control_type[i] == MQTT_CONTROL_PUBLISH);
+        assert_true(mq.qos[i] == 1);
+        assert_true(mq.time_sent[i] == (mqtt_pal_time_t) i);
+    }
+    pid = 8;
+    assert_true(mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &pid) == 7);
+    pid = 10;
+    assert_true(mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &pid) == -1);
+
+    /* and shrink once the queue drains */
+    for(i = 0; i < 7; ++i) {
+        mq.state[i] = MQTT_QUEUED_COMPLETE;
+    }
+    mqtt_mq_clean(&mq);
+    assert_true(mqtt_mq_length(&mq) == 2);
+    assert_true(mq.capacity == 8);
+    for(i = 0; i < 2; ++i) {
+        assert_true(mq.offset[i] == i);
+        assert_true(mq.packet_id[i] == i + 8);
+        assert_true(mq.state[i] == MQTT_QUEUED_AWAITING_ACK);
+        assert_true(mq.qos[i] == 1);
+        assert_true(mq.time_sent[i] == (mqtt_pal_time_t) (i + 7));
+    }
 }
 
 static void TEST__utility__pid_lfsr(void **unused) {
@@ -573,6 +755,1780 @@ static void TEST__utility__pid_lfsr(void **unused) {
     assert_true(period == 65535u);
 }
 
+static void TEST__utility__publish_reserve(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendmem[1024], recvmem[256];
+    uint8_t correct[256];
+    size_t msg;
+    void *payload;
+    ssize_t rv;
+
+    mqtt_init(&client, -1, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+
+    /* reserve more than needed (2 byte remaining length) and commit less (1 byte) */
+    assert_true(mqtt_publish_reserve(&client, "topic1", 200, MQTT_PUBLISH_QOS_1, &payload) == MQTT_OK);
+    memcpy(payload, "0123456789", 10);
+    assert_true(mqtt_publish_commit(&client, 10) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+
+    msg = 1;
+    rv = mqtt_pack_publish_request(correct, sizeof(correct), "topic1", client.mq.packet_id[msg], "0123456789", 10, MQTT_PUBLISH_QOS_1);
+    assert_true(rv == 22);
+    assert_true(client.mq.size[msg] == 22);
+    assert_true(client.mq.control_type[msg] == MQTT_CONTROL_PUBLISH);
+    assert_true(client.mq.qos[msg] == 1);
+    assert_true(memcmp(mqtt_mq_start(&client.mq, msg), correct, 22) == 0);
+
+    /* the skipped byte is dropped when the queue is compacted */
+    client.mq.state[0] = MQTT_QUEUED_COMPLETE;
+    mqtt_mq_clean(&client.mq);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+    assert_true(client.mq.offset[0] == 0 && client.mq.size[0] == 22);
+    assert_true(memcmp(mqtt_mq_start(&client.mq, 0), correct, 22) == 0);
+    assert_true(client.mq.curr == (uint8_t*) client.mq.mem_start + 22);
+
+    /* cancelled reservations are never queued */
+    assert_true(mqtt_publish_reserve(&client, "topic1", 10, MQTT_PUBLISH_QOS_0, &payload) == MQTT_OK);
+    mqtt_publish_cancel(&client);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+
+    /* committing more than was reserved is an error */
+    assert_true(mqtt_publish_reserve(&client, "topic1", 10, MQTT_PUBLISH_QOS_0, &payload) == MQTT_OK);
+    assert_true(mqtt_publish_commit(&client, 11) == MQTT_ERROR_MALFORMED_REQUEST);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+
+    /* but it doesn't break the client */
+    assert_true(client.error == MQTT_OK);
+    assert_true(mqtt_publish(&client, "topic1", "0123456789", 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+}
+
+static void count_publishes(void** state, struct mqtt_response_publish *publish) {
+    int *count = *(int**)state;
+    *count += 1;
+}
+
+/* counts the packets of each control type that can be read from sockfd */
+static void count_packets(int sockfd, int counts[16]) {
+    uint8_t received[1024];
+    ssize_t rv, i;
+    memset(counts, 0, 16 * sizeof(int));
+    rv = recv(sockfd, received, sizeof(received), MSG_DONTWAIT);
+    for (i = 0; i < rv; i += 2 + received[i + 1]) {
+        ++counts[received[i] >> 4];
+    }
+}
+
+/* opens a connected pair of sockets, sv[0] (non-blocking) for the client and sv[1] for the test's broker */
+static void open_socketpair(int sv[2]) {
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+}
+
+/* initializes client on sv[0] of a new socketpair */
+static void init_socketpair_client(struct mqtt_client *client, int sv[2],
+                                   uint8_t *sendmem, size_t sendmemsz,
+                                   uint8_t *recvmem, size_t recvmemsz,
+                                   void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    open_socketpair(sv);
+    mqtt_init(client, sv[0], sendmem, sendmemsz, recvmem, recvmemsz, publish_response_callback);
+}
+
+static void TEST__utility__qos0_buffer(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_response response;
+    uint8_t sendmem[1024], recvmem[256], qos0mem[64];
+    uint8_t big[100], received[2048];
+    char payload[16];
+    void *reserved;
+    ssize_t rv, received_size = 0, consumed;
+    int sv[2], i, expected;
+
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mqtt_init(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    mqtt_set_qos0_buffer(&client, qos0mem, sizeof(qos0mem));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* 4 15-byte packets are staged without touching the queue */
+    for(i = 0; i < 4; ++i) {
+        snprintf(payload, sizeof(payload), "message-%d", i);
+        assert_true(mqtt_publish(&client, "a", payload, 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    }
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+    assert_true(client.qos0_buffer.curr_sz == 4);
+
+    /* the 5th makes room by moving the staged packets into the queue */
+    snprintf(payload, sizeof(payload), "message-%d", 4);
+    assert_true(mqtt_publish(&client, "a", payload, 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    assert_true(client.qos0_buffer.curr_sz == 64 - 15);
+
+    /* packets that can never be staged are queued behind it */
+    memset(big, '5', sizeof(big));
+    assert_true(mqtt_publish(&client, "a", big, sizeof(big), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 4);
+    assert_true(client.qos0_buffer.curr_sz == 64);
+    snprintf(payload, sizeof(payload), "message-%d", 6);
+    assert_true(mqtt_publish(&client, "a", payload, 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* a reserved packet is queued behind the staged ones too */
+    assert_true(mqtt_publish_reserve(&client, "a", 16, MQTT_PUBLISH_QOS_0, &reserved) == MQTT_OK);
+    assert_true(client.qos0_buffer.curr_sz == 64);
+    snprintf(payload, sizeof(payload), "message-%d", 7);
+    memcpy(reserved, payload, 10);
+    assert_true(mqtt_publish_commit(&client, 10) == MQTT_OK);
+    snprintf(payload, sizeof(payload), "message-%d", 8);
+    assert_true(mqtt_publish(&client, "a", payload, 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* everything is sent in order, after the CONNECT */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(client.qos0_buffer.curr_sz == 64);
+    for(i = 0; i < mqtt_mq_length(&client.mq); ++i) {
+        if (client.mq.control_type[i] == MQTT_CONTROL_PUBLISH) {
+            assert_true(client.mq.state[i] == MQTT_QUEUED_COMPLETE);
+        }
+    }
+    while ((rv = recv(sv[1], received + received_size, sizeof(received) - received_size, MSG_DONTWAIT)) > 0) {
+        received_size += rv;
+    }
+    assert_true(received_size > 0 && received[0] >> 4 == MQTT_CONTROL_CONNECT);
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    consumed += response.fixed_header.remaining_length;
+    for(expected = 0; expected < 9; ++expected) {
+        rv = mqtt_unpack_response(&response, received + consumed, received_size - consumed);
+        assert_true(rv > 0);
+        assert_true(response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+        if (expected == 5) {
+            assert_true(response.decoded.publish.application_message_size == sizeof(big));
+        } else {
+            snprintf(payload, sizeof(payload), "message-%d", expected);
+            assert_true(memcmp(response.decoded.publish.application_message, payload, 10) == 0);
+        }
+        consumed += rv;
+    }
+    assert_true(consumed == received_size);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__recv_buffer_pool(void **unused) {
+    struct mqtt_recv_buffer_pool pool;
+    struct mqtt_client clients[3];
+    union { uint8_t bytes[2*64]; void *align; } poolmem;
+    uint8_t sendmem[3][256], packet[64];
+    ssize_t packet_size;
+    int sv[3][2], counts[3], i;
+
+    assert_true(mqtt_recv_buffer_pool_init(&pool, poolmem.bytes, sizeof(poolmem.bytes), 64) == 2);
+    assert_true(pool.number_of_free_blocks == 2);
+
+    for(i = 0; i < 3; ++i) {
+        open_socketpair(sv[i]);
+        mqtt_init_reconnect(&clients[i], NULL, NULL, count_publishes);
+        mqtt_set_recv_buffer_pool(&clients[i], &pool);
+        mqtt_reinit(&clients[i], sv[i][0], sendmem[i], sizeof(sendmem[i]), NULL, 0);
+        counts[i] = 0;
+        clients[i].publish_response_callback_state = &counts[i];
+    }
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "a/b", 0, "hello", 5, MQTT_PUBLISH_QOS_0);
+    assert_true(packet_size > 0);
+
+    /* an idle client doesn't keep a buffer */
+    assert_true(__mqtt_recv(&clients[0]) == MQTT_OK);
+    assert_true(clients[0].recv_buffer.mem_start == NULL);
+    assert_true(pool.number_of_free_blocks == 2);
+
+    /* nor does one that got whole packets */
+    assert_true(send(sv[0][1], packet, packet_size, 0) == packet_size);
+    assert_true(__mqtt_recv(&clients[0]) == MQTT_OK);
+    assert_true(counts[0] == 1);
+    assert_true(pool.number_of_free_blocks == 2);
+
+    /* clients holding part of a packet keep their buffers */
+    assert_true(send(sv[0][1], packet, 4, 0) == 4);
+    assert_true(send(sv[1][1], packet, 4, 0) == 4);
+    assert_true(__mqtt_recv(&clients[0]) == MQTT_OK);
+    assert_true(__mqtt_recv(&clients[1]) == MQTT_OK);
+    assert_true(clients[0].recv_buffer.mem_start != NULL);
+    assert_true(pool.number_of_free_blocks == 0);
+
+    /* so the third has to wait */
+    assert_true(send(sv[2][1], packet, packet_size, 0) == packet_size);
+    assert_true(__mqtt_recv(&clients[2]) == MQTT_OK);
+    assert_true(counts[2] == 0);
+    assert_true(pool.number_of_exhaustions == 1);
+
+    /* until the first finishes its packet */
+    assert_true(send(sv[0][1], packet + 4, packet_size - 4, 0) == packet_size - 4);
+    assert_true(__mqtt_recv(&clients[0]) == MQTT_OK);
+    assert_true(counts[0] == 2);
+    assert_true(pool.number_of_free_blocks == 1);
+    assert_true(__mqtt_recv(&clients[2]) == MQTT_OK);
+    assert_true(counts[2] == 1);
+    assert_true(pool.number_of_free_blocks == 1);
+
+    /* reinitializing a client gives its buffer back */
+    mqtt_reinit(&clients[1], sv[1][0], sendmem[1], sizeof(sendmem[1]), NULL, 0);
+    assert_true(clients[1].recv_buffer_pool == &pool);
+    assert_true(pool.number_of_free_blocks == 2);
+
+    for(i = 0; i < 3; ++i) {
+        mqtt_deinit(&clients[i]);
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+}
+
+static void TEST__utility__recv_buffer_growth(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendmem[256], recvmem[16], packet[512], payload[400];
+    ssize_t packet_size;
+    int sv[2], count = 0;
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), count_publishes);
+    client.publish_response_callback_state = &count;
+    client.recv_buffer.max_size = 256;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    memset(payload, 'x', sizeof(payload));
+
+    /* a packet a little too big for the buffer doubles it */
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "a", 0, payload, 20, MQTT_PUBLISH_QOS_0);
+    assert_true(send(sv[1], packet, packet_size, 0) == packet_size);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(count == 1);
+    assert_true(client.recv_buffer.mem_size == 32);
+
+    /* a much bigger one grows it to fit */
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "a", 0, payload, 100, MQTT_PUBLISH_QOS_0);
+    assert_true(send(sv[1], packet, packet_size, 0) == packet_size);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(count == 2);
+    assert_true(client.recv_buffer.mem_size == (size_t) packet_size);
+
+    /* the buffer is kept while the connection is busy and released once it's idle */
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(client.recv_buffer.mem_start != recvmem);
+    client.recv_buffer.idle_trim_time = 0;
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(client.recv_buffer.mem_start == recvmem);
+    assert_true(client.recv_buffer.mem_size == sizeof(recvmem));
+    assert_true(client.heap_allocator.bytes_in_use == 0);
+
+    /* packets bigger than max_size are still an error */
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "a", 0, payload, 300, MQTT_PUBLISH_QOS_0);
+    assert_true(send(sv[1], packet, packet_size, 0) == packet_size);
+    assert_true(__mqtt_recv(&client) == MQTT_ERROR_RECV_BUFFER_TOO_SMALL);
+    assert_true(count == 2);
+
+    mqtt_deinit(&client);
+    assert_true(client.heap_allocator.bytes_in_use == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__session_store(void **unused) {
+    struct mqtt_session_store store;
+    struct mqtt_client client;
+    struct mqtt_response response;
+    uint8_t sendmem[256], recvmem[256], received[1024], puback[4];
+    char path[] = "/tmp/mqtt-c-session-XXXXXX";
+    uint16_t packet_ids[3], pid_lfsr;
+    ssize_t rv, received_size = 0, consumed;
+    int sv[2], fd, i;
+
+    fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    /* a new store starts empty */
+    assert_true(mqtt_session_store_open(&store, path, 4096) == MQTT_OK);
+    assert_true(!store.restored);
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    assert_true(mqtt_set_session_store(&client, &store) == MQTT_OK);
+    assert_true(client.mq.mem_start == store.mem + MQTT_SESSION_STORE_HEADER_SIZE);
+    client.mq.growth_segment_size = 256;
+    client.mq.growth_max_size = 8192;
+    assert_true(mqtt_mq_grow(&client.mq) == 0);
+    assert_true(client.mq.mem_start == store.mem + MQTT_SESSION_STORE_HEADER_SIZE);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* everything published before a send is committed at once */
+    for(i = 0; i < 3; ++i) {
+        assert_true(mqtt_publish(&client, "a", "hello", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+        packet_ids[i] = client.mq.packet_id[i + 1];
+    }
+    assert_true(mqtt_publish(&client, "a", "hello", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(store.number_of_commits == 1);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(store.number_of_commits == 2);
+    assert_true(!store.dirty);
+    while ((rv = recv(sv[1], received, sizeof(received), MSG_DONTWAIT)) > 0);
+
+    /* the second publish is acknowledged, then the process "restarts" */
+    assert_true(mqtt_pack_pubxxx_request(puback, sizeof(puback), MQTT_CONTROL_PUBACK, packet_ids[1]) == 4);
+    assert_true(send(sv[1], puback, 4, 0) == 4);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    pid_lfsr = client.pid_lfsr;
+    mqtt_session_store_close(&store);
+    close(sv[0]);
+    close(sv[1]);
+
+    /* the unacknowledged publishes are resent with DUP after the CONNECT */
+    assert_true(mqtt_session_store_open(&store, path, 4096) == MQTT_OK);
+    assert_true(store.restored);
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mqtt_init(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    assert_true(mqtt_set_session_store(&client, &store) == MQTT_OK);
+    assert_true(store.number_of_restored_messages == 2);
+    assert_true(client.pid_lfsr == pid_lfsr);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(client.mq.control_type[0] == MQTT_CONTROL_CONNECT);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    while ((rv = recv(sv[1], received + received_size, sizeof(received) - received_size, MSG_DONTWAIT)) > 0) {
+        received_size += rv;
+    }
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    assert_true(consumed > 0 && response.fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    consumed += response.fixed_header.remaining_length;
+    for(i = 0; i < 3; i += 2) {
+        rv = mqtt_unpack_response(&response, received + consumed, received_size - consumed);
+        assert_true(rv > 0);
+        assert_true(response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+        assert_true(response.decoded.publish.dup_flag == 1);
+        assert_true(response.decoded.publish.packet_id == packet_ids[i]);
+        consumed += rv;
+    }
+    assert_true(consumed == received_size);
+
+    mqtt_session_store_close(&store);
+    close(sv[0]);
+    close(sv[1]);
+    unlink(path);
+}
+
+static void TEST__utility__spool(void **unused) {
+    struct mqtt_spool spool;
+    struct mqtt_client client;
+    struct mqtt_response response;
+    uint8_t sendmem[1024], recvmem[256], received[1024], scratch[64];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    char dir[] = "/tmp/mqtt-c-spool-XXXXXX", path[64], payload[16];
+    void *reserved;
+    ssize_t rv, received_size = 0, consumed;
+    int sv[2], i;
+
+    assert_true(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/out", dir);
+
+    /* publishes made before the first connection are spooled */
+    assert_true(mqtt_spool_open(&spool, path, 64, 190, MQTT_SPOOL_DROP_OLDEST) == MQTT_OK);
+    mqtt_init_reconnect(&client, NULL, NULL, NULL);
+    mqtt_set_scratch_buffer(&client, scratch, sizeof(scratch));
+    mqtt_set_spool(&client, &spool);
+    for(i = 0; i < 9; ++i) {
+        snprintf(payload, sizeof(payload), "message-%d", i);
+        assert_true(mqtt_publish(&client, "a", payload, 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    }
+    /* the messages are packed in the scratch buffer */
+    assert_true(client.scratch.number_of_allocations == 9 && client.scratch.bytes_in_use == 0);
+    assert_true(client.heap_allocator.number_of_allocations == 0);
+    assert_true(spool.length == 9);
+    assert_true(mqtt_publish_reserve(&client, "a", 9, MQTT_PUBLISH_QOS_1, &reserved) == MQTT_ERROR_SPOOL_ACTIVE);
+    assert_true(spool.bytes_on_disk == 9 * 20);
+    assert_true(spool.last_segment == spool.first_segment + 2);
+
+    /* the oldest segment (3 messages) is deleted to make room */
+    snprintf(payload, sizeof(payload), "message-%d", 9);
+    assert_true(mqtt_publish(&client, "a", payload, 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.length == 7);
+    assert_true(spool.number_of_spooled == 10);
+    assert_true(spool.number_of_dropped_oldest == 3);
+
+    /* the messages survive reopening the spool */
+    mqtt_spool_close(&spool);
+    assert_true(mqtt_spool_open(&spool, path, 64, 190, MQTT_SPOOL_DROP_OLDEST) == MQTT_OK);
+    assert_true(spool.length == 7);
+    assert_true(spool.bytes_on_disk == 7 * 20);
+
+    /* until the CONNACK arrives new publishes are spooled behind them */
+    open_socketpair(sv);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    snprintf(payload, sizeof(payload), "message-%d", 10);
+    assert_true(mqtt_publish(&client, "a", payload, 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.length == 8);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+
+    /* then they are drained at the configured rate */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    spool.drain_rate = 5;
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(spool.number_of_drained == 5);
+    /* reserved publishes would overtake the rest */
+    assert_true(mqtt_publish_reserve(&client, "a", 9, MQTT_PUBLISH_QOS_1, &reserved) == MQTT_ERROR_SPOOL_ACTIVE);
+    spool.time_of_last_drain = MQTT_PAL_TIME();
+    spool.drain_budget = 0;
+    assert_true(__mqtt_spool_drain(&client) == MQTT_OK);
+    assert_true(spool.number_of_drained == 5);
+    spool.drain_rate = 0;
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(spool.length == 0 && spool.bytes_on_disk == 0);
+    while ((rv = recv(sv[1], received + received_size, sizeof(received) - received_size, MSG_DONTWAIT)) > 0) {
+        received_size += rv;
+    }
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    consumed += response.fixed_header.remaining_length;
+    for(i = 3; i <= 10; ++i) {
+        rv = mqtt_unpack_response(&response, received + consumed, received_size - consumed);
+        assert_true(rv > 0);
+        snprintf(payload, sizeof(payload), "message-%d", i);
+        assert_true(memcmp(response.decoded.publish.application_message, payload, 9) == 0);
+        assert_true(response.decoded.publish.packet_id != 0);
+        consumed += rv;
+    }
+    assert_true(consumed == received_size);
+
+    /* once drained, publishing goes straight to the queue again */
+    assert_true(mqtt_publish(&client, "a", payload, 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.number_of_spooled == 1);
+    mqtt_spool_close(&spool);
+
+    /* a spool that drops new messages keeps the old ones */
+    assert_true(mqtt_spool_open(&spool, path, 64, 20, MQTT_SPOOL_DROP_NEWEST) == MQTT_OK);
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+    assert_true(mqtt_publish(&client, "a", "first", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "second", 6, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(spool.length == 1);
+    assert_true(spool.number_of_dropped_newest == 1);
+    mqtt_spool_close(&spool);
+
+    close(sv[0]);
+    close(sv[1]);
+    snprintf(path, sizeof(path), "%s/out.head", dir);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/out.%08lx", dir, (unsigned long) spool.first_segment);
+    remove(path);
+    assert_true(rmdir(dir) == 0);
+}
+
+static void TEST__utility__spool_torn_segment(void **unused) {
+    struct mqtt_spool spool;
+    struct mqtt_client client;
+    struct mqtt_response response;
+    uint8_t sendmem[1024], recvmem[256], received[1024];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    char dir[] = "/tmp/mqtt-c-spool-XXXXXX", path[64], segment[MQTT_SPOOL_MAX_PATH + 16];
+    ssize_t rv, received_size = 0, consumed;
+    int sv[2], counts[16], i;
+
+    assert_true(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/out", dir);
+
+    /* a crash in the middle of an append leaves a torn message at the end of the segment */
+    assert_true(mqtt_spool_open(&spool, path, 1024, 1024, MQTT_SPOOL_DROP_OLDEST) == MQTT_OK);
+    mqtt_init_reconnect(&client, NULL, NULL, NULL);
+    mqtt_set_spool(&client, &spool);
+    assert_true(mqtt_publish(&client, "a", "message-0", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "message-1", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    mqtt_spool_close(&spool);
+    snprintf(segment, sizeof(segment), "%s.%08lx", path, (unsigned long) spool.first_segment);
+    assert_true(truncate(segment, 2 * 20 - 3) == 0);
+
+    /* reopening drops it, and new messages follow the whole ones */
+    assert_true(mqtt_spool_open(&spool, path, 1024, 1024, MQTT_SPOOL_DROP_OLDEST) == MQTT_OK);
+    assert_true(spool.length == 1);
+    assert_true(spool.bytes_on_disk == 20);
+    assert_true(mqtt_publish(&client, "a", "message-2", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.length == 2);
+
+    /* and everything that is left is drained once connected */
+    open_socketpair(sv);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(spool.length == 0);
+    while ((rv = recv(sv[1], received + received_size, sizeof(received) - received_size, MSG_DONTWAIT)) > 0) {
+        received_size += rv;
+    }
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    consumed += response.fixed_header.remaining_length;
+    for(i = 0; i < 2; ++i) {
+        rv = mqtt_unpack_response(&response, received + consumed, received_size - consumed);
+        assert_true(rv > 0);
+        assert_true(memcmp(response.decoded.publish.application_message, i == 0 ? "message-0" : "message-2", 9) == 0);
+        consumed += rv;
+    }
+    assert_true(consumed == received_size);
+
+    /* a message that can't be read doesn't hold up the rest of the queue */
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+    assert_true(mqtt_publish(&client, "a", "message-3", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.length == 1);
+    snprintf(segment, sizeof(segment), "%s.%08lx", path, (unsigned long) spool.first_segment);
+    assert_true(truncate(segment, 20 - 3) == 0);
+    client.error = MQTT_OK;
+    assert_true(mqtt_ping(&client) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_ERROR_SPOOL_IO);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PINGREQ] == 1);
+    assert_true(spool.length == 1);
+    assert_true(__mqtt_send(&client) == MQTT_ERROR_SPOOL_IO);
+    mqtt_spool_close(&spool);
+
+    close(sv[0]);
+    close(sv[1]);
+    remove(segment);
+    snprintf(path, sizeof(path), "%s/out.head", dir);
+    remove(path);
+    assert_true(rmdir(dir) == 0);
+}
+
+static void TEST__utility__spool_failed_append(void **unused) {
+    struct mqtt_spool spool;
+    struct mqtt_client client;
+    struct mqtt_response response;
+    struct rlimit limit, file_size_limit;
+    struct stat st;
+    uint8_t sendmem[1024], recvmem[256], received[1024];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    char dir[] = "/tmp/mqtt-c-spool-XXXXXX", path[64], segment[MQTT_SPOOL_MAX_PATH + 16];
+    ssize_t rv, received_size = 0, consumed;
+    int sv[2], i;
+
+    assert_true(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/out", dir);
+    assert_true(mqtt_spool_open(&spool, path, 1024, 1024, MQTT_SPOOL_DROP_OLDEST) == MQTT_OK);
+    snprintf(segment, sizeof(segment), "%s.%08lx", path, (unsigned long) spool.first_segment);
+    mqtt_init_reconnect(&client, NULL, NULL, NULL);
+    mqtt_set_spool(&client, &spool);
+    assert_true(mqtt_publish(&client, "a", "message-0", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+
+    /* a full disk writes only part of the message */
+    signal(SIGXFSZ, SIG_IGN);
+    assert_true(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    file_size_limit = limit;
+    file_size_limit.rlim_cur = 30;
+    assert_true(setrlimit(RLIMIT_FSIZE, &file_size_limit) == 0);
+    assert_true(mqtt_publish(&client, "a", "message-1", 9, MQTT_PUBLISH_QOS_1) == MQTT_ERROR_SPOOL_IO);
+    assert_true(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    assert_true(spool.length == 1);
+
+    /* the partial message is cut off, and the next one follows the whole ones */
+    assert_true(stat(segment, &st) == 0 && st.st_size == 20);
+    assert_true(mqtt_publish(&client, "a", "message-2", 9, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(spool.length == 2);
+
+    open_socketpair(sv);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(spool.length == 0);
+    while ((rv = recv(sv[1], received + received_size, sizeof(received) - received_size, MSG_DONTWAIT)) > 0) {
+        received_size += rv;
+    }
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    consumed += response.fixed_header.remaining_length;
+    for(i = 0; i < 2; ++i) {
+        rv = mqtt_unpack_response(&response, received + consumed, received_size - consumed);
+        assert_true(rv > 0);
+        assert_true(memcmp(response.decoded.publish.application_message, i == 0 ? "message-0" : "message-2", 9) == 0);
+        consumed += rv;
+    }
+    assert_true(consumed == received_size);
+    mqtt_spool_close(&spool);
+
+    close(sv[0]);
+    close(sv[1]);
+    remove(segment);
+    snprintf(path, sizeof(path), "%s/out.head", dir);
+    remove(path);
+    assert_true(rmdir(dir) == 0);
+}
+
+static void publish_reply(void** state, struct mqtt_response_publish *publish) {
+    struct mqtt_client *client = *(struct mqtt_client**)state;
+    assert_true(mqtt_publish(client, "reply", (void*) publish->application_message, publish->application_message_size, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+}
+
+static void TEST__utility__publish_from_callback(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendmem[256], recvmem[256], publish[32];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    ssize_t publish_size;
+    int counts[16];
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), publish_reply);
+    client.publish_response_callback_state = &client;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    /* the callback is called without the client's mutex, so its reply goes out in the same sync */
+    publish_size = mqtt_pack_publish_request(publish, sizeof(publish), "request", 0, "ping", 4, MQTT_PUBLISH_QOS_0);
+    assert_true(send(sv[1], publish, publish_size, 0) == publish_size);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct send_thread_state {
+    struct mqtt_client *client;
+    ssize_t rv;
+};
+
+static void* send_thread(void *arg) {
+    struct send_thread_state *state = (struct send_thread_state*) arg;
+    state->rv = __mqtt_send(state->client);
+    return NULL;
+}
+
+static void TEST__utility__publish_while_sending(void **unused) {
+    static uint8_t sendmem[1 << 17], payload[100000], received[1 << 14];
+    struct mqtt_client client;
+    struct send_thread_state state;
+    mqtt_pal_thread_t thread;
+    uint8_t recvmem[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    int sndbuf = 4096, sending = 0, counts[16], i;
+    size_t received_size = 0;
+    ssize_t rv;
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* a message that doesn't fit into the socket's buffer blocks the sending thread */
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) & ~O_NONBLOCK);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    assert_true(mqtt_publish(&client, "big", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    state.client = &client;
+    assert_true(mqtt_pal_thread_start(&thread, send_thread, &state) == 0);
+    for(i = 0; i < 500 && !sending; ++i) {
+        usleep(10000);
+        MQTT_PAL_MUTEX_LOCK(&client.mutex);
+        sending = client.sending;
+        MQTT_PAL_MUTEX_UNLOCK(&client.mutex);
+    }
+    assert_true(sending);
+
+    /* meanwhile producers only wait for the queue insert */
+    assert_true(mqtt_publish(&client, "small", "hello", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    sending = client.sending;
+    MQTT_PAL_MUTEX_UNLOCK(&client.mutex);
+    assert_true(sending);
+
+    /* the queued message is sent by the next pass */
+    while (received_size < sizeof(payload) && (rv = recv(sv[1], received, sizeof(received), 0)) > 0) {
+        received_size += (size_t) rv;
+    }
+    mqtt_pal_thread_join(thread);
+    assert_true(state.rv == MQTT_OK);
+    while (recv(sv[1], received, sizeof(received), MSG_DONTWAIT) > 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct client_pool_test_state {
+    int sv[3][2];
+    uint8_t sendmem[3][1024];
+    uint8_t recvmem[3][256];
+};
+
+static void client_pool_reconnect(struct mqtt_client_pool *pool, size_t index, const char *client_id, void **state) {
+    struct client_pool_test_state *s = *(struct client_pool_test_state**) state;
+    struct mqtt_client *client = &pool->clients[index].client;
+    open_socketpair(s->sv[index]);
+    mqtt_reinit(client, s->sv[index][0], s->sendmem[index], sizeof(s->sendmem[index]), s->recvmem[index], sizeof(s->recvmem[index]));
+    mqtt_connect(client, client_id, NULL, NULL, 0, NULL, NULL, 0, 30);
+}
+
+static void TEST__utility__client_pool(void **unused) {
+    struct client_pool_test_state state;
+    struct mqtt_client_pool_member members[3];
+    struct mqtt_client_pool pool;
+    struct mqtt_client_pool_stats stats;
+    char topic[32], expected_id[16];
+    uint8_t received[256];
+    size_t used = 0;
+    int i;
+
+    assert_true(mqtt_client_pool_init(&pool, members, 0, "ingest", client_pool_reconnect, &state, count_publishes) == MQTT_ERROR_NULLPTR);
+    assert_true(mqtt_client_pool_init(&pool, members, 3,
+        "a-prefix-that-is-far-too-long-to-be-used-for-the-ids-of-a-pools-clients",
+        client_pool_reconnect, &state, count_publishes) == MQTT_ERROR_CLIENT_ID_TOO_LONG);
+    assert_true(mqtt_client_pool_init(&pool, members, 3, "ingest", client_pool_reconnect, &state, count_publishes) == MQTT_OK);
+
+    /* the first sync connects every client with its own id */
+    assert_true(mqtt_client_pool_sync(&pool) == MQTT_OK);
+    for(i = 0; i < 3; ++i) {
+        ssize_t rv = recv(state.sv[i][1], received, sizeof(received), MSG_DONTWAIT);
+        snprintf(expected_id, sizeof(expected_id), "ingest-%d", i);
+        assert_true(rv > 14 && received[0] >> 4 == MQTT_CONTROL_CONNECT);
+        assert_true(received[13] == strlen(expected_id));
+        assert_true(memcmp(received + 14, expected_id, strlen(expected_id)) == 0);
+    }
+
+    /* a topic always goes through the same client */
+    for(i = 0; i < 30; ++i) {
+        struct mqtt_client *client;
+        ssize_t length;
+        snprintf(topic, sizeof(topic), "sensor/%d", i);
+        client = mqtt_client_pool_route(&pool, topic);
+        assert_true(client == mqtt_client_pool_route(&pool, topic));
+        length = mqtt_mq_length(&client->mq);
+        assert_true(mqtt_client_pool_publish(&pool, topic, "x", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+        assert_true(mqtt_mq_length(&client->mq) == length + 1);
+    }
+    for(i = 0; i < 3; ++i) {
+        used += members[i].number_of_publishes > 0;
+    }
+    assert_true(used > 1);
+
+    mqtt_client_pool_get_stats(&pool, &stats);
+    assert_true(stats.number_of_connected_clients == 3);
+    assert_true(stats.number_of_publishes == 30);
+    assert_true(stats.number_of_reconnects == 0);
+    assert_true(stats.send_buffer_bytes_in_use > 0);
+
+    /* a broken connection is reconnected through the pool's callback */
+    close(state.sv[1][0]);
+    close(state.sv[1][1]);
+    members[1].client.error = MQTT_ERROR_SOCKET_ERROR;
+    assert_true(mqtt_client_pool_sync(&pool) == MQTT_OK);
+    mqtt_client_pool_get_stats(&pool, &stats);
+    assert_true(stats.number_of_reconnects == 1 && members[1].number_of_reconnects == 1);
+    assert_true(stats.number_of_connected_clients == 3);
+
+    mqtt_client_pool_deinit(&pool);
+    for(i = 0; i < 3; ++i) {
+        close(state.sv[i][0]);
+        close(state.sv[i][1]);
+    }
+}
+
+static void TEST__utility__io_thread(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_response response;
+    struct timeval timeout = {2, 0};
+    uint8_t sendmem[1024], recvmem[256], received[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t inbound[64];
+    int sv[2], count = 0, i;
+    ssize_t rv;
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), count_publishes);
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    client.publish_response_callback_state = &count;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* the thread only wakes up on its own every 10s, so everything below is signalled */
+    client.io_thread.max_wait_ms = 10000;
+    assert_true(mqtt_start_io_thread(&client) == MQTT_OK);
+    assert_true(mqtt_start_io_thread(&client) == MQTT_ERROR_IO_THREAD);
+
+    /* the queued CONNECT is sent right away */
+    rv = recv(sv[1], received, sizeof(received), 0);
+    assert_true(rv > 0 && received[0] >> 4 == MQTT_CONTROL_CONNECT);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+
+    /* publishes wake the thread up */
+    assert_true(mqtt_publish(&client, "topic", "hello", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    rv = recv(sv[1], received, sizeof(received), 0);
+    assert_true(rv > 0);
+    assert_true(mqtt_unpack_response(&response, received, (size_t) rv) == rv);
+    assert_true(response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(memcmp(response.decoded.publish.application_message, "hello", 5) == 0);
+
+    /* and so does the socket */
+    rv = mqtt_pack_publish_request(inbound, sizeof(inbound), "topic", 0, "world", 5, 0);
+    assert_true(send(sv[1], inbound, (size_t) rv, 0) == rv);
+    for(i = 0; i < 200; ++i) {
+        MQTT_PAL_MUTEX_LOCK(&client.mutex);
+        rv = count;
+        MQTT_PAL_MUTEX_UNLOCK(&client.mutex);
+        if (rv == 1) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert_true(rv == 1);
+
+    mqtt_stop_io_thread(&client);
+    assert_true(client.io_thread.running == 0);
+    mqtt_stop_io_thread(&client);
+
+    /* nothing is sent once it has stopped */
+    assert_true(mqtt_publish(&client, "topic", "later", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(recv(sv[1], received, sizeof(received), MSG_DONTWAIT) < 0);
+
+    /* and it can be started again */
+    assert_true(mqtt_start_io_thread(&client) == MQTT_OK);
+    rv = recv(sv[1], received, sizeof(received), 0);
+    assert_true(rv > 0 && received[0] >> 4 == MQTT_CONTROL_PUBLISH);
+
+    mqtt_deinit(&client);
+    assert_true(client.io_thread.running == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__publish_handles(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[5];
+    struct timeval timeout = {2, 0};
+    uint8_t sendmem[1024], recvmem[256], received[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t ack[4];
+    int sv[2];
+    ssize_t rv;
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* QoS 0 messages have nothing to wait for */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "zero", 4, MQTT_PUBLISH_QOS_0, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_publish_handle_status(&handles[0]) == MQTT_PUBLISH_HANDLE_UNTRACKED);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "one", 3, MQTT_PUBLISH_QOS_1, &handles[1]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "two", 3, MQTT_PUBLISH_QOS_2, &handles[2]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "three", 5, MQTT_PUBLISH_QOS_1, &handles[3]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_publish_handle_status(&handles[1]) == MQTT_PUBLISH_HANDLE_PENDING);
+    assert_true(mqtt_publish_handle_wait(&handles[1], 0) == MQTT_PUBLISH_HANDLE_PENDING);
+
+    /* acks can arrive out of order */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[3].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_publish_handle_status(&handles[3]) == MQTT_PUBLISH_HANDLE_ACKNOWLEDGED);
+    assert_true(mqtt_publish_handle_status(&handles[1]) == MQTT_PUBLISH_HANDLE_PENDING);
+
+    /* QoS 2 messages are only done once PUBCOMP arrives */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBREC, handles[2].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_publish_handle_status(&handles[2]) == MQTT_PUBLISH_HANDLE_PENDING);
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBCOMP, handles[2].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_publish_handle_status(&handles[2]) == MQTT_PUBLISH_HANDLE_ACKNOWLEDGED);
+    while (recv(sv[1], received, sizeof(received), MSG_DONTWAIT) > 0);
+
+    /* a waiter is woken up by the thread that receives the ack */
+    assert_true(mqtt_start_io_thread(&client) == MQTT_OK);
+    assert_true(mqtt_publish_handle_wait(&handles[1], 50) == MQTT_PUBLISH_HANDLE_PENDING);
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_publish_handle_wait(&handles[1], 2000) == MQTT_PUBLISH_HANDLE_ACKNOWLEDGED);
+
+    /* handles that are still pending are dropped with the client */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "four", 4, MQTT_PUBLISH_QOS_1, &handles[4]) == MQTT_OK);
+    rv = recv(sv[1], received, sizeof(received), 0);
+    assert_true(rv > 0 && received[0] >> 4 == MQTT_CONTROL_PUBLISH);
+    mqtt_deinit(&client);
+    assert_true(mqtt_publish_handle_status(&handles[4]) == MQTT_PUBLISH_HANDLE_DROPPED);
+    assert_true(client.publish_handles.head == NULL);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__inflight_window(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[5];
+    uint8_t sendmem[1024], recvmem[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t ack[4];
+    int counts[16];
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    assert_true(client.max_inflight_qos1 == 0 && client.max_inflight_qos2 == 1);
+    client.max_inflight_qos1 = 1;
+    client.max_inflight_qos2 = 2;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    /* only as many PUBLISHes as the windows allow are sent */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "a", 1, MQTT_PUBLISH_QOS_2, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "b", 1, MQTT_PUBLISH_QOS_2, &handles[1]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "c", 1, MQTT_PUBLISH_QOS_2, &handles[2]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "d", 1, MQTT_PUBLISH_QOS_1, &handles[3]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "e", 1, MQTT_PUBLISH_QOS_1, &handles[4]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 3);
+
+    /* a QoS 2 exchange stays in flight after PUBREC */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBREC, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBREL] == 1);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 0);
+
+    /* and makes room once its PUBCOMP arrives */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBCOMP, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+    assert_true(mqtt_publish_handle_status(&handles[1]) == MQTT_PUBLISH_HANDLE_ACKNOWLEDGED);
+
+    /* likewise for QoS 1 */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[3].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__qos1_window_autotune(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[6];
+    uint8_t sendmem[1024], recvmem[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t ack[4];
+    int counts[16];
+    int sv[2], i;
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    mqtt_set_qos1_window_autotune(&client, 1, 2);
+    assert_true(client.max_inflight_qos1 == 1);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    for (i = 0; i < 6; ++i) {
+        assert_true(mqtt_publish_with_handle(&client, "topic", "x", 1, MQTT_PUBLISH_QOS_1, &handles[i]) == MQTT_OK);
+    }
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    /* the first round trip sets the baseline and grows the window */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[0].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.max_inflight_qos1 == 2);
+    assert_true(client.qos1_window.min_rtt_us == client.qos1_window.last_rtt_us);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 2);
+
+    /* but not past its maximum */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.max_inflight_qos1 == 2);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    /* a round trip that took much longer than the baseline halves the window */
+    client.qos1_window.min_rtt_us = 100;
+    usleep(2000);
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[3].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.qos1_window.last_rtt_us >= 2000);
+    assert_true(client.max_inflight_qos1 == 1);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 0);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__mqtt5(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[3];
+    uint8_t sendmem[1024], recvmem[256], received[64], payload[64];
+    const uint8_t connack[] = {
+        0x20, 17, 0x00, 0x00, 14,
+        MQTT_PROPERTY_RECEIVE_MAXIMUM, 0, 2,
+        MQTT_PROPERTY_MAXIMUM_PACKET_SIZE, 0, 0, 0, 40,
+        MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, 0, 4,
+        MQTT_PROPERTY_SERVER_KEEP_ALIVE, 0, 15
+    };
+    const uint8_t disconnect[] = {0xE0, 1, 0x8E};
+    uint8_t ack[4];
+    int counts[16];
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    client.protocol_level = MQTT_PROTOCOL_LEVEL_5;
+    client.max_inflight_qos1 = 0;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* the CONNECT tells the broker how big a packet the client can receive */
+    assert_true(recv(sv[1], received, sizeof(received), MSG_DONTWAIT) > 18);
+    assert_true(received[8] == MQTT_PROTOCOL_LEVEL_5);
+    assert_true(received[12] == 5 && received[13] == MQTT_PROPERTY_MAXIMUM_PACKET_SIZE);
+    assert_true(received[16] == 1 && received[17] == 0);
+
+    /* the CONNACK's limits are applied */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.broker_limits.receive_maximum == 2);
+    assert_true(client.broker_limits.maximum_packet_size == 40);
+    assert_true(client.broker_limits.topic_alias_maximum == 4);
+    assert_true(client.keep_alive == 15);
+
+    /* no more than receive maximum PUBLISHes are in flight */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "a", 1, MQTT_PUBLISH_QOS_1, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "b", 1, MQTT_PUBLISH_QOS_1, &handles[1]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "c", 1, MQTT_PUBLISH_QOS_1, &handles[2]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 2);
+
+    /* publishes bigger than the maximum packet size are refused */
+    memset(payload, 'x', sizeof(payload));
+    assert_true(mqtt_publish(&client, "topic", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_ERROR_PACKET_TOO_LARGE);
+    assert_true(client.error == MQTT_OK);
+
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[0].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+
+    /* the broker can close the connection */
+    assert_true(send(sv[1], disconnect, sizeof(disconnect), 0) == sizeof(disconnect));
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_CONNECTION_CLOSED);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__retransmission_timeout(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[2];
+    uint8_t sendmem[1024], recvmem[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t ack[4];
+    uint64_t srtt_us, rto_us;
+    int counts[16];
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    client.rto.min_us = 1000;
+    assert_true(client.rto.srtt_us == 0);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    /* the CONNACK's round trip replaces the 30 second response_timeout */
+    assert_true(client.rto.srtt_us > 0);
+    assert_true(client.rto.rto_us >= client.rto.min_us && client.rto.rto_us < 1000000);
+    srtt_us = client.rto.srtt_us;
+    rto_us = client.rto.rto_us;
+
+    /* an unacknowledged PUBLISH is resent once the timeout has passed, which backs it off */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "a", 1, MQTT_PUBLISH_QOS_1, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    usleep(rto_us + 1000);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 2);
+    assert_true(client.number_of_timeouts == 1);
+    assert_true(client.rto.backoff == 1);
+    assert_true(client.rto.rto_us == 2 * rto_us);
+    assert_true(client.mq.resends[mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBLISH, &handles[0].packet_id)] == 1);
+
+    /* the ACK of a resent message isn't sampled */
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[0].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.rto.backoff == 1 && client.rto.srtt_us == srtt_us);
+
+    /* the next one is, and it ends the backoff */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "b", 1, MQTT_PUBLISH_QOS_1, &handles[1]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_pack_pubxxx_request(ack, sizeof(ack), MQTT_CONTROL_PUBACK, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.rto.backoff == 0);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct resend_reconnect_state {
+    int sockfd;
+    uint8_t *sendmem;
+    size_t sendmemsz;
+    uint8_t *recvmem;
+    size_t recvmemsz;
+};
+
+static void resend_reconnect_callback(struct mqtt_client *client, void **state) {
+    struct resend_reconnect_state *reconnect = *((struct resend_reconnect_state**) state);
+    mqtt_reinit(client, reconnect->sockfd, reconnect->sendmem, reconnect->sendmemsz, reconnect->recvmem, reconnect->recvmemsz);
+    mqtt_connect(client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30);
+}
+
+static void TEST__utility__resend_only_on_reconnect(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handle;
+    struct resend_reconnect_state reconnect;
+    struct mqtt_response response;
+    uint8_t sendmem[1024], recvmem[256], received[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    ssize_t received_size, consumed;
+    int counts[16];
+    int sv[2];
+
+    open_socketpair(sv);
+    reconnect.sockfd = sv[0];
+    reconnect.sendmem = sendmem;
+    reconnect.sendmemsz = sizeof(sendmem);
+    reconnect.recvmem = recvmem;
+    reconnect.recvmemsz = sizeof(recvmem);
+    mqtt_init_reconnect(&client, resend_reconnect_callback, &reconnect, NULL);
+    client.resend_only_on_reconnect = 1;
+    client.rto.min_us = 1000;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    /* a PUBLISH that isn't acknowledged in time isn't resent on the same connection */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "a", 1, MQTT_PUBLISH_QOS_1, &handle) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 1);
+    usleep(client.rto.rto_us + 1000);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    usleep(client.rto.rto_us + 1000);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PUBLISH] == 0);
+    assert_true(client.number_of_timeouts == 1);
+    assert_true(client.number_of_resends_avoided == 1);
+
+    /* but after the CONNECT of the next connection, with DUP set */
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+    close(sv[0]);
+    close(sv[1]);
+    open_socketpair(sv);
+    reconnect.sockfd = sv[0];
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    received_size = recv(sv[1], received, sizeof(received), MSG_DONTWAIT);
+    consumed = mqtt_unpack_fixed_header(&response, received, received_size);
+    assert_true(consumed > 0 && response.fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    consumed += response.fixed_header.remaining_length;
+    assert_true(mqtt_unpack_response(&response, received + consumed, received_size - consumed) == received_size - consumed);
+    assert_true(response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(response.decoded.publish.dup_flag == 1);
+    assert_true(response.decoded.publish.packet_id == handle.packet_id);
+    assert_true(mqtt_publish_handle_status(&handle) == MQTT_PUBLISH_HANDLE_PENDING);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void ignore_publish(void** state, struct mqtt_response_publish *publish) {
+}
+
+static void TEST__utility__keep_alive(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendmem[1024], recvmem[256], publish[16];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t pingresp[2] = {0xD0, 0x00};
+    ssize_t publish_size, ping;
+    int counts[16];
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), ignore_publish);
+    assert_true(client.keep_alive_response_fraction == 0.5);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 1) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+
+    /* a quiet connection pings (queued by one sync and sent by the next) */
+    client.time_of_last_send -= 2;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PINGREQ] == 1);
+
+    /* but only once until the PINGRESP arrives */
+    client.time_of_last_send -= 2;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PINGREQ] == 0);
+    assert_true(send(sv[1], pingresp, sizeof(pingresp), 0) == sizeof(pingresp));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    client.time_of_last_send -= 2;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PINGREQ] == 1);
+
+    /* traffic from the broker shows it's alive while the PINGRESP is outstanding */
+    publish_size = mqtt_pack_publish_request(publish, sizeof(publish), "a", 0, "x", 1, MQTT_PUBLISH_QOS_0);
+    ping = mqtt_mq_find(&client.mq, MQTT_CONTROL_PINGREQ, NULL);
+    assert_true(ping >= 0);
+    client.mq.time_sent[ping] -= 600000;
+    assert_true(send(sv[1], publish, publish_size, 0) == publish_size);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    client.time_of_last_recv_us -= 250000;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* but a broker that stays silent for half the keep-alive is dead */
+    client.time_of_last_recv_us -= 350000;
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_KEEP_ALIVE_TIMEOUT);
+    assert_true(client.error == MQTT_ERROR_KEEP_ALIVE_TIMEOUT);
+    count_packets(sv[1], counts);
+    assert_true(counts[MQTT_CONTROL_PINGREQ] == 0);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct received_topics {
+    char topics[3][160];
+    int length;
+};
+
+static void topic_alias_callback(void** state, struct mqtt_response_publish *publish) {
+    struct received_topics *received = *((struct received_topics**) state);
+    memcpy(received->topics[received->length], publish->topic_name, publish->topic_name_size);
+    received->topics[received->length][publish->topic_name_size] = '\0';
+    ++received->length;
+}
+
+static void TEST__utility__topic_aliases(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_topic_alias outbound[2], inbound[2];
+    struct received_topics received;
+    struct mqtt_response response;
+    struct mqtt_property property;
+    uint8_t sendmem[1024], recvmem[256], packets[256];
+    const uint8_t connack[] = {
+        0x20, 6, 0x00, 0x00, 3, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, 0, 2
+    };
+    const char* topics[] = {
+        "sensors/temperature", "sensors/temperature", "sensors/humidity", 
+        "sensors/pressure", "sensors/temperature", "sensors/temperature"
+    };
+    /* the topic each PUBLISH carries and its alias */
+    const char* expected_topics[] = {
+        "sensors/temperature", "", "sensors/humidity", 
+        "sensors/pressure", "sensors/temperature", "sensors/temperature"
+    };
+    const uint32_t expected_aliases[] = {1, 1, 2, 1, 2, 0};
+    char long_topic[MQTT_TOPIC_ALIAS_MAX_TOPIC_SIZE + 20];
+    ssize_t rv, length, offset;
+    int sv[2], i;
+
+    received.length = 0;
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), topic_alias_callback);
+    client.publish_response_callback_state = &received;
+    client.protocol_level = MQTT_PROTOCOL_LEVEL_5;
+    mqtt_set_topic_aliases(&client, outbound, 2, inbound, 2);
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* the CONNECT announces the client's Topic Alias Maximum */
+    length = recv(sv[1], packets, sizeof(packets), MSG_DONTWAIT);
+    assert_true(mqtt_unpack_fixed_header(&response, packets, length) == 2);
+    assert_true(packets[12] == 8 && packets[18] == MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM && packets[20] == 2);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* QoS 0 topics are aliased and the least recently used alias is replaced */
+    for (i = 0; i < 5; ++i) {
+        assert_true(mqtt_publish(&client, topics[i], "1", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    }
+    /* QoS 1 PUBLISHes always carry their topic */
+    assert_true(mqtt_publish(&client, topics[5], "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    length = recv(sv[1], packets, sizeof(packets), MSG_DONTWAIT);
+    for (i = 0, offset = 0; i < 6; ++i, offset += rv) {
+        rv = mqtt_unpack_response_v5(&response, packets + offset, length - offset);
+        assert_true(rv > 0);
+        assert_true(response.decoded.publish.topic_name_size == strlen(expected_topics[i]));
+        assert_true(memcmp(response.decoded.publish.topic_name, expected_topics[i], strlen(expected_topics[i])) == 0);
+        if (expected_aliases[i] != 0) {
+            assert_true(mqtt_properties_find(&response.decoded.publish.properties, MQTT_PROPERTY_TOPIC_ALIAS, &property) == 1);
+            assert_true(property.value.integer == expected_aliases[i]);
+        } else {
+            assert_true(mqtt_properties_find(&response.decoded.publish.properties, MQTT_PROPERTY_TOPIC_ALIAS, &property) == 0);
+        }
+    }
+    assert_true(offset == length);
+    assert_true(client.topic_aliases.bytes_saved == strlen("sensors/temperature") - 3 - 4 * 3);
+
+    /* the broker's aliases are resolved before the callback */
+    property.identifier = MQTT_PROPERTY_TOPIC_ALIAS;
+    property.value.integer = 2;
+    rv = mqtt_pack_publish_request_v5(packets, sizeof(packets), "a/b/c", 0, "1", 1, 0, &property, 1);
+    length = rv + mqtt_pack_publish_request_v5(packets + rv, sizeof(packets) - rv, "", 0, "2", 1, 0, &property, 1);
+    assert_true(send(sv[1], packets, length, 0) == length);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received.length == 2);
+    assert_true(strcmp(received.topics[0], "a/b/c") == 0);
+    assert_true(strcmp(received.topics[1], "a/b/c") == 0);
+
+    /* a topic too long to remember is delivered, but the alias can't be used alone */
+    memset(long_topic, 'x', sizeof(long_topic) - 1);
+    long_topic[sizeof(long_topic) - 1] = '\0';
+    rv = mqtt_pack_publish_request_v5(packets, sizeof(packets), long_topic, 0, "3", 1, 0, &property, 1);
+    assert_true(rv > 0);
+    assert_true(send(sv[1], packets, rv, 0) == rv);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received.length == 3);
+    assert_true(strcmp(received.topics[2], long_topic) == 0);
+    length = mqtt_pack_publish_request_v5(packets, sizeof(packets), "", 0, "4", 1, 0, &property, 1);
+    assert_true(send(sv[1], packets, length, 0) == length);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_TOPIC_ALIAS_INVALID);
+    assert_true(received.length == 3);
+
+    /* carry on with a new connection */
+    mqtt_reinit(&client, sv[0], sendmem, sizeof(sendmem), recvmem, sizeof(recvmem));
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    /* an alias the client didn't offer is an error */
+    property.value.integer = 3;
+    length = mqtt_pack_publish_request_v5(packets, sizeof(packets), "a/b/c", 0, "1", 1, 0, &property, 1);
+    assert_true(send(sv[1], packets, length, 0) == length);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_TOPIC_ALIAS_INVALID);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct delivery_log {
+    struct mqtt_delivery deliveries[8];
+    size_t length;
+    size_t calls;
+};
+
+static void delivery_callback(void** state, const struct mqtt_delivery *deliveries, size_t number_of_deliveries) {
+    struct delivery_log *log = *((struct delivery_log**) state);
+    size_t i;
+    for (i = 0; i < number_of_deliveries; ++i) {
+        log->deliveries[log->length++] = deliveries[i];
+    }
+    ++log->calls;
+}
+
+static void TEST__utility__delivery_callback(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_publish_handle handles[3];
+    struct delivery_log log = {0};
+    uint8_t sendmem[1024], recvmem[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t acks[12];
+    uint16_t packet_id;
+    ssize_t msg;
+    int sv[2];
+
+    init_socketpair_client(&client, sv, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    client.delivery_callback = delivery_callback;
+    client.delivery_callback_state = &log;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    handles[0].cookie = &handles[0];
+    handles[1].cookie = &handles[1];
+    handles[2].cookie = &handles[2];
+    assert_true(mqtt_publish_with_handle(&client, "topic", "one", 3, MQTT_PUBLISH_QOS_1, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "two", 3, MQTT_PUBLISH_QOS_2, &handles[1]) == MQTT_OK);
+    assert_true(mqtt_publish_with_handle(&client, "topic", "three", 5, MQTT_PUBLISH_QOS_1, &handles[2]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(log.calls == 0);
+
+    /* acks that arrive together are reported in one batch, PUBREC isn't reported */
+    assert_true(mqtt_pack_pubxxx_request(acks, 4, MQTT_CONTROL_PUBACK, handles[2].packet_id) == 4);
+    assert_true(mqtt_pack_pubxxx_request(acks + 4, 4, MQTT_CONTROL_PUBREC, handles[1].packet_id) == 4);
+    assert_true(mqtt_pack_pubxxx_request(acks + 8, 4, MQTT_CONTROL_PUBACK, handles[0].packet_id) == 4);
+    assert_true(send(sv[1], acks, sizeof(acks), 0) == sizeof(acks));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(log.calls == 1);
+    assert_true(log.length == 2);
+    assert_true(log.deliveries[0].packet_id == handles[2].packet_id);
+    assert_true(log.deliveries[0].cookie == &handles[2]);
+    assert_true(log.deliveries[0].qos == 1);
+    assert_true(log.deliveries[1].cookie == &handles[0]);
+
+    /* QoS 2 messages are reported once PUBCOMP arrives, timed from the PUBREL */
+    packet_id = handles[1].packet_id;
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBREL, &packet_id);
+    assert_true(msg >= 0);
+    client.mq.time_sent[msg] -= 5000000;
+    assert_true(mqtt_pack_pubxxx_request(acks, 4, MQTT_CONTROL_PUBCOMP, handles[1].packet_id) == 4);
+    assert_true(send(sv[1], acks, 4, 0) == 4);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(log.calls == 2);
+    assert_true(log.length == 3);
+    assert_true(log.deliveries[2].cookie == &handles[1]);
+    assert_true(log.deliveries[2].qos == 2);
+    assert_true(log.deliveries[2].latency_us >= 5000000 && log.deliveries[2].latency_us < 6000000);
+
+    /* PUBLISHes without a handle are reported without a cookie */
+    assert_true(mqtt_publish(&client, "topic", "plain", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    msg = mqtt_mq_length(&client.mq) - 1;
+    packet_id = client.mq.packet_id[msg];
+    client.mq.time_sent[msg] -= 5000000;
+    assert_true(mqtt_pack_pubxxx_request(acks, 4, MQTT_CONTROL_PUBACK, packet_id) == 4);
+    assert_true(send(sv[1], acks, 4, 0) == 4);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(log.calls == 3);
+    assert_true(log.length == 4);
+    assert_true(log.deliveries[3].packet_id == packet_id);
+    assert_true(log.deliveries[3].cookie == NULL);
+    assert_true(log.deliveries[3].qos == 1);
+    assert_true(log.deliveries[3].latency_us >= 5000000 && log.deliveries[3].latency_us < 6000000);
+
+    /* acks before one that fails are still reported */
+    assert_true(mqtt_publish_with_handle(&client, "topic", "four", 4, MQTT_PUBLISH_QOS_1, &handles[0]) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_pack_pubxxx_request(acks, 4, MQTT_CONTROL_PUBACK, handles[0].packet_id) == 4);
+    assert_true(mqtt_pack_pubxxx_request(acks + 4, 4, MQTT_CONTROL_PUBACK, handles[0].packet_id + 100) == 4);
+    assert_true(send(sv[1], acks, 8, 0) == 8);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_ACK_OF_UNKNOWN);
+    assert_true(log.calls == 4);
+    assert_true(log.length == 5);
+    assert_true(log.deliveries[4].cookie == &handles[0]);
+
+    mqtt_deinit(&client);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__reactor(void **unused) {
+    struct mqtt_reactor reactor;
+    struct mqtt_client clients[2];
+    struct mqtt_response response;
+    uint8_t sendmem[2][1024], recvmem[2][256], received[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t inbound[64];
+    int sv[2][2], count = 0, i;
+    size_t syncs;
+    ssize_t rv;
+
+    assert_true(mqtt_reactor_init(&reactor) == MQTT_OK);
+    for(i = 0; i < 2; ++i) {
+        open_socketpair(sv[i]);
+        fcntl(sv[i][1], F_SETFL, fcntl(sv[i][1], F_GETFL) | O_NONBLOCK);
+        mqtt_init(&clients[i], sv[i][0], sendmem[i], sizeof(sendmem[i]), recvmem[i], sizeof(recvmem[i]), count_publishes);
+        clients[i].publish_response_callback_state = &count;
+        assert_true(mqtt_connect(&clients[i], "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+        assert_true(mqtt_reactor_add(&reactor, &clients[i]) == MQTT_OK);
+    }
+    assert_true(mqtt_reactor_add(&reactor, &clients[0]) == MQTT_ERROR_REACTOR);
+    assert_true(reactor.number_of_clients == 2);
+
+    /* new clients are synced right away */
+    assert_true(mqtt_reactor_run_once(&reactor, 0) == MQTT_OK);
+    for(i = 0; i < 2; ++i) {
+        rv = recv(sv[i][1], received, sizeof(received), 0);
+        assert_true(rv > 0 && received[0] >> 4 == MQTT_CONTROL_CONNECT);
+        assert_true(send(sv[i][1], connack, sizeof(connack), 0) == sizeof(connack));
+    }
+    while (mqtt_mq_find(&clients[0].mq, MQTT_CONTROL_CONNECT, NULL) >= 0 
+           || mqtt_mq_find(&clients[1].mq, MQTT_CONTROL_CONNECT, NULL) >= 0)
+    {
+        assert_true(mqtt_reactor_run_once(&reactor, 100) == MQTT_OK);
+    }
+
+    /* idle clients aren't synced */
+    syncs = reactor.number_of_syncs;
+    assert_true(mqtt_reactor_run_once(&reactor, 0) == MQTT_OK);
+    assert_true(reactor.number_of_syncs == syncs);
+
+    /* only the client whose socket is readable is synced */
+    rv = mqtt_pack_publish_request(inbound, sizeof(inbound), "topic", 0, "world", 5, 0);
+    assert_true(send(sv[1][1], inbound, (size_t) rv, 0) == rv);
+    assert_true(mqtt_reactor_run_once(&reactor, 100) == MQTT_OK);
+    assert_true(count == 1);
+    assert_true(reactor.number_of_syncs == syncs + 1);
+
+    /* publishes are sent on the next run */
+    clients[0].response_timeout = 1;
+    assert_true(mqtt_publish(&clients[0], "topic", "hello", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_reactor_run_once(&reactor, 0) == MQTT_OK);
+    rv = recv(sv[0][1], received, sizeof(received), 0);
+    assert_true(rv > 0);
+    assert_true(mqtt_unpack_response(&response, received, (size_t) rv) == rv);
+    assert_true(response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(response.decoded.publish.dup_flag == 0);
+
+    /* and resent once the client's deadline passes */
+    for(i = 0; i < 5 && recv(sv[0][1], received, sizeof(received), 0) <= 0; ++i) {
+        assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    }
+    assert_true(i < 5);
+    assert_true(reactor.number_of_expirations > 0);
+    assert_true(clients[0].number_of_timeouts == 1);
+
+    /* deinit removes a client, and so does deinitializing the reactor */
+    mqtt_deinit(&clients[0]);
+    assert_true(clients[0].reactor.reactor == NULL);
+    assert_true(reactor.number_of_clients == 1);
+    mqtt_reactor_deinit(&reactor);
+    assert_true(clients[1].reactor.reactor == NULL);
+    assert_true(reactor.number_of_clients == 0);
+
+    mqtt_deinit(&clients[1]);
+    for(i = 0; i < 2; ++i) {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+}
+
+static void TEST__utility__reactor_group(void **unused) {
+    struct mqtt_reactor_group group;
+    struct mqtt_reactor reactors[2];
+    struct mqtt_client clients[3];
+    struct timeval timeout = {2, 0};
+    uint8_t sendmem[3][1024], recvmem[3][256], received[256];
+    uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t inbound[64];
+    int sv[3][2], counts[3] = {0, 0, 0}, i;
+    ssize_t rv;
+
+    assert_true(mqtt_reactor_group_init(&group, reactors, 0) == MQTT_ERROR_NULLPTR);
+    assert_true(mqtt_reactor_group_init(&group, reactors, 2) == MQTT_OK);
+    assert_true(mqtt_reactor_group_start(&group) == MQTT_OK);
+    assert_true(mqtt_reactor_group_start(&group) == MQTT_ERROR_REACTOR);
+
+    /* clients are spread over the reactors and connected by their threads */
+    for(i = 0; i < 3; ++i) {
+        init_socketpair_client(&clients[i], sv[i], sendmem[i], sizeof(sendmem[i]), recvmem[i], sizeof(recvmem[i]), count_publishes);
+        setsockopt(sv[i][1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        clients[i].publish_response_callback_state = &counts[i];
+        assert_true(mqtt_connect(&clients[i], "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+        assert_true(mqtt_reactor_group_add(&group, &clients[i]) == MQTT_OK);
+    }
+    assert_true(reactors[0].number_of_clients + reactors[1].number_of_clients == 3);
+    assert_true(reactors[0].number_of_clients > 0 && reactors[1].number_of_clients > 0);
+    for(i = 0; i < 3; ++i) {
+        rv = recv(sv[i][1], received, sizeof(received), 0);
+        assert_true(rv > 0 && received[0] >> 4 == MQTT_CONTROL_CONNECT);
+        assert_true(send(sv[i][1], connack, sizeof(connack), 0) == sizeof(connack));
+    }
+
+    /* inbound publishes are delivered */
+    rv = mqtt_pack_publish_request(inbound, sizeof(inbound), "topic", 0, "world", 5, 0);
+    for(i = 0; i < 3; ++i) {
+        assert_true(send(sv[i][1], inbound, (size_t) rv, 0) == rv);
+    }
+    for(i = 0; i < 200; ++i) {
+        int delivered = 0, j;
+        /* the callback runs with only the I/O mutex held */
+        for(j = 0; j < 3; ++j) {
+            MQTT_PAL_MUTEX_LOCK(&clients[j].io_mutex);
+            delivered += counts[j];
+            MQTT_PAL_MUTEX_UNLOCK(&clients[j].io_mutex);
+        }
+        if (delivered == 3) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert_true(i < 200);
+
+    /* the reactors measure themselves */
+    usleep(250000);
+    for(i = 0; i < 2; ++i) {
+        MQTT_PAL_MUTEX_LOCK(&reactors[i].mutex);
+        assert_true(reactors[i].utilization >= 0.0 && reactors[i].utilization <= 1.0);
+        MQTT_PAL_MUTEX_UNLOCK(&reactors[i].mutex);
+        assert_true(reactors[i].interval > 0);
+    }
+
+    /* clients leave the group while it runs */
+    mqtt_reactor_group_remove(&group, &clients[0]);
+    assert_true(clients[0].reactor.reactor == NULL);
+    mqtt_reactor_group_remove(&group, &clients[0]);
+    mqtt_deinit(&clients[2]);
+    assert_true(clients[2].reactor.reactor == NULL);
+    close(sv[2][0]);
+    close(sv[2][1]);
+    MQTT_PAL_MUTEX_LOCK(&reactors[0].mutex);
+    MQTT_PAL_MUTEX_LOCK(&reactors[1].mutex);
+    assert_true(reactors[0].number_of_clients + reactors[1].number_of_clients == 1);
+    MQTT_PAL_MUTEX_UNLOCK(&reactors[1].mutex);
+    MQTT_PAL_MUTEX_UNLOCK(&reactors[0].mutex);
+    assert_true(mqtt_reactor_group_add(&group, &clients[0]) == MQTT_OK);
+
+    mqtt_reactor_group_stop(&group);
+    assert_true(group.running == 0);
+    mqtt_reactor_group_stop(&group);
+    assert_true(mqtt_reactor_group_start(&group) == MQTT_OK);
+    mqtt_reactor_group_deinit(&group);
+    assert_true(group.running == 0);
+    for(i = 0; i < 2; ++i) {
+        assert_true(clients[i].reactor.reactor == NULL);
+        mqtt_deinit(&clients[i]);
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+}
+
+static void watermark_callback(void** state, enum MQTTSendBufferWatermarks watermark, size_t bytes_used) {
+    int *crossings = *(int**)state;
+    crossings[watermark] += 1;
+}
+
+static void TEST__utility__send_buffer_growth(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendmem[256], recvmem[256];
+    int crossings[2] = {0, 0};
+    enum MQTTErrors rv;
+    ssize_t i;
+
+    mqtt_init(&client, -1, sendmem, sizeof(sendmem), recvmem, sizeof(recvmem), NULL);
+    client.mq.growth_segment_size = 256;
+    client.mq.growth_max_size = 1024;
+    client.send_buffer_watermark_callback = watermark_callback;
+    client.send_buffer_watermark_callback_state = crossings;
+    client.send_buffer_high_watermark = 512;
+    client.send_buffer_low_watermark = 128;
+    assert_true(mqtt_connect(&client, "liam", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* publishes keep succeeding past the end of sendmem until the ceiling is reached */
+    do {
+        rv = mqtt_publish(&client, "topic1", "0123456789", 10, MQTT_PUBLISH_QOS_1);
+    } while (rv == MQTT_OK);
+    assert_true(rv == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(client.mq.mem_start != (void*) sendmem);
+    assert_true((uint8_t*) client.mq.mem_end - (uint8_t*) client.mq.mem_start <= 1024);
+    assert_true(mqtt_mq_bytes_used(&client.mq) > 512);
+    assert_true(crossings[MQTT_SEND_BUFFER_HIGH_WATERMARK] == 1);
+    assert_true(crossings[MQTT_SEND_BUFFER_LOW_WATERMARK] == 0);
+
+    /* queued messages survive the moves */
+    for(i = 1; i < mqtt_mq_length(&client.mq); ++i) {
+        assert_true(client.mq.size[i] == 22);
+        assert_true(memcmp(mqtt_mq_start(&client.mq, i) + 12, "0123456789", 10) == 0);
+    }
+
+    /* once drained the queue moves back into sendmem */
+    for(i = 0; i < mqtt_mq_length(&client.mq); ++i) {
+        client.mq.state[i] = MQTT_QUEUED_COMPLETE;
+    }
+    mqtt_mq_clean(&client.mq);
+    __mqtt_check_send_buffer_watermarks(&client);
+    assert_true(client.mq.mem_start == (void*) sendmem);
+    assert_true(mqtt_mq_length(&client.mq) == 0);
+    assert_true(crossings[MQTT_SEND_BUFFER_LOW_WATERMARK] == 1);
+    assert_true(client.heap_allocator.bytes_in_use == 0);
+    assert_true(client.heap_allocator.number_of_allocations == client.heap_allocator.number_of_frees);
+
+    mqtt_deinit(&client);
+}
+
+static void TEST__utility__allocators(void **unused) {
+    struct mqtt_allocator heap, arena_allocator, pool_allocator;
+    struct mqtt_arena arena;
+    struct mqtt_pool pool;
+    uint8_t arena_mem[256];
+    void *a, *b, *c;
+
+    /* arena */
+    mqtt_arena_allocator_init(&arena_allocator, &arena, arena_mem, sizeof(arena_mem));
+    a = mqtt_allocator_alloc(&arena_allocator, 100);
+    b = mqtt_allocator_alloc(&arena_allocator, 100);
+    assert_true(a == (void*) arena_mem);
+    assert_true(b != NULL && (uint8_t*) b >= (uint8_t*) a + 100);
+    assert_true(mqtt_allocator_alloc(&arena_allocator, 100) == NULL);
+    assert_true(arena_allocator.number_of_failures == 1);
+    assert_true(arena_allocator.bytes_in_use == 200);
+
+    /* freeing the last allocation makes room again */
+    mqtt_allocator_free(&arena_allocator, b, 100);
+    assert_true(mqtt_allocator_alloc(&arena_allocator, 100) == b);
+    mqtt_arena_reset(&arena_allocator);
+    assert_true(arena_allocator.bytes_in_use == 0);
+    assert_true(arena_allocator.peak_bytes_in_use == 200);
+    assert_true(mqtt_allocator_alloc(&arena_allocator, 200) == (void*) arena_mem);
+
+    /* pool */
+    mqtt_heap_allocator_init(&heap);
+    mqtt_pool_allocator_init(&pool_allocator, &pool, &heap, 1024);
+    a = mqtt_allocator_alloc(&pool_allocator, 20);
+    b = mqtt_allocator_alloc(&pool_allocator, 32);
+    assert_true(a != NULL && b != NULL && a != b);
+    assert_true(heap.number_of_allocations == 1);
+
+    /* freed blocks are reused */
+    mqtt_allocator_free(&pool_allocator, a, 20);
+    assert_true(mqtt_allocator_alloc(&pool_allocator, 30) == a);
+    assert_true(heap.number_of_allocations == 1);
+
+    /* other size classes get their own slabs; oversized requests go to the backing allocator */
+    c = mqtt_allocator_alloc(&pool_allocator, 500);
+    assert_true(heap.number_of_allocations == 2);
+    c = mqtt_allocator_alloc(&pool_allocator, 100000);
+    assert_true(c != NULL);
+    assert_true(heap.number_of_allocations == 3);
+    mqtt_allocator_free(&pool_allocator, c, 100000);
+    assert_true(heap.number_of_frees == 1);
+    assert_true(pool_allocator.bytes_in_use == 30 + 32 + 500);
+
+    mqtt_pool_deinit(&pool_allocator);
+    assert_true(heap.bytes_in_use == 0);
+    assert_true(heap.number_of_frees == 3);
+}
+
 void publish_callback(void** state, struct mqtt_response_publish *publish) {
     /*char *name = (char*) malloc(publish->topic_name_size + 1);
     memcpy(name, publish->topic_name, publish->topic_name_size);
@@ -692,8 +2648,8 @@ static void TEST__api__publish_subscribe__single(void **unused) {
 #define TEST_PACKET_SIZE (149)
 #define TEST_DATA_SIZE (128)
 static void TEST__api__publish_subscribe__multiple(void **unused) {
-    uint8_t sendmem1[TEST_PACKET_SIZE*4 + sizeof(struct mqtt_queued_message)*4], 
-            sendmem2[TEST_PACKET_SIZE*4 + sizeof(struct mqtt_queued_message)*4];
+    uint8_t sendmem1[TEST_PACKET_SIZE*4 + MQTT_MQ_DESCRIPTOR_SIZE*8 + MQTT_MQ_DESCRIPTOR_ALIGNMENT], 
+            sendmem2[TEST_PACKET_SIZE*4 + MQTT_MQ_DESCRIPTOR_SIZE*8 + MQTT_MQ_DESCRIPTOR_ALIGNMENT];
     uint8_t recvmem1[TEST_PACKET_SIZE], recvmem2[TEST_PACKET_SIZE];
     struct mqtt_client sender, receiver;
     ssize_t rv;
@@ -818,7 +2774,8 @@ static void TEST__api__publish_subscribe__multiple(void **unused) {
         assert_true(rv  > 0);
     }
     assert_true(sender.error == MQTT_OK);
-    assert_true(sender.mq.curr_sz == 0);
+    /* only the descriptor arrays' alignment padding is left */
+    assert_true(sender.mq.curr_sz <= MQTT_MQ_DESCRIPTOR_ALIGNMENT);
 
     /* give 2 seconds for sending and receiving (also don't manually clean) */
     start = time(NULL);
@@ -957,6 +2914,8 @@ int main(int argc, const char *argv[]) {
         cmocka_unit_test(TEST__framing__unsuback),
         cmocka_unit_test(TEST__framing__ping),
         cmocka_unit_test(TEST__framing__disconnect),
+        cmocka_unit_test(TEST__framing__properties),
+        cmocka_unit_test(TEST__framing__v5),
     };
 
     rv |= cmocka_run_group_tests(framing_tests, NULL, NULL);
@@ -964,7 +2923,33 @@ int main(int argc, const char *argv[]) {
     printf("\n[MQTT-C Utilities Tests]\n");
     const struct CMUnitTest util_tests[] = {
         cmocka_unit_test(TEST__utility__message_queue),
+        cmocka_unit_test(TEST__utility__message_queue_descriptors),
         cmocka_unit_test(TEST__utility__pid_lfsr),
+        cmocka_unit_test(TEST__utility__publish_reserve),
+        cmocka_unit_test(TEST__utility__send_buffer_growth),
+        cmocka_unit_test(TEST__utility__allocators),
+        cmocka_unit_test(TEST__utility__qos0_buffer),
+        cmocka_unit_test(TEST__utility__recv_buffer_pool),
+        cmocka_unit_test(TEST__utility__recv_buffer_growth),
+        cmocka_unit_test(TEST__utility__session_store),
+        cmocka_unit_test(TEST__utility__spool),
+        cmocka_unit_test(TEST__utility__spool_torn_segment),
+        cmocka_unit_test(TEST__utility__spool_failed_append),
+        cmocka_unit_test(TEST__utility__publish_from_callback),
+        cmocka_unit_test(TEST__utility__publish_while_sending),
+        cmocka_unit_test(TEST__utility__client_pool),
+        cmocka_unit_test(TEST__utility__io_thread),
+        cmocka_unit_test(TEST__utility__reactor),
+        cmocka_unit_test(TEST__utility__reactor_group),
+        cmocka_unit_test(TEST__utility__publish_handles),
+        cmocka_unit_test(TEST__utility__delivery_callback),
+        cmocka_unit_test(TEST__utility__inflight_window),
+        cmocka_unit_test(TEST__utility__qos1_window_autotune),
+        cmocka_unit_test(TEST__utility__mqtt5),
+        cmocka_unit_test(TEST__utility__topic_aliases),
+        cmocka_unit_test(TEST__utility__retransmission_timeout),
+        cmocka_unit_test(TEST__utility__resend_only_on_reconnect),
+        cmocka_unit_test(TEST__utility__keep_alive),
         cmocka_unit_test(TEST__utility__connect_disconnect),
         cmocka_unit_test(TEST__utility__ping),
     };